@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "admin.h"
+#include "unix_socket.h"
+#include "placement.h"
+#include "log.h"
+
+#define ADMIN_MAX_CLIENTS 8
+#define ADMIN_LINE_MAX 1024
+
+struct admin_conn {
+    int fd;          // -1 when the slot is free
+    size_t used;
+    char line[ADMIN_LINE_MAX];
+};
+
+struct admin_server {
+    char *path;
+    int listen_fd;
+    int stop_pipe[2];
+    admin_handler handler;
+    void *arg;
+    pthread_t tid;
+    int running;
+    char *reply;
+    struct admin_conn conns[ADMIN_MAX_CLIENTS];
+};
+
+static void drop_conn(struct admin_conn *c) {
+    close(c->fd);
+    c->fd = -1;
+    c->used = 0;
+}
+
+// Runs every complete line in the connection's buffer. Returns -1 when the
+// connection should be closed.
+static int serve_lines(struct admin_server *s, struct admin_conn *c) {
+    char *start = c->line, *nl;
+    while ((nl = memchr(start, '\n', c->used - (size_t)(start - c->line)))) {
+        *nl = '\0';
+        if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+        if (strcmp(start, "quit") == 0) return -1;
+        size_t n = s->handler(s->arg, start, s->reply, ADMIN_REPLY_MAX);
+        if (unix_socket_write_all(c->fd, s->reply, n) != 0) return -1;
+        start = nl + 1;
+    }
+    c->used -= (size_t)(start - c->line);
+    memmove(c->line, start, c->used);
+    if (c->used == sizeof(c->line)) {
+        static const char too_long[] = "error: line too long\n";
+        unix_socket_write_all(c->fd, too_long, sizeof(too_long) - 1);
+        return -1;
+    }
+    return 0;
+}
+
+// An abstract socket has no file mode to keep others out, so only the server's
+// own user, or root, may connect to one.
+static void accept_conn(struct admin_server *s) {
+    int fd = accept4(s->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+    unsigned uid = 0;
+    if (s->path[0] == '@' && !unix_socket_peer_allowed(fd, &uid)) {
+        log_warn("Refused admin connection from uid %u", uid);
+        close(fd);
+        return;
+    }
+    for (int i = 0; i < ADMIN_MAX_CLIENTS; i++) {
+        if (s->conns[i].fd < 0) {
+            // A client that stops reading must not wedge the admin thread.
+            struct timeval tv = { 1, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            s->conns[i].fd = fd;
+            s->conns[i].used = 0;
+            return;
+        }
+    }
+    static const char busy[] = "error: too many admin connections\n";
+    unix_socket_write_all(fd, busy, sizeof(busy) - 1);
+    close(fd);
+}
+
+static void *admin_main(void *arg) {
+    struct admin_server *s = arg;
+    placement_apply("admin", NULL);
+    for (;;) {
+        struct pollfd pfds[ADMIN_MAX_CLIENTS + 2];
+        int slot[ADMIN_MAX_CLIENTS + 2];
+        int n = 0;
+        pfds[n].fd = s->stop_pipe[0];
+        pfds[n++].events = POLLIN;
+        pfds[n].fd = s->listen_fd;
+        pfds[n++].events = POLLIN;
+        for (int i = 0; i < ADMIN_MAX_CLIENTS; i++) {
+            if (s->conns[i].fd < 0) continue;
+            slot[n] = i;
+            pfds[n].fd = s->conns[i].fd;
+            pfds[n++].events = POLLIN;
+        }
+        if (poll(pfds, (nfds_t)n, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("Admin socket poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfds[0].revents) break;
+        if (pfds[1].revents & POLLIN) accept_conn(s);
+        for (int i = 2; i < n; i++) {
+            if (!pfds[i].revents) continue;
+            struct admin_conn *c = &s->conns[slot[i]];
+            ssize_t got = read(c->fd, c->line + c->used, sizeof(c->line) - c->used);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) {
+                drop_conn(c);
+                continue;
+            }
+            c->used += (size_t)got;
+            if (serve_lines(s, c) != 0) drop_conn(c);
+        }
+    }
+    placement_forget();
+    return NULL;
+}
+
+struct admin_server *admin_server_start(const char *path, int mode, admin_handler handler,
+                                        void *arg) {
+    struct admin_server *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->handler = handler;
+    s->arg = arg;
+    s->listen_fd = -1;
+    s->stop_pipe[0] = s->stop_pipe[1] = -1;
+    for (int i = 0; i < ADMIN_MAX_CLIENTS; i++) s->conns[i].fd = -1;
+    if (!(s->path = strdup(path)) || !(s->reply = malloc(ADMIN_REPLY_MAX)) ||
+        pipe2(s->stop_pipe, O_CLOEXEC) != 0 ||
+        (s->listen_fd = unix_socket_listen(path, mode, ADMIN_MAX_CLIENTS, "admin")) < 0) {
+        if (s->stop_pipe[0] >= 0) {
+            close(s->stop_pipe[0]);
+            close(s->stop_pipe[1]);
+        }
+        free(s->reply);
+        free(s->path);
+        free(s);
+        return NULL;
+    }
+    if (pthread_create(&s->tid, NULL, admin_main, s) != 0) {
+        fprintf(stderr, "Failed to start the admin thread\n");
+        admin_server_stop(s);
+        return NULL;
+    }
+    s->running = 1;
+    return s;
+}
+
+void admin_server_stop(struct admin_server *s) {
+    if (!s) return;
+    if (s->running) {
+        if (write(s->stop_pipe[1], "x", 1) < 0) {}
+        pthread_join(s->tid, NULL);
+    }
+    for (int i = 0; i < ADMIN_MAX_CLIENTS; i++) {
+        if (s->conns[i].fd >= 0) close(s->conns[i].fd);
+    }
+    close(s->listen_fd);
+    if (s->path[0] != '@') unlink(s->path);
+    close(s->stop_pipe[0]);
+    close(s->stop_pipe[1]);
+    free(s->reply);
+    free(s->path);
+    free(s);
+}
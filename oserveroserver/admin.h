@@ -0,0 +1,29 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include <stddef.h>
+
+// Local control socket: a UNIX stream listener served by its own thread.
+// Clients send one command per line and get the handler's reply back. The
+// socket carries no authentication, so access is controlled by its file mode.
+// A leading '@' in the path selects the Linux abstract namespace, where there
+// is no file mode; only peers running as the server's user or root are
+// accepted there.
+
+#define ADMIN_REPLY_MAX 65536
+
+// Fills out with the reply to one command line (without its newline) and
+// returns its length. Runs on the admin thread, so it may block briefly.
+typedef size_t (*admin_handler)(void *arg, char *line, char *out, size_t len);
+
+struct admin_server;
+
+// Replaces a stale socket file at path. Returns NULL and prints the reason on
+// failure.
+struct admin_server *admin_server_start(const char *path, int mode, admin_handler handler,
+                                        void *arg);
+
+// Closes every admin connection and removes the socket file.
+void admin_server_stop(struct admin_server *s);
+
+#endif
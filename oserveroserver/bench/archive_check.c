@@ -0,0 +1,122 @@
+// Round-trip check for history_archive.c: writes rows with awkward times
+// (none, going backwards, far apart) and lengths (empty, past the 256 KiB
+// buffer), plain and compressed, and reads them back. Then cuts each file at
+// many points and checks that every row read before the cut is right and that
+// the cut is reported as damage, never as a clean end. Exits 1 on the first
+// failure. Cuts inside the header make the reader print why it refuses the
+// file; that is expected.
+//
+//   gcc -O2 bench/archive_check.c history_archive.c -I. -o archive_check -lz
+//   ./archive_check [PATH]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "history_archive.h"
+
+#define ROWS 3000
+#define BIG_ROW 1500     // carries a 300 KiB message
+#define BIG_LEN (300 * 1024)
+
+static const char *path = "/tmp/archive_check.scha";
+static char *big;
+
+static void make_row(int i, struct archive_row *row, char *buf, size_t len) {
+    static const long long times[] = { 0, 1760000000000LL, 1759999999999LL, 1, 4102444800000LL };
+    row->ts_ms = i % 7 == 0 ? times[(i / 7) % 5] : 1760000000000LL + i * 37LL;
+    row->username = i % 11 == 0 ? "" : "bob";
+    row->username_len = strlen(row->username);
+    if (i == BIG_ROW) {
+        row->message = big;
+        row->message_len = BIG_LEN;
+    } else {
+        int n = snprintf(buf, len, "row %d caf\xc3\xa9 %.*s", i, i % 40,
+                         "0123456789012345678901234567890123456789");
+        row->message = buf;
+        row->message_len = i % 13 == 0 ? 0 : (size_t)n;
+    }
+}
+
+static int write_file(int compress) {
+    struct archive_writer *w = archive_writer_open(path, compress);
+    if (!w) return -1;
+    int rc = 0;
+    for (int i = 0; i < ROWS; i++) {
+        char buf[128];
+        struct archive_row row;
+        make_row(i, &row, buf, sizeof(buf));
+        if (archive_write_row(w, &row) != 0) rc = -1;
+    }
+    return archive_writer_close(w) == 0 ? rc : -1;
+}
+
+// Reads the file back: the rows read in *rows, then 0 for a clean end, 1 for
+// reported damage, -1 for a wrong row.
+static int read_file(int *rows) {
+    *rows = 0;
+    struct archive_reader *r = archive_reader_open(path);
+    if (!r) return 1;
+    struct archive_row got;
+    int rc;
+    while ((rc = archive_read_row(r, &got)) == 1) {
+        char buf[128];
+        struct archive_row want;
+        make_row(*rows, &want, buf, sizeof(buf));
+        if (got.ts_ms != want.ts_ms || got.username_len != want.username_len ||
+            memcmp(got.username, want.username, want.username_len) != 0 ||
+            got.message_len != want.message_len ||
+            memcmp(got.message, want.message, want.message_len) != 0) {
+            fprintf(stderr, "row %d differs\n", *rows);
+            archive_reader_close(r);
+            return -1;
+        }
+        (*rows)++;
+    }
+    archive_reader_close(r);
+    return rc == 0 ? 0 : 1;
+}
+
+static int check(int compress) {
+    const char *mode = compress ? "compressed" : "plain";
+    int rows;
+    struct stat sb;
+    if (write_file(compress) != 0 || stat(path, &sb) != 0) {
+        fprintf(stderr, "Cannot write %s\n", path);
+        return -1;
+    }
+    int rc = read_file(&rows);
+    printf("{\"case\":\"%s round trip\",\"bytes\":%lld,\"rows\":%d}\n", mode, (long long)sb.st_size, rows);
+    if (rc != 0 || rows != ROWS) {
+        fprintf(stderr, "%s round trip: %d of %d rows, status %d\n", mode, rows, ROWS, rc);
+        return -1;
+    }
+    // Every byte near both ends, then a spread through the middle
+    long cuts = 0;
+    for (off_t cut = 0; cut < sb.st_size; cut++) {
+        if (cut > 64 && cut < sb.st_size - 64 && cut % 997 != 0) continue;
+        if (write_file(compress) != 0 || truncate(path, cut) != 0) return -1;
+        rc = read_file(&rows);
+        if (rc != 1) {
+            fprintf(stderr, "%s cut at %lld of %lld: %s after %d rows\n", mode, (long long)cut,
+                    (long long)sb.st_size, rc == 0 ? "clean end" : "wrong row", rows);
+            return -1;
+        }
+        cuts++;
+    }
+    printf("{\"case\":\"%s cuts\",\"cuts\":%ld}\n", mode, cuts);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) path = argv[1];
+    if (!(big = malloc(BIG_LEN))) return 1;
+    for (size_t i = 0; i < BIG_LEN; i++) big[i] = (char)('a' + (i * 7919) % 26);
+    int rc = check(0) == 0 && check(1) == 0 ? 0 : 1;
+    unlink(path);
+    free(big);
+    if (rc == 0) printf("{\"check\":\"history_archive\",\"ok\":true}\n");
+    return rc;
+}
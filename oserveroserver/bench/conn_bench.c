@@ -0,0 +1,194 @@
+// Connection-overhead benchmark: opens N chat-protocol WebSockets against a
+// running server, either as HTTP/1.1 upgrades (one TCP+TLS connection each) or
+// as RFC 8441 streams multiplexed over HTTP/2, and reports setup latency,
+// sockets used and client RSS as one JSON line.
+//
+//   gcc bench/conn_bench.c -o conn_bench $(pkg-config --cflags --libs libwebsockets)
+//   ./conn_bench --mode h1 -n 200
+//   ./conn_bench --mode h2 -n 200
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <libwebsockets.h>
+
+struct bench_state {
+    int sessions;
+    int established;
+    int failed;
+    int closed;
+    double start_ms;
+    double *connect_ms; // per-session time from start to ESTABLISHED
+};
+
+static struct bench_state st;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int bench_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                          void *user, void *in, size_t len) {
+    (void)wsi; (void)user; (void)len;
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            st.connect_ms[st.established++] = now_ms() - st.start_ms;
+            break;
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            fprintf(stderr, "connect error: %s\n", in ? (const char *)in : "unknown");
+            st.failed++;
+            break;
+        case LWS_CALLBACK_CLIENT_CLOSED:
+            st.closed++;
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static const struct lws_protocols protocols[] = {
+    { "chat-protocol", bench_callback, 0, 4096, 0, NULL, 0 },
+    LWS_PROTOCOL_LIST_TERM
+};
+
+static int count_sockets(void) {
+    DIR *d = opendir("/proc/self/fd");
+    if (!d) return -1;
+    int n = 0;
+    struct dirent *e;
+    char path[64], target[64];
+    while ((e = readdir(d)) != NULL) {
+        snprintf(path, sizeof(path), "/proc/self/fd/%s", e->d_name);
+        ssize_t l = readlink(path, target, sizeof(target) - 1);
+        if (l <= 0) continue;
+        target[l] = '\0';
+        if (strncmp(target, "socket:", 7) == 0) n++;
+    }
+    closedir(d);
+    return n;
+}
+
+static long rss_kb(void) {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (!f) return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, int n, double p) {
+    if (n == 0) return 0;
+    int i = (int)(p * (n - 1) + 0.5);
+    return sorted[i];
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--mode h1|h2] [-n sessions] [--host HOST] [--port PORT] [--timeout SECS]\n"
+        "  Both modes use TLS and accept self-signed certificates.\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *mode = "h2";
+    const char *host = "localhost";
+    int port = 8080;
+    int timeout_s = 30;
+    st.sessions = 100;
+    static const struct option long_opts[] = {
+        { "mode", required_argument, NULL, 'm' },
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "timeout", required_argument, NULL, 't' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "n:m:H:p:t:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'n': st.sessions = atoi(optarg); break;
+            case 'm': mode = optarg; break;
+            case 'H': host = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 't': timeout_s = atoi(optarg); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    int h2 = strcmp(mode, "h2") == 0;
+    if (!h2 && strcmp(mode, "h1") != 0) { usage(argv[0]); return 1; }
+    if (st.sessions <= 0) st.sessions = 1;
+    st.connect_ms = calloc(st.sessions, sizeof(double));
+    if (!st.connect_ms) return 1;
+
+    lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    info.fd_limit_per_thread = 1 + st.sessions + 16;
+    struct lws_context *context = lws_create_context(&info);
+    if (!context) {
+        fprintf(stderr, "lws init failed\n");
+        return 1;
+    }
+
+    int base_sockets = count_sockets();
+    st.start_ms = now_ms();
+    for (int i = 0; i < st.sessions; i++) {
+        struct lws_client_connect_info ci;
+        memset(&ci, 0, sizeof(ci));
+        ci.context = context;
+        ci.address = host;
+        ci.port = port;
+        ci.path = "/chat-protocol";
+        ci.host = host;
+        ci.origin = host;
+        ci.protocol = "chat-protocol";
+        ci.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED |
+                            LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+        // h2: later sessions queue behind the first connection and become
+        // streams on it instead of opening their own socket.
+        if (h2) ci.ssl_connection |= LCCSCF_PIPELINE;
+        ci.alpn = h2 ? "h2" : "http/1.1";
+        if (!lws_client_connect_via_info(&ci)) st.failed++;
+    }
+
+    double deadline = st.start_ms + timeout_s * 1000.0;
+    while (st.established + st.failed < st.sessions && now_ms() < deadline) {
+        if (lws_service(context, 50) < 0) break;
+    }
+    double total_ms = now_ms() - st.start_ms;
+    int sockets = count_sockets() - base_sockets;
+    long rss = rss_kb();
+
+    qsort(st.connect_ms, st.established, sizeof(double), cmp_double);
+    printf("{\"mode\":\"%s\",\"sessions\":%d,\"established\":%d,\"failed\":%d,"
+           "\"total_ms\":%.2f,\"p50_ms\":%.2f,\"p99_ms\":%.2f,"
+           "\"per_session_us\":%.1f,\"sockets\":%d,\"rss_kb\":%ld}\n",
+           mode, st.sessions, st.established, st.failed, total_ms,
+           percentile(st.connect_ms, st.established, 0.50),
+           percentile(st.connect_ms, st.established, 0.99),
+           st.established ? total_ms * 1000.0 / st.established : 0.0,
+           sockets, rss);
+
+    lws_context_destroy(context);
+    free(st.connect_ms);
+    return st.established == st.sessions ? 0 : 1;
+}
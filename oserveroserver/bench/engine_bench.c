@@ -0,0 +1,317 @@
+// Microbenchmarks for the engine's hot paths, without the network: history
+// snapshots, single and batched inserts, broadcast fan-out and count_roles().
+// chat_engine.c is compiled into this file so its static functions can be
+// called directly. Fake clients have no socket; they sit on service thread 1
+// of a two-thread engine, so broadcasts flag them for a wakeup instead of
+// touching a wsi.
+//
+// Each case is calibrated to run for at least --min-ms, then timed --runs
+// times; the JSON line per case gives the median, min and max per operation.
+// Pin with --cpu for stable numbers.
+//
+// Build with the engine_bench line under "Build Command" in README.md, which
+// lists every module chat_engine.c links against. Then:
+//   ./engine_bench --cpu 2 --filter fanout
+#include "chat_engine.c"
+
+#include <getopt.h>
+
+struct bench_opts {
+    int runs;
+    double min_ms;
+    const char *filter;
+};
+
+struct bench_ctx {
+    struct chat_engine *e;
+    struct client *clients;
+    int nclients;
+    int limit;
+    int batch;
+    const char *message;
+};
+
+// Runs iters operations and returns the nanoseconds spent in the measured part.
+typedef double (*bench_fn)(struct bench_ctx *ctx, long iters);
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Prints {"bench":name,<params>,...timing}; returns the median ns per op.
+static double measure(const struct bench_opts *o, const char *name, const char *params,
+                      bench_fn fn, struct bench_ctx *ctx) {
+    if (o->filter && !strstr(name, o->filter)) return 0;
+    // Calibrate: double the batch until one takes min_ms. This also warms
+    // the caches, the pool and SQLite's page cache.
+    long iters = 1;
+    for (;;) {
+        double ns = fn(ctx, iters);
+        if (ns >= o->min_ms * 1e6 || iters >= (1L << 30)) break;
+        iters *= 2;
+    }
+    double per_op[64];
+    int runs = o->runs < 64 ? o->runs : 64;
+    for (int r = 0; r < runs; r++) per_op[r] = fn(ctx, iters) / (double)iters;
+    qsort(per_op, (size_t)runs, sizeof(double), cmp_double);
+    double median = per_op[runs / 2];
+    printf("{\"bench\":\"%s\",%s,\"iters\":%ld,\"runs\":%d,"
+           "\"ns_median\":%.1f,\"ns_min\":%.1f,\"ns_max\":%.1f}\n",
+           name, params, iters, runs, median, per_op[0], per_op[runs - 1]);
+    fflush(stdout);
+    return median;
+}
+
+static void fill_text(char *buf, size_t len, unsigned seed) {
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz      ";
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245u + 12345u;
+        buf[i] = alphabet[(seed >> 16) % (sizeof(alphabet) - 1)];
+    }
+    buf[len] = '\0';
+}
+
+static int fill_history(struct chat_engine *e, int rows, size_t row_bytes) {
+    char *msg = malloc(row_bytes + 1);
+    if (!msg) return -1;
+    sqlite3_exec(e->db, "DELETE FROM messages; BEGIN;", NULL, NULL, NULL);
+    for (int i = 0; i < rows; i++) {
+        fill_text(msg, row_bytes, (unsigned)i);
+        if (db_insert_message(e, "bench", msg, wall_ms()) != 0) break;
+    }
+    sqlite3_exec(e->db, "COMMIT;", NULL, NULL, NULL);
+    free(msg);
+    return 0;
+}
+
+static double bench_history(struct bench_ctx *ctx, long iters) {
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+        pthread_rwlock_wrlock(&ctx->e->history_lock);
+        struct frame *f = db_get_history_snapshot(ctx->e, ctx->limit);
+        pthread_rwlock_unlock(&ctx->e->history_lock);
+        frame_release(f);
+    }
+    return now_ns() - t0;
+}
+
+// Autocommit: one transaction, and one WAL sync, per message.
+static double bench_insert_single(struct bench_ctx *ctx, long iters) {
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+        pthread_rwlock_wrlock(&ctx->e->history_lock);
+        db_insert_message(ctx->e, "bench", ctx->message, wall_ms());
+        pthread_rwlock_unlock(&ctx->e->history_lock);
+    }
+    return now_ns() - t0;
+}
+
+// persist_batch() as the persistence thread calls it; iters counts messages.
+static double bench_insert_batched(struct bench_ctx *ctx, long iters) {
+    double spent = 0;
+    for (long done = 0; done < iters; ) {
+        struct persist_item *head = NULL;
+        int n = 0;
+        for (; n < ctx->batch && done + n < iters; n++) {
+            struct persist_item *it = calloc(1, sizeof(*it));
+            if (!it || !(it->username = strdup("bench")) || !(it->message = strdup(ctx->message))) {
+                fprintf(stderr, "out of memory\n");
+                exit(1);
+            }
+            it->next = head;
+            head = it;
+        }
+        double t0 = now_ns();
+        persist_batch(ctx->e, head);
+        spent += now_ns() - t0;
+        done += n;
+    }
+    return spent;
+}
+
+// Frees what a broadcast queued, as the writeable callbacks would.
+static void drain_clients(struct bench_ctx *ctx) {
+    struct chat_engine *e = ctx->e;
+    pthread_mutex_lock(&e->clients_mutex);
+    for (int i = 0; i < ctx->nclients; i++) {
+        struct client *c = &ctx->clients[i];
+        struct frame *f;
+        while ((f = dequeue_frame(e, c)) != NULL) frame_release(f);
+        c->wake = 0;
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+}
+
+static double bench_fanout(struct bench_ctx *ctx, long iters) {
+    double spent = 0;
+    for (long i = 0; i < iters; i++) {
+        double t0 = now_ns();
+        broadcast_text(ctx->e, ctx->message);
+        spent += now_ns() - t0;
+        drain_clients(ctx);
+    }
+    return spent;
+}
+
+static double bench_count_roles(struct bench_ctx *ctx, long iters) {
+    int readers = 0, writers = 0;
+    volatile int sink = 0;
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+        count_roles(ctx->e, &readers, &writers);
+        sink += readers + writers;
+    }
+    (void)sink;
+    return now_ns() - t0;
+}
+
+// n fake readers (one writer among them) on service thread 1, linked into
+// the engine's client list in the order add_client() would leave them.
+static int make_clients(struct bench_ctx *ctx, int n) {
+    struct chat_engine *e = ctx->e;
+    ctx->clients = calloc((size_t)n, sizeof(struct client));
+    if (!ctx->clients) return -1;
+    ctx->nclients = n;
+    e->clients_head = NULL;
+    for (int i = 0; i < n; i++) {
+        struct client *c = &ctx->clients[i];
+        c->wsi = (struct lws *)(uintptr_t)(i + 1); // never dereferenced
+        c->tsi = 1;
+        snprintf(c->username, MAX_NAME_LEN, "user%d", i);
+        snprintf(c->role, MAX_ROLE_LEN, i == 0 ? "WRITER" : "READER");
+        c->next = e->clients_head;
+        e->clients_head = c;
+    }
+    e->client_count = n;
+    return 0;
+}
+
+static void free_clients(struct bench_ctx *ctx) {
+    drain_clients(ctx);
+    ctx->e->clients_head = NULL;
+    ctx->e->client_count = 0;
+    free(ctx->clients);
+    ctx->clients = NULL;
+    ctx->nclients = 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--runs N] [--min-ms MS] [--cpu LIST] [--filter NAME] [--db PATH]\n"
+        "  NAME selects cases by substring: history_snapshot, insert_single,\n"
+        "  insert_batched, fanout, count_roles.\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct bench_opts o = { 7, 50.0, NULL };
+    const char *cpus = NULL;
+    char db_path[256];
+    int own_db = 1; // temporary file, removed at exit
+    snprintf(db_path, sizeof(db_path), "/tmp/engine_bench.%d.sqlite", (int)getpid());
+    static const struct option long_opts[] = {
+        { "runs", required_argument, NULL, 'r' },
+        { "min-ms", required_argument, NULL, 'm' },
+        { "cpu", required_argument, NULL, 'c' },
+        { "filter", required_argument, NULL, 'f' },
+        { "db", required_argument, NULL, 'd' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:m:c:f:d:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'r': o.runs = atoi(optarg); break;
+            case 'm': o.min_ms = atof(optarg); break;
+            case 'c': cpus = optarg; break;
+            case 'f': o.filter = optarg; break;
+            case 'd':
+                snprintf(db_path, sizeof(db_path), "%s", optarg);
+                own_db = 0;
+                break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (o.runs < 1) o.runs = 1;
+    if (placement_apply("bench", cpus) != 0) return 1;
+
+    struct chat_engine *e = calloc(1, sizeof(*e));
+    if (!e) return 1;
+    chat_engine_config_init(&e->cfg);
+    e->cfg.service_threads = 2;
+    // enqueue_frame() and the history paths read the live limits
+    if (!(e->limits = default_limits(&e->cfg))) return 1;
+    pthread_mutex_init(&e->clients_mutex, NULL);
+    pthread_rwlock_init(&e->history_lock, NULL);
+    if (init_db(e, db_path) != 0) return 1;
+
+    // Only used by lws_cancel_service() when a broadcast flags a wakeup.
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.gid = -1;
+    info.uid = -1;
+    lws_set_log_level(LLL_ERR, NULL);
+    e->context = lws_create_context(&info);
+    if (!e->context) {
+        fprintf(stderr, "lws init failed\n");
+        return 1;
+    }
+
+    char message[101], params[128];
+    fill_text(message, 100, 1);
+    struct bench_ctx ctx = { .e = e, .message = message };
+
+    static const size_t row_sizes[] = { 32, 256, 2000 };
+    static const int limits[] = { 50, HISTORY_LIMIT, 2000 };
+    for (size_t r = 0; r < sizeof(row_sizes) / sizeof(row_sizes[0]); r++) {
+        if (o.filter && !strstr("history_snapshot", o.filter)) break;
+        fill_history(e, limits[2], row_sizes[r]);
+        for (size_t l = 0; l < sizeof(limits) / sizeof(limits[0]); l++) {
+            ctx.limit = limits[l];
+            snprintf(params, sizeof(params), "\"limit\":%d,\"row_bytes\":%zu", ctx.limit, row_sizes[r]);
+            measure(&o, "history_snapshot", params, bench_history, &ctx);
+        }
+    }
+
+    snprintf(params, sizeof(params), "\"row_bytes\":100,\"batch\":1");
+    measure(&o, "insert_single", params, bench_insert_single, &ctx);
+    static const int batches[] = { 16, 256, 4096 };
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); b++) {
+        ctx.batch = batches[b];
+        snprintf(params, sizeof(params), "\"row_bytes\":100,\"batch\":%d", ctx.batch);
+        measure(&o, "insert_batched", params, bench_insert_batched, &ctx);
+    }
+
+    static const int client_counts[] = { 10, 100, 1000, 10000, 100000 };
+    for (size_t n = 0; n < sizeof(client_counts) / sizeof(client_counts[0]); n++) {
+        if (make_clients(&ctx, client_counts[n]) != 0) return 1;
+        snprintf(params, sizeof(params), "\"clients\":%d,\"row_bytes\":100", ctx.nclients);
+        measure(&o, "fanout", params, bench_fanout, &ctx);
+        snprintf(params, sizeof(params), "\"clients\":%d", ctx.nclients);
+        measure(&o, "count_roles", params, bench_count_roles, &ctx);
+        free_clients(&ctx);
+    }
+
+    lws_context_destroy(e->context);
+    close_db(e);
+    pthread_rwlock_destroy(&e->history_lock);
+    pthread_mutex_destroy(&e->clients_mutex);
+    free(e);
+    if (own_db) {
+        char side[300];
+        unlink(db_path);
+        snprintf(side, sizeof(side), "%s-wal", db_path);
+        unlink(side);
+        snprintf(side, sizeof(side), "%s-shm", db_path);
+        unlink(side);
+    }
+    return 0;
+}
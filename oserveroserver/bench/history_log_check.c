@@ -0,0 +1,182 @@
+// Crash-recovery check for history_log.c: commits groups of rows, including
+// one larger than the registered buffer, then cuts the file inside a record
+// or flips a byte in one, and checks that replay returns exactly the records
+// before the damage, that appends go on right after them, and that a second
+// replay sees those too. Exits 1 on the first failure.
+//
+//   gcc -O2 bench/history_log_check.c history_log.c log.c -I. -o history_log_check -lz -lpthread
+//   ./history_log_check [PATH]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "history_log.h"
+
+#define GROUPS 50
+#define GROUP_ROWS 40
+#define BIG_ROWS 20000   // about 1.5 MiB, past HISTORY_LOG_BUF
+
+static const char *log_path = "/tmp/history_log_check.log";
+static long total_rows;
+static off_t *ends;      // end offset of each record
+
+static void row_text(uint64_t id, char *buf, size_t len, size_t *n) {
+    // Lengths vary so records straddle every alignment
+    *n = (size_t)snprintf(buf, len, "message %llu %.*s", (unsigned long long)id, (int)(id % 23),
+                          "abcdefghijklmnopqrstuvw");
+}
+
+static int write_rows(struct history_log *hl, uint64_t first, long rows, off_t base) {
+    for (long i = 0; i < rows; i++) {
+        uint64_t id = first + (uint64_t)i;
+        char msg[64];
+        size_t n;
+        row_text(id, msg, sizeof(msg), &n);
+        struct history_log_row row = { id, (long long)id * 1000, "alice", 5, msg, n };
+        if (history_log_stage(hl, &row) != 0) return -1;
+        base += 8 + 20 + 5 + (off_t)n;
+        ends[id - 1] = base;
+        if (i % GROUP_ROWS == GROUP_ROWS - 1 && history_log_commit(hl) != 0) return -1;
+    }
+    return history_log_commit(hl);
+}
+
+struct replay_state {
+    long rows;
+    int bad;
+};
+
+static int check_row(void *arg, const struct history_log_row *row) {
+    struct replay_state *st = arg;
+    uint64_t id = (uint64_t)st->rows + 1;
+    char msg[64];
+    size_t n;
+    row_text(id, msg, sizeof(msg), &n);
+    if (row->id != id || row->ts_ms != (long long)id * 1000 || row->username_len != 5 ||
+        memcmp(row->username, "alice", 5) != 0 || row->message_len != n ||
+        memcmp(row->message, msg, n) != 0)
+        st->bad = 1;
+    st->rows++;
+    return 0;
+}
+
+// Replays the file and returns the rows read, or -1 if one was wrong.
+static long replay(struct history_log **out) {
+    struct history_log *hl = history_log_open(log_path, 1);
+    if (!hl) return -1;
+    struct replay_state st = { 0, 0 };
+    long n = history_log_replay(hl, check_row, &st);
+    if (out) *out = hl;
+    else history_log_close(hl);
+    return st.bad || n != st.rows ? -1 : n;
+}
+
+static int expect(const char *what, long got, long want) {
+    printf("{\"case\":\"%s\",\"replayed\":%ld,\"expected\":%ld}\n", what, got, want);
+    if (got == want) return 0;
+    fprintf(stderr, "%s: replayed %ld rows, expected %ld\n", what, got, want);
+    return -1;
+}
+
+// Writes the reference log: GROUPS groups, then one big group.
+static int write_log(void) {
+    struct history_log *hl = history_log_open(log_path, 0);
+    if (!hl) return -1;
+    int rc = write_rows(hl, 1, GROUPS * GROUP_ROWS, 0);
+    history_log_close(hl);
+    if (rc != 0) return -1;
+    hl = history_log_open(log_path, 1);
+    if (!hl) return -1;
+    struct replay_state st = { 0, 0 };
+    history_log_replay(hl, check_row, &st);
+    // Not split by write_rows(): one group past the registered buffer
+    for (long i = 0; i < BIG_ROWS; i++) {
+        uint64_t id = (uint64_t)(GROUPS * GROUP_ROWS + i + 1);
+        char msg[64];
+        size_t n;
+        row_text(id, msg, sizeof(msg), &n);
+        struct history_log_row row = { id, (long long)id * 1000, "alice", 5, msg, n };
+        if (history_log_stage(hl, &row) != 0) rc = -1;
+        ends[id - 1] = ends[id - 2] + 8 + 20 + 5 + (off_t)n;
+    }
+    if (history_log_commit(hl) != 0 || history_log_flush(hl) != 0) rc = -1;
+    history_log_close(hl);
+    return rc;
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1) log_path = argv[1];
+    total_rows = GROUPS * GROUP_ROWS + BIG_ROWS;
+    if (!(ends = calloc((size_t)total_rows + 1, sizeof(*ends)))) return 1;
+    if (write_log() != 0) {
+        fprintf(stderr, "Cannot write %s\n", log_path);
+        return 1;
+    }
+    if (expect("intact", replay(NULL), total_rows) != 0) return 1;
+
+    // Cut inside records near the start, at a group edge, inside the big
+    // group and in its last record.
+    static const long cut_rows[] = { 0, 1, 39, 40, 777, 2000, 2001, 15000 };
+    for (size_t i = 0; i < sizeof(cut_rows) / sizeof(cut_rows[0]); i++) {
+        long keep = cut_rows[i];
+        off_t start = keep ? ends[keep - 1] : 0;
+        for (off_t into = 1; into < ends[keep] - start; into += 5) {
+            if (write_log() != 0 || truncate(log_path, start + into) != 0) return 1;
+            char what[64];
+            snprintf(what, sizeof(what), "cut %ld+%lld", keep, (long long)into);
+            if (expect(what, replay(NULL), keep) != 0) return 1;
+        }
+    }
+    if (write_log() != 0 || truncate(log_path, ends[total_rows - 1] - 1) != 0 ||
+        expect("cut last", replay(NULL), total_rows - 1) != 0)
+        return 1;
+
+    // A flipped byte anywhere in a record drops it and everything after.
+    static const long flip_rows[] = { 0, 5, 1999, 2000, 12345 };
+    for (size_t i = 0; i < sizeof(flip_rows) / sizeof(flip_rows[0]); i++) {
+        long keep = flip_rows[i];
+        off_t start = keep ? ends[keep - 1] : 0;
+        for (off_t at = start; at < ends[keep]; at += 3) {
+            if (write_log() != 0) return 1;
+            int fd = open(log_path, O_RDWR);
+            unsigned char b;
+            if (fd < 0 || pread(fd, &b, 1, at) != 1) return 1;
+            b ^= 0x20;
+            if (pwrite(fd, &b, 1, at) != 1) return 1;
+            close(fd);
+            char what[64];
+            snprintf(what, sizeof(what), "flip %ld+%lld", keep, (long long)(at - start));
+            if (expect(what, replay(NULL), keep) != 0) return 1;
+        }
+    }
+
+    // After a torn tail, new groups go where the intact records end.
+    if (write_log() != 0 || truncate(log_path, ends[999] + 9) != 0) return 1;
+    struct history_log *hl;
+    if (expect("reopen", replay(&hl), 1000) != 0) return 1;
+    int rc = write_rows(hl, 1001, 500, ends[999]);
+    history_log_close(hl);
+    if (rc != 0 || expect("append after tear", replay(NULL), 1500) != 0) return 1;
+
+    // A damaged record leaves intact ones behind it. A shorter group written
+    // over the damage must still end the log, not run on into them.
+    if (write_log() != 0) return 1;
+    int fd = open(log_path, O_RDWR);
+    unsigned char b;
+    if (fd < 0 || pread(fd, &b, 1, ends[999] + 4) != 1) return 1;
+    b ^= 0x20;
+    if (pwrite(fd, &b, 1, ends[999] + 4) != 1) return 1;
+    close(fd);
+    if (expect("reopen after flip", replay(&hl), 1000) != 0) return 1;
+    rc = write_rows(hl, 1001, 1, ends[999]);
+    history_log_close(hl);
+    if (rc != 0 || expect("short group over flip", replay(NULL), 1001) != 0) return 1;
+
+    unlink(log_path);
+    free(ends);
+    printf("{\"check\":\"history_log\",\"ok\":true}\n");
+    return 0;
+}
@@ -0,0 +1,463 @@
+// Traffic replay: re-drives a running server from a recording made with
+// `server --record`, opening, feeding and closing one WebSocket per recorded
+// connection at the recorded times (divided by --scale). Prints one JSON line
+// with throughput and echo latency: the time from sending a chat message to
+// receiving its "name: message" broadcast on the same connection. With
+// --compare, a second line gives the change against an earlier result, so the
+// same recording can be replayed against two builds.
+//
+//   gcc -O2 bench/replay.c traffic_record.c log.c -I. -o replay $(pkg-config --cflags --libs libwebsockets) -lpthread
+//   ./replay --port 8080 --scale 2 traffic.rec > new.json
+//   ./replay --port 8080 --compare old.json traffic.rec
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <libwebsockets.h>
+
+#include "traffic_record.h"
+
+#define MAX_PENDING_ECHOES 64 // per connection; older sends count as unanswered
+
+struct out_msg {
+    struct out_msg *next;
+    size_t len;
+    unsigned char buf[]; // LWS_PRE headroom + payload
+};
+
+struct echo {
+    double sent_ms;
+    size_t len;
+    char *text;
+};
+
+struct conn {
+    struct lws *wsi;
+    int connecting, open, done;
+    int close_requested;
+    struct out_msg *out_head, *out_tail;
+    struct echo echoes[MAX_PENDING_ECHOES];
+    int echo_head, echo_count;
+    char *rx;            // partial inbound message
+    size_t rx_len, rx_cap;
+};
+
+struct replay_event {
+    enum traffic_type type;
+    double at_ms; // already scaled
+    uint32_t conn;
+    char *data;
+    size_t len;
+};
+
+static struct {
+    struct lws_context *context;
+    const char *host;
+    int port;
+    int tls;
+    struct replay_event *events;
+    size_t nevents, next_event;
+    struct conn *conns; // indexed by recorded connection number
+    uint32_t nconns;
+    lws_sorted_usec_list_t sul;
+    double start_ms;
+    int live; // connections opened and not yet finished
+
+    unsigned long opened, failed, frames_sent, frames_received, unanswered;
+    unsigned long long bytes_sent, bytes_received;
+    double max_slip_ms; // how late events were dispatched
+    double *latency_ms;
+    size_t nlatency, latency_cap;
+} rs;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Control messages get no echo; anything else is broadcast as "name: text".
+static int is_chat(const char *p, size_t len) {
+    return !(len >= 9 && strncmp(p, "username:", 9) == 0) &&
+           !(len >= 5 && strncmp(p, "role:", 5) == 0) &&
+           !(len >= 11 && strncmp(p, "get_history", 11) == 0);
+}
+
+static void add_latency(double ms) {
+    if (rs.nlatency == rs.latency_cap) {
+        size_t cap = rs.latency_cap ? rs.latency_cap * 2 : 4096;
+        double *tmp = realloc(rs.latency_ms, cap * sizeof(double));
+        if (!tmp) return;
+        rs.latency_ms = tmp;
+        rs.latency_cap = cap;
+    }
+    rs.latency_ms[rs.nlatency++] = ms;
+}
+
+static void drop_echo(struct conn *c) {
+    free(c->echoes[c->echo_head].text);
+    c->echo_head = (c->echo_head + 1) % MAX_PENDING_ECHOES;
+    c->echo_count--;
+}
+
+static void push_echo(struct conn *c, const char *text, size_t len) {
+    if (c->echo_count == MAX_PENDING_ECHOES) {
+        drop_echo(c);
+        rs.unanswered++;
+    }
+    struct echo *ec = &c->echoes[(c->echo_head + c->echo_count) % MAX_PENDING_ECHOES];
+    ec->text = malloc(len);
+    if (!ec->text) return;
+    memcpy(ec->text, text, len);
+    ec->len = len;
+    ec->sent_ms = now_ms();
+    c->echo_count++;
+}
+
+// Matches a received message against the oldest pending sends. Sends the
+// server dropped (rate limit, duplicates, filter) are skipped over.
+static void match_echo(struct conn *c, const char *msg, size_t len) {
+    for (int i = 0; i < c->echo_count; i++) {
+        struct echo *ec = &c->echoes[(c->echo_head + i) % MAX_PENDING_ECHOES];
+        if (len < ec->len + 2 || memcmp(msg + len - ec->len, ec->text, ec->len) != 0 ||
+            memcmp(msg + len - ec->len - 2, ": ", 2) != 0)
+            continue;
+        add_latency(now_ms() - ec->sent_ms);
+        for (int k = 0; k < i; k++) {
+            drop_echo(c);
+            rs.unanswered++;
+        }
+        drop_echo(c);
+        return;
+    }
+}
+
+static void finish(struct conn *c) {
+    if (c->done) return;
+    c->done = 1;
+    c->open = 0;
+    c->wsi = NULL;
+    while (c->out_head) {
+        struct out_msg *m = c->out_head;
+        c->out_head = m->next;
+        free(m);
+    }
+    c->out_tail = NULL;
+    rs.unanswered += (unsigned long)c->echo_count;
+    while (c->echo_count) drop_echo(c);
+    rs.live--;
+}
+
+static int replay_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                           void *user, void *in, size_t len) {
+    (void)user;
+    struct conn *c = lws_get_opaque_user_data(wsi);
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_ESTABLISHED:
+            if (!c) break;
+            c->connecting = 0;
+            c->open = 1;
+            rs.opened++;
+            if (c->out_head || c->close_requested) lws_callback_on_writable(wsi);
+            break;
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+            fprintf(stderr, "connect error: %s\n", in ? (const char *)in : "unknown");
+            if (c && !c->done) {
+                rs.failed++;
+                finish(c);
+            }
+            break;
+        case LWS_CALLBACK_CLIENT_RECEIVE: {
+            if (!c) break;
+            if (c->rx_len + len > c->rx_cap) {
+                size_t cap = (c->rx_len + len) * 2;
+                char *tmp = realloc(c->rx, cap);
+                if (!tmp) return -1;
+                c->rx = tmp;
+                c->rx_cap = cap;
+            }
+            memcpy(c->rx + c->rx_len, in, len);
+            c->rx_len += len;
+            if (!lws_is_final_fragment(wsi)) break;
+            rs.frames_received++;
+            rs.bytes_received += c->rx_len;
+            if (c->echo_count) match_echo(c, c->rx, c->rx_len);
+            c->rx_len = 0;
+            break;
+        }
+        case LWS_CALLBACK_CLIENT_WRITEABLE: {
+            if (!c) break;
+            struct out_msg *m = c->out_head;
+            if (!m) return c->close_requested ? -1 : 0;
+            c->out_head = m->next;
+            if (!c->out_head) c->out_tail = NULL;
+            const char *payload = (const char *)m->buf + LWS_PRE;
+            if (is_chat(payload, m->len)) push_echo(c, payload, m->len);
+            int n = lws_write(wsi, m->buf + LWS_PRE, m->len, LWS_WRITE_TEXT);
+            free(m);
+            if (n < 0) return -1;
+            rs.frames_sent++;
+            rs.bytes_sent += (unsigned long long)n;
+            if (c->out_head || c->close_requested) lws_callback_on_writable(wsi);
+            break;
+        }
+        case LWS_CALLBACK_CLIENT_CLOSED:
+            if (c) finish(c);
+            break;
+        default:
+            break;
+    }
+    return 0;
+}
+
+static const struct lws_protocols protocols[] = {
+    { "chat-protocol", replay_callback, 0, 65536, 0, NULL, 0 },
+    LWS_PROTOCOL_LIST_TERM
+};
+
+static void open_conn(struct conn *c) {
+    struct lws_client_connect_info ci;
+    memset(&ci, 0, sizeof(ci));
+    ci.context = rs.context;
+    ci.address = rs.host;
+    ci.port = rs.port;
+    ci.path = "/chat-protocol";
+    ci.host = rs.host;
+    ci.origin = rs.host;
+    ci.protocol = "chat-protocol";
+    if (rs.tls)
+        ci.ssl_connection = LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED |
+                            LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK;
+    ci.opaque_user_data = c;
+    ci.pwsi = &c->wsi;
+    c->connecting = 1;
+    rs.live++;
+    if (!lws_client_connect_via_info(&ci) && !c->done) {
+        rs.failed++;
+        finish(c);
+    }
+}
+
+static void dispatch(const struct replay_event *ev) {
+    if (ev->conn >= rs.nconns) return;
+    struct conn *c = &rs.conns[ev->conn];
+    switch (ev->type) {
+        case TRAFFIC_OPEN:
+            if (!c->connecting && !c->open && !c->done) open_conn(c);
+            break;
+        case TRAFFIC_FRAME: {
+            if (c->done || (!c->connecting && !c->open)) break;
+            struct out_msg *m = malloc(sizeof(*m) + LWS_PRE + ev->len);
+            if (!m) break;
+            m->next = NULL;
+            m->len = ev->len;
+            memcpy(m->buf + LWS_PRE, ev->data, ev->len);
+            if (c->out_tail) c->out_tail->next = m;
+            else c->out_head = m;
+            c->out_tail = m;
+            if (c->open) lws_callback_on_writable(c->wsi);
+            break;
+        }
+        case TRAFFIC_CLOSE:
+            if (c->done) break;
+            c->close_requested = 1;
+            if (c->open) lws_callback_on_writable(c->wsi);
+            break;
+    }
+}
+
+// Runs every event that is due, then sleeps until the next one.
+static void tick(lws_sorted_usec_list_t *sul) {
+    (void)sul;
+    double now = now_ms() - rs.start_ms;
+    while (rs.next_event < rs.nevents && rs.events[rs.next_event].at_ms <= now) {
+        const struct replay_event *ev = &rs.events[rs.next_event++];
+        if (now - ev->at_ms > rs.max_slip_ms) rs.max_slip_ms = now - ev->at_ms;
+        dispatch(ev);
+    }
+    if (rs.next_event < rs.nevents) {
+        double wait_ms = rs.events[rs.next_event].at_ms - now;
+        lws_sul_schedule(rs.context, 0, &rs.sul, tick, (lws_usec_t)(wait_ms * 1000) + 1);
+    }
+}
+
+static int load_events(const char *path, double scale) {
+    struct traffic_reader *r = traffic_reader_open(path);
+    if (!r) return -1;
+    size_t cap = 0;
+    struct traffic_event ev;
+    int rc;
+    while ((rc = traffic_reader_next(r, &ev)) == 1) {
+        if (rs.nevents == cap) {
+            cap = cap ? cap * 2 : 4096;
+            struct replay_event *tmp = realloc(rs.events, cap * sizeof(*tmp));
+            if (!tmp) {
+                rc = -1;
+                break;
+            }
+            rs.events = tmp;
+        }
+        struct replay_event *re = &rs.events[rs.nevents];
+        re->type = ev.type;
+        re->at_ms = ev.at_us / 1000.0 / scale;
+        re->conn = ev.conn;
+        re->len = ev.len;
+        re->data = NULL;
+        if (ev.type == TRAFFIC_FRAME && !(re->data = malloc(ev.len ? ev.len : 1))) {
+            rc = -1;
+            break;
+        }
+        if (re->data) memcpy(re->data, ev.data, ev.len);
+        if (ev.conn >= rs.nconns) rs.nconns = ev.conn + 1;
+        rs.nevents++;
+    }
+    traffic_reader_close(r);
+    if (rc < 0) {
+        fprintf(stderr, "%s: damaged record after %zu events\n", path, rs.nevents);
+        return -1;
+    }
+    rs.conns = calloc(rs.nconns ? rs.nconns : 1, sizeof(struct conn));
+    return rs.conns ? 0 : -1;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    size_t i = (size_t)(p * (double)(n - 1) + 0.5);
+    return sorted[i];
+}
+
+// Value of "key": in a one-line JSON result, or -1.
+static double json_number(const char *line, const char *key) {
+    char pat[64];
+    snprintf(pat, sizeof(pat), "\"%s\":", key);
+    const char *p = strstr(line, pat);
+    return p ? strtod(p + strlen(pat), NULL) : -1;
+}
+
+static void print_compare(const char *path, const char *result) {
+    FILE *f = fopen(path, "r");
+    char line[2048];
+    if (!f || !fgets(line, sizeof(line), f)) {
+        fprintf(stderr, "Cannot read baseline '%s'\n", path);
+        if (f) fclose(f);
+        return;
+    }
+    fclose(f);
+    static const char *const keys[] = {
+        "recv_per_sec", "send_per_sec", "echo_p50_ms", "echo_p90_ms", "echo_p99_ms", "echo_max_ms",
+    };
+    printf("{\"baseline\":\"%s\"", path);
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+        double old = json_number(line, keys[i]), cur = json_number(result, keys[i]);
+        printf(",\"%s_change_pct\":", keys[i]);
+        if (old > 0 && cur >= 0) printf("%.1f", (cur - old) * 100.0 / old);
+        else printf("null");
+    }
+    printf("}\n");
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--host HOST] [--port PORT] [--tls] [--scale F] [--drain SECS]\n"
+        "          [--compare RESULT.json] RECORDING\n"
+        "  --scale 2 replays twice as fast; --drain is how long to wait for\n"
+        "  replies after the last event (default 5).\n", prog);
+}
+
+int main(int argc, char **argv) {
+    const char *compare = NULL;
+    double scale = 1.0;
+    int drain_s = 5;
+    rs.host = "localhost";
+    rs.port = 8080;
+    static const struct option long_opts[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "tls", no_argument, NULL, 'T' },
+        { "scale", required_argument, NULL, 's' },
+        { "drain", required_argument, NULL, 'd' },
+        { "compare", required_argument, NULL, 'c' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "H:p:Ts:d:c:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': rs.host = optarg; break;
+            case 'p': rs.port = atoi(optarg); break;
+            case 'T': rs.tls = 1; break;
+            case 's': scale = atof(optarg); break;
+            case 'd': drain_s = atoi(optarg); break;
+            case 'c': compare = optarg; break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (optind != argc - 1 || scale <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (load_events(argv[optind], scale) != 0) return 1;
+
+    lws_set_log_level(LLL_ERR | LLL_WARN, NULL);
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    if (rs.tls) info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    info.fd_limit_per_thread = 1 + rs.nconns + 16;
+    rs.context = lws_create_context(&info);
+    if (!rs.context) {
+        fprintf(stderr, "lws init failed\n");
+        return 1;
+    }
+
+    rs.start_ms = now_ms();
+    tick(&rs.sul);
+    double drain_until = 0;
+    for (;;) {
+        if (rs.next_event == rs.nevents) {
+            if (!drain_until) drain_until = now_ms() + drain_s * 1000.0;
+            if (rs.live == 0 || now_ms() >= drain_until) break;
+        }
+        if (lws_service(rs.context, 50) < 0) break;
+    }
+    double total_s = (now_ms() - rs.start_ms) / 1000.0;
+    double recorded_s = rs.nevents ? rs.events[rs.nevents - 1].at_ms * scale / 1000.0 : 0;
+
+    qsort(rs.latency_ms, rs.nlatency, sizeof(double), cmp_double);
+    char result[1024];
+    snprintf(result, sizeof(result),
+             "{\"events\":%zu,\"connections\":%u,\"opened\":%lu,\"failed\":%lu,"
+             "\"frames_sent\":%lu,\"frames_received\":%lu,\"bytes_sent\":%llu,\"bytes_received\":%llu,"
+             "\"recorded_s\":%.3f,\"scale\":%g,\"elapsed_s\":%.3f,\"max_slip_ms\":%.2f,"
+             "\"send_per_sec\":%.1f,\"recv_per_sec\":%.1f,\"echoes\":%zu,\"unanswered\":%lu,"
+             "\"echo_p50_ms\":%.3f,\"echo_p90_ms\":%.3f,\"echo_p99_ms\":%.3f,\"echo_max_ms\":%.3f}",
+             rs.nevents, rs.nconns ? rs.nconns - 1 : 0, rs.opened, rs.failed,
+             rs.frames_sent, rs.frames_received, rs.bytes_sent, rs.bytes_received,
+             recorded_s, scale, total_s, rs.max_slip_ms,
+             total_s > 0 ? rs.frames_sent / total_s : 0.0,
+             total_s > 0 ? rs.frames_received / total_s : 0.0,
+             rs.nlatency, rs.unanswered,
+             percentile(rs.latency_ms, rs.nlatency, 0.50),
+             percentile(rs.latency_ms, rs.nlatency, 0.90),
+             percentile(rs.latency_ms, rs.nlatency, 0.99),
+             rs.nlatency ? rs.latency_ms[rs.nlatency - 1] : 0.0);
+    printf("%s\n", result);
+    if (compare) print_compare(compare, result);
+
+    lws_context_destroy(rs.context);
+    for (size_t i = 0; i < rs.nevents; i++) free(rs.events[i].data);
+    free(rs.events);
+    for (uint32_t i = 0; i < rs.nconns; i++) free(rs.conns[i].rx);
+    free(rs.conns);
+    free(rs.latency_ms);
+    return rs.failed ? 1 : 0;
+}
@@ -0,0 +1,574 @@
+// Soak harness: keeps a steady writer, fast readers, slow readers (which stop
+// reading for seconds at a time, so their server-side queues back up) and
+// flapping readers (which join, fetch history and leave in a loop) running
+// against one server for hours. Every --interval seconds it samples the
+// server's RSS and open fds from /proc, its queue depth from the admin
+// socket's stats (--admin) and the fast readers' delivery latency, and prints
+// one JSON line. At the end a summary line checks for growth after the
+// warm-up; the exit status is 1 when a check failed.
+//
+// Readers never send role:READER, since readers are not admitted while a
+// writer is inside; connections without a role still get every broadcast.
+// The writer embeds a CLOCK_MONOTONIC timestamp in each message, so the
+// harness must run on the server's host. If the server runs with
+// --writer-rate, keep --rate below it.
+//
+//   gcc -O2 bench/soak.c -o soak $(pkg-config --cflags --libs libwebsockets)
+//   ./soak --admin @soak --duration 14400 -- ./server --admin-socket @soak soak.sqlite
+//   ./soak --pid $(pidof server) --admin @soak --duration 3600
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <libwebsockets.h>
+
+#define MAX_PENDING 8   // outbound messages per connection
+#define MAX_SAMPLES 100000
+
+enum soak_role { SOAK_WRITER, SOAK_FAST, SOAK_SLOW, SOAK_FLAPPER };
+static const char *role_names[] = { "writer", "fast", "slow", "flapper" };
+
+struct soak_client {
+    lws_sorted_usec_list_t sul; // reconnects, flaps and read pauses
+    struct lws *wsi;
+    enum soak_role role;
+    int id;
+    int connected;
+    int leaving;   // close on the next writeable
+    int paused;    // slow reader not reading
+    char pending[MAX_PENDING][256];
+    int pending_head, pending_count;
+};
+
+struct sample {
+    double t;
+    long rss_kb;
+    int fds;
+    double queued;
+    double p99_ms;
+};
+
+static struct {
+    struct lws_context *context;
+    const char *host;
+    int port;
+    const char *admin; // admin socket for stats, or NULL
+    pid_t pid;
+    int spawned;
+    double rate;
+    double start_s;
+    struct soak_client *clients;
+    int nclients;
+    struct soak_client *writer;
+    lws_sorted_usec_list_t write_sul, sample_sul;
+    unsigned long seq;
+
+    unsigned long sent, received, stalled, reconnects, flaps, slow_drops;
+    double *lat;    // fast readers' latency this interval, ms
+    size_t nlat, lat_cap;
+
+    double interval, warmup;
+    struct sample *samples;
+    int nsamples;
+    int server_died;
+    int stop;
+} sk;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void on_signal(int sig) {
+    (void)sig;
+    sk.stop = 1;
+}
+
+static void queue_text(struct soak_client *c, const char *text) {
+    if (c->pending_count == MAX_PENDING) {
+        if (c->role == SOAK_WRITER) sk.stalled++;
+        return;
+    }
+    snprintf(c->pending[(c->pending_head + c->pending_count) % MAX_PENDING], 256, "%s", text);
+    c->pending_count++;
+    if (c->connected) lws_callback_on_writable(c->wsi);
+}
+
+static void connect_client(lws_sorted_usec_list_t *sul);
+
+// Seconds, uniformly in [lo, hi).
+static double jitter(double lo, double hi) {
+    return lo + (hi - lo) * (double)random() / ((double)RAND_MAX + 1.0);
+}
+
+static void schedule(struct soak_client *c, sul_cb_t cb, double seconds) {
+    lws_sul_schedule(sk.context, 0, &c->sul, cb, (lws_usec_t)(seconds * LWS_US_PER_SEC));
+}
+
+static void flap_leave(lws_sorted_usec_list_t *sul) {
+    struct soak_client *c = lws_container_of(sul, struct soak_client, sul);
+    if (!c->connected) return;
+    c->leaving = 1;
+    lws_callback_on_writable(c->wsi);
+}
+
+// Slow readers alternate between reading and not reading; while they do not,
+// the kernel buffers fill and the server queues frames for them.
+static void slow_toggle(lws_sorted_usec_list_t *sul) {
+    struct soak_client *c = lws_container_of(sul, struct soak_client, sul);
+    if (!c->connected) return;
+    c->paused = !c->paused;
+    lws_rx_flow_control(c->wsi, !c->paused);
+    schedule(c, slow_toggle, c->paused ? jitter(2, 8) : jitter(1, 3));
+}
+
+static void add_latency(double ms) {
+    if (sk.nlat == sk.lat_cap) {
+        size_t cap = sk.lat_cap ? sk.lat_cap * 2 : 4096;
+        double *tmp = realloc(sk.lat, cap * sizeof(double));
+        if (!tmp) return;
+        sk.lat = tmp;
+        sk.lat_cap = cap;
+    }
+    sk.lat[sk.nlat++] = ms;
+}
+
+static int soak_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                         void *user, void *in, size_t len) {
+    (void)user;
+    struct soak_client *c = lws_get_opaque_user_data(wsi);
+    if (!c) return 0;
+    switch (reason) {
+        case LWS_CALLBACK_CLIENT_ESTABLISHED: {
+            char text[64];
+            c->connected = 1;
+            c->leaving = 0;
+            c->paused = 0;
+            snprintf(text, sizeof(text), "username:soak-%s-%d", role_names[c->role], c->id);
+            queue_text(c, text);
+            if (c->role == SOAK_WRITER) queue_text(c, "role:WRITER");
+            else if (c->role == SOAK_FLAPPER) queue_text(c, "get_history");
+            if (c->role == SOAK_FLAPPER) schedule(c, flap_leave, jitter(0.5, 5));
+            else if (c->role == SOAK_SLOW) schedule(c, slow_toggle, jitter(1, 3));
+            break;
+        }
+        case LWS_CALLBACK_CLIENT_RECEIVE: {
+            if (c->role != SOAK_FAST && c->role != SOAK_SLOW) break;
+            sk.received++;
+            // "soak-writer-0: soak <seq> <monotonic seconds>"
+            const char *p = memmem(in, len, ": soak ", 7);
+            if (c->role != SOAK_FAST || !p) break;
+            char tail[64];
+            size_t n = len - (size_t)(p + 7 - (const char *)in);
+            if (n >= sizeof(tail)) break;
+            memcpy(tail, p + 7, n);
+            tail[n] = '\0';
+            unsigned long seq;
+            double sent_at;
+            if (sscanf(tail, "%lu %lf", &seq, &sent_at) == 2) add_latency((now_s() - sent_at) * 1000.0);
+            break;
+        }
+        case LWS_CALLBACK_CLIENT_WRITEABLE: {
+            if (c->leaving) return -1;
+            if (!c->pending_count) break;
+            unsigned char buf[LWS_PRE + 256];
+            char *text = c->pending[c->pending_head];
+            size_t n = strlen(text);
+            memcpy(buf + LWS_PRE, text, n);
+            c->pending_head = (c->pending_head + 1) % MAX_PENDING;
+            c->pending_count--;
+            if (lws_write(wsi, buf + LWS_PRE, n, LWS_WRITE_TEXT) < (int)n) return -1;
+            if (c->role == SOAK_WRITER && strncmp(text, "soak ", 5) == 0) sk.sent++;
+            if (c->pending_count) lws_callback_on_writable(wsi);
+            break;
+        }
+        case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+        case LWS_CALLBACK_CLIENT_CLOSED: {
+            int was_leaving = c->leaving;
+            c->connected = 0;
+            c->wsi = NULL;
+            c->pending_count = 0;
+            lws_sul_cancel(&c->sul);
+            if (sk.stop) break;
+            if (c->role == SOAK_FLAPPER && was_leaving) {
+                sk.flaps++;
+                schedule(c, connect_client, jitter(0.1, 2));
+            } else {
+                if (c->role == SOAK_SLOW && reason == LWS_CALLBACK_CLIENT_CLOSED) sk.slow_drops++;
+                sk.reconnects++;
+                schedule(c, connect_client, 1.0);
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return 0;
+}
+
+static const struct lws_protocols protocols[] = {
+    { "chat-protocol", soak_callback, 0, 65536, 0, NULL, 0 },
+    LWS_PROTOCOL_LIST_TERM
+};
+
+static void connect_client(lws_sorted_usec_list_t *sul) {
+    struct soak_client *c = lws_container_of(sul, struct soak_client, sul);
+    struct lws_client_connect_info ci;
+    memset(&ci, 0, sizeof(ci));
+    ci.context = sk.context;
+    ci.address = sk.host;
+    ci.port = sk.port;
+    ci.path = "/chat-protocol";
+    ci.host = sk.host;
+    ci.origin = sk.host;
+    ci.protocol = "chat-protocol";
+    ci.opaque_user_data = c;
+    ci.pwsi = &c->wsi;
+    if (!lws_client_connect_via_info(&ci) && !c->wsi) schedule(c, connect_client, 1.0);
+}
+
+static void write_tick(lws_sorted_usec_list_t *sul) {
+    (void)sul;
+    struct soak_client *w = sk.writer;
+    if (w->connected) {
+        char text[64];
+        snprintf(text, sizeof(text), "soak %lu %.6f", ++sk.seq, now_s());
+        queue_text(w, text);
+    }
+    lws_sul_schedule(sk.context, 0, &sk.write_sul, write_tick, (lws_usec_t)(LWS_US_PER_SEC / sk.rate));
+}
+
+static long proc_rss_kb(pid_t pid) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    long kb = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1) break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static int proc_fds(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/fd", (int)pid);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    int n = 0;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] != '.') n++;
+    }
+    closedir(d);
+    return n;
+}
+
+// Value of "key": in the server's admin stats, or -1 without --admin.
+// Blocking, with a 2 s timeout; the server is local.
+static double fetch_metric(const char *key) {
+    char buf[65536];
+    struct sockaddr_un sa = { .sun_family = AF_UNIX };
+    if (!sk.admin || strlen(sk.admin) >= sizeof(sa.sun_path)) return -1;
+    strcpy(sa.sun_path, sk.admin);
+    socklen_t salen = sizeof(sa);
+    if (sk.admin[0] == '@') {
+        sa.sun_path[0] = '\0';
+        salen = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + strlen(sk.admin));
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct timeval tv = { 2, 0 };
+    double value = -1;
+    if (fd < 0) return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (connect(fd, (struct sockaddr *)&sa, salen) == 0) {
+        // quit makes the server close the connection after the stats reply
+        static const char req[] = "stats\nquit\n";
+        size_t got = 0;
+        ssize_t n;
+        if (write(fd, req, sizeof(req) - 1) == (ssize_t)(sizeof(req) - 1)) {
+            while (got < sizeof(buf) - 1 && (n = read(fd, buf + got, sizeof(buf) - 1 - got)) > 0)
+                got += (size_t)n;
+        }
+        buf[got] = '\0';
+        char pat[64];
+        snprintf(pat, sizeof(pat), "\"%s\":", key);
+        const char *p = strstr(buf, pat);
+        if (p) value = strtod(p + strlen(pat), NULL);
+    }
+    close(fd);
+    return value;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    if (n == 0) return 0;
+    return sorted[(size_t)(p * (double)(n - 1) + 0.5)];
+}
+
+static void sample_tick(lws_sorted_usec_list_t *sul) {
+    (void)sul;
+    double t = now_s() - sk.start_s;
+    if (sk.spawned && waitpid(sk.pid, NULL, WNOHANG) == sk.pid) {
+        fprintf(stderr, "server exited\n");
+        sk.server_died = 1;
+        sk.stop = 1;
+        return;
+    }
+    long rss = proc_rss_kb(sk.pid);
+    int fds = proc_fds(sk.pid);
+    if (rss < 0) {
+        fprintf(stderr, "cannot read /proc/%d\n", (int)sk.pid);
+        sk.server_died = 1;
+        sk.stop = 1;
+        return;
+    }
+    double queued = fetch_metric("queued_frames"), clients = fetch_metric("clients");
+    qsort(sk.lat, sk.nlat, sizeof(double), cmp_double);
+    double p50 = percentile(sk.lat, sk.nlat, 0.50), p99 = percentile(sk.lat, sk.nlat, 0.99);
+    double max = sk.nlat ? sk.lat[sk.nlat - 1] : 0;
+    printf("{\"t\":%.0f,\"rss_kb\":%ld,\"fds\":%d,\"clients\":%.0f,\"queued_frames\":%.0f,"
+           "\"sent\":%lu,\"received\":%lu,\"stalled\":%lu,\"lat_count\":%zu,"
+           "\"lat_p50_ms\":%.2f,\"lat_p99_ms\":%.2f,\"lat_max_ms\":%.2f,"
+           "\"reconnects\":%lu,\"slow_drops\":%lu,\"flaps\":%lu}\n",
+           t, rss, fds, clients, queued, sk.sent, sk.received, sk.stalled, sk.nlat,
+           p50, p99, max, sk.reconnects, sk.slow_drops, sk.flaps);
+    fflush(stdout);
+    if (sk.nsamples < MAX_SAMPLES) {
+        sk.samples[sk.nsamples++] = (struct sample){ t, rss, fds, queued, p99 };
+    }
+    sk.nlat = 0;
+    lws_sul_schedule(sk.context, 0, &sk.sample_sul, sample_tick,
+                     (lws_usec_t)(sk.interval * LWS_US_PER_SEC));
+}
+
+// Least-squares slope of y over x.
+static double slope(const double *x, const double *y, int n) {
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for (int i = 0; i < n; i++) {
+        sx += x[i];
+        sy += y[i];
+        sxx += x[i] * x[i];
+        sxy += x[i] * y[i];
+    }
+    double d = n * sxx - sx * sx;
+    return d != 0 ? (n * sxy - sx * sy) / d : 0;
+}
+
+struct limits {
+    double rss_kb_per_hour;
+    int fd_growth;
+    double queue_growth;
+    double latency_drift;
+};
+
+// Compares the samples after the warm-up; returns 0 when all checks pass.
+static int summarize(const struct limits *lim) {
+    int first = 0;
+    while (first < sk.nsamples && sk.samples[first].t < sk.warmup) first++;
+    int n = sk.nsamples - first;
+    struct sample *s = sk.samples + first;
+    char failed[128] = "";
+    double rss_slope = 0, p99_first = 0, p99_last = 0;
+    int fd_growth = 0;
+    double queue_growth = 0;
+    if (n >= 4) {
+        double *x = malloc((size_t)n * sizeof(double)), *y = malloc((size_t)n * sizeof(double));
+        if (x && y) {
+            for (int i = 0; i < n; i++) {
+                x[i] = s[i].t / 3600.0;
+                y[i] = (double)s[i].rss_kb;
+            }
+            rss_slope = slope(x, y, n);
+        }
+        free(x);
+        free(y);
+        // Averages over the first and last thirds smooth out single spikes.
+        int k = n / 3;
+        double fd0 = 0, fd1 = 0, q0 = 0, q1 = 0;
+        for (int i = 0; i < k; i++) {
+            fd0 += s[i].fds;
+            fd1 += s[n - 1 - i].fds;
+            q0 += s[i].queued;
+            q1 += s[n - 1 - i].queued;
+            p99_first += s[i].p99_ms;
+            p99_last += s[n - 1 - i].p99_ms;
+        }
+        fd_growth = (int)((fd1 - fd0) / k + 0.5);
+        queue_growth = (q1 - q0) / k;
+        p99_first /= k;
+        p99_last /= k;
+        if (rss_slope > lim->rss_kb_per_hour) strcat(failed, "\"rss\",");
+        if (fd_growth > lim->fd_growth) strcat(failed, "\"fds\",");
+        if (queue_growth > lim->queue_growth) strcat(failed, "\"queue\",");
+        // Sub-millisecond p99s double on noise alone.
+        if (p99_last > 1.0 && p99_last > p99_first * lim->latency_drift) strcat(failed, "\"latency\",");
+    }
+    if (sk.server_died) strcat(failed, "\"server_exit\",");
+    size_t fl = strlen(failed);
+    if (fl) failed[fl - 1] = '\0';
+    printf("{\"summary\":true,\"samples\":%d,\"evaluated\":%d,\"rss_kb_per_hour\":%.1f,"
+           "\"fd_growth\":%d,\"queue_growth\":%.1f,\"p99_first_ms\":%.2f,\"p99_last_ms\":%.2f,"
+           "\"pass\":%s,\"failed\":[%s]}\n",
+           sk.nsamples, n, rss_slope, fd_growth, queue_growth, p99_first, p99_last,
+           fl ? "false" : "true", failed);
+    if (n < 4) fprintf(stderr, "too few samples after the warm-up to check for growth\n");
+    return fl ? 1 : 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [options] (--pid PID | -- SERVER_CMD [ARGS...])\n"
+        "  --host HOST --port PORT     server address (default localhost:8080)\n"
+        "  --admin PATH                server's --admin-socket, for clients and queue depth\n"
+        "  --duration S                total run time (default 14400)\n"
+        "  --interval S                seconds between samples (default 10)\n"
+        "  --warmup S                  ignored by the growth checks (default 300)\n"
+        "  --fast N --slow N --flappers N   readers of each kind (default 20, 5, 10)\n"
+        "  --rate R                    writer messages per second (default 4)\n"
+        "  --max-rss-growth KB         per hour (default 1024)\n"
+        "  --max-fd-growth N           (default 4)\n"
+        "  --max-queue-growth N        queued frames (default 256)\n"
+        "  --max-latency-drift X       last/first p99 ratio (default 2)\n", prog);
+}
+
+int main(int argc, char **argv) {
+    struct limits lim = { 1024, 4, 256, 2.0 };
+    int nfast = 20, nslow = 5, nflap = 10;
+    double duration = 14400;
+    sk.host = "localhost";
+    sk.port = 8080;
+    sk.rate = 4;
+    sk.interval = 10;
+    sk.warmup = 300;
+    enum { OPT_MAX_RSS = 256, OPT_MAX_FD, OPT_MAX_QUEUE, OPT_MAX_DRIFT };
+    static const struct option long_opts[] = {
+        { "host", required_argument, NULL, 'H' },
+        { "port", required_argument, NULL, 'p' },
+        { "pid", required_argument, NULL, 'P' },
+        { "admin", required_argument, NULL, 'a' },
+        { "duration", required_argument, NULL, 'd' },
+        { "interval", required_argument, NULL, 'i' },
+        { "warmup", required_argument, NULL, 'w' },
+        { "fast", required_argument, NULL, 'f' },
+        { "slow", required_argument, NULL, 's' },
+        { "flappers", required_argument, NULL, 'F' },
+        { "rate", required_argument, NULL, 'r' },
+        { "max-rss-growth", required_argument, NULL, OPT_MAX_RSS },
+        { "max-fd-growth", required_argument, NULL, OPT_MAX_FD },
+        { "max-queue-growth", required_argument, NULL, OPT_MAX_QUEUE },
+        { "max-latency-drift", required_argument, NULL, OPT_MAX_DRIFT },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "+H:p:P:a:d:i:w:f:s:F:r:h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 'H': sk.host = optarg; break;
+            case 'p': sk.port = atoi(optarg); break;
+            case 'P': sk.pid = (pid_t)atoi(optarg); break;
+            case 'a': sk.admin = optarg; break;
+            case 'd': duration = atof(optarg); break;
+            case 'i': sk.interval = atof(optarg); break;
+            case 'w': sk.warmup = atof(optarg); break;
+            case 'f': nfast = atoi(optarg); break;
+            case 's': nslow = atoi(optarg); break;
+            case 'F': nflap = atoi(optarg); break;
+            case 'r': sk.rate = atof(optarg); break;
+            case OPT_MAX_RSS: lim.rss_kb_per_hour = atof(optarg); break;
+            case OPT_MAX_FD: lim.fd_growth = atoi(optarg); break;
+            case OPT_MAX_QUEUE: lim.queue_growth = atof(optarg); break;
+            case OPT_MAX_DRIFT: lim.latency_drift = atof(optarg); break;
+            case 'h': usage(argv[0]); return 0;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if ((!sk.pid) == (optind == argc) || sk.rate <= 0 || sk.interval <= 0 ||
+        nfast < 0 || nslow < 0 || nflap < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (!sk.pid) {
+        sk.pid = fork();
+        if (sk.pid < 0) {
+            perror("fork");
+            return 1;
+        }
+        if (sk.pid == 0) {
+            execvp(argv[optind], argv + optind);
+            perror(argv[optind]);
+            _exit(127);
+        }
+        sk.spawned = 1;
+        sleep(1); // let it bind
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    srandom((unsigned)getpid());
+    sk.samples = calloc(MAX_SAMPLES, sizeof(struct sample));
+    sk.nclients = 1 + nfast + nslow + nflap;
+    sk.clients = calloc((size_t)sk.nclients, sizeof(struct soak_client));
+    if (!sk.samples || !sk.clients) return 1;
+
+    lws_set_log_level(LLL_ERR, NULL);
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = protocols;
+    info.fd_limit_per_thread = (unsigned int)sk.nclients + 16;
+    sk.context = lws_create_context(&info);
+    if (!sk.context) {
+        fprintf(stderr, "lws init failed\n");
+        return 1;
+    }
+
+    // The writer goes first: it is only admitted while no readers hold a role.
+    for (int i = 0; i < sk.nclients; i++) {
+        struct soak_client *c = &sk.clients[i];
+        c->id = i;
+        c->role = i == 0 ? SOAK_WRITER : i <= nfast ? SOAK_FAST
+                : i <= nfast + nslow ? SOAK_SLOW : SOAK_FLAPPER;
+        schedule(c, connect_client, i == 0 ? 0 : 0.5 + i * 0.01);
+    }
+    sk.writer = &sk.clients[0];
+    sk.start_s = now_s();
+    lws_sul_schedule(sk.context, 0, &sk.write_sul, write_tick, LWS_US_PER_SEC);
+    lws_sul_schedule(sk.context, 0, &sk.sample_sul, sample_tick,
+                     (lws_usec_t)(sk.interval * LWS_US_PER_SEC));
+
+    while (!sk.stop && now_s() - sk.start_s < duration) {
+        if (lws_service(sk.context, 0) < 0) break;
+    }
+    sk.stop = 1;
+    int rc = summarize(&lim);
+
+    lws_context_destroy(sk.context);
+    if (sk.spawned && !sk.server_died) {
+        kill(sk.pid, SIGTERM);
+        waitpid(sk.pid, NULL, 0);
+    }
+    free(sk.clients);
+    free(sk.samples);
+    free(sk.lat);
+    return rc;
+}
@@ -0,0 +1,181 @@
+// Inbound text sanitizer benchmark: copies a message-sized buffer and runs
+// sanitize_text() on it, for the dispatched (SIMD) and scalar paths, against
+// a plain memcpy of the same buffer. Prints one JSON line per corpus/path.
+//
+// First it checks that the dispatched path gives byte for byte the result of
+// sanitize_text_scalar() on random and malformed input, at every alignment
+// and with tight length limits, and exits 1 on the first mismatch. --check
+// stops after that.
+//
+//   gcc -O2 bench/utf8_bench.c sanitize.c -I. -o utf8_bench
+//   ./utf8_bench --size 4096 --iters 200000
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "sanitize.h"
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Fills buf with len bytes drawn from pieces, never splitting a piece.
+static size_t fill(char *buf, size_t len, const char *const *pieces, size_t npieces) {
+    size_t off = 0;
+    unsigned seed = 12345;
+    for (;;) {
+        seed = seed * 1103515245u + 12345u;
+        const char *p = pieces[(seed >> 16) % npieces];
+        size_t n = strlen(p);
+        if (off + n > len) break;
+        memcpy(buf + off, p, n);
+        off += n;
+    }
+    return off;
+}
+
+static volatile size_t sink;
+
+// Bytes that exercise the vector loops' exits: ASCII runs of every length
+// around the vector widths, controls, lead and continuation bytes and
+// whole multi-byte sequences, valid or not.
+static size_t random_text(char *buf, size_t len, unsigned *seed) {
+    static const char *const pieces[] = {
+        "\t", "\n", "\x7f", "\xc2\x85", "\xc3\xa9", "\xe4\xb8\xad", "\xf0\x9f\x98\x80",
+        "\xc0\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80", "\xe2\x82", "\x80", "\xbf", "\xff",
+    };
+    size_t off = 0;
+    while (off < len) {
+        *seed = *seed * 1103515245u + 12345u;
+        unsigned r = *seed >> 16;
+        size_t n;
+        if (r % 3 == 0) {
+            n = r % 40;
+            if (n > len - off) n = len - off;
+            for (size_t i = 0; i < n; i++) buf[off + i] = (char)(' ' + (r + i * 7) % 95);
+        } else if (r % 3 == 1) {
+            const char *p = pieces[(r >> 2) % (sizeof(pieces) / sizeof(pieces[0]))];
+            n = strlen(p);
+            if (n > len - off) n = len - off;
+            memcpy(buf + off, p, n);
+        } else {
+            n = 1;
+            buf[off] = (char)(r >> 3);
+        }
+        off += n;
+    }
+    return len;
+}
+
+// Returns the number of mismatching cases.
+static long check(long rounds) {
+    char src[600], a[600 + 64], b[600 + 64];
+    unsigned seed = 777;
+    long bad = 0, cases = 0;
+    for (long i = 0; i < rounds; i++) {
+        seed = seed * 1103515245u + 12345u;
+        size_t len = random_text(src, (seed >> 16) % 520, &seed);
+        size_t align = i % 33;
+        size_t max_chars = i % 4 == 0 ? (seed >> 8) % 300 : len;
+        size_t max_bytes = i % 4 == 1 ? (seed >> 4) % 500 : len;
+        char *pa = a + align, *pb = b + align;
+        memcpy(pa, src, len);
+        memcpy(pb, src, len);
+        pa[len] = pb[len] = 'x';
+        size_t na = sanitize_text(pa, len, max_chars, max_bytes);
+        size_t nb = sanitize_text_scalar(pb, len, max_chars, max_bytes);
+        cases++;
+        if (na != nb || memcmp(pa, pb, na) != 0 || (na < len && pa[na] != pb[na])) {
+            if (!bad)
+                fprintf(stderr, "%s differs from scalar: case %ld, %zu bytes, limits %zu/%zu, "
+                                "lengths %zu/%zu\n", sanitize_impl(), i, len, max_chars, max_bytes, na, nb);
+            bad++;
+        }
+    }
+    printf("{\"check\":\"%s\",\"cases\":%ld,\"mismatches\":%ld}\n", sanitize_impl(), cases, bad);
+    return bad;
+}
+
+typedef size_t (*sanitize_fn)(char *, size_t, size_t, size_t);
+
+static double run(const char *src, char *work, size_t len, long iters, sanitize_fn fn) {
+    double t0 = now_ns();
+    for (long i = 0; i < iters; i++) {
+        memcpy(work, src, len);
+        sink += fn ? fn(work, len, len, len) : (size_t)work[len / 2];
+    }
+    return (now_ns() - t0) / (double)iters;
+}
+
+int main(int argc, char **argv) {
+    size_t size = 4096;
+    long iters = 200000;
+    int check_only = 0;
+    static const struct option long_opts[] = {
+        { "size", required_argument, NULL, 's' },
+        { "iters", required_argument, NULL, 'i' },
+        { "check", no_argument, NULL, 'c' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "s:i:c", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case 's': size = strtoul(optarg, NULL, 10); break;
+            case 'i': iters = strtol(optarg, NULL, 10); break;
+            case 'c': check_only = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [--size BYTES] [--iters N] [--check]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (check(200000) != 0) return 1;
+    if (check_only) return 0;
+
+    static const char *const ascii[] = {
+        "hello ", "the build is green ", "see you at 10:30, ", "ok! ", "https://example.org/a?b=c ",
+    };
+    static const char *const mixed[] = {
+        "hello ", "caf\xc3\xa9 ", "\xe4\xb8\xad\xe6\x96\x87 ", "\xf0\x9f\x98\x80 ", "na\xc3\xafve ",
+        "the build is green ",
+    };
+    static const char *const dirty[] = {
+        "hello ", "line\nbreak ", "tab\there ", "\xc0\xaf ", "\xed\xa0\x80 ", "\xe2\x82 ",
+        "\x1b[31mred ", "\xc2\x85 ", "caf\xc3\xa9 ",
+    };
+    struct {
+        const char *name;
+        const char *const *pieces;
+        size_t n;
+    } corpora[] = {
+        { "ascii", ascii, sizeof(ascii) / sizeof(ascii[0]) },
+        { "mixed", mixed, sizeof(mixed) / sizeof(mixed[0]) },
+        { "dirty", dirty, sizeof(dirty) / sizeof(dirty[0]) },
+    };
+
+    char *src = malloc(size + 1), *work = malloc(size + 1);
+    if (!src || !work) return 1;
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+        size_t len = fill(src, size, corpora[c].pieces, corpora[c].n);
+        double base = run(src, work, len, iters, NULL);
+        struct { const char *impl; sanitize_fn fn; } impls[] = {
+            { sanitize_impl(), sanitize_text },
+            { "scalar", sanitize_text_scalar },
+        };
+        for (size_t k = 0; k < 2; k++) {
+            double ns = run(src, work, len, iters, impls[k].fn);
+            double extra = ns > base ? ns - base : 0;
+            printf("{\"corpus\":\"%s\",\"impl\":\"%s\",\"bytes\":%zu,\"ns_per_msg\":%.1f,"
+                   "\"memcpy_ns\":%.1f,\"sanitize_gbps\":%.2f,\"vs_memcpy\":%.2f}\n",
+                   corpora[c].name, impls[k].impl, len, ns, base,
+                   extra > 0 ? (double)len / extra : 0.0, base > 0 ? ns / base : 0.0);
+        }
+    }
+    free(src);
+    free(work);
+    return 0;
+}
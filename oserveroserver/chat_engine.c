@@ -0,0 +1,3363 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sqlite3.h>
+#include <libwebsockets.h>
+#include <time.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stddef.h>
+#if defined(LWS_WITH_TLS) && !defined(LWS_WITH_MBEDTLS)
+#include <openssl/ssl.h>
+#endif
+
+#include "chat_engine.h"
+#include "placement.h"
+#include "frame_pool.h"
+#include "sanitize.h"
+#include "content_filter.h"
+#include "traffic_record.h"
+#include "log.h"
+#include "admin.h"
+#include "sequencer.h"
+#include "history_cache.h"
+#include "history_store.h"
+#include "history_archive.h"
+#include "replication.h"
+#include "history_log.h"
+
+#define MAX_NAME_LEN 64
+#define MAX_ROLE_LEN 16
+#define MAX_MSG_LEN 4096
+// Defaults for struct chat_limits. Inbound limits are in code points, applied
+// by sanitize_text() within the byte buffers above.
+#define MAX_NAME_CHARS 32
+#define MAX_MSG_CHARS 2000
+#define HISTORY_LIMIT 500
+#define MAX_QUEUED_FRAMES 1024
+#define LIMITS_APPLY_TIMEOUT_S 1 // chat_engine_set_limits() wait for the service loop
+#define LIMITS_GRACE_S 5.0       // replaced limits outlive any reader by this long
+#define CONFIG_FILE_MAX 65536
+#define SEQUENCER_SLOTS 4096 // messages in flight between sequencing and fan-out
+
+// Load shedding. Every service thread measures how late a PROBE_INTERVAL_MS
+// timer fires; the worse of that lag and the mean send-queue depth picks the
+// load level. Levels drop one step at a time, LOAD_HOLD_SECONDS apart.
+#define PROBE_INTERVAL_MS 100
+#define LOAD_HOLD_SECONDS 2.0
+#define SHED_HISTORY_LIMIT 50   // default shed_history_limit
+#define SHED_RETRY_AFTER "5"    // seconds, on refused upgrades
+#define SHED_DROP_DEPTH 64      // default slow_reader_depth
+#define DEFERRED_PER_TICK 32    // deferred snapshots served per probe tick
+#define PING_INTERVAL_S 10.0    // RTT probes per connection
+#define TOP_CONNECTIONS_MAX 100 // rows the admin connections command returns at most
+#define TAKEOVER_RETRY_MS 20  // a standby rebinding a port its primary still holds
+#define TAKEOVER_RETRIES 250
+
+// One outbound WebSocket message, shared by every client it is queued on.
+// buf keeps LWS_PRE bytes of headroom in front of the payload for lws_write().
+// ws_hdr is the unmasked text frame header, built once for the writev fast
+// path. Frames come from frame_pool so fan-out does not go through malloc.
+// A history span from the history cache is the first row's fragment, then
+// span_len bytes of span_file and HISTORY_CACHE_END; it only goes out raw.
+struct frame {
+    int refs;
+    size_t len;
+    unsigned char ws_hdr[10];
+    unsigned char ws_hdr_len;
+    struct history_file *span_file; // NULL for ordinary frames
+    uint64_t span_off;
+    size_t span_len;
+    unsigned char buf[];
+};
+
+struct out_node {
+    struct frame *frame;
+    struct out_node *next;
+};
+
+struct client {
+    struct lws *wsi;
+    char username[MAX_NAME_LEN];
+    char role[MAX_ROLE_LEN]; // "READER", "WRITER" or "NONE"
+    // Frames waiting for LWS_CALLBACK_SERVER_WRITEABLE. lws only allows writes
+    // from that callback, which HTTP/2 streams depend on for flow control.
+    struct out_node *out_head;
+    struct out_node *out_tail;
+    int out_count;
+    int closing; // queue overflowed, drop the connection on next writeable
+    int tsi;     // lws service thread owning wsi
+    int wake;    // needs lws_callback_on_writable() from its own thread
+    // Writer token bucket; only the owning service thread touches it
+    double tokens;
+    double tokens_at;
+    int throttled; // "too fast" notice sent since the bucket ran dry
+    int history_deferred; // get_history postponed until load is normal
+    long long history_since_ms; // join sends rows from then instead of the history
+    int shed;             // closing because the server dropped a slow reader
+    // Statistics. Queue fields are under clients_mutex; the rest are written
+    // by the owning service thread and read relaxed by the admin socket.
+    char peer[48];
+    double connected_at;
+    size_t queued_bytes;
+    int max_depth;
+    int ping_due;              // under clients_mutex
+    unsigned long frames_sent;
+    unsigned long long bytes_sent;
+    long long last_write_us;   // monotonic, 0 before the first write
+    long long ping_sent_us;    // payload of the ping in flight, 0 if none
+    long rtt_us;               // last ping round trip, -1 before the first pong
+    long rtt_avg_us;
+    // writev fast path and history spans, owning service thread only. raw_fd
+    // is -1 when frames go through lws_write(); raw_frame is a frame partly
+    // written to it, and raw_fallback is set once a short write sent the
+    // connection's ordinary frames back to lws.
+    int raw_fd;
+    int raw_fallback;
+    struct frame *raw_frame;
+    size_t raw_off;
+    struct client *next;
+};
+
+// Per-session data lws allocates for each connection
+struct session {
+    struct client *client;   // WebSocket connections
+    uint32_t record_conn;    // connection number in the traffic recording, 0 if none
+};
+
+enum load_level {
+    LOAD_NORMAL,
+    LOAD_DEFER_HISTORY,   // get_history waits for LOAD_NORMAL
+    LOAD_SHRINK_HISTORY,  // joins get shed_history_limit rows
+    LOAD_REFUSE_UPGRADES, // new WebSockets get 503 + Retry-After
+    LOAD_DROP_READERS,    // readers with slow_reader_depth queued frames are closed
+};
+
+static const char *load_level_names[] = {
+    "normal", "defer_history", "shrink_history", "refuse_upgrades", "drop_readers",
+};
+
+// Entry thresholds for LOAD_DEFER_HISTORY .. LOAD_DROP_READERS
+static const int lag_thresholds_ms[] = { 20, 50, 100, 250 };
+static const int depth_thresholds[] = { 4, 16, 64, 256 }; // mean queued frames per client
+
+// Loop-lag timer of one service thread
+struct loop_probe {
+    lws_sorted_usec_list_t sul;
+    struct chat_engine *e;
+    int tsi;
+    double due;
+    long lag_us;     // moving average
+    long max_lag_us;
+    double next_ping;
+};
+
+// Recently stored messages, for duplicate suppression
+struct dedup_entry {
+    uint64_t hash; // username and message
+    double at;
+};
+
+// One published set of limits; see chat_engine.limits.
+struct limits_node {
+    struct limits_node *next; // limits_retired
+    unsigned long gen;
+    double retired_at; // now_seconds() when replaced
+    struct chat_limits l;
+};
+
+// A writer message between the sequencer and store_and_broadcast()
+struct sequenced_msg {
+    char username[MAX_NAME_LEN];
+    char message[];
+};
+
+struct persist_item {
+    struct persist_item *next;
+    char *username;
+    char *message;
+    long long ts_ms; // stamped before the broadcast
+    int stored;      // inserted in the current batch
+};
+
+// A history file ATTACHed to the main database as schema "p<seq>"
+struct partition {
+    unsigned long long seq;
+    long day;   // UTC day it was opened on
+    long long opened_ms; // its rows are from then until the next one opened
+    char *path;
+};
+
+struct chat_engine {
+    struct chat_engine_config cfg;
+
+    struct client *clients_head;
+    pthread_mutex_t clients_mutex;
+    int client_count;   // under clients_mutex
+    long queued_frames; // under clients_mutex
+
+    int wake_pending; // some client on another service thread has wake set
+
+    // select_stmt and insert_stmt are shared, so readers take it exclusively too
+    pthread_rwlock_t history_lock;
+    sqlite3 *db;
+    sqlite3_stmt *insert_stmt;
+    sqlite3_stmt *select_stmt;
+    sqlite3_stmt *range_stmt; // by ts, over the messages_ts index
+    long long last_ts_ms;     // newest stamp_ts(), atomic
+
+    // cfg.partition_*: the newest partition takes the inserts through
+    // insert_stmt and select_stmt. At most one older one, the last a read
+    // reached into, stays attached with cold_select. Under history_lock.
+    struct partition *parts; // oldest first
+    int nparts;
+    int parts_cap;
+    long hot_rows;
+    unsigned long long cold_seq; // 0 when none is attached
+    sqlite3_stmt *cold_select;
+    unsigned long parts_dropped;
+    unsigned long cold_attaches;
+
+    // Persistence thread: messages are queued here and committed in batches
+    pthread_t persist_tid;
+    int persist_running;
+    int persist_stop;
+    pthread_mutex_t persist_mutex;
+    pthread_cond_t persist_cond;
+    struct persist_item *persist_head;
+    struct persist_item *persist_tail;
+
+    // Content filter, swapped whole by the reload thread. Holders retain it
+    // under filter_mutex, so a reload never waits for a message in flight.
+    struct content_filter *filter;
+    pthread_mutex_t filter_mutex;
+    unsigned long filter_generation;
+    unsigned long filter_rejected;
+    unsigned long filter_masked;
+    unsigned long filter_flagged;
+
+    // Ring of the last cfg.dedup_window stored messages
+    struct dedup_entry *dedup;
+    int dedup_next;
+    pthread_mutex_t dedup_mutex;
+    unsigned long dup_suppressed;
+    unsigned long rate_limited;
+
+    // chat_engine_reload() posts reload_sem; the reload thread does the work.
+    pthread_t reload_tid;
+    int reload_running;
+    int reload_stop;
+    sem_t reload_sem;
+
+    struct traffic_recorder *recorder; // cfg.record_path, NULL when not recording
+
+    // Runtime limits. Readers load the pointer once per use and drop it before
+    // the call returns. A new set is posted to limits_pending and swapped in
+    // on service thread 0; replaced sets wait on limits_retired, newest first,
+    // for LIMITS_GRACE_S before that thread frees them.
+    struct limits_node *limits;
+    struct limits_node *limits_pending; // under limits_mutex
+    struct limits_node *limits_retired; // under limits_mutex
+    unsigned long limits_posted;        // under limits_mutex
+    unsigned long limits_applied;       // under limits_mutex
+    pthread_mutex_t limits_mutex;
+    pthread_cond_t limits_cond;         // limits_applied moved
+    struct admin_server *admin;
+
+    // Multi-writer rooms (cfg.max_writers > 1): writer messages are stored
+    // and fanned out in sequencer order, so history and every client's queue
+    // agree on one total order.
+    struct sequencer *sequencer;
+
+    struct loop_probe probes[CHAT_MAX_SERVICE_THREADS];
+    pthread_mutex_t load_mutex;
+    int load_level;
+    double load_changed;
+    unsigned long deferred_history;
+    unsigned long shrunk_joins;
+    unsigned long refused_upgrades;
+    unsigned long dropped_readers;
+
+    unsigned long raw_frames;   // frames sent by the writev fast path
+    unsigned long raw_partial;  // short writes; the connection then uses lws_write()
+
+    // cfg.history_cache_path: joins on plain sockets get their history from
+    // this file by sendfile().
+    struct history_cache *history_cache;
+
+    // cfg.history_memory_mb: history kept in memory in compressed blocks,
+    // read instead of SQLite while it holds the rows asked for.
+    struct history_store *history_store;
+
+    // cfg.replication_path: stored rows stream to hot standbys. Set under
+    // history_lock, as db_insert_message() publishes through it.
+    struct repl_server *repl;
+    sqlite3_stmt *repl_select_stmt; // catch-up reads, by id
+    // cfg.standby_of: rows from the primary are inserted by repl_insert_stmt,
+    // with its ids and times, and the listeners wait until it is gone.
+    struct repl_client *standby;
+    sqlite3_stmt *repl_insert_stmt;
+    int takeover_pending;
+    int takeover_attempts;
+    long long primary_lost_us;
+    lws_sorted_usec_list_t takeover_sul;
+    struct lws_vhost *tcp_vhost;
+    struct lws_vhost *unix_vhost;
+
+    // cfg.history_log_path: stored rows are also appended to this log, synced
+    // per commit group, so SQLite commits with synchronous=NORMAL. Under
+    // history_lock; NULL again after a write to it failed.
+    struct history_log *history_log;
+
+    struct lws_context *context;
+    struct lws_protocols protocols[2]; // user points back at the engine
+    int stop;
+};
+
+// lws service thread index of the calling thread, -1 outside service threads
+static __thread int service_tsi = -1;
+
+static void broadcast_text(struct chat_engine *e, const char *message);
+static void take_over(struct chat_engine *e);
+
+static const struct chat_limits *limits(struct chat_engine *e) {
+    return &__atomic_load_n(&e->limits, __ATOMIC_ACQUIRE)->l;
+}
+
+static struct chat_engine *engine_from_wsi(struct lws *wsi) {
+    const struct lws_protocols *p = lws_get_protocol(wsi);
+    if (p && p->user) return p->user;
+    return lws_context_user(lws_get_context(wsi));
+}
+
+// Payload is left for the caller to fill in at f->buf + LWS_PRE.
+static struct frame *frame_alloc(size_t len) {
+    struct frame *f = frame_pool_alloc(sizeof(struct frame) + LWS_PRE + len);
+    if (!f) return NULL;
+    f->refs = 1;
+    f->len = len;
+    f->span_file = NULL;
+    // FIN + text opcode, no mask; 16- or 64-bit big-endian extended length
+    f->ws_hdr[0] = 0x81;
+    if (len < 126) {
+        f->ws_hdr[1] = (unsigned char)len;
+        f->ws_hdr_len = 2;
+    } else if (len < 65536) {
+        f->ws_hdr[1] = 126;
+        f->ws_hdr[2] = (unsigned char)(len >> 8);
+        f->ws_hdr[3] = (unsigned char)len;
+        f->ws_hdr_len = 4;
+    } else {
+        f->ws_hdr[1] = 127;
+        for (int i = 0; i < 8; i++) f->ws_hdr[2 + i] = (unsigned char)((uint64_t)len >> (56 - 8 * i));
+        f->ws_hdr_len = 10;
+    }
+    return f;
+}
+
+static struct frame *frame_new(const char *msg, size_t len) {
+    struct frame *f = frame_alloc(len);
+    if (f) memcpy(f->buf + LWS_PRE, msg, len);
+    return f;
+}
+
+static void frame_release(struct frame *f) {
+    if (f && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        history_file_release(f->span_file);
+        frame_pool_free(f);
+    }
+}
+
+// Caller holds clients_mutex. A wsi may only be asked for writeable callbacks
+// from its own service thread; others are flagged and woken via
+// LWS_CALLBACK_EVENT_WAIT_CANCELLED once the caller calls wake_service_threads().
+static void request_write(struct chat_engine *e, struct client *c) {
+    if (e->cfg.service_threads <= 1 || c->tsi == service_tsi) {
+        lws_callback_on_writable(c->wsi);
+    } else {
+        c->wake = 1;
+        e->wake_pending = 1;
+    }
+}
+
+// Caller holds clients_mutex.
+static void enqueue_frame(struct chat_engine *e, struct client *c, struct frame *f) {
+    if (c->closing) return;
+    if (c->out_count >= limits(e)->max_queued_frames) {
+        c->closing = 1;
+        request_write(e, c);
+        return;
+    }
+    struct out_node *n = malloc(sizeof(struct out_node));
+    if (!n) return;
+    __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    n->frame = f;
+    n->next = NULL;
+    if (c->out_tail) c->out_tail->next = n;
+    else c->out_head = n;
+    c->out_tail = n;
+    c->out_count++;
+    c->queued_bytes += f->len;
+    if (c->out_count > c->max_depth) c->max_depth = c->out_count;
+    e->queued_frames++;
+    request_write(e, c);
+}
+
+// Caller holds clients_mutex; call wake_service_threads() after unlocking
+// when this returns non-zero.
+static int take_wakeups(struct chat_engine *e) {
+    int pending = e->wake_pending;
+    e->wake_pending = 0;
+    return pending;
+}
+
+static void wake_service_threads(struct chat_engine *e) {
+    lws_cancel_service(e->context);
+}
+
+// LWS_CALLBACK_EVENT_WAIT_CANCELLED on service thread tsi.
+static void wake_clients(struct chat_engine *e, int tsi) {
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *c = e->clients_head; c; c = c->next) {
+        if (c->wake && c->tsi == tsi) {
+            c->wake = 0;
+            lws_callback_on_writable(c->wsi);
+        }
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+}
+
+// Caller holds clients_mutex. Returns NULL when the queue is empty.
+static struct frame *dequeue_frame(struct chat_engine *e, struct client *c) {
+    struct out_node *n = c->out_head;
+    if (!n) return NULL;
+    c->out_head = n->next;
+    if (!c->out_head) c->out_tail = NULL;
+    c->out_count--;
+    e->queued_frames--;
+    struct frame *f = n->frame;
+    c->queued_bytes -= f->len;
+    free(n);
+    return f;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// Wall clock in milliseconds since the epoch, the scale of history times
+static long long wall_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// A message's ts, taken once before it is broadcast and stored. Strictly
+// increasing, so a client that saw ts T resumes from T + 1 without losing a
+// message stamped in the same millisecond.
+static long long stamp_ts(struct chat_engine *e) {
+    long long now = wall_ms(), last = __atomic_load_n(&e->last_ts_ms, __ATOMIC_RELAXED), ts;
+    do {
+        ts = now > last ? now : last + 1;
+    } while (!__atomic_compare_exchange_n(&e->last_ts_ms, &last, ts, 0, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+    return ts;
+}
+
+// The ts column's format, in UTC
+static void format_ts(long long ms, char *buf, size_t len) {
+    time_t t = (time_t)(ms / 1000);
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    size_t n = strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+    snprintf(buf + n, len - n, ".%03d", (int)(ms % 1000));
+}
+
+// Inverse of format_ts(); 0 for a missing or malformed time.
+static long long parse_ts(const unsigned char *ts) {
+    struct tm tm;
+    int ms = 0;
+    memset(&tm, 0, sizeof(tm));
+    if (!ts || sscanf((const char *)ts, "%d-%d-%d %d:%d:%d.%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+                      &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &ms) < 6)
+        return 0;
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return (long long)timegm(&tm) * 1000 + ms;
+}
+
+static struct client *add_client(struct chat_engine *e, struct lws *wsi) {
+    struct client *c = calloc(1, sizeof(struct client));
+    if (!c) return NULL;
+    c->wsi = wsi;
+    c->tsi = lws_get_tsi(wsi);
+    c->tokens = limits(e)->writer_burst;
+    c->tokens_at = now_seconds();
+    c->connected_at = c->tokens_at;
+    c->rtt_us = -1;
+    // Only plain sockets carry the frames directly: TLS records and h2
+    // streams need lws to wrap them. The engine negotiates no extensions.
+    c->raw_fd = -1;
+    if ((e->cfg.writev_fast_path || e->history_cache) && !lws_is_ssl(wsi) &&
+        lws_get_network_wsi(wsi) == wsi)
+        c->raw_fd = lws_get_socket_fd(wsi);
+    if (lws_get_peer_simple(wsi, c->peer, sizeof(c->peer)) == NULL) c->peer[0] = '\0';
+    snprintf(c->username, MAX_NAME_LEN, "Anonymous");
+    snprintf(c->role, MAX_ROLE_LEN, "NONE"); // No role until set
+    pthread_mutex_lock(&e->clients_mutex);
+    c->next = e->clients_head;
+    e->clients_head = c;
+    e->client_count++;
+    pthread_mutex_unlock(&e->clients_mutex);
+    return c;
+}
+
+static void remove_client(struct chat_engine *e, struct lws *wsi) {
+    pthread_mutex_lock(&e->clients_mutex);
+    struct client **p = &e->clients_head;
+    while (*p) {
+        if ((*p)->wsi == wsi) {
+            struct client *tofree = *p;
+            *p = tofree->next;
+            struct frame *f;
+            while ((f = dequeue_frame(e, tofree)) != NULL) frame_release(f);
+            frame_release(tofree->raw_frame);
+            e->client_count--;
+            free(tofree);
+            break;
+        }
+        p = &(*p)->next;
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+}
+
+static void count_roles(struct chat_engine *e, int *readers, int *writers) {
+    int r=0, w=0;
+    pthread_mutex_lock(&e->clients_mutex);
+    struct client *p = e->clients_head;
+    while (p) {
+        if (strcasecmp(p->role, "WRITER") == 0) w++;
+        else if (strcasecmp(p->role, "READER") == 0) r++;
+        p = p->next;
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+    if (readers) *readers = r;
+    if (writers) *writers = w;
+}
+
+#define MESSAGES_COLUMNS \
+    "id INTEGER PRIMARY KEY AUTOINCREMENT, " \
+    "username TEXT NOT NULL, " \
+    "message TEXT NOT NULL, " \
+    "ts DATETIME DEFAULT (strftime('%Y-%m-%d %H:%M:%f','now'))"
+
+static void close_db(struct chat_engine *e) {
+    if (e->insert_stmt) { sqlite3_finalize(e->insert_stmt); e->insert_stmt = NULL; }
+    if (e->select_stmt) { sqlite3_finalize(e->select_stmt); e->select_stmt = NULL; }
+    if (e->range_stmt) { sqlite3_finalize(e->range_stmt); e->range_stmt = NULL; }
+    if (e->cold_select) { sqlite3_finalize(e->cold_select); e->cold_select = NULL; }
+    if (e->repl_select_stmt) { sqlite3_finalize(e->repl_select_stmt); e->repl_select_stmt = NULL; }
+    if (e->repl_insert_stmt) { sqlite3_finalize(e->repl_insert_stmt); e->repl_insert_stmt = NULL; }
+    if (e->db) { sqlite3_close(e->db); e->db = NULL; }
+    for (int i = 0; i < e->nparts; i++) free(e->parts[i].path);
+    free(e->parts);
+    e->parts = NULL;
+    e->nparts = e->parts_cap = 0;
+    e->cold_seq = 0;
+}
+
+static int partitioned(struct chat_engine *e) {
+    return e->cfg.partition_daily || e->cfg.partition_rows > 0;
+}
+
+static long utc_day(void) {
+    return (long)(time(NULL) / 86400);
+}
+
+static int db_exec(sqlite3 *db, const char *sql) {
+    char *errmsg = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &errmsg) == SQLITE_OK) return 0;
+    log_error("%s failed: %s", sql, errmsg ? errmsg : sqlite3_errmsg(db));
+    sqlite3_free(errmsg);
+    return -1;
+}
+
+// Removes a database file along with its WAL, shared-memory and journal files.
+static void unlink_db_files(const char *path) {
+    static const char *const suffixes[] = { "", "-wal", "-shm", "-journal" };
+    size_t len = strlen(path) + 16;
+    char *name = malloc(len);
+    if (!name) return;
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(name, len, "%s%s", path, suffixes[i]);
+        unlink(name);
+    }
+    free(name);
+}
+
+static int attach_partition(struct chat_engine *e, const struct partition *p) {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "ATTACH DATABASE ?1 AS p%llu;", p->seq);
+    sqlite3_stmt *st = NULL;
+    int rc = sqlite3_prepare_v2(e->db, sql, -1, &st, NULL);
+    if (rc == SQLITE_OK) {
+        sqlite3_bind_text(st, 1, p->path, -1, SQLITE_STATIC);
+        rc = sqlite3_step(st);
+    }
+    sqlite3_finalize(st);
+    if (rc != SQLITE_DONE) {
+        log_error("Cannot attach history partition %s: %s", p->path, sqlite3_errmsg(e->db));
+        return -1;
+    }
+    return 0;
+}
+
+// The partition's statements must be finalized first.
+static void detach_partition(struct chat_engine *e, unsigned long long seq) {
+    char sql[64];
+    snprintf(sql, sizeof(sql), "DETACH DATABASE p%llu;", seq);
+    db_exec(e->db, sql);
+}
+
+static sqlite3_stmt *prepare_partition_stmt(struct chat_engine *e, const char *fmt,
+                                            unsigned long long seq) {
+    char sql[160];
+    snprintf(sql, sizeof(sql), fmt, seq);
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(e->db, sql, -1, &st, NULL) != SQLITE_OK) {
+        log_error("Failed to prepare %s: %s", sql, sqlite3_errmsg(e->db));
+        sqlite3_finalize(st);
+        return NULL;
+    }
+    return st;
+}
+
+#define PARTITION_INSERT_SQL "INSERT INTO p%llu.messages (username, message, ts) VALUES (?, ?, ?);"
+#define PARTITION_SELECT_SQL "SELECT username, message, ts FROM p%llu.messages ORDER BY id DESC LIMIT ?;"
+#define PARTITION_RANGE_SQL \
+    "SELECT username, message, ts FROM p%llu.messages WHERE ts >= ?1 AND ts < ?2 " \
+    "ORDER BY ts DESC, id DESC LIMIT ?3;"
+
+// Detaches the oldest partition and unlinks its file. Never the newest one.
+static void drop_oldest_partition(struct chat_engine *e) {
+    struct partition *p = &e->parts[0];
+    if (e->cold_seq == p->seq) {
+        sqlite3_finalize(e->cold_select);
+        e->cold_select = NULL;
+        e->cold_seq = 0;
+        detach_partition(e, p->seq);
+    }
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(e->db, "DELETE FROM partitions WHERE seq = ?;", -1, &st, NULL) == SQLITE_OK) {
+        sqlite3_bind_int64(st, 1, (sqlite3_int64)p->seq);
+        sqlite3_step(st);
+    }
+    sqlite3_finalize(st);
+    unlink_db_files(p->path);
+    log_info("Dropped history partition %s", p->path);
+    free(p->path);
+    e->nparts--;
+    memmove(e->parts, e->parts + 1, (size_t)e->nparts * sizeof(*e->parts));
+    e->parts_dropped++;
+}
+
+// Creates the next partition file and moves inserts to it. The one it
+// replaces stays attached as the cold partition, since the next history reads
+// reaching past the new file want its rows. Caller holds history_lock outside
+// any transaction; on failure nothing changes.
+static int open_partition(struct chat_engine *e) {
+    if (e->nparts == e->parts_cap) {
+        int ncap = e->parts_cap ? e->parts_cap * 2 : 8;
+        struct partition *np = realloc(e->parts, (size_t)ncap * sizeof(*np));
+        if (!np) return -1;
+        e->parts = np;
+        e->parts_cap = ncap;
+    }
+    struct partition p = { e->nparts ? e->parts[e->nparts - 1].seq + 1 : 1, utc_day(), wall_ms(), NULL };
+    size_t len = strlen(e->cfg.db_path) + 24;
+    if (!(p.path = malloc(len))) return -1;
+    snprintf(p.path, len, "%s.%06llu", e->cfg.db_path, p.seq);
+    unlink_db_files(p.path); // left by a run that stopped before recording it
+    if (attach_partition(e, &p) != 0) {
+        free(p.path);
+        return -1;
+    }
+    char sql[320];
+    snprintf(sql, sizeof(sql),
+             "PRAGMA p%llu.journal_mode=WAL; CREATE TABLE p%llu.messages (%s);"
+             "CREATE INDEX p%llu.messages_ts ON messages (ts);",
+             p.seq, p.seq, MESSAGES_COLUMNS, p.seq);
+    sqlite3_stmt *ins = NULL, *sel = NULL, *range = NULL, *rec = NULL;
+    int ok = db_exec(e->db, sql) == 0 &&
+             (ins = prepare_partition_stmt(e, PARTITION_INSERT_SQL, p.seq)) &&
+             (sel = prepare_partition_stmt(e, PARTITION_SELECT_SQL, p.seq)) &&
+             (range = prepare_partition_stmt(e, PARTITION_RANGE_SQL, p.seq)) &&
+             sqlite3_prepare_v2(e->db, "INSERT INTO partitions (seq, path, day) VALUES (?, ?, ?);",
+                                -1, &rec, NULL) == SQLITE_OK;
+    if (ok) {
+        sqlite3_bind_int64(rec, 1, (sqlite3_int64)p.seq);
+        sqlite3_bind_text(rec, 2, p.path, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(rec, 3, p.day);
+        ok = sqlite3_step(rec) == SQLITE_DONE;
+    }
+    sqlite3_finalize(rec);
+    if (!ok) {
+        log_error("Cannot create history partition %s: %s", p.path, sqlite3_errmsg(e->db));
+        sqlite3_finalize(ins);
+        sqlite3_finalize(sel);
+        sqlite3_finalize(range);
+        detach_partition(e, p.seq);
+        unlink_db_files(p.path);
+        free(p.path);
+        return -1;
+    }
+    if (e->nparts > 0) {
+        if (e->cold_seq) {
+            sqlite3_finalize(e->cold_select);
+            detach_partition(e, e->cold_seq);
+        }
+        e->cold_seq = e->parts[e->nparts - 1].seq;
+        e->cold_select = e->select_stmt;
+    } else {
+        sqlite3_finalize(e->select_stmt); // on the main messages table
+    }
+    sqlite3_finalize(e->insert_stmt);
+    sqlite3_finalize(e->range_stmt);
+    e->insert_stmt = ins;
+    e->select_stmt = sel;
+    e->range_stmt = range;
+    e->parts[e->nparts++] = p;
+    e->hot_rows = 0;
+    log_info("Opened history partition %s", p.path);
+    while (e->cfg.partition_keep > 0 && e->nparts > e->cfg.partition_keep) drop_oldest_partition(e);
+    return 0;
+}
+
+// Moves inserts to a new partition once the current one is full or from an
+// earlier day. Inside a transaction (a persist batch) the rows so far are
+// committed first, as SQLite cannot attach or detach within one.
+static void rotate_partition_if_due(struct chat_engine *e) {
+    struct partition *hot = &e->parts[e->nparts - 1];
+    if (!(e->cfg.partition_rows > 0 && e->hot_rows >= e->cfg.partition_rows) &&
+        !(e->cfg.partition_daily && hot->day != utc_day()))
+        return;
+    int in_txn = !sqlite3_get_autocommit(e->db);
+    if (in_txn && db_exec(e->db, "COMMIT;") != 0) return;
+    if (open_partition(e) != 0) {
+        hot = &e->parts[e->nparts - 1];
+        log_warn("Keeping history partition %s for another round", hot->path);
+        hot->day = utc_day();
+        e->hot_rows = 0;
+    }
+    if (in_txn) db_exec(e->db, "BEGIN;");
+}
+
+// Select statement for older partition i, attached in place of the current
+// cold one. NULL when it cannot be attached.
+static sqlite3_stmt *cold_select(struct chat_engine *e, int i) {
+    const struct partition *p = &e->parts[i];
+    if (e->cold_seq == p->seq) return e->cold_select;
+    if (e->cold_seq) {
+        sqlite3_finalize(e->cold_select);
+        e->cold_select = NULL;
+        detach_partition(e, e->cold_seq);
+        e->cold_seq = 0;
+    }
+    if (attach_partition(e, p) != 0) return NULL;
+    if (!(e->cold_select = prepare_partition_stmt(e, PARTITION_SELECT_SQL, p->seq))) {
+        detach_partition(e, p->seq);
+        return NULL;
+    }
+    e->cold_seq = p->seq;
+    e->cold_attaches++;
+    return e->cold_select;
+}
+
+// Partition files left by the last run are removed, as the rows of the
+// messages table are, and the first one is opened.
+static int start_partitions(struct chat_engine *e) {
+    if (db_exec(e->db, "CREATE TABLE IF NOT EXISTS partitions ("
+                   "seq INTEGER PRIMARY KEY, path TEXT NOT NULL, day INTEGER NOT NULL);") != 0)
+        return -1;
+    sqlite3_stmt *st = NULL;
+    if (sqlite3_prepare_v2(e->db, "SELECT path FROM partitions;", -1, &st, NULL) == SQLITE_OK) {
+        while (sqlite3_step(st) == SQLITE_ROW) {
+            const unsigned char *path = sqlite3_column_text(st, 0);
+            if (path) unlink_db_files((const char *)path);
+        }
+    }
+    sqlite3_finalize(st);
+    if (db_exec(e->db, "DELETE FROM partitions;") != 0) return -1;
+    return open_partition(e);
+}
+
+static int init_db(struct chat_engine *e, const char *filename) {
+    int rc = sqlite3_open(filename, &e->db);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Cannot open sqlite db '%s': %s\n", filename, sqlite3_errmsg(e->db));
+        sqlite3_close(e->db);
+        e->db = NULL;
+        return -1;
+    }
+    char *errmsg = NULL;
+    rc = sqlite3_exec(e->db, "PRAGMA journal_mode=WAL;", NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Warning: failed to set WAL mode: %s\n", errmsg ? errmsg : "unknown");
+        sqlite3_free(errmsg);
+    }
+    const char *create_sql = "CREATE TABLE IF NOT EXISTS messages (" MESSAGES_COLUMNS ");";
+    rc = sqlite3_exec(e->db, create_sql, NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to create table: %s\n", errmsg ? errmsg : "unknown");
+        sqlite3_free(errmsg);
+        sqlite3_close(e->db);
+        e->db = NULL;
+        return -1;
+    }
+
+
+    rc = e->cfg.keep_history ? SQLITE_OK : sqlite3_exec(e->db, "DELETE FROM messages;", NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to clear table: %s\n", errmsg ? errmsg : "unknown");
+        sqlite3_free(errmsg);
+
+    }
+
+    // After the DELETE, so building it on an old database costs nothing
+    rc = sqlite3_exec(e->db, "CREATE INDEX IF NOT EXISTS messages_ts ON messages (ts);",
+                      NULL, NULL, &errmsg);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to create ts index: %s\n", errmsg ? errmsg : "unknown");
+        sqlite3_free(errmsg);
+        sqlite3_close(e->db);
+        e->db = NULL;
+        return -1;
+    }
+
+    // ts is bound rather than defaulted, so a row streamed to standbys carries
+    // the time stored here.
+    const char *insert_sql = "INSERT INTO messages (username, message, ts) VALUES (?, ?, ?);";
+    rc = sqlite3_prepare_v2(e->db, insert_sql, -1, &e->insert_stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare insert stmt: %s\n", sqlite3_errmsg(e->db));
+        sqlite3_close(e->db);
+        e->db = NULL;
+        return -1;
+    }
+    const char *select_sql =
+        "SELECT username, message, ts FROM messages "
+        "ORDER BY id DESC LIMIT ?;";
+    rc = sqlite3_prepare_v2(e->db, select_sql, -1, &e->select_stmt, NULL);
+    if (rc != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare select stmt: %s\n", sqlite3_errmsg(e->db));
+        sqlite3_finalize(e->insert_stmt);
+        e->insert_stmt = NULL;
+        sqlite3_close(e->db);
+        e->db = NULL;
+        return -1;
+    }
+    const char *range_sql =
+        "SELECT username, message, ts FROM messages WHERE ts >= ?1 AND ts < ?2 "
+        "ORDER BY ts DESC, id DESC LIMIT ?3;";
+    if (sqlite3_prepare_v2(e->db, range_sql, -1, &e->range_stmt, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Failed to prepare range stmt: %s\n", sqlite3_errmsg(e->db));
+        close_db(e);
+        return -1;
+    }
+    if ((e->cfg.replication_path || e->cfg.standby_of) &&
+        (sqlite3_prepare_v2(e->db, "SELECT id, username, message, ts FROM messages WHERE id > ? "
+                                   "ORDER BY id LIMIT ?;", -1, &e->repl_select_stmt, NULL) != SQLITE_OK ||
+         (e->cfg.standby_of &&
+          sqlite3_prepare_v2(e->db, "INSERT OR REPLACE INTO messages (id, username, message, ts) "
+                                    "VALUES (?, ?, ?, ?);", -1, &e->repl_insert_stmt, NULL) != SQLITE_OK))) {
+        fprintf(stderr, "Failed to prepare replication stmts: %s\n", sqlite3_errmsg(e->db));
+        close_db(e);
+        return -1;
+    }
+    if (partitioned(e) && start_partitions(e) != 0) {
+        fprintf(stderr, "Cannot set up history partitions next to '%s'\n", filename);
+        close_db(e);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Rows in the messages table, or near enough: the highest id.
+static long long db_stored_rows(struct chat_engine *e) {
+    sqlite3_stmt *st = NULL;
+    long long n = 0;
+    if (sqlite3_prepare_v2(e->db, "SELECT max(id) FROM messages;", -1, &st, NULL) == SQLITE_OK &&
+        sqlite3_step(st) == SQLITE_ROW)
+        n = sqlite3_column_int64(st, 0);
+    sqlite3_finalize(st);
+    return n;
+}
+
+// history_log_replay_fn: puts back rows the database lost with its unsynced
+// commits. The ids are the ones SQLite gave them, so rows it kept are skipped.
+static int replay_history_row(void *arg, const struct history_log_row *row) {
+    sqlite3_stmt *stmt = arg;
+    char ts[32];
+    format_ts(row->ts_ms, ts, sizeof(ts));
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)row->id);
+    sqlite3_bind_text(stmt, 2, row->username, (int)row->username_len, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 3, row->message, (int)row->message_len, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, ts, -1, SQLITE_TRANSIENT);
+    return sqlite3_step(stmt) == SQLITE_DONE ? 0 : -1;
+}
+
+// Replays what the log holds into the database, committed with
+// synchronous=FULL, then empties the log and lets SQLite stop syncing.
+static int open_history_log(struct chat_engine *e) {
+    if (!(e->history_log = history_log_open(e->cfg.history_log_path, e->cfg.keep_history))) return -1;
+    sqlite3_stmt *stmt = NULL;
+    long rows = 0;
+    if (e->cfg.keep_history) {
+        if (sqlite3_prepare_v2(e->db, "INSERT OR IGNORE INTO messages (id, username, message, ts) "
+                                      "VALUES (?, ?, ?, ?);", -1, &stmt, NULL) != SQLITE_OK ||
+            db_exec(e->db, "BEGIN;") != 0 ||
+            (rows = history_log_replay(e->history_log, replay_history_row, stmt)) < 0 ||
+            db_exec(e->db, "COMMIT;") != 0) {
+            fprintf(stderr, "Cannot replay history log '%s': %s\n", e->cfg.history_log_path,
+                    sqlite3_errmsg(e->db));
+            sqlite3_exec(e->db, "ROLLBACK;", NULL, NULL, NULL);
+            sqlite3_finalize(stmt);
+            return -1;
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (history_log_reset(e->history_log) != 0 || db_exec(e->db, "PRAGMA synchronous=NORMAL;") != 0) {
+        fprintf(stderr, "Cannot start history log '%s'\n", e->cfg.history_log_path);
+        return -1;
+    }
+    if (rows > 0) log_info("Replayed %ld rows from history log %s", rows, e->cfg.history_log_path);
+    return 0;
+}
+
+// SQLite takes back syncing its own commits, and makes the ones it skipped
+// durable before the log goes.
+static void drop_history_log(struct chat_engine *e) {
+    log_error("Giving up history log %s; SQLite syncs its commits again", e->cfg.history_log_path);
+    db_exec(e->db, "PRAGMA synchronous=FULL;");
+    sqlite3_wal_checkpoint_v2(e->db, NULL, SQLITE_CHECKPOINT_FULL, NULL, NULL);
+    history_log_close(e->history_log);
+    e->history_log = NULL;
+}
+
+// After the transaction holding the staged rows committed. Once the log is a
+// segment long, a checkpoint syncs the database and the log starts over; a
+// checkpoint that could not copy every frame is tried again next time.
+static void commit_history_log(struct chat_engine *e) {
+    if (history_log_commit(e->history_log) != 0) {
+        drop_history_log(e);
+        return;
+    }
+    if (history_log_size(e->history_log) < HISTORY_LOG_SEGMENT) return;
+    int frames = -1, copied = -1;
+    if (history_log_flush(e->history_log) != 0) {
+        drop_history_log(e);
+    } else if (sqlite3_wal_checkpoint_v2(e->db, NULL, SQLITE_CHECKPOINT_PASSIVE, &frames, &copied) ==
+                   SQLITE_OK && frames == copied &&
+               history_log_reset(e->history_log) != 0) {
+        drop_history_log(e);
+    }
+}
+
+static int db_insert_message(struct chat_engine *e, const char *username, const char *message,
+                             long long ts_ms) {
+    if (!e->db || !e->insert_stmt) return -1;
+    if (e->nparts) rotate_partition_if_due(e);
+    if (!username) username = "Anonymous";
+    if (!message) message = "";
+    char ts[32];
+    format_ts(ts_ms, ts, sizeof(ts));
+    int rc;
+    sqlite3_stmt *stmt = e->insert_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    rc = sqlite3_bind_text(stmt, 1, username, -1, SQLITE_TRANSIENT);
+    if (rc != SQLITE_OK) return -1;
+    rc = sqlite3_bind_text(stmt, 2, message, -1, SQLITE_TRANSIENT);
+    if (rc != SQLITE_OK) return -1;
+    rc = sqlite3_bind_text(stmt, 3, ts, -1, SQLITE_TRANSIENT);
+    if (rc != SQLITE_OK) return -1;
+    rc = sqlite3_step(stmt);
+    if (rc != SQLITE_DONE) {
+        log_error("Failed to insert message: %s", sqlite3_errmsg(e->db));
+        return -1;
+    }
+    e->hot_rows++;
+    if (e->repl) {
+        struct repl_row row = { (uint64_t)sqlite3_last_insert_rowid(e->db), ts_ms, username,
+                                strlen(username), message, strlen(message) };
+        // Inside a persist batch the row goes out with its COMMIT
+        if (sqlite3_get_autocommit(e->db)) repl_publish(e->repl, &row);
+        else repl_stage(e->repl, &row);
+    }
+    if (e->history_log) {
+        struct history_log_row row = { (uint64_t)sqlite3_last_insert_rowid(e->db), ts_ms, username,
+                                       strlen(username), message, strlen(message) };
+        if (history_log_stage(e->history_log, &row) != 0)
+            log_warn("Row %llu is too large for the history log", (unsigned long long)row.id);
+        else if (sqlite3_get_autocommit(e->db))
+            commit_history_log(e);
+    }
+    return 0;
+}
+
+struct row_span {
+    size_t off;
+    size_t len;
+};
+
+// Returns a frame_pool buffer of at least need bytes holding buf's contents,
+// or NULL with buf untouched.
+static void *grow_scratch(void *buf, size_t *cap, size_t need) {
+    if (need <= *cap) return buf;
+    size_t ncap = *cap ? *cap : 4096;
+    while (ncap < need) ncap *= 2;
+    void *n = frame_pool_alloc(ncap);
+    if (!n) return NULL;
+    if (buf) {
+        memcpy(n, buf, *cap);
+        frame_pool_free(buf);
+    }
+    *cap = frame_pool_usable(n);
+    return n;
+}
+
+struct row_buf {
+    char *text;
+    struct row_span *rows;
+    size_t text_cap, text_len, rows_cap, nrows;
+};
+
+// Appends the rows stmt yields. Returns -1 when out of memory.
+static int collect_rows(sqlite3_stmt *stmt, struct row_buf *rb) {
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const unsigned char *uname = sqlite3_column_text(stmt, 0);
+        const unsigned char *msg = sqlite3_column_text(stmt, 1);
+
+        const char *u = uname ? (const char*)uname : "Anonymous";
+        const char *m = msg ? (const char*)msg : "";
+        size_t ulen = strlen(u), mlen = strlen(m);
+        char *t = grow_scratch(rb->text, &rb->text_cap, rb->text_len + ulen + 2 + mlen);
+        if (!t) return -1;
+        rb->text = t;
+        struct row_span *r = grow_scratch(rb->rows, &rb->rows_cap, (rb->nrows + 1) * sizeof(*r));
+        if (!r) return -1;
+        rb->rows = r;
+        r[rb->nrows].off = rb->text_len;
+        r[rb->nrows].len = ulen + 2 + mlen;
+        rb->nrows++;
+        memcpy(rb->text + rb->text_len, u, ulen);
+        memcpy(rb->text + rb->text_len + ulen, ": ", 2);
+        memcpy(rb->text + rb->text_len + ulen + 2, m, mlen);
+        rb->text_len += ulen + 2 + mlen;
+    }
+    return 0;
+}
+
+// Frees rb's buffers. Returns NULL when out of memory.
+static struct frame *rows_frame(struct row_buf *rb, const char *head) {
+    size_t hlen = head ? strlen(head) : 0;
+    struct frame *f = frame_alloc(hlen + rb->text_len + (rb->nrows ? rb->nrows - 1 : 0) +
+                                  (hlen && rb->nrows ? 1 : 0));
+    if (f) {
+        unsigned char *out = f->buf + LWS_PRE;
+        if (hlen) memcpy(out, head, hlen);
+        out += hlen;
+        if (hlen && rb->nrows) *out++ = '\n';
+        for (size_t i = rb->nrows; i-- > 0; ) {
+            memcpy(out, rb->text + rb->rows[i].off, rb->rows[i].len);
+            out += rb->rows[i].len;
+            if (i > 0) *out++ = '\n';
+        }
+    }
+    frame_pool_free(rb->text);
+    frame_pool_free(rb->rows);
+    return f;
+}
+
+// Newest-first rows become an oldest-first, '\n'-joined frame. Rows are packed
+// into one scratch buffer and copied once into the frame; an empty history
+// yields a frame with len 0. With partitions, older files are read newest
+// first until limit rows are found. Caller holds history_lock.
+static struct frame *db_get_history_snapshot(struct chat_engine *e, int limit) {
+    if (!e->db || !e->select_stmt) return NULL;
+    sqlite3_stmt *stmt = e->select_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (sqlite3_bind_int(stmt, 1, limit) != SQLITE_OK) return NULL;
+    struct row_buf rb = { 0 };
+    int ok = collect_rows(stmt, &rb) == 0;
+    sqlite3_reset(stmt);
+    for (int i = e->nparts - 2; ok && i >= 0 && (limit < 0 || rb.nrows < (size_t)limit); i--) {
+        stmt = cold_select(e, i);
+        if (!stmt) break;
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        if (sqlite3_bind_int(stmt, 1, limit < 0 ? -1 : limit - (int)rb.nrows) != SQLITE_OK) break;
+        ok = collect_rows(stmt, &rb) == 0;
+        sqlite3_reset(stmt);
+    }
+    return rows_frame(&rb, NULL);
+}
+
+static int bind_range(sqlite3_stmt *stmt, const char *from, const char *to, int limit) {
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    return sqlite3_bind_text(stmt, 1, from, -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_text(stmt, 2, to, -1, SQLITE_STATIC) == SQLITE_OK &&
+           sqlite3_bind_int(stmt, 3, limit) == SQLITE_OK ? 0 : -1;
+}
+
+// The newest limit rows stored in [from_ms, to_ms), as a frame starting with
+// head when it is not NULL. 0 leaves either end open. Each file is one range
+// scan of its ts index; partitions opened after to_ms are skipped, and those
+// opened before the one holding from_ms are not read. Caller holds
+// history_lock.
+static struct frame *db_get_history_range(struct chat_engine *e, long long from_ms, long long to_ms,
+                                          int limit, const char *head) {
+    if (!e->db || !e->range_stmt) return NULL;
+    // Bounds must not look numeric: ts has NUMERIC affinity, which would turn
+    // "9999" into a number that sorts before every text value.
+    char from[32] = "", to[32] = "9999-12-31 23:59:59.999";
+    if (from_ms > 0) format_ts(from_ms, from, sizeof(from));
+    if (to_ms > 0) format_ts(to_ms, to, sizeof(to));
+    struct row_buf rb = { 0 };
+    int ok = 1;
+    for (int i = e->nparts ? e->nparts - 1 : 0; ok && i >= 0 && rb.nrows < (size_t)limit; i--) {
+        if (e->nparts && to_ms > 0 && e->parts[i].opened_ms >= to_ms) continue;
+        sqlite3_stmt *stmt = e->range_stmt;
+        if (i < e->nparts - 1) {
+            stmt = cold_select(e, i) ? prepare_partition_stmt(e, PARTITION_RANGE_SQL, e->parts[i].seq)
+                                     : NULL;
+            if (!stmt) break;
+        }
+        if (bind_range(stmt, from, to, limit - (int)rb.nrows) == 0) ok = collect_rows(stmt, &rb) == 0;
+        if (stmt == e->range_stmt) sqlite3_reset(stmt);
+        else sqlite3_finalize(stmt);
+        if (!e->nparts || e->parts[i].opened_ms <= from_ms) break;
+    }
+    return rows_frame(&rb, head);
+}
+
+static void broadcast_counts(struct chat_engine *e) {
+    int readers=0, writers=0;
+    count_roles(e, &readers, &writers);
+    char buf[128];
+    // Multi-writer rooms add the writer cap so clients know writers may join.
+    if (e->cfg.max_writers > 1)
+        snprintf(buf, sizeof(buf), "SYSTEM_COUNTS:%d:%d:%d", readers, writers, e->cfg.max_writers);
+    else
+        snprintf(buf, sizeof(buf), "SYSTEM_COUNTS:%d:%d", readers, writers);
+    broadcast_text(e, buf);
+}
+
+// Queues f on c; the caller keeps its own reference.
+static void send_frame_to_client(struct chat_engine *e, struct client *c, struct frame *f) {
+    pthread_mutex_lock(&e->clients_mutex);
+    enqueue_frame(e, c, f);
+    int wake = take_wakeups(e);
+    pthread_mutex_unlock(&e->clients_mutex);
+    if (wake) wake_service_threads(e);
+}
+
+static void send_to_client(struct chat_engine *e, struct client *c, const char *msg) {
+    if (!c || !c->wsi || !msg) return;
+    struct frame *f = frame_new(msg, strlen(msg));
+    if (!f) return;
+    send_frame_to_client(e, c, f);
+    frame_release(f);
+}
+
+static void broadcast_text(struct chat_engine *e, const char *message) {
+    if (!message) return;
+    size_t len = strlen(message);
+    // One copy per service thread: lws_write() rewrites the LWS_PRE headroom
+    // (h2 frame headers differ per stream), so threads must not share a buffer.
+    struct frame *frames[CHAT_MAX_SERVICE_THREADS] = { NULL };
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *p = e->clients_head; p; p = p->next) {
+        struct frame **f = &frames[p->tsi];
+        if (!*f && !(*f = frame_new(message, len))) continue;
+        enqueue_frame(e, p, *f);
+    }
+    int wake = take_wakeups(e);
+    pthread_mutex_unlock(&e->clients_mutex);
+    if (wake) wake_service_threads(e);
+    for (int i = 0; i < CHAT_MAX_SERVICE_THREADS; i++) frame_release(frames[i]);
+}
+
+// The payload is the send time, which the pong echoes back.
+static int write_ping(struct client *c, int more) {
+    unsigned char buf[LWS_PRE + 8];
+    long long sent = now_us();
+    for (int i = 0; i < 8; i++) buf[LWS_PRE + i] = (unsigned char)((unsigned long long)sent >> (8 * i));
+    if (lws_write(c->wsi, buf + LWS_PRE, 8, LWS_WRITE_PING) < 8) return -1;
+    __atomic_store_n(&c->ping_sent_us, sent, __ATOMIC_RELAXED);
+    if (more) lws_callback_on_writable(c->wsi);
+    return 0;
+}
+
+// Only pongs that echo the ping in flight count; browsers may send others.
+static void handle_pong(struct client *c, const unsigned char *in, size_t len) {
+    long long sent = __atomic_load_n(&c->ping_sent_us, __ATOMIC_RELAXED);
+    if (len != 8 || !sent) return;
+    unsigned long long v = 0;
+    for (int i = 0; i < 8; i++) v |= (unsigned long long)in[i] << (8 * i);
+    if ((long long)v != sent) return;
+    long rtt = (long)(now_us() - sent);
+    long avg = c->rtt_us < 0 ? rtt : (c->rtt_avg_us * 7 + rtt) / 8;
+    __atomic_store_n(&c->rtt_us, rtt, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->rtt_avg_us, avg, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->ping_sent_us, 0, __ATOMIC_RELAXED);
+}
+
+static void note_sent(struct client *c, size_t len) {
+    __atomic_add_fetch(&c->frames_sent, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&c->bytes_sent, (unsigned long long)len, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->last_write_us, now_us(), __ATOMIC_RELAXED);
+}
+
+// Header and payload of f from byte off on, in one gather write. MSG_MORE
+// when a history span follows, so the first row shares its packets.
+static ssize_t send_head(struct client *c, struct frame *f, size_t off) {
+    struct iovec iov[2];
+    int n = 0;
+    if (off < f->ws_hdr_len) {
+        iov[n].iov_base = f->ws_hdr + off;
+        iov[n++].iov_len = f->ws_hdr_len - off;
+        off = 0;
+    } else {
+        off -= f->ws_hdr_len;
+    }
+    iov[n].iov_base = f->buf + LWS_PRE + off;
+    iov[n++].iov_len = f->len - off;
+    // sendmsg rather than writev for MSG_NOSIGNAL: a vanished peer must not
+    // raise SIGPIPE.
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = (size_t)n };
+    return sendmsg(c->raw_fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT | (f->span_file ? MSG_MORE : 0));
+}
+
+// Sends the rest of c->raw_frame, bypassing lws_write(): header and payload in
+// one gather write, then for a history span the cached rows by sendfile() and
+// the closing fragment. Returns 1 once the frame is out, 0 if the socket is
+// full, -1 on error. After a short write the frame is finished here and the
+// connection's ordinary frames go back to lws_write(), which buffers partial
+// sends itself. sendfile() relies on lws ignoring SIGPIPE.
+static int write_raw(struct chat_engine *e, struct client *c) {
+    struct frame *f = c->raw_frame;
+    size_t head = f->ws_hdr_len + f->len;
+    size_t total = head + (f->span_file ? f->span_len + HISTORY_CACHE_END_LEN : 0);
+    while (c->raw_off < total) {
+        ssize_t w;
+        if (c->raw_off < head) {
+            w = send_head(c, f, c->raw_off);
+        } else if (c->raw_off < head + f->span_len) {
+            off_t off = (off_t)(f->span_off + (c->raw_off - head));
+            w = sendfile(c->raw_fd, history_file_fd(f->span_file), &off,
+                         f->span_len - (c->raw_off - head));
+            if (w == 0) return -1; // the file is shorter than the span
+        } else {
+            size_t done = c->raw_off - head - f->span_len;
+            w = send(c->raw_fd, HISTORY_CACHE_END + done, HISTORY_CACHE_END_LEN - done,
+                     MSG_NOSIGNAL | MSG_DONTWAIT);
+        }
+        if (w < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return -1;
+            break;
+        }
+        c->raw_off += (size_t)w;
+    }
+    if (c->raw_off < total) {
+        if (!c->raw_fallback) __atomic_add_fetch(&e->raw_partial, 1, __ATOMIC_RELAXED);
+        c->raw_fallback = 1;
+        lws_callback_on_writable(c->wsi);
+        return 0;
+    }
+    c->raw_frame = NULL;
+    __atomic_add_fetch(&e->raw_frames, 1, __ATOMIC_RELAXED);
+    note_sent(c, f->len + f->span_len);
+    frame_release(f);
+    return 1;
+}
+
+// Writes a due ping or at most one queued frame; lws calls back again while
+// more are pending.
+static int write_pending(struct chat_engine *e, struct client *c) {
+    pthread_mutex_lock(&e->clients_mutex);
+    if (c->closing) {
+        int shed = c->shed;
+        pthread_mutex_unlock(&e->clients_mutex);
+        if (shed) {
+            static const char reason[] = "server overloaded";
+            lws_close_reason(c->wsi, LWS_CLOSE_STATUS_TRY_AGAIN_LATER,
+                             (unsigned char *)reason, sizeof(reason) - 1);
+        } else {
+            static const char reason[] = "send queue overflow";
+            lws_close_reason(c->wsi, LWS_CLOSE_STATUS_POLICY_VIOLATION,
+                             (unsigned char *)reason, sizeof(reason) - 1);
+        }
+        return -1;
+    }
+    if (c->raw_frame) {
+        // Nothing else may go out in the middle of a frame.
+        pthread_mutex_unlock(&e->clients_mutex);
+        if (c->raw_off == 0 && lws_has_buffered_out(c->wsi)) {
+            lws_callback_on_writable(c->wsi);
+            return 0;
+        }
+        int rc = write_raw(e, c);
+        if (rc > 0) lws_callback_on_writable(c->wsi); // queued frames or a ping may wait
+        return rc < 0 ? -1 : 0;
+    }
+    if (c->ping_due) {
+        c->ping_due = 0;
+        int more = c->out_head != NULL;
+        pthread_mutex_unlock(&e->clients_mutex);
+        return write_ping(c, more);
+    }
+    struct frame *f = dequeue_frame(e, c);
+    int more = c->out_head != NULL;
+    pthread_mutex_unlock(&e->clients_mutex);
+    if (!f) return 0;
+    // History spans never go through lws, so they wait until lws has sent
+    // what it buffered.
+    if (f->span_file || (e->cfg.writev_fast_path && c->raw_fd >= 0 && !c->raw_fallback &&
+                         !lws_has_buffered_out(c->wsi))) {
+        c->raw_frame = f; // takes the queue's reference
+        c->raw_off = 0;
+        if (lws_has_buffered_out(c->wsi)) {
+            lws_callback_on_writable(c->wsi);
+            return 0;
+        }
+        int rc = write_raw(e, c);
+        if (rc > 0 && more) lws_callback_on_writable(c->wsi);
+        return rc < 0 ? -1 : 0;
+    }
+    int n = lws_write(c->wsi, f->buf + LWS_PRE, f->len, LWS_WRITE_TEXT);
+    size_t len = f->len;
+    frame_release(f);
+    if (n < (int)len) return -1;
+    note_sent(c, len);
+    if (more) lws_callback_on_writable(c->wsi);
+    return 0;
+}
+
+static int active_readers(struct chat_engine *e) {
+    int r=0,w=0;
+    count_roles(e, &r, &w);
+    return r;
+}
+
+static int active_writers(struct chat_engine *e) {
+    int r=0,w=0;
+    count_roles(e, &r, &w);
+    return w;
+}
+
+// Classic rooms hold one writer and no readers, or readers only. Multi-writer
+// rooms admit readers at any time and up to max_writers writers.
+static int can_admit_as_reader(struct chat_engine *e) {
+    return e->cfg.max_writers > 1 || active_writers(e) == 0;
+}
+
+static int can_admit_as_writer(struct chat_engine *e) {
+    if (e->cfg.max_writers > 1) return active_writers(e) < e->cfg.max_writers;
+    return active_writers(e) == 0 && active_readers(e) == 0;
+}
+
+// The newest limit rows from the history cache: the first row is read into
+// the frame as a text fragment with FIN clear, the rest stay in the file.
+// NULL when the cache does not hold them.
+static struct frame *cached_history(struct chat_engine *e, int limit) {
+    struct history_span span;
+    int n = history_cache_span(e->history_cache, limit, &span);
+    if (n <= 0) return n == 0 ? frame_alloc(0) : NULL;
+    struct frame *f = frame_alloc(span.first_len);
+    if (f && pread(history_file_fd(span.file), f->buf + LWS_PRE, span.first_len,
+                   (off_t)span.first_off) != (ssize_t)span.first_len) {
+        frame_release(f);
+        f = NULL;
+    }
+    if (!f || n == 1) {
+        history_file_release(span.file);
+        return f;
+    }
+    f->ws_hdr[0] = 0x01;
+    f->span_file = span.file;
+    f->span_off = span.rest_off;
+    f->span_len = span.rest_len;
+    return f;
+}
+
+static char *frame_payload(void *arg, size_t len) {
+    struct frame **f = arg;
+    *f = frame_alloc(len);
+    return *f ? (char *)(*f)->buf + LWS_PRE : NULL;
+}
+
+// The newest limit rows from the history store while it holds them, from
+// SQLite otherwise.
+static struct frame *history_snapshot(struct chat_engine *e, int limit) {
+    struct frame *f = NULL;
+    if (e->history_store && history_store_read(e->history_store, limit, frame_payload, &f) >= 0)
+        return f;
+    pthread_rwlock_wrlock(&e->history_lock);
+    f = db_get_history_snapshot(e, limit);
+    pthread_rwlock_unlock(&e->history_lock);
+    return f;
+}
+
+static void send_history(struct chat_engine *e, struct client *c, int always, int limit) {
+    struct frame *snap = NULL;
+    if (e->history_cache && c->raw_fd >= 0) snap = cached_history(e, limit);
+    if (!snap) snap = history_snapshot(e, limit);
+    if (snap) {
+        send_frame_to_client(e, c, snap);
+        frame_release(snap);
+    } else if (always) {
+        send_to_client(e, c, "");
+    }
+}
+
+// "HISTORY_RANGE:<ts>", then the rows stored in [from_ms, to_ms) on their own
+// lines. Messages stamped after the query get a later ts, so a client can ask
+// for what followed with history_since:<ts>.
+static void send_history_range(struct chat_engine *e, struct client *c, long long from_ms,
+                               long long to_ms, int limit) {
+    char head[48];
+    pthread_rwlock_wrlock(&e->history_lock);
+    snprintf(head, sizeof(head), "HISTORY_RANGE:%lld", stamp_ts(e));
+    struct frame *f = db_get_history_range(e, from_ms, to_ms, limit, head);
+    pthread_rwlock_unlock(&e->history_lock);
+    if (f) {
+        send_frame_to_client(e, c, f);
+        frame_release(f);
+    }
+}
+
+static int load_level(struct chat_engine *e) {
+    return __atomic_load_n(&e->load_level, __ATOMIC_RELAXED);
+}
+
+// Raises the level at once, lowers it one step per LOAD_HOLD_SECONDS.
+static void update_load_level(struct chat_engine *e, double now) {
+    long lag_us = 0;
+    for (int i = 0; i < e->cfg.service_threads; i++) {
+        long l = __atomic_load_n(&e->probes[i].lag_us, __ATOMIC_RELAXED);
+        if (l > lag_us) lag_us = l;
+    }
+    pthread_mutex_lock(&e->clients_mutex);
+    double depth = e->client_count ? (double)e->queued_frames / e->client_count : 0;
+    pthread_mutex_unlock(&e->clients_mutex);
+    int want = LOAD_NORMAL;
+    if (e->cfg.load_shedding) {
+        for (int l = 0; l < 4; l++) {
+            if (lag_us >= lag_thresholds_ms[l] * 1000L || depth >= depth_thresholds[l]) want = l + 1;
+        }
+    }
+    pthread_mutex_lock(&e->load_mutex);
+    int level = e->load_level;
+    if (want > level || (want < level && now - e->load_changed >= LOAD_HOLD_SECONDS)) {
+        int next = want > level ? want : level - 1;
+        __atomic_store_n(&e->load_level, next, __ATOMIC_RELAXED);
+        e->load_changed = now;
+        log_warn("Load level %s -> %s (loop lag %.1f ms, %.1f frames queued per client)",
+                 load_level_names[level], load_level_names[next], lag_us / 1000.0, depth);
+    }
+    pthread_mutex_unlock(&e->load_mutex);
+}
+
+// Clients of tsi are only freed on tsi, which is the calling thread, so they
+// stay valid after clients_mutex is dropped.
+static void serve_deferred_history(struct chat_engine *e, int tsi) {
+    struct client *batch[DEFERRED_PER_TICK];
+    int n = 0;
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *c = e->clients_head; c && n < DEFERRED_PER_TICK; c = c->next) {
+        if (c->tsi == tsi && c->history_deferred) {
+            c->history_deferred = 0;
+            batch[n++] = c;
+        }
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+    int rows = limits(e)->history_limit;
+    for (int i = 0; i < n; i++) send_history(e, batch[i], 1, rows);
+}
+
+static void drop_slow_readers(struct chat_engine *e, int tsi) {
+    int dropped = 0, depth = limits(e)->slow_reader_depth;
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *c = e->clients_head; c; c = c->next) {
+        if (c->tsi != tsi || c->closing || c->out_count < depth ||
+            strcasecmp(c->role, "READER") != 0) continue;
+        c->closing = 1;
+        c->shed = 1;
+        request_write(e, c);
+        dropped++;
+    }
+    int wake = take_wakeups(e);
+    pthread_mutex_unlock(&e->clients_mutex);
+    if (wake) wake_service_threads(e);
+    if (dropped) __atomic_add_fetch(&e->dropped_readers, (unsigned long)dropped, __ATOMIC_RELAXED);
+}
+
+// A new ping replaces one still unanswered, so a lost pong does not stop the
+// measurements.
+static void ping_clients(struct chat_engine *e, int tsi) {
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *c = e->clients_head; c; c = c->next) {
+        if (c->tsi != tsi || c->closing || c->ping_due) continue;
+        c->ping_due = 1;
+        lws_callback_on_writable(c->wsi);
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+}
+
+static void probe_tick(lws_sorted_usec_list_t *sul) {
+    struct loop_probe *pr = lws_container_of(sul, struct loop_probe, sul);
+    struct chat_engine *e = pr->e;
+    double now = now_seconds();
+    long lag = (long)((now - pr->due) * 1e6);
+    if (lag < 0) lag = 0;
+    long avg = (__atomic_load_n(&pr->lag_us, __ATOMIC_RELAXED) * 4 + lag) / 5;
+    __atomic_store_n(&pr->lag_us, avg, __ATOMIC_RELAXED);
+    if (lag > __atomic_load_n(&pr->max_lag_us, __ATOMIC_RELAXED))
+        __atomic_store_n(&pr->max_lag_us, lag, __ATOMIC_RELAXED);
+
+    update_load_level(e, now);
+    int level = load_level(e);
+    if (level == LOAD_NORMAL) serve_deferred_history(e, pr->tsi);
+    else if (level >= LOAD_DROP_READERS) drop_slow_readers(e, pr->tsi);
+    if (now >= pr->next_ping) {
+        ping_clients(e, pr->tsi);
+        pr->next_ping = now + PING_INTERVAL_S;
+    }
+
+    pr->due = now_seconds() + PROBE_INTERVAL_MS / 1000.0;
+    lws_sul_schedule(e->context, pr->tsi, &pr->sul, probe_tick, PROBE_INTERVAL_MS * LWS_US_PER_MS);
+}
+
+// Before any service thread runs, as lws_sul_schedule() is not thread-safe.
+static void start_probes(struct chat_engine *e) {
+    for (int i = 0; i < e->cfg.service_threads; i++) {
+        struct loop_probe *pr = &e->probes[i];
+        pr->e = e;
+        pr->tsi = i;
+        pr->due = now_seconds() + PROBE_INTERVAL_MS / 1000.0;
+        pr->next_ping = pr->due + PING_INTERVAL_S;
+        lws_sul_schedule(e->context, i, &pr->sul, probe_tick, PROBE_INTERVAL_MS * LWS_US_PER_MS);
+    }
+}
+
+// History rows for a joining client under the current load.
+static int join_history_limit(struct chat_engine *e) {
+    const struct chat_limits *l = limits(e);
+    if (load_level(e) < LOAD_SHRINK_HISTORY) return l->history_limit;
+    __atomic_add_fetch(&e->shrunk_joins, 1, __ATOMIC_RELAXED);
+    return l->shed_history_limit;
+}
+
+// A client back after a disconnect gets the rows stored since then instead.
+static void send_join_history(struct chat_engine *e, struct client *c) {
+    int limit = join_history_limit(e);
+    if (c->history_since_ms > 0) send_history_range(e, c, c->history_since_ms, 0, limit);
+    else send_history(e, c, 0, limit);
+}
+
+// 503 with Retry-After instead of the 101 Switching Protocols.
+static int refuse_upgrade(struct chat_engine *e, struct lws *wsi) {
+    unsigned char hdr[LWS_PRE + 256];
+    unsigned char *start = hdr + LWS_PRE, *p = start, *end = hdr + sizeof(hdr) - 1;
+    __atomic_add_fetch(&e->refused_upgrades, 1, __ATOMIC_RELAXED);
+    if (lws_add_http_header_status(wsi, HTTP_STATUS_SERVICE_UNAVAILABLE, &p, end) ||
+        lws_add_http_header_by_name(wsi, (const unsigned char *)"retry-after:",
+                                    (const unsigned char *)SHED_RETRY_AFTER,
+                                    (int)strlen(SHED_RETRY_AFTER), &p, end) ||
+        lws_add_http_header_content_length(wsi, 0, &p, end) ||
+        lws_finalize_write_http_header(wsi, start, &p, end))
+        return -1; // hang up
+    return 1;
+}
+
+// Caller holds history_lock and has committed the row, so the in-memory
+// history never holds a row the database lost, and it stays in id order.
+static void remember_row(struct chat_engine *e, const char *username, const char *msg) {
+    if (e->history_cache) history_cache_append(e->history_cache, username, msg);
+    if (e->history_store) history_store_append(e->history_store, username, msg);
+}
+
+// Commits everything queued so far in one transaction.
+static void persist_batch(struct chat_engine *e, struct persist_item *batch) {
+    pthread_rwlock_wrlock(&e->history_lock);
+    sqlite3_exec(e->db, "BEGIN;", NULL, NULL, NULL);
+    for (struct persist_item *it = batch; it; it = it->next) {
+        it->stored = db_insert_message(e, it->username, it->message, it->ts_ms) == 0;
+        if (!it->stored) log_warn("Failed to insert message into DB");
+    }
+    if (sqlite3_exec(e->db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+        log_error("Failed to commit history batch: %s", sqlite3_errmsg(e->db));
+        sqlite3_exec(e->db, "ROLLBACK;", NULL, NULL, NULL);
+        if (e->history_log) history_log_discard(e->history_log);
+        if (e->repl) repl_discard(e->repl);
+    } else {
+        if (e->history_log) commit_history_log(e);
+        if (e->repl) repl_commit(e->repl);
+        for (struct persist_item *it = batch; it; it = it->next) {
+            if (it->stored) remember_row(e, it->username, it->message);
+        }
+    }
+    pthread_rwlock_unlock(&e->history_lock);
+    while (batch) {
+        struct persist_item *next = batch->next;
+        free(batch->username);
+        free(batch->message);
+        free(batch);
+        batch = next;
+    }
+}
+
+static void *persist_main(void *arg) {
+    struct chat_engine *e = arg;
+    placement_apply("persist", e->cfg.persist_cpus);
+    for (;;) {
+        pthread_mutex_lock(&e->persist_mutex);
+        while (!e->persist_head && !e->persist_stop)
+            pthread_cond_wait(&e->persist_cond, &e->persist_mutex);
+        // With persist_batch_ms, keep collecting for that long after the
+        // first message so bursts commit in one transaction.
+        int batch_ms = limits(e)->persist_batch_ms;
+        if (e->persist_head && batch_ms > 0 && !e->persist_stop) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec += batch_ms / 1000;
+            until.tv_nsec += (batch_ms % 1000) * 1000000L;
+            if (until.tv_nsec >= 1000000000L) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            while (!e->persist_stop &&
+                   pthread_cond_timedwait(&e->persist_cond, &e->persist_mutex, &until) != ETIMEDOUT) {}
+        }
+        struct persist_item *batch = e->persist_head;
+        e->persist_head = e->persist_tail = NULL;
+        int stop = e->persist_stop;
+        pthread_mutex_unlock(&e->persist_mutex);
+        if (batch) persist_batch(e, batch);
+        else if (stop) break;
+    }
+    placement_forget();
+    return NULL;
+}
+
+static int persist_enqueue(struct chat_engine *e, const char *username, const char *msg,
+                           long long ts_ms) {
+    struct persist_item *it = calloc(1, sizeof(struct persist_item));
+    if (!it) return -1;
+    it->ts_ms = ts_ms;
+    it->username = strdup(username ? username : "Anonymous");
+    it->message = strdup(msg);
+    if (!it->username || !it->message) {
+        free(it->username);
+        free(it->message);
+        free(it);
+        return -1;
+    }
+    pthread_mutex_lock(&e->persist_mutex);
+    if (e->persist_tail) e->persist_tail->next = it;
+    else e->persist_head = it;
+    e->persist_tail = it;
+    pthread_cond_signal(&e->persist_cond);
+    pthread_mutex_unlock(&e->persist_mutex);
+    return 0;
+}
+
+static int start_persist_thread(struct chat_engine *e) {
+    pthread_mutex_init(&e->persist_mutex, NULL);
+    pthread_cond_init(&e->persist_cond, NULL);
+    if (pthread_create(&e->persist_tid, NULL, persist_main, e) != 0) {
+        fprintf(stderr, "Failed to start persistence thread\n");
+        return -1;
+    }
+    e->persist_running = 1;
+    return 0;
+}
+
+// Drains what is still queued before the database is closed.
+static void stop_persist_thread(struct chat_engine *e) {
+    if (!e->persist_running) return;
+    pthread_mutex_lock(&e->persist_mutex);
+    e->persist_stop = 1;
+    pthread_cond_signal(&e->persist_cond);
+    pthread_mutex_unlock(&e->persist_mutex);
+    pthread_join(e->persist_tid, NULL);
+    e->persist_running = 0;
+    pthread_cond_destroy(&e->persist_cond);
+    pthread_mutex_destroy(&e->persist_mutex);
+}
+
+// The broadcast carries the row's ts ("MSG:<ts>:user: text"), so a client
+// can resume from exactly what it has seen.
+static int store_and_broadcast(struct chat_engine *e, const char *username, const char *msg) {
+    char out[MAX_MSG_LEN + 32];
+    long long ts_ms = stamp_ts(e);
+    snprintf(out, sizeof(out), "MSG:%lld:%s: %s", ts_ms, username && username[0] ? username : "Anon", msg);
+
+    int rc;
+    if (e->persist_running) {
+        rc = persist_enqueue(e, username, msg, ts_ms);
+    } else {
+        pthread_rwlock_wrlock(&e->history_lock);
+        rc = db_insert_message(e, username, msg, ts_ms);
+        if (rc == 0) remember_row(e, username ? username : "Anonymous", msg);
+        pthread_rwlock_unlock(&e->history_lock);
+    }
+    if (rc != 0) {
+        log_warn("Failed to insert message into DB");
+    }
+
+    broadcast_text(e, out);
+    return rc;
+}
+
+// repl_catch_up_fn: the next rows a standby has not seen, from the database.
+// Under history_lock, so rows committed meanwhile wait for repl_go_live().
+static int repl_catch_up(void *arg, struct repl_standby *st, uint64_t after, int max) {
+    struct chat_engine *e = arg;
+    pthread_rwlock_wrlock(&e->history_lock);
+    sqlite3_stmt *stmt = e->repl_select_stmt;
+    sqlite3_reset(stmt);
+    sqlite3_bind_int64(stmt, 1, (sqlite3_int64)after);
+    sqlite3_bind_int(stmt, 2, max);
+    int n = 0, rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct repl_row row = {
+            .id = (uint64_t)sqlite3_column_int64(stmt, 0),
+            .ts_ms = parse_ts(sqlite3_column_text(stmt, 3)),
+            .username = (const char *)sqlite3_column_text(stmt, 1),
+            .username_len = (size_t)sqlite3_column_bytes(stmt, 1),
+            .message = (const char *)sqlite3_column_text(stmt, 2),
+            .message_len = (size_t)sqlite3_column_bytes(stmt, 2),
+        };
+        repl_queue_row(st, &row);
+        n++;
+    }
+    if (rc != SQLITE_DONE) {
+        log_error("Failed to read history for a standby: %s", sqlite3_errmsg(e->db));
+        n = -1;
+    } else if (n < max) {
+        repl_go_live(st);
+    }
+    sqlite3_reset(stmt);
+    pthread_rwlock_unlock(&e->history_lock);
+    return n;
+}
+
+// repl_apply_fn on a standby: one transaction per batch, then the in-memory
+// history, the same way store_and_broadcast() feeds them.
+static void apply_replicated(void *arg, const struct repl_row *rows, int n) {
+    struct chat_engine *e = arg;
+    sqlite3_stmt *stmt = e->repl_insert_stmt;
+    pthread_rwlock_wrlock(&e->history_lock);
+    int ok = db_exec(e->db, "BEGIN;") == 0;
+    for (int i = 0; ok && i < n; i++) {
+        char ts[32];
+        format_ts(rows[i].ts_ms, ts, sizeof(ts));
+        sqlite3_reset(stmt);
+        sqlite3_bind_int64(stmt, 1, (sqlite3_int64)rows[i].id);
+        sqlite3_bind_text(stmt, 2, rows[i].username, (int)rows[i].username_len, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, rows[i].message, (int)rows[i].message_len, SQLITE_STATIC);
+        if (rows[i].ts_ms) sqlite3_bind_text(stmt, 4, ts, -1, SQLITE_TRANSIENT);
+        else sqlite3_bind_null(stmt, 4);
+        ok = sqlite3_step(stmt) == SQLITE_DONE;
+        if (ok && e->history_log) {
+            struct history_log_row row = { rows[i].id, rows[i].ts_ms, rows[i].username,
+                                           rows[i].username_len, rows[i].message, rows[i].message_len };
+            history_log_stage(e->history_log, &row);
+        }
+    }
+    sqlite3_reset(stmt);
+    if (!ok || db_exec(e->db, "COMMIT;") != 0) {
+        log_error("Failed to store %d replicated rows: %s", n, sqlite3_errmsg(e->db));
+        sqlite3_exec(e->db, "ROLLBACK;", NULL, NULL, NULL);
+        if (e->history_log) history_log_discard(e->history_log);
+    } else {
+        if (e->history_log) commit_history_log(e);
+        for (int i = 0; i < n; i++) remember_row(e, rows[i].username, rows[i].message);
+    }
+    pthread_rwlock_unlock(&e->history_lock);
+}
+
+// repl_lost_fn: the listeners open on service thread 0.
+static void primary_lost(void *arg) {
+    struct chat_engine *e = arg;
+    e->primary_lost_us = now_us();
+    __atomic_store_n(&e->takeover_pending, 1, __ATOMIC_RELEASE);
+    lws_cancel_service(e->context);
+}
+
+// seq itself stays internal. The ts that store_and_broadcast() stamps here
+// increases in sequence order, and that is the order key clients (MSG:<ts>)
+// and the messages table see.
+static void apply_sequenced(void *arg, uint64_t seq, void *item) {
+    struct sequenced_msg *m = item;
+    (void)seq;
+    store_and_broadcast(arg, m->username, m->message);
+    free(m);
+}
+
+// Stores and broadcasts a checked writer message; in multi-writer rooms it
+// goes through the sequencer and may be applied on another writer's thread.
+static int submit_message(struct chat_engine *e, const char *username, const char *msg) {
+    if (!e->sequencer) return store_and_broadcast(e, username, msg);
+    size_t len = strlen(msg);
+    struct sequenced_msg *m = malloc(sizeof(*m) + len + 1);
+    if (!m) return -1;
+    snprintf(m->username, sizeof(m->username), "%s", username ? username : "Anonymous");
+    memcpy(m->message, msg, len + 1);
+    sequencer_submit(e->sequencer, m);
+    return 0;
+}
+
+static struct content_filter *current_filter(struct chat_engine *e) {
+    pthread_mutex_lock(&e->filter_mutex);
+    struct content_filter *f = content_filter_retain(e->filter);
+    pthread_mutex_unlock(&e->filter_mutex);
+    return f;
+}
+
+// Runs the content filter over a writer's message, masking in place.
+static enum filter_action filter_message(struct chat_engine *e, const char *username,
+                                         char *msg, size_t len) {
+    struct content_filter *f = current_filter(e);
+    if (!f) return FILTER_NONE;
+    const char *phrase;
+    enum filter_action action = content_filter_apply(f, msg, len, &phrase);
+    switch (action) {
+        case FILTER_REJECT: __atomic_add_fetch(&e->filter_rejected, 1, __ATOMIC_RELAXED); break;
+        case FILTER_MASK: __atomic_add_fetch(&e->filter_masked, 1, __ATOMIC_RELAXED); break;
+        case FILTER_FLAG:
+            __atomic_add_fetch(&e->filter_flagged, 1, __ATOMIC_RELAXED);
+            log_info("Flagged message from %s (phrase '%s')", username, phrase);
+            break;
+        case FILTER_NONE: break;
+    }
+    content_filter_release(f);
+    return action;
+}
+
+// Token bucket: writer_burst messages at once, refilled at writer_rate per
+// second. Called on the client's own service thread.
+static int take_token(struct chat_engine *e, struct client *c) {
+    const struct chat_limits *l = limits(e);
+    if (l->writer_rate <= 0) return 1;
+    double now = now_seconds();
+    c->tokens += (now - c->tokens_at) * l->writer_rate;
+    if (c->tokens > l->writer_burst) c->tokens = l->writer_burst;
+    c->tokens_at = now;
+    if (c->tokens < 1.0) {
+        __atomic_add_fetch(&e->rate_limited, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    c->tokens -= 1.0;
+    c->throttled = 0;
+    return 1;
+}
+
+// FNV-1a over "username\0message"
+static uint64_t message_hash(const char *username, const char *msg, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const char *p = username; ; p++) {
+        h = (h ^ (unsigned char)*p) * 0x100000001b3ULL;
+        if (!*p) break;
+    }
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)msg[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+// Returns 1 if the same user sent the same text within the window; otherwise
+// records it and returns 0.
+static int is_duplicate(struct chat_engine *e, const char *username, const char *msg, size_t len) {
+    int seconds = limits(e)->dedup_seconds;
+    if (!e->dedup || seconds <= 0) return 0;
+    uint64_t h = message_hash(username, msg, len);
+    double now = now_seconds();
+    int dup = 0;
+    pthread_mutex_lock(&e->dedup_mutex);
+    for (int i = 0; i < e->cfg.dedup_window; i++) {
+        const struct dedup_entry *d = &e->dedup[i];
+        if (d->hash == h && d->at > 0 && now - d->at < seconds) {
+            dup = 1;
+            break;
+        }
+    }
+    if (!dup) {
+        e->dedup[e->dedup_next].hash = h;
+        e->dedup[e->dedup_next].at = now;
+        e->dedup_next = (e->dedup_next + 1) % e->cfg.dedup_window;
+    }
+    pthread_mutex_unlock(&e->dedup_mutex);
+    if (dup) __atomic_add_fetch(&e->dup_suppressed, 1, __ATOMIC_RELAXED);
+    return dup;
+}
+
+static int reload_filter(struct chat_engine *e) {
+    struct content_filter *f = content_filter_load(e->cfg.filter_path);
+    if (!f) return -1; // keep serving with the previous phrase list
+    pthread_mutex_lock(&e->filter_mutex);
+    struct content_filter *old = e->filter;
+    e->filter = f;
+    e->filter_generation++;
+    pthread_mutex_unlock(&e->filter_mutex);
+    content_filter_release(old);
+    return 0;
+}
+
+// Fields of struct chat_limits settable by name, with their valid ranges.
+struct limit_field {
+    const char *name;
+    size_t offset;
+    int is_double;
+    double min, max;
+};
+
+static const struct limit_field limit_fields[] = {
+    { "history_limit", offsetof(struct chat_limits, history_limit), 0, 1, 100000 },
+    { "shed_history_limit", offsetof(struct chat_limits, shed_history_limit), 0, 1, 100000 },
+    { "max_msg_chars", offsetof(struct chat_limits, max_msg_chars), 0, 1, MAX_MSG_LEN - MAX_NAME_LEN - 2 },
+    { "max_name_chars", offsetof(struct chat_limits, max_name_chars), 0, 1, MAX_NAME_LEN - 1 },
+    { "max_queued_frames", offsetof(struct chat_limits, max_queued_frames), 0, 1, 1000000 },
+    { "slow_reader_depth", offsetof(struct chat_limits, slow_reader_depth), 0, 1, 1000000 },
+    { "writer_rate", offsetof(struct chat_limits, writer_rate), 1, 0, 1000000 },
+    { "writer_burst", offsetof(struct chat_limits, writer_burst), 0, 0, 1000000 },
+    { "dedup_seconds", offsetof(struct chat_limits, dedup_seconds), 0, 0, 86400 },
+    { "persist_batch_ms", offsetof(struct chat_limits, persist_batch_ms), 0, 0, 10000 },
+};
+#define LIMIT_FIELDS (sizeof(limit_fields) / sizeof(limit_fields[0]))
+
+static const struct limit_field *find_limit(const char *name) {
+    for (size_t i = 0; i < LIMIT_FIELDS; i++) {
+        if (strcmp(limit_fields[i].name, name) == 0) return &limit_fields[i];
+    }
+    return NULL;
+}
+
+static double limit_value(const struct chat_limits *l, const struct limit_field *f) {
+    const char *p = (const char *)l + f->offset;
+    return f->is_double ? *(const double *)p : *(const int *)p;
+}
+
+static size_t format_limit(const struct chat_limits *l, const struct limit_field *f,
+                           char *buf, size_t len) {
+    int n = snprintf(buf, len, "%s %g\n", f->name, limit_value(l, f));
+    return n < 0 ? 0 : (size_t)n < len ? (size_t)n : len ? len - 1 : 0;
+}
+
+// The limits an engine starts with before --config is applied: the compiled-in
+// defaults and the rate settings from cfg.
+static struct limits_node *default_limits(const struct chat_engine_config *cfg) {
+    struct limits_node *n = calloc(1, sizeof(*n));
+    if (!n) return NULL;
+    n->l = (struct chat_limits){
+        .history_limit = HISTORY_LIMIT,
+        .shed_history_limit = SHED_HISTORY_LIMIT,
+        .max_msg_chars = MAX_MSG_CHARS,
+        .max_name_chars = MAX_NAME_CHARS,
+        .max_queued_frames = MAX_QUEUED_FRAMES,
+        .slow_reader_depth = SHED_DROP_DEPTH,
+        .writer_rate = cfg->writer_rate,
+        .writer_burst = cfg->writer_burst,
+        .dedup_seconds = cfg->dedup_seconds,
+    };
+    return n;
+}
+
+static int validate_limits(const struct chat_limits *l, char *err, size_t errlen) {
+    for (size_t i = 0; i < LIMIT_FIELDS; i++) {
+        const struct limit_field *f = &limit_fields[i];
+        double v = limit_value(l, f);
+        if (!(v >= f->min && v <= f->max)) {
+            snprintf(err, errlen, "%s must be %g..%g", f->name, f->min, f->max);
+            return -1;
+        }
+    }
+    if (l->writer_rate > 0 && l->writer_burst < 1) {
+        snprintf(err, errlen, "writer_burst must be at least 1 when writer_rate is set");
+        return -1;
+    }
+    return 0;
+}
+
+// Applies "key value" pairs ('=' between them is optional), one or more per
+// line, '#' starting a comment. Each value is range-checked as it is read;
+// validate_limits() checks the set as a whole.
+static int apply_settings(struct chat_limits *l, char *text, const char *origin,
+                          char *err, size_t errlen) {
+    int lineno = 0;
+    for (char *line = text, *next; line; line = next) {
+        next = strchr(line, '\n');
+        if (next) *next++ = '\0';
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        for (char *p = line; *p; p++) {
+            if (*p == '=') *p = ' ';
+        }
+        char *save, *key;
+        for (key = strtok_r(line, " \t\r", &save); key; key = strtok_r(NULL, " \t\r", &save)) {
+            char *value = strtok_r(NULL, " \t\r", &save), *end;
+            const struct limit_field *f = find_limit(key);
+            if (!f) {
+                snprintf(err, errlen, "%s:%d: unknown setting '%s'", origin, lineno, key);
+                return -1;
+            }
+            double v = value ? strtod(value, &end) : 0;
+            if (!value || end == value || *end) {
+                snprintf(err, errlen, "%s:%d: %s needs a%s number", origin, lineno, key,
+                         f->is_double ? "" : " whole");
+                return -1;
+            }
+            // Before any int conversion, which is undefined out of range
+            if (!(v >= f->min && v <= f->max)) {
+                snprintf(err, errlen, "%s:%d: %s must be %g..%g", origin, lineno, key, f->min, f->max);
+                return -1;
+            }
+            if (!f->is_double && v != (double)(int)v) {
+                snprintf(err, errlen, "%s:%d: %s needs a whole number", origin, lineno, key);
+                return -1;
+            }
+            char *dst = (char *)l + f->offset;
+            if (f->is_double) *(double *)dst = v;
+            else *(int *)dst = (int)v;
+        }
+    }
+    return 0;
+}
+
+// Whole config file as text, NULL with the reason in err. Caller frees.
+static char *read_config(const char *path, char *err, size_t errlen) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        snprintf(err, errlen, "Cannot open config '%s': %s", path, strerror(errno));
+        return NULL;
+    }
+    char *text = malloc(CONFIG_FILE_MAX + 1);
+    size_t n = text ? fread(text, 1, CONFIG_FILE_MAX + 1, f) : 0;
+    fclose(f);
+    if (!text || n > CONFIG_FILE_MAX) {
+        snprintf(err, errlen, "Config '%s' is larger than %d bytes", path, CONFIG_FILE_MAX);
+        free(text);
+        return NULL;
+    }
+    text[n] = '\0';
+    return text;
+}
+
+// Caller holds limits_mutex. Queues l for the service loop, replacing a set
+// it has not taken yet. Returns the generation to wait for, 0 when out of
+// memory.
+static unsigned long post_limits_locked(struct chat_engine *e, const struct chat_limits *l) {
+    struct limits_node *n = calloc(1, sizeof(*n));
+    if (!n) return 0;
+    n->l = *l;
+    n->gen = ++e->limits_posted;
+    free(e->limits_pending);
+    e->limits_pending = n;
+    return n->gen;
+}
+
+// Wakes the service loop and waits for it to apply generation gen. Returns 0
+// once it has, 1 on timeout.
+static int wait_limits(struct chat_engine *e, unsigned long gen) {
+    lws_cancel_service(e->context);
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += LIMITS_APPLY_TIMEOUT_S;
+    pthread_mutex_lock(&e->limits_mutex);
+    while (e->limits_applied < gen &&
+           pthread_cond_timedwait(&e->limits_cond, &e->limits_mutex, &until) != ETIMEDOUT) {}
+    int applied = e->limits_applied >= gen;
+    pthread_mutex_unlock(&e->limits_mutex);
+    return applied ? 0 : 1;
+}
+
+// Applies settings text on top of the newest limits. Returns -1 with the
+// reason in err when anything in it is invalid, else as wait_limits().
+static int update_limits(struct chat_engine *e, char *text, const char *origin,
+                         char *err, size_t errlen) {
+    pthread_mutex_lock(&e->limits_mutex);
+    struct chat_limits l = e->limits_pending ? e->limits_pending->l : e->limits->l;
+    unsigned long gen = 0;
+    if (apply_settings(&l, text, origin, err, errlen) == 0 &&
+        validate_limits(&l, err, errlen) == 0 && !(gen = post_limits_locked(e, &l)))
+        snprintf(err, errlen, "out of memory");
+    pthread_mutex_unlock(&e->limits_mutex);
+    return gen ? wait_limits(e, gen) : -1;
+}
+
+// Service thread 0, on LWS_CALLBACK_EVENT_WAIT_CANCELLED. Also frees the sets
+// replaced more than LIMITS_GRACE_S ago; no reader holds one that long.
+static void apply_pending_limits(struct chat_engine *e) {
+    double now = now_seconds();
+    struct limits_node *expired = NULL;
+    pthread_mutex_lock(&e->limits_mutex);
+    struct limits_node *n = e->limits_pending;
+    if (n) {
+        struct limits_node *old = e->limits;
+        e->limits_pending = NULL;
+        __atomic_store_n(&e->limits, n, __ATOMIC_RELEASE);
+        old->retired_at = now;
+        old->next = e->limits_retired;
+        e->limits_retired = old;
+        e->limits_applied = n->gen;
+        pthread_cond_broadcast(&e->limits_cond);
+    }
+    for (struct limits_node **p = &e->limits_retired; *p; p = &(*p)->next) {
+        if (now - (*p)->retired_at >= LIMITS_GRACE_S) {
+            expired = *p; // and everything after it, which is older
+            *p = NULL;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&e->limits_mutex);
+    while (expired) {
+        struct limits_node *next = expired->next;
+        free(expired);
+        expired = next;
+    }
+    if (n) log_info("Limits generation %lu applied", n->gen);
+}
+
+// Keys the file leaves out keep their running values, including ones changed
+// over the admin socket.
+static void reload_config(struct chat_engine *e) {
+    char err[256];
+    char *text = read_config(e->cfg.config_path, err, sizeof(err));
+    if (!text || update_limits(e, text, e->cfg.config_path, err, sizeof(err)) < 0)
+        log_error("%s; keeping the current limits", err);
+    else
+        log_info("Config reloaded from %s", e->cfg.config_path);
+    free(text);
+}
+
+static void *reload_main(void *arg) {
+    struct chat_engine *e = arg;
+    placement_apply("reload", NULL);
+    for (;;) {
+        while (sem_wait(&e->reload_sem) != 0 && errno == EINTR) {}
+        if (__atomic_load_n(&e->reload_stop, __ATOMIC_ACQUIRE)) break;
+        if (e->cfg.filter_path && reload_filter(e) == 0)
+            log_info("Content filter reloaded from %s", e->cfg.filter_path);
+        if (e->cfg.config_path) reload_config(e);
+    }
+    placement_forget();
+    return NULL;
+}
+
+static int start_reload_thread(struct chat_engine *e) {
+    if (sem_init(&e->reload_sem, 0, 0) != 0) return -1;
+    if (pthread_create(&e->reload_tid, NULL, reload_main, e) != 0) {
+        sem_destroy(&e->reload_sem);
+        fprintf(stderr, "Failed to start the reload thread\n");
+        return -1;
+    }
+    e->reload_running = 1;
+    return 0;
+}
+
+static void stop_reload_thread(struct chat_engine *e) {
+    if (!e->reload_running) return;
+    __atomic_store_n(&e->reload_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&e->reload_sem);
+    pthread_join(e->reload_tid, NULL);
+    sem_destroy(&e->reload_sem);
+    e->reload_running = 0;
+}
+
+#if defined(LWS_WITH_TLS) && !defined(LWS_WITH_MBEDTLS)
+static int load_ticket_key(SSL_CTX *ctx, const char *path) {
+    // OpenSSL >= 1.1.0 wants name(16) + hmac(32) + aes(32), older releases 48 bytes
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+    unsigned char key[80];
+#else
+    unsigned char key[48];
+#endif
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open TLS ticket key '%s': %s\n", path, strerror(errno));
+        return -1;
+    }
+    size_t n = fread(key, 1, sizeof(key), f);
+    fclose(f);
+    int rc = 0;
+    if (n != sizeof(key)) {
+        fprintf(stderr, "TLS ticket key '%s' must hold %zu bytes (got %zu)\n", path, sizeof(key), n);
+        rc = -1;
+    } else if (SSL_CTX_set_tlsext_ticket_keys(ctx, key, sizeof(key)) != 1) {
+        fprintf(stderr, "Failed to install TLS ticket key\n");
+        rc = -1;
+    }
+    // Unlike memset(), not optimised away for a buffer about to go out of scope
+    OPENSSL_cleanse(key, sizeof(key));
+    return rc;
+}
+#endif
+
+static int configure_tls_ctx(const struct chat_tls_config *tls, void *ssl_ctx) {
+#if defined(LWS_WITH_TLS) && !defined(LWS_WITH_MBEDTLS)
+    SSL_CTX *ctx = ssl_ctx;
+    if (!ctx) return 0;
+    static const unsigned char sid_ctx[] = "oserveroserver";
+    SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    if (tls->session_cache_size > 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, tls->session_cache_size);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    }
+    SSL_CTX_set_timeout(ctx, tls->session_timeout);
+    if (tls->tickets) {
+        SSL_CTX_clear_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        SSL_CTX_set_num_tickets(ctx, 2);
+#endif
+        if (tls->ticket_key_path && load_ticket_key(ctx, tls->ticket_key_path) != 0)
+            return -1;
+    } else {
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+    }
+    if (tls->ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        // OpenSSL switches the socket to kTLS after the handshake when the kernel
+        // and negotiated cipher allow it, and silently stays in userspace otherwise.
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#else
+        fprintf(stderr, "Warning: kTLS requested but OpenSSL was built without it\n");
+#endif
+    }
+    printf("TLS: session cache %d, tickets %s, kTLS %s\n",
+           tls->session_cache_size, tls->tickets ? "on" : "off",
+           tls->ktls ? "requested" : "off");
+#else
+    (void)tls;
+    (void)ssl_ctx;
+#endif
+    return 0;
+}
+
+// Metrics as JSON. phrases adds the content filter's per-phrase hits.
+static size_t format_metrics(struct chat_engine *e, char *buf, size_t len, int phrases) {
+    int clients = 0, readers = 0, writers = 0;
+    size_t queued = 0;
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *c = e->clients_head; c; c = c->next) {
+        clients++;
+        queued += (size_t)c->out_count;
+        if (strcasecmp(c->role, "WRITER") == 0) writers++;
+        else if (strcasecmp(c->role, "READER") == 0) readers++;
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+    int n = snprintf(buf, len,
+                     "{\"clients\":%d,\"readers\":%d,\"writers\":%d,\"queued_frames\":%zu,"
+                     "\"service_threads\":%d,\"persist_thread\":%s,\"threads\":",
+                     clients, readers, writers, queued, e->cfg.service_threads,
+                     e->persist_running ? "true" : "false");
+    size_t off = n > 0 && (size_t)n < len ? (size_t)n : 0;
+    off += placement_format_json(buf + off, len - off);
+    int m = off < len ? snprintf(buf + off, len - off, ",\"frame_pool\":") : 0;
+    if (m > 0 && off + (size_t)m < len) {
+        off += (size_t)m;
+        off += frame_pool_format_json(buf + off, len - off);
+    }
+    long lag_us = 0, max_lag_us = 0;
+    for (int i = 0; i < e->cfg.service_threads; i++) {
+        long l = __atomic_load_n(&e->probes[i].lag_us, __ATOMIC_RELAXED);
+        long ml = __atomic_load_n(&e->probes[i].max_lag_us, __ATOMIC_RELAXED);
+        if (l > lag_us) lag_us = l;
+        if (ml > max_lag_us) max_lag_us = ml;
+    }
+    m = off < len ? snprintf(buf + off, len - off,
+                             ",\"load\":{\"level\":\"%s\",\"lag_ms\":%.1f,\"max_lag_ms\":%.1f,"
+                             "\"deferred_history\":%lu,\"shrunk_joins\":%lu,\"refused_upgrades\":%lu,"
+                             "\"dropped_readers\":%lu}",
+                             load_level_names[load_level(e)], lag_us / 1000.0, max_lag_us / 1000.0,
+                             __atomic_load_n(&e->deferred_history, __ATOMIC_RELAXED),
+                             __atomic_load_n(&e->shrunk_joins, __ATOMIC_RELAXED),
+                             __atomic_load_n(&e->refused_upgrades, __ATOMIC_RELAXED),
+                             __atomic_load_n(&e->dropped_readers, __ATOMIC_RELAXED)) : 0;
+    if (m > 0 && off + (size_t)m < len) off += (size_t)m;
+    m = off < len ? snprintf(buf + off, len - off, ",\"writev\":{\"frames\":%lu,\"partial\":%lu}",
+                             __atomic_load_n(&e->raw_frames, __ATOMIC_RELAXED),
+                             __atomic_load_n(&e->raw_partial, __ATOMIC_RELAXED)) : 0;
+    if (m > 0 && off + (size_t)m < len) off += (size_t)m;
+    m = off < len ? snprintf(buf + off, len - off,
+                             ",\"suppressed\":{\"duplicates\":%lu,\"rate_limited\":%lu}",
+                             __atomic_load_n(&e->dup_suppressed, __ATOMIC_RELAXED),
+                             __atomic_load_n(&e->rate_limited, __ATOMIC_RELAXED)) : 0;
+    if (m > 0 && off + (size_t)m < len) off += (size_t)m;
+    struct content_filter *f = current_filter(e);
+    if (f && off < len) {
+        pthread_mutex_lock(&e->filter_mutex);
+        unsigned long generation = e->filter_generation;
+        pthread_mutex_unlock(&e->filter_mutex);
+        m = off < len ? snprintf(buf + off, len - off,
+                                 ",\"filter\":{\"generation\":%lu,\"rejected\":%lu,\"masked\":%lu,"
+                                 "\"flagged\":%lu,\"automaton\":",
+                                 generation,
+                                 __atomic_load_n(&e->filter_rejected, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&e->filter_masked, __ATOMIC_RELAXED),
+                                 __atomic_load_n(&e->filter_flagged, __ATOMIC_RELAXED)) : 0;
+        if (m > 0 && off + (size_t)m < len) {
+            off += (size_t)m;
+            off += content_filter_format_json(f, buf + off, len - off, phrases);
+            if (off + 1 < len) buf[off++] = '}';
+        }
+        content_filter_release(f);
+    }
+    if (e->recorder && off + 12 < len) {
+        memcpy(buf + off, ",\"record\":", 10);
+        off += 10;
+        off += traffic_recorder_format_json(e->recorder, buf + off, len - off);
+    }
+    if (e->history_cache && off + 19 < len) {
+        memcpy(buf + off, ",\"history_cache\":", 17);
+        off += 17;
+        off += history_cache_format_json(e->history_cache, buf + off, len - off);
+    }
+    if (e->history_store && off + 19 < len) {
+        memcpy(buf + off, ",\"history_store\":", 17);
+        off += 17;
+        off += history_store_format_json(e->history_store, buf + off, len - off);
+    }
+    if (e->standby && off + 13 < len) {
+        memcpy(buf + off, ",\"standby\":", 11);
+        off += 11;
+        off += repl_client_format_json(e->standby, buf + off, len - off);
+    }
+    pthread_rwlock_rdlock(&e->history_lock);
+    if (e->repl && off + 17 < len) {
+        memcpy(buf + off, ",\"replication\":", 15);
+        off += 15;
+        off += repl_server_format_json(e->repl, buf + off, len - off);
+    }
+    if (e->history_log && off + 17 < len) {
+        memcpy(buf + off, ",\"history_log\":", 15);
+        off += 15;
+        off += history_log_format_json(e->history_log, buf + off, len - off);
+    }
+    pthread_rwlock_unlock(&e->history_lock);
+    if (e->nparts) {
+        pthread_rwlock_rdlock(&e->history_lock);
+        m = off < len ? snprintf(buf + off, len - off,
+                                 ",\"partitions\":{\"files\":%d,\"hot_rows\":%ld,\"dropped\":%lu,"
+                                 "\"cold_attaches\":%lu}",
+                                 e->nparts, e->hot_rows, e->parts_dropped, e->cold_attaches) : 0;
+        pthread_rwlock_unlock(&e->history_lock);
+        if (m > 0 && off + (size_t)m < len) off += (size_t)m;
+    }
+    if (e->sequencer) {
+        struct sequencer_stats st;
+        sequencer_get_stats(e->sequencer, &st);
+        m = off < len ? snprintf(buf + off, len - off,
+                                 ",\"sequencer\":{\"submitted\":%llu,\"applied\":%llu,"
+                                 "\"handed_off\":%lu,\"full_waits\":%lu}",
+                                 (unsigned long long)st.submitted, (unsigned long long)st.applied,
+                                 st.handed_off, st.full_waits) : 0;
+        if (m > 0 && off + (size_t)m < len) off += (size_t)m;
+    }
+    unsigned long log_dropped, log_suppressed;
+    log_counters(&log_dropped, &log_suppressed);
+    m = off < len ? snprintf(buf + off, len - off, ",\"log\":{\"dropped\":%lu,\"suppressed\":%lu}",
+                             log_dropped, log_suppressed) : 0;
+    if (m > 0 && off + (size_t)m < len) off += (size_t)m;
+    if (off + 2 < len) {
+        buf[off++] = '}';
+        buf[off] = '\0';
+    }
+    return off;
+}
+
+enum conn_sort { SORT_QUEUE, SORT_DEPTH, SORT_RTT, SORT_STALL };
+static const char *conn_sort_names[] = { "queue", "depth", "rtt", "stall" };
+
+struct conn_stat {
+    double key;
+    char peer[48];
+    char username[MAX_NAME_LEN];
+    char role[MAX_ROLE_LEN];
+    int tsi;
+    double age_s;
+    unsigned long frames_sent;
+    unsigned long long bytes_sent;
+    int depth;
+    int max_depth;
+    size_t queued_bytes;
+    double stall_s; // since the last write, while frames are queued
+    long rtt_us;
+    long rtt_avg_us;
+};
+
+static double conn_key(const struct conn_stat *s, enum conn_sort by) {
+    switch (by) {
+        case SORT_DEPTH: return s->depth;
+        case SORT_RTT: return (double)s->rtt_avg_us;
+        case SORT_STALL: return s->stall_s;
+        case SORT_QUEUE: break;
+    }
+    return (double)s->queued_bytes;
+}
+
+static void conn_sift_down(struct conn_stat *h, int n, int i) {
+    for (;;) {
+        int m = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && h[l].key < h[m].key) m = l;
+        if (r < n && h[r].key < h[m].key) m = r;
+        if (m == i) return;
+        struct conn_stat t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+static int cmp_conn_desc(const void *a, const void *b) {
+    double x = ((const struct conn_stat *)a)->key, y = ((const struct conn_stat *)b)->key;
+    return (x < y) - (x > y);
+}
+
+static size_t json_escape(char *buf, size_t len, const char *s) {
+    size_t off = 0;
+    for (; *s && off + 7 < len; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            buf[off++] = '\\';
+            buf[off++] = (char)c;
+        } else if (c < 0x20) {
+            off += (size_t)snprintf(buf + off, len - off, "\\u%04x", c);
+        } else {
+            buf[off++] = (char)c;
+        }
+    }
+    return off;
+}
+
+// The top worst connections by one key. The client list is walked once under
+// clients_mutex with a min-heap of top entries, so a large room holds the lock
+// for one pass and no sort; formatting happens after it is dropped.
+static size_t format_connections(struct chat_engine *e, char *buf, size_t len, int top,
+                                 enum conn_sort by) {
+    struct conn_stat heap[TOP_CONNECTIONS_MAX];
+    int n = 0, total = 0;
+    if (top < 1) top = 1;
+    if (top > TOP_CONNECTIONS_MAX) top = TOP_CONNECTIONS_MAX;
+    double now = now_seconds();
+    long long now_u = now_us();
+    pthread_mutex_lock(&e->clients_mutex);
+    for (struct client *c = e->clients_head; c; c = c->next) {
+        struct conn_stat s;
+        total++;
+        s.depth = c->out_count;
+        s.queued_bytes = c->queued_bytes;
+        long long last = __atomic_load_n(&c->last_write_us, __ATOMIC_RELAXED);
+        long long since = last ? now_u - last : (long long)((now - c->connected_at) * 1e6);
+        s.stall_s = c->out_count ? since / 1e6 : 0;
+        s.rtt_avg_us = __atomic_load_n(&c->rtt_avg_us, __ATOMIC_RELAXED);
+        s.key = conn_key(&s, by);
+        if (n == top && s.key <= heap[0].key) continue;
+        snprintf(s.peer, sizeof(s.peer), "%s", c->peer);
+        snprintf(s.username, sizeof(s.username), "%s", c->username);
+        snprintf(s.role, sizeof(s.role), "%s", c->role);
+        s.tsi = c->tsi;
+        s.age_s = now - c->connected_at;
+        s.frames_sent = __atomic_load_n(&c->frames_sent, __ATOMIC_RELAXED);
+        s.bytes_sent = __atomic_load_n(&c->bytes_sent, __ATOMIC_RELAXED);
+        s.max_depth = c->max_depth;
+        s.rtt_us = __atomic_load_n(&c->rtt_us, __ATOMIC_RELAXED);
+        if (n < top) {
+            heap[n++] = s;
+            if (n == top) {
+                for (int i = n / 2 - 1; i >= 0; i--) conn_sift_down(heap, n, i);
+            }
+        } else {
+            heap[0] = s;
+            conn_sift_down(heap, n, 0);
+        }
+    }
+    pthread_mutex_unlock(&e->clients_mutex);
+    qsort(heap, (size_t)n, sizeof(heap[0]), cmp_conn_desc);
+
+    size_t off = 0;
+#define APPEND(...) do { \
+        size_t at_ = off < len ? off : len; \
+        int w_ = snprintf(buf + at_, len - at_, __VA_ARGS__); \
+        if (w_ > 0) off += (size_t)w_; \
+    } while (0)
+    APPEND("{\"clients\":%d,\"by\":\"%s\",\"connections\":[", total, conn_sort_names[by]);
+    for (int i = 0; i < n; i++) {
+        const struct conn_stat *s = &heap[i];
+        APPEND("%s{\"peer\":\"%s\",\"username\":\"", i ? "," : "", s->peer);
+        if (off < len) off += json_escape(buf + off, len - off, s->username);
+        APPEND("\",\"role\":\"%s\",\"thread\":%d,\"age_s\":%.1f,\"frames_sent\":%lu,"
+               "\"bytes_sent\":%llu,\"queued_frames\":%d,\"queued_bytes\":%zu,\"max_queued_frames\":%d,"
+               "\"stall_s\":%.3f,",
+               s->role, s->tsi, s->age_s, s->frames_sent, s->bytes_sent, s->depth, s->queued_bytes,
+               s->max_depth, s->stall_s);
+        if (s->rtt_us < 0) APPEND("\"rtt_ms\":null,\"rtt_avg_ms\":null}");
+        else APPEND("\"rtt_ms\":%.3f,\"rtt_avg_ms\":%.3f}", s->rtt_us / 1000.0, s->rtt_avg_us / 1000.0);
+    }
+    APPEND("]}");
+#undef APPEND
+    if (len && off >= len) off = len - 1;
+    return off;
+}
+
+static const char admin_help[] =
+    "get [KEY]                 show limits\n"
+    "set KEY VALUE [KEY VALUE] change limits together, applied on the service loop\n"
+    "stats [phrases]           metrics as JSON, phrases adds per-phrase filter hits\n"
+    "connections [N] [BY]      worst N connections by queue, depth, rtt or stall\n"
+    "reload                    re-read the content filter and config file\n"
+    "quit                      close this connection\n";
+
+// One admin socket command. Replies end with "ok" or "error: ...".
+static size_t admin_command(void *arg, char *line, char *out, size_t len) {
+    struct chat_engine *e = arg;
+    char *save, *cmd = strtok_r(line, " \t", &save);
+    size_t off = 0, room = len - 64; // keeps space for the status line
+    char err[256] = "";
+    int rc = 0;
+    if (!cmd) return 0;
+    if (strcmp(cmd, "help") == 0) {
+        off = (size_t)snprintf(out, len, "%s", admin_help);
+    } else if (strcmp(cmd, "get") == 0) {
+        const char *key = strtok_r(NULL, " \t", &save);
+        struct chat_limits l;
+        chat_engine_get_limits(e, &l);
+        for (size_t i = 0; i < LIMIT_FIELDS; i++) {
+            if (!key || strcmp(key, limit_fields[i].name) == 0)
+                off += format_limit(&l, &limit_fields[i], out + off, room - off);
+        }
+        if (key && !find_limit(key)) {
+            snprintf(err, sizeof(err), "unknown setting '%s'", key);
+            rc = -1;
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        char *rest = save;
+        if (!rest || !*rest) {
+            snprintf(err, sizeof(err), "usage: set KEY VALUE [KEY VALUE ...]");
+            rc = -1;
+        } else if ((rc = update_limits(e, rest, "admin", err, sizeof(err))) == 1) {
+            off = (size_t)snprintf(out, len, "pending: the service loop has not applied it yet\n");
+            rc = 0;
+        }
+    } else if (strcmp(cmd, "stats") == 0) {
+        const char *arg = strtok_r(NULL, " \t", &save);
+        if (arg && strcmp(arg, "phrases") != 0) {
+            snprintf(err, sizeof(err), "usage: stats [phrases]");
+            rc = -1;
+        } else {
+            off = format_metrics(e, out, room, arg != NULL);
+            out[off++] = '\n';
+        }
+    } else if (strcmp(cmd, "connections") == 0) {
+        const char *n = strtok_r(NULL, " \t", &save), *by = strtok_r(NULL, " \t", &save);
+        enum conn_sort sort = SORT_QUEUE;
+        for (int i = 0; by && i <= SORT_STALL; i++) {
+            if (strcmp(by, conn_sort_names[i]) == 0) sort = (enum conn_sort)i;
+        }
+        off = format_connections(e, out, room, n ? atoi(n) : 10, sort);
+        out[off++] = '\n';
+    } else if (strcmp(cmd, "reload") == 0) {
+        if (e->reload_running) chat_engine_reload(e);
+        else {
+            snprintf(err, sizeof(err), "no content filter or config file to reload");
+            rc = -1;
+        }
+    } else {
+        snprintf(err, sizeof(err), "unknown command '%s' (try help)", cmd);
+        rc = -1;
+    }
+    int n = rc == 0 ? snprintf(out + off, len - off, "ok\n")
+                    : snprintf(out + off, len - off, "error: %s\n", err);
+    return off + (n > 0 ? (size_t)n : 0);
+}
+
+static void report_poll_fd(struct chat_engine *e, enum chat_poll_op op, void *in) {
+    const struct lws_pollargs *pa = in;
+    if (e->cfg.event_loop == CHAT_LOOP_EXTERNAL && e->cfg.poll_fd && pa)
+        e->cfg.poll_fd(e->cfg.poll_host, op, pa->fd, pa->events);
+}
+
+// Non-WebSocket events of the chat protocol. It is protocols[0], so lws sends
+// it plain HTTP requests, poll fd changes and vhost TLS setup too. Serving the
+// web client here lets the page and its WebSockets share one HTTP/2
+// connection; only the client page is exposed, never the working directory.
+static int http_callback(struct chat_engine *e, struct lws *wsi, enum lws_callback_reasons reason,
+                         void *user, void *in, size_t len) {
+    switch (reason) {
+        case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS: {
+            // user is the vhost's SSL_CTX
+            if (configure_tls_ctx(&e->cfg.tls, user) != 0) return 1;
+            return 0;
+        }
+        case LWS_CALLBACK_ADD_POLL_FD:
+            report_poll_fd(e, CHAT_POLL_ADD, in);
+            return 0;
+        case LWS_CALLBACK_DEL_POLL_FD:
+            report_poll_fd(e, CHAT_POLL_DEL, in);
+            return 0;
+        case LWS_CALLBACK_CHANGE_MODE_POLL_FD:
+            report_poll_fd(e, CHAT_POLL_CHANGE, in);
+            return 0;
+        case LWS_CALLBACK_HTTP_CONFIRM_UPGRADE:
+            if (load_level(e) >= LOAD_REFUSE_UPGRADES) return refuse_upgrade(e, wsi);
+            return 0;
+        case LWS_CALLBACK_HTTP: {
+            const char *uri = in;
+            if (!e->cfg.index_path || (strcmp(uri, "/") != 0 && strcmp(uri, "/index.html") != 0)) {
+                if (lws_return_http_status(wsi, HTTP_STATUS_NOT_FOUND, NULL)) return -1;
+                return lws_http_transaction_completed(wsi) ? -1 : 0;
+            }
+            int n = lws_serve_http_file(wsi, e->cfg.index_path, "text/html", NULL, 0);
+            if (n < 0 || (n > 0 && lws_http_transaction_completed(wsi))) return -1;
+            return 0;
+        }
+        default:
+            return lws_callback_http_dummy(wsi, reason, user, in, len);
+    }
+}
+
+static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason,
+                       void *user, void *in, size_t len) {
+    struct chat_engine *e = engine_from_wsi(wsi);
+    struct session *pss = user;
+    if (!e) return lws_callback_http_dummy(wsi, reason, user, in, len);
+    switch (reason) {
+        case LWS_CALLBACK_ESTABLISHED: {
+            pss->client = add_client(e, wsi);
+            if (!pss->client) return -1;
+            if (e->recorder) {
+                pss->record_conn = traffic_recorder_next_conn(e->recorder);
+                traffic_record(e->recorder, TRAFFIC_OPEN, pss->record_conn, NULL, 0);
+            }
+            break;
+        }
+        case LWS_CALLBACK_SERVER_WRITEABLE: {
+            if (pss->client && write_pending(e, pss->client) != 0) return -1;
+            break;
+        }
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+            int tsi = lws_get_tsi(wsi);
+            if (tsi == 0) {
+                apply_pending_limits(e);
+                if (__atomic_load_n(&e->takeover_pending, __ATOMIC_ACQUIRE)) take_over(e);
+            }
+            if (e->cfg.service_threads > 1) wake_clients(e, tsi);
+            break;
+        }
+        case LWS_CALLBACK_RECEIVE_PONG: {
+            if (pss->client) handle_pong(pss->client, in, len);
+            break;
+        }
+        case LWS_CALLBACK_RECEIVE: {
+            struct client *c = pss->client;
+            if (!c) break;
+            if (pss->record_conn) traffic_record(e->recorder, TRAFFIC_FRAME, pss->record_conn, in, len);
+            char *msg = malloc(len + 1);
+            if (!msg) break;
+            memcpy(msg, in, len);
+            msg[len] = '\0';
+            // Strips newlines and other controls that would break the
+            // '\n'-joined history, and repairs invalid UTF-8. The byte bound
+            // keeps "username: message" within MAX_MSG_LEN.
+            len = sanitize_text(msg, len, (size_t)limits(e)->max_msg_chars, MAX_MSG_LEN - MAX_NAME_LEN - 2);
+            if (len == 0) {
+                free(msg);
+                break;
+            }
+
+            if (strncmp(msg, "username:", 9) == 0) {
+                char *uname = msg + 9;
+                while (*uname == ' ') uname++;
+                size_t n = sanitize_text(uname, strlen(uname), (size_t)limits(e)->max_name_chars,
+                                         MAX_NAME_LEN - 1);
+                if (n > 0) snprintf(c->username, MAX_NAME_LEN, "%s", uname);
+            } else if (strncmp(msg, "role:", 5) == 0) {
+                char *r = msg + 5;
+                while (*r == ' ' || *r == '\t') r++;
+                if (strcasecmp(r, "WRITER") == 0) {
+                    if (can_admit_as_writer(e)) {
+                        snprintf(c->role, MAX_ROLE_LEN, "WRITER");
+                        // Send history BEFORE confirming role
+                        send_join_history(e, c);
+                        // Confirm role, with a stamp to resume from with history_since
+                        char confirm[64];
+                        snprintf(confirm, sizeof(confirm), "ROLE_CONFIRMED:writer:%lld", stamp_ts(e));
+                        send_to_client(e, c, confirm);
+                        char sysmsg[200];
+                        snprintf(sysmsg, sizeof(sysmsg), "System: %s joined as Writer", c->username);
+                        broadcast_text(e, sysmsg);
+                    } else {
+                        send_to_client(e, c, e->cfg.max_writers > 1
+                                       ? "ROLE_DENIED:The room has all the writers it allows."
+                                       : "ROLE_DENIED:A writer or readers are already inside.");
+                    }
+                } else {
+                    if (can_admit_as_reader(e)) {
+                        snprintf(c->role, MAX_ROLE_LEN, "READER");
+                        send_join_history(e, c);
+                        char confirm[64];
+                        snprintf(confirm, sizeof(confirm), "ROLE_CONFIRMED:reader:%lld", stamp_ts(e));
+                        send_to_client(e, c, confirm);
+                        char sysmsg[200];
+                        snprintf(sysmsg, sizeof(sysmsg), "System: %s joined as Reader", c->username);
+                        broadcast_text(e, sysmsg);
+                    } else {
+                        send_to_client(e, c, "ROLE_DENIED:A writer is already inside.");
+                    }
+                }
+                broadcast_counts(e);
+            } else if (strncmp(msg, "history_since:", 14) == 0) {
+                c->history_since_ms = atoll(msg + 14);
+            } else if (strncmp(msg, "get_history_range:", 18) == 0) {
+                long long from = 0, to = 0;
+                int n = 0, cap = limits(e)->history_limit;
+                sscanf(msg + 18, "%lld:%lld:%d", &from, &to, &n);
+                if (load_level(e) >= LOAD_DEFER_HISTORY)
+                    send_to_client(e, c, "System: The server is busy; ask for that history again shortly.");
+                else
+                    send_history_range(e, c, from, to, n > 0 && n < cap ? n : cap);
+            } else if (strncmp(msg, "get_history", 11) == 0) {
+                if (load_level(e) >= LOAD_DEFER_HISTORY) {
+                    pthread_mutex_lock(&e->clients_mutex);
+                    c->history_deferred = 1;
+                    pthread_mutex_unlock(&e->clients_mutex);
+                    __atomic_add_fetch(&e->deferred_history, 1, __ATOMIC_RELAXED);
+                    send_to_client(e, c, "System: The server is busy; history will follow shortly.");
+                } else {
+                    send_history(e, c, 1, limits(e)->history_limit);
+                }
+            } else {
+                if (strcasecmp(c->role, "WRITER") != 0) {
+                    char err[200];
+                    snprintf(err, sizeof(err), "System: You are a READER — you cannot send messages.");
+                    send_to_client(e, c, err);
+                } else if (!take_token(e, c)) {
+                    // One notice per burst, so a flood cannot fill its own queue
+                    if (!c->throttled) {
+                        c->throttled = 1;
+                        send_to_client(e, c, "System: You are sending messages too fast.");
+                    }
+                } else if (filter_message(e, c->username, msg, len) == FILTER_REJECT) {
+                    send_to_client(e, c, "System: Your message was blocked by the content filter.");
+                } else if (is_duplicate(e, c->username, msg, len)) {
+                    send_to_client(e, c, "System: You already sent that message.");
+                } else {
+                    submit_message(e, c->username, msg);
+                }
+            }
+            free(msg);
+            break;
+        }
+        case LWS_CALLBACK_CLOSED: {
+            struct client *c = pss->client;
+            pss->client = NULL;
+            if (pss->record_conn) traffic_record(e->recorder, TRAFFIC_CLOSE, pss->record_conn, NULL, 0);
+            if (c && strcasecmp(c->role, "WRITER") == 0) {
+                char sysmsg[200];
+                snprintf(sysmsg, sizeof(sysmsg), "System: %s disconnected.", c->username);
+                remove_client(e, wsi);
+                broadcast_text(e, sysmsg);
+                broadcast_counts(e);
+            } else {
+                remove_client(e, wsi);
+                broadcast_counts(e);
+            }
+            break;
+        }
+        default:
+            return http_callback(e, wsi, reason, user, in, len);
+    }
+    return 0;
+}
+
+// Same protocols as the TCP vhost, so UNIX clients join the same room.
+static struct lws_vhost *create_unix_vhost(struct chat_engine *e) {
+    const char *path = e->cfg.unix_path;
+    struct stat sb;
+    if (path[0] != '@' && lstat(path, &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode)) {
+            fprintf(stderr, "Refusing to replace non-socket '%s'\n", path);
+            return NULL;
+        }
+        unlink(path); // stale socket from a previous run
+    }
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.vhost_name = "unix";
+    info.options = LWS_SERVER_OPTION_UNIX_SOCK;
+    info.iface = path;
+    info.port = CHAT_DEFAULT_PORT; // ignored for UNIX sockets, but must not be CONTEXT_PORT_NO_LISTEN
+    info.unix_socket_perms = e->cfg.unix_owner;
+    info.protocols = e->protocols;
+    struct lws_vhost *vh = lws_create_vhost(e->context, &info);
+    if (!vh) {
+        fprintf(stderr, "Failed to listen on UNIX socket '%s'\n", path);
+        return NULL;
+    }
+    if (path[0] != '@' && e->cfg.unix_mode >= 0 && chmod(path, (mode_t)e->cfg.unix_mode) != 0) {
+        fprintf(stderr, "Warning: chmod %o '%s': %s\n", e->cfg.unix_mode, path, strerror(errno));
+    }
+    return vh;
+}
+
+static struct lws_vhost *create_tcp_vhost(struct chat_engine *e) {
+    const struct chat_tls_config *tls = &e->cfg.tls;
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.port = e->cfg.port;
+    info.protocols = e->protocols;
+    if (tls->cert_path) {
+        info.ssl_cert_filepath = tls->cert_path;
+        info.ssl_private_key_filepath = tls->key_path;
+        info.ssl_cipher_list = tls->cipher_list;
+        info.tls1_3_plus_cipher_list = tls->tls13_ciphers;
+        // With h2 negotiated, browsers open WebSockets as extended CONNECT
+        // streams (RFC 8441) on the page's existing connection.
+        info.alpn = tls->h2 ? "h2,http/1.1" : "http/1.1";
+    }
+    struct lws_vhost *vh = lws_create_vhost(e->context, &info);
+    if (!vh) fprintf(stderr, "Failed to listen on :%d\n", e->cfg.port);
+    return vh;
+}
+
+// A standby's context has this vhost only, so the lws_cancel_service() from
+// primary_lost() still reaches ws_callback().
+static struct lws_vhost *create_standby_vhost(struct chat_engine *e) {
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.vhost_name = "standby";
+    info.port = CONTEXT_PORT_NO_LISTEN;
+    info.protocols = e->protocols;
+    struct lws_vhost *vh = lws_create_vhost(e->context, &info);
+    if (!vh) fprintf(stderr, "Failed to create the standby vhost\n");
+    return vh;
+}
+
+static void takeover_retry(lws_sorted_usec_list_t *sul) {
+    struct chat_engine *e = lws_container_of(sul, struct chat_engine, takeover_sul);
+    __atomic_store_n(&e->takeover_pending, 1, __ATOMIC_RELEASE);
+    take_over(e);
+}
+
+// The primary is gone: open the listeners and start serving standbys of our
+// own. Service thread 0. A port still held, by a primary that has closed its
+// replication socket but not yet exited, is retried for TAKEOVER_RETRIES
+// intervals before the standby gives up rather than run beside it.
+static void take_over(struct chat_engine *e) {
+    if (!__atomic_exchange_n(&e->takeover_pending, 0, __ATOMIC_ACQ_REL)) return;
+    if ((e->cfg.port && !e->tcp_vhost && !(e->tcp_vhost = create_tcp_vhost(e))) ||
+        (e->cfg.unix_path && !e->unix_vhost && !(e->unix_vhost = create_unix_vhost(e)))) {
+        if (++e->takeover_attempts < TAKEOVER_RETRIES) {
+            lws_sul_schedule(e->context, 0, &e->takeover_sul, takeover_retry,
+                             TAKEOVER_RETRY_MS * LWS_US_PER_MS);
+        } else {
+            log_error("Listeners still taken after %d ms; not taking over from %s",
+                      TAKEOVER_RETRIES * TAKEOVER_RETRY_MS, e->cfg.standby_of);
+        }
+        return;
+    }
+    if (e->cfg.replication_path) {
+        struct repl_server *rs = repl_server_start(e->cfg.replication_path, repl_catch_up, e);
+        if (!rs) log_error("Cannot serve standbys on %s", e->cfg.replication_path);
+        pthread_rwlock_wrlock(&e->history_lock);
+        e->repl = rs;
+        pthread_rwlock_unlock(&e->history_lock);
+    }
+    log_warn("Took over from the primary at %s in %.1f ms", e->cfg.standby_of,
+             (double)(now_us() - e->primary_lost_us) / 1000.0);
+}
+
+void chat_engine_config_init(struct chat_engine_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->db_path = CHAT_DEFAULT_DB;
+    cfg->port = CHAT_DEFAULT_PORT;
+    cfg->index_path = "index.html";
+    cfg->tls.session_cache_size = 20480;
+    cfg->tls.session_timeout = 7200;
+    cfg->tls.tickets = 1;
+    cfg->tls.h2 = 1;
+    cfg->unix_mode = -1;
+    cfg->service_threads = 1;
+    cfg->writer_burst = 10;
+    cfg->dedup_seconds = 30;
+    cfg->load_shedding = 1;
+    cfg->admin_mode = 0600;
+    cfg->max_writers = 1;
+    cfg->event_loop = CHAT_LOOP_POLL;
+}
+
+struct chat_engine *chat_engine_create(const struct chat_engine_config *cfg) {
+    if (!cfg->tls.cert_path != !cfg->tls.key_path) {
+        fprintf(stderr, "TLS needs both a certificate and a key\n");
+        return NULL;
+    }
+    if (!cfg->port && !cfg->unix_path) {
+        fprintf(stderr, "No listener configured\n");
+        return NULL;
+    }
+    if (cfg->service_threads < 1 || cfg->service_threads > CHAT_MAX_SERVICE_THREADS ||
+        (cfg->service_threads > 1 && cfg->event_loop != CHAT_LOOP_POLL)) {
+        fprintf(stderr, "service_threads must be 1..%d, and 1 on foreign event loops\n",
+                CHAT_MAX_SERVICE_THREADS);
+        return NULL;
+    }
+    if (cfg->max_writers < 1) {
+        fprintf(stderr, "max_writers must be at least 1\n");
+        return NULL;
+    }
+    if (cfg->partition_rows < 0 || cfg->partition_keep < 0) {
+        fprintf(stderr, "partition_rows and partition_keep must not be negative\n");
+        return NULL;
+    }
+    if (cfg->keep_history && (cfg->partition_daily || cfg->partition_rows > 0)) {
+        fprintf(stderr, "keep_history does not work with partitions\n");
+        return NULL;
+    }
+    // Replication follows the messages table by id, which partitions restart
+    if ((cfg->replication_path || cfg->standby_of) && (cfg->partition_daily || cfg->partition_rows > 0)) {
+        fprintf(stderr, "Replication does not work with partitions\n");
+        return NULL;
+    }
+    if (cfg->history_log_path && (cfg->partition_daily || cfg->partition_rows > 0)) {
+        fprintf(stderr, "The history log does not work with partitions\n");
+        return NULL;
+    }
+    struct limits_node *limits = default_limits(cfg);
+    if (!limits) return NULL;
+    char err[256];
+    char *text = NULL;
+    if ((cfg->config_path && (!(text = read_config(cfg->config_path, err, sizeof(err))) ||
+                              apply_settings(&limits->l, text, cfg->config_path, err, sizeof(err)) != 0)) ||
+        validate_limits(&limits->l, err, sizeof(err)) != 0) {
+        fprintf(stderr, "%s\n", err);
+        free(text);
+        free(limits);
+        return NULL;
+    }
+    free(text);
+    struct chat_engine *e = calloc(1, sizeof(struct chat_engine));
+    if (!e) {
+        free(limits);
+        return NULL;
+    }
+    e->limits = limits;
+    pthread_mutex_init(&e->limits_mutex, NULL);
+    pthread_cond_init(&e->limits_cond, NULL);
+    e->cfg = *cfg;
+    frame_pool_set_hugepages((enum frame_pool_hugepages)cfg->hugepages);
+    pthread_mutex_init(&e->clients_mutex, NULL);
+    pthread_rwlock_init(&e->history_lock, NULL);
+    pthread_mutex_init(&e->filter_mutex, NULL);
+    pthread_mutex_init(&e->dedup_mutex, NULL);
+    pthread_mutex_init(&e->load_mutex, NULL);
+    e->protocols[0].name = "chat-protocol";
+    e->protocols[0].callback = ws_callback;
+    e->protocols[0].per_session_data_size = sizeof(struct session);
+    e->protocols[0].rx_buffer_size = 4096;
+    e->protocols[0].user = e;
+
+    if (cfg->dedup_window > 0 &&
+        !(e->dedup = calloc((size_t)cfg->dedup_window, sizeof(struct dedup_entry)))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    if (cfg->max_writers > 1 &&
+        !(e->sequencer = sequencer_create(SEQUENCER_SLOTS, apply_sequenced, e))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    if (cfg->record_path && !(e->recorder = traffic_recorder_open(cfg->record_path))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    // Sized for the larger join history at start; a history_limit raised
+    // beyond it later is served from the database.
+    int cache_rows = limits->l.history_limit > limits->l.shed_history_limit
+                         ? limits->l.history_limit : limits->l.shed_history_limit;
+    if (cfg->history_cache_path &&
+        !(e->history_cache = history_cache_open(cfg->history_cache_path, cache_rows))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    if (cfg->history_memory_mb > 0 &&
+        !(e->history_store = history_store_create((size_t)cfg->history_memory_mb << 20))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    if ((cfg->filter_path && reload_filter(e) != 0) ||
+        ((cfg->filter_path || cfg->config_path) && start_reload_thread(e) != 0) ||
+        init_db(e, cfg->db_path) != 0 || (cfg->history_log_path && open_history_log(e) != 0) ||
+        (cfg->persist_thread && start_persist_thread(e) != 0)) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    // A standby starts serving standbys only once it takes over, so both may
+    // name the same socket.
+    if (cfg->replication_path && !cfg->standby_of &&
+        !(e->repl = repl_server_start(cfg->replication_path, repl_catch_up, e))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    if (cfg->keep_history) {
+        // Rows from before the start are only in the database
+        long long kept = db_stored_rows(e);
+        if (e->history_cache) history_cache_skip(e->history_cache, (uint64_t)kept);
+        if (e->history_store) history_store_skip(e->history_store, (uint64_t)kept);
+    }
+
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof(info));
+    info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+    info.gid = -1;
+    info.uid = -1;
+    info.user = e;
+    info.count_threads = (unsigned int)cfg->service_threads;
+    if (cfg->tls.cert_path) info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+    if (cfg->event_loop == CHAT_LOOP_LIBUV) info.options |= LWS_SERVER_OPTION_LIBUV;
+    else if (cfg->event_loop == CHAT_LOOP_LIBEV) info.options |= LWS_SERVER_OPTION_LIBEV;
+    if (e->cfg.foreign_loop &&
+        (cfg->event_loop == CHAT_LOOP_LIBUV || cfg->event_loop == CHAT_LOOP_LIBEV))
+        info.foreign_loops = &e->cfg.foreign_loop;
+
+    e->context = lws_create_context(&info);
+    if (!e->context) {
+        fprintf(stderr, "lws init failed\n");
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    if (cfg->standby_of) {
+        if (!create_standby_vhost(e) ||
+            !(e->standby = repl_client_start(cfg->standby_of, (uint64_t)db_stored_rows(e),
+                                             apply_replicated, primary_lost, e))) {
+            chat_engine_destroy(e);
+            return NULL;
+        }
+    } else if ((cfg->port && !(e->tcp_vhost = create_tcp_vhost(e))) ||
+               (cfg->unix_path && !(e->unix_vhost = create_unix_vhost(e)))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    start_probes(e);
+    if (cfg->admin_path &&
+        !(e->admin = admin_server_start(cfg->admin_path, cfg->admin_mode, admin_command, e))) {
+        chat_engine_destroy(e);
+        return NULL;
+    }
+    return e;
+}
+
+void chat_engine_destroy(struct chat_engine *e) {
+    if (!e) return;
+    // Both may be waiting on the service loop to take new limits.
+    admin_server_stop(e->admin);
+    stop_reload_thread(e);
+    repl_client_stop(e->standby); // it may still wake the context
+    if (e->context) lws_context_destroy(e->context);
+    if (e->cfg.unix_path && e->cfg.unix_path[0] != '@') unlink(e->cfg.unix_path);
+    traffic_recorder_close(e->recorder); // after the CLOSED callbacks
+    history_cache_close(e->history_cache);
+    history_store_destroy(e->history_store);
+    sequencer_destroy(e->sequencer);     // empty once no thread is submitting
+    stop_persist_thread(e);
+    repl_server_stop(e->repl); // after the last batch, before catch-ups lose the database
+    history_log_close(e->history_log); // after the last batch too
+    content_filter_release(e->filter);
+    close_db(e);
+    pthread_mutex_destroy(&e->filter_mutex);
+    pthread_mutex_destroy(&e->dedup_mutex);
+    pthread_mutex_destroy(&e->load_mutex);
+    free(e->limits);
+    free(e->limits_pending);
+    while (e->limits_retired) {
+        struct limits_node *next = e->limits_retired->next;
+        free(e->limits_retired);
+        e->limits_retired = next;
+    }
+    pthread_cond_destroy(&e->limits_cond);
+    pthread_mutex_destroy(&e->limits_mutex);
+    free(e->dedup);
+    pthread_rwlock_destroy(&e->history_lock);
+    pthread_mutex_destroy(&e->clients_mutex);
+    free(e);
+}
+
+struct service_thread {
+    struct chat_engine *e;
+    int tsi;
+    pthread_t tid;
+};
+
+static int service_loop(struct chat_engine *e, int tsi) {
+    char name[16], cpus[256];
+    snprintf(name, sizeof(name), "service-%d", tsi);
+    placement_apply(name, placement_nth_list(e->cfg.service_cpus, tsi, cpus, sizeof(cpus)));
+    service_tsi = tsi;
+    int n = 0;
+    while (n >= 0 && !__atomic_load_n(&e->stop, __ATOMIC_ACQUIRE)) {
+        n = lws_service_tsi(e->context, 1000, tsi);
+    }
+    placement_forget();
+    return n < 0 ? -1 : 0;
+}
+
+static void *service_main(void *arg) {
+    struct service_thread *t = arg;
+    service_loop(t->e, t->tsi);
+    return NULL;
+}
+
+int chat_engine_run(struct chat_engine *e) {
+    struct service_thread threads[CHAT_MAX_SERVICE_THREADS];
+    int started = 0;
+    for (int i = 1; i < e->cfg.service_threads; i++) {
+        threads[i].e = e;
+        threads[i].tsi = i;
+        if (pthread_create(&threads[i].tid, NULL, service_main, &threads[i]) != 0) {
+            fprintf(stderr, "Failed to start service thread %d\n", i);
+            break;
+        }
+        started = i;
+    }
+    int rc = service_loop(e, 0);
+    chat_engine_stop(e);
+    for (int i = 1; i <= started; i++) pthread_join(threads[i].tid, NULL);
+    return rc;
+}
+
+int chat_engine_service(struct chat_engine *e, int timeout_ms) {
+    if (__atomic_load_n(&e->stop, __ATOMIC_ACQUIRE)) return -1;
+    service_tsi = 0;
+    return lws_service(e->context, timeout_ms);
+}
+
+int chat_engine_service_fd(struct chat_engine *e, int fd, int revents) {
+    if (fd < 0) return lws_service_fd(e->context, NULL);
+    struct lws_pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = 0;
+    pfd.revents = (short)revents;
+    return lws_service_fd(e->context, &pfd);
+}
+
+void chat_engine_stop(struct chat_engine *e) {
+    __atomic_store_n(&e->stop, 1, __ATOMIC_RELEASE);
+    if (e->context) lws_cancel_service(e->context);
+}
+
+void chat_engine_reload(struct chat_engine *e) {
+    if (e->reload_running) sem_post(&e->reload_sem);
+}
+
+struct lws_context *chat_engine_context(struct chat_engine *e) {
+    return e->context;
+}
+
+void chat_engine_get_limits(struct chat_engine *e, struct chat_limits *l) {
+    *l = *limits(e);
+}
+
+int chat_engine_set_limits(struct chat_engine *e, const struct chat_limits *l) {
+    char err[256];
+    if (validate_limits(l, err, sizeof(err)) != 0) {
+        log_error("Limits rejected: %s", err);
+        return -1;
+    }
+    pthread_mutex_lock(&e->limits_mutex);
+    unsigned long gen = post_limits_locked(e, l);
+    pthread_mutex_unlock(&e->limits_mutex);
+    return gen ? wait_limits(e, gen) : -1;
+}
+
+int chat_engine_post(struct chat_engine *e, const char *username, const char *message) {
+    if (!message) return -1;
+    // Same cleanup as client input; hosts are trusted, not their data.
+    char name[MAX_NAME_LEN];
+    snprintf(name, sizeof(name), "%s", username ? username : "Anonymous");
+    const struct chat_limits *l = limits(e);
+    if (sanitize_text(name, strlen(name), (size_t)l->max_name_chars, MAX_NAME_LEN - 1) == 0) return -1;
+    size_t len = strlen(message);
+    char *msg = malloc(len + 1);
+    if (!msg) return -1;
+    memcpy(msg, message, len + 1);
+    int rc = -1;
+    if (sanitize_text(msg, len, (size_t)l->max_msg_chars, MAX_MSG_LEN - MAX_NAME_LEN - 2) > 0)
+        rc = submit_message(e, name, msg);
+    free(msg);
+    return rc;
+}
+
+// Copies the payload into a string and releases f.
+static char *frame_string(struct frame *f) {
+    if (!f) return NULL;
+    char *out = malloc(f->len + 1);
+    if (out) {
+        memcpy(out, f->buf + LWS_PRE, f->len);
+        out[f->len] = '\0';
+    }
+    frame_release(f);
+    return out;
+}
+
+char *chat_engine_history(struct chat_engine *e, int limit) {
+    return frame_string(history_snapshot(e, limit > 0 ? limit : limits(e)->history_limit));
+}
+
+char *chat_engine_history_range(struct chat_engine *e, long long from_ms, long long to_ms, int limit) {
+    pthread_rwlock_wrlock(&e->history_lock);
+    struct frame *f = db_get_history_range(e, from_ms, to_ms,
+                                           limit > 0 ? limit : limits(e)->history_limit, NULL);
+    pthread_rwlock_unlock(&e->history_lock);
+    return frame_string(f);
+}
+
+// Writes the rows stmt yields. Returns -1 if the archive could not take them.
+static int export_rows(sqlite3_stmt *stmt, struct archive_writer *w, long long *rows) {
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        struct archive_row row = {
+            .ts_ms = parse_ts(sqlite3_column_text(stmt, 2)),
+            .username = (const char *)sqlite3_column_text(stmt, 0),
+            .username_len = (size_t)sqlite3_column_bytes(stmt, 0),
+            .message = (const char *)sqlite3_column_text(stmt, 1),
+            .message_len = (size_t)sqlite3_column_bytes(stmt, 1),
+        };
+        if (archive_write_row(w, &row) != 0) return -1;
+        (*rows)++;
+    }
+    return rc == SQLITE_DONE ? 0 : -1;
+}
+
+long long chat_engine_export_history(const char *db_path, const char *path, int compress) {
+    sqlite3 *db = NULL;
+    if (sqlite3_open_v2(db_path, &db, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open sqlite db '%s': %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return -1;
+    }
+    struct archive_writer *w = archive_writer_open(path, compress);
+    if (!w) {
+        sqlite3_close(db);
+        return -1;
+    }
+    long long rows = 0;
+    sqlite3_stmt *st = NULL, *parts = NULL;
+    int ok = sqlite3_prepare_v2(db, "SELECT username, message, ts FROM messages ORDER BY id;", -1, &st,
+                                NULL) == SQLITE_OK && export_rows(st, w, &rows) == 0;
+    sqlite3_finalize(st);
+    // Partition files, in the order they were opened
+    if (ok && sqlite3_prepare_v2(db, "SELECT path FROM partitions ORDER BY seq;", -1, &parts, NULL) == SQLITE_OK) {
+        while (ok && sqlite3_step(parts) == SQLITE_ROW) {
+            const char *file = (const char *)sqlite3_column_text(parts, 0);
+            sqlite3 *pdb = NULL;
+            st = NULL;
+            ok = sqlite3_open_v2(file, &pdb, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK &&
+                 sqlite3_prepare_v2(pdb, "SELECT username, message, ts FROM messages ORDER BY id;", -1,
+                                    &st, NULL) == SQLITE_OK &&
+                 export_rows(st, w, &rows) == 0;
+            if (!ok) fprintf(stderr, "Cannot export partition '%s': %s\n", file, sqlite3_errmsg(pdb));
+            sqlite3_finalize(st);
+            sqlite3_close(pdb);
+        }
+    }
+    sqlite3_finalize(parts);
+    if (!ok) fprintf(stderr, "Export of '%s' failed: %s\n", db_path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    if (archive_writer_close(w) != 0) {
+        if (ok) fprintf(stderr, "Cannot write archive '%s'\n", path);
+        ok = 0;
+    }
+    return ok ? rows : -1;
+}
+
+long long chat_engine_import_history(const char *db_path, const char *path) {
+    struct archive_reader *r = archive_reader_open(path);
+    if (!r) return -1;
+    sqlite3 *db = NULL;
+    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
+        fprintf(stderr, "Cannot open sqlite db '%s': %s\n", db_path, sqlite3_errmsg(db));
+        sqlite3_close(db);
+        archive_reader_close(r);
+        return -1;
+    }
+    // The index is dropped and built once at the end, inside the same
+    // transaction, rather than updated for every row.
+    sqlite3_stmt *ins = NULL;
+    int ok = db_exec(db, "PRAGMA journal_mode=WAL;") == 0 &&
+             db_exec(db, "PRAGMA cache_size=-65536;") == 0 &&
+             db_exec(db, "CREATE TABLE IF NOT EXISTS messages (" MESSAGES_COLUMNS ");") == 0 &&
+             db_exec(db, "BEGIN;") == 0 &&
+             db_exec(db, "DROP INDEX IF EXISTS messages_ts;") == 0 &&
+             sqlite3_prepare_v2(db,
+                                "INSERT INTO messages (username, message, ts) VALUES "
+                                "(?1, ?2, COALESCE(?3, strftime('%Y-%m-%d %H:%M:%f','now')));",
+                                -1, &ins, NULL) == SQLITE_OK;
+    long long rows = 0;
+    struct archive_row row;
+    int rc = 0;
+    while (ok && (rc = archive_read_row(r, &row)) == 1) {
+        char ts[32];
+        sqlite3_reset(ins);
+        sqlite3_bind_text(ins, 1, row.username_len ? row.username : "", (int)row.username_len, SQLITE_STATIC);
+        sqlite3_bind_text(ins, 2, row.message_len ? row.message : "", (int)row.message_len, SQLITE_STATIC);
+        if (row.ts_ms) {
+            format_ts(row.ts_ms, ts, sizeof(ts));
+            sqlite3_bind_text(ins, 3, ts, -1, SQLITE_STATIC);
+        } else {
+            sqlite3_bind_null(ins, 3);
+        }
+        if ((ok = sqlite3_step(ins) == SQLITE_DONE)) rows++;
+    }
+    sqlite3_finalize(ins);
+    if (ok && rc != 0) {
+        fprintf(stderr, "Archive '%s' is damaged or truncated after %lld rows\n", path, rows);
+        ok = 0;
+    } else if (!ok || db_exec(db, "CREATE INDEX messages_ts ON messages (ts);") != 0 ||
+               db_exec(db, "COMMIT;") != 0) {
+        fprintf(stderr, "Import into '%s' failed: %s\n", db_path, sqlite3_errmsg(db));
+        ok = 0;
+    }
+    if (!ok) sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    sqlite3_close(db);
+    archive_reader_close(r);
+    return ok ? rows : -1;
+}
+
+void chat_engine_counts(struct chat_engine *e, int *readers, int *writers) {
+    count_roles(e, readers, writers);
+}
@@ -0,0 +1,257 @@
+#ifndef CHAT_ENGINE_H
+#define CHAT_ENGINE_H
+
+#include <stddef.h>
+#include <libwebsockets.h>
+
+// Embeddable broadcast chat engine: client registry, reader/writer admission,
+// SQLite-backed history and fan-out, driven by libwebsockets. The server binary
+// is a thin wrapper around this API; a host service can run the same engine on
+// its own event loop instead.
+
+#define CHAT_DEFAULT_PORT 8080
+#define CHAT_MAX_SERVICE_THREADS 32
+#define CHAT_DEFAULT_DB "chat_history.sqlite"
+
+struct chat_engine;
+
+enum chat_event_loop {
+    CHAT_LOOP_POLL,      // lws' built-in poll() loop, driven by chat_engine_run()/_service()
+    CHAT_LOOP_LIBUV,     // libuv; foreign_loop is a uv_loop_t * or NULL for an lws-owned loop
+    CHAT_LOOP_LIBEV,     // libev; foreign_loop is a struct ev_loop * or NULL
+    CHAT_LOOP_EXTERNAL,  // host epoll/select loop via poll_fd and chat_engine_service_fd()
+};
+
+// lws poll operations reported to CHAT_LOOP_EXTERNAL hosts
+enum chat_poll_op {
+    CHAT_POLL_ADD,
+    CHAT_POLL_DEL,
+    CHAT_POLL_CHANGE,
+};
+
+// Page backing for the history frame classes (see frame_pool.h)
+enum chat_hugepages {
+    CHAT_PAGES_DEFAULT,
+    CHAT_PAGES_THP,      // 2 MiB-aligned slabs with MADV_HUGEPAGE
+    CHAT_PAGES_HUGETLB,  // MAP_HUGETLB from vm.nr_hugepages, THP when none are free
+};
+
+// Limits that can change while the engine runs: through the admin socket,
+// the config file or chat_engine_set_limits(). A change is checked as a whole
+// and swapped in on the service loop, so a message sees either the old set or
+// the new one. The writer_* and dedup_seconds fields start out as the config's.
+struct chat_limits {
+    int history_limit;       // rows sent on join and get_history
+    int shed_history_limit;  // rows sent on join while load shedding shrinks history
+    int max_msg_chars;       // code points per message
+    int max_name_chars;      // code points per username
+    int max_queued_frames;   // unsent frames after which a client is disconnected
+    int slow_reader_depth;   // unsent frames that mark a reader as slow when shedding
+    double writer_rate;
+    int writer_burst;
+    int dedup_seconds;
+    int persist_batch_ms;    // persist thread waits this long to gather a batch
+};
+
+struct chat_tls_config {
+    const char *cert_path;         // NULL disables TLS
+    const char *key_path;
+    const char *cipher_list;       // TLS <= 1.2
+    const char *tls13_ciphers;     // TLS 1.3 suites
+    const char *ticket_key_path;   // shared ticket key so resumption survives restarts
+    int session_cache_size;        // 0 disables the server-side session cache
+    int session_timeout;           // seconds a session / ticket stays resumable
+    int tickets;                   // stateless session tickets (RFC 5077 / TLS 1.3 PSK)
+    int ktls;                      // hand record encryption to the kernel (Linux)
+    int h2;                        // offer h2 via ALPN (RFC 8441 WebSockets)
+};
+
+struct chat_engine_config {
+    const char *db_path;
+    // Keep the rows already in db_path instead of clearing them at start, e.g.
+    // after chat_engine_import_history(). Not with partitions.
+    int keep_history;
+    int port;                      // TCP listener; 0 when only the UNIX socket is wanted
+    const char *index_path;        // web client served at /, NULL to serve nothing
+    struct chat_tls_config tls;
+
+    // Optional listener for co-located producers and archivers. A leading '@'
+    // selects the Linux abstract namespace (no file, no perms).
+    const char *unix_path;
+    const char *unix_owner;        // "user:group" for chown, or NULL
+    int unix_mode;                 // chmod bits for the socket file, -1 keeps the umask default
+
+    // Thread layout. CPU lists use "0-3,8" syntax; service_cpus holds one
+    // ':'-separated list per service thread ("0:1:2:3"). Pinned threads prefer
+    // memory from their CPUs' NUMA node. NULL leaves a thread unpinned.
+    int service_threads;           // lws service threads, CHAT_LOOP_POLL only
+    const char *service_cpus;
+    int persist_thread;            // write history on a dedicated thread in batches
+    const char *persist_cpus;
+    enum chat_hugepages hugepages; // process-wide; affects slabs mapped afterwards
+
+    // Flood control for writer messages, checked before the insert and
+    // broadcast. A writer may send writer_burst messages at once, refilled at
+    // writer_rate per second (0 disables). A message identical to one the same
+    // user sent among the last dedup_window stored messages, within
+    // dedup_seconds, is dropped (0 disables). Both checks are off by default.
+    double writer_rate;
+    int writer_burst;
+    int dedup_window;
+    int dedup_seconds;
+
+    // Send WebSocket frames on plain (non-TLS, HTTP/1.1) connections with one
+    // gather write of a header built once per broadcast, instead of lws_write().
+    // A connection that hits a short write goes back to lws_write().
+    int writev_fast_path;
+
+    // Keeps the newest history rows in this file as ready-to-send WebSocket
+    // fragments (see history_cache.h), NULL for none. Joins on plain
+    // connections get their history from it by sendfile(); TLS and h2 ones,
+    // and requests for more rows than it holds, still read SQLite. The file
+    // is truncated at start, like the history table.
+    const char *history_cache_path;
+
+    // MiB of memory for history kept in deflate-compressed blocks (see
+    // history_store.h), 0 for none. Joins, get_history and
+    // chat_engine_history() read it instead of SQLite while it still holds
+    // the rows they ask for; the oldest blocks go once it is full.
+    int history_memory_mb;
+
+    // Splits history over SQLite files named db_path.000001 and up, ATTACHed
+    // to db_path, which then only lists them. Inserts move to a new file each
+    // UTC day (partition_daily) and/or every partition_rows rows. History
+    // reads go back through the files newest first. Past partition_keep
+    // files the oldest is detached and unlinked, 0 keeps them all. Files are
+    // removed at start, like the history table. All 0 keeps one table.
+    int partition_daily;
+    int partition_rows;
+    int partition_keep;
+
+    // UNIX socket hot standbys follow this server's history on (see
+    // replication.h), NULL for none. Not with partitions.
+    const char *replication_path;
+    // Runs as a hot standby of the server whose replication_path this is:
+    // its rows are copied into db_path, which must be this process's own
+    // file, and into the in-memory history as they commit there. The
+    // listeners and replication_path open once that server is gone.
+    const char *standby_of;
+
+    // Append-only log each commit group of stored rows is also written to,
+    // by io_uring where the kernel allows (see history_log.h), NULL for none.
+    // SQLite then commits with synchronous=NORMAL; with keep_history, rows
+    // the database lost in a crash are replayed from the log at start. Not
+    // with partitions.
+    const char *history_log_path;
+
+    // 1 keeps the classic room: one writer and no readers, or readers only.
+    // Above 1, readers may always join and up to max_writers writers may send
+    // at once; their messages get a global sequence number, and history and
+    // every client see them in that order.
+    int max_writers;
+
+    // Phrase list for writer messages (see content_filter.h), NULL for none.
+    // Re-read by chat_engine_reload().
+    const char *filter_path;
+
+    // Graded load shedding driven by event-loop lag and outbound queue depth:
+    // defer history, shrink join history, refuse upgrades with 503, then drop
+    // the slowest readers. Each step backs off once load has stayed lower for
+    // a couple of seconds.
+    int load_shedding;
+
+    // Appends every connection open/close and inbound frame, with timestamps,
+    // to this file (see traffic_record.h), NULL to not record. The replay
+    // tool in bench/ re-drives a server from it.
+    const char *record_path;
+
+    // Local control socket for inspecting the engine and changing its limits
+    // (see README), NULL for none. A leading '@' selects the abstract
+    // namespace; admin_mode sets the file's permissions.
+    const char *admin_path;
+    int admin_mode;
+
+    // "key value" lines setting chat_limits fields by name, applied at start
+    // and again by chat_engine_reload() on top of the running values.
+    const char *config_path;
+
+    enum chat_event_loop event_loop;
+    void *foreign_loop;
+    // CHAT_LOOP_EXTERNAL: called on the service thread whenever lws wants an
+    // fd added to, removed from or re-armed in the host's poller.
+    void (*poll_fd)(void *host, enum chat_poll_op op, int fd, int events);
+    void *poll_host;
+};
+
+// Fills cfg with the defaults the server binary uses.
+void chat_engine_config_init(struct chat_engine_config *cfg);
+
+// Opens the database, creates the lws context and listeners. The config's
+// strings must outlive the engine. Returns NULL on failure.
+struct chat_engine *chat_engine_create(const struct chat_engine_config *cfg);
+
+// Stops listeners, disconnects clients and closes the database. With a foreign
+// libuv/libev loop the host must keep running its loop until lws has closed
+// its handles.
+void chat_engine_destroy(struct chat_engine *e);
+
+// Runs the built-in loop until chat_engine_stop(). Only for CHAT_LOOP_POLL and
+// lws-owned libuv/libev loops. Starts service_threads - 1 extra threads and
+// services the first one on the calling thread.
+int chat_engine_run(struct chat_engine *e);
+
+// One service iteration for hosts that interleave the engine with their own
+// work on CHAT_LOOP_POLL. Returns < 0 once the engine should shut down.
+int chat_engine_service(struct chat_engine *e, int timeout_ms);
+
+// CHAT_LOOP_EXTERNAL: report readiness of an fd previously announced through
+// poll_fd. Pass fd = -1 periodically (about once a second) to run timers.
+int chat_engine_service_fd(struct chat_engine *e, int fd, int revents);
+
+// Thread- and signal-safe; makes chat_engine_run() return.
+void chat_engine_stop(struct chat_engine *e);
+
+// Re-reads the content filter and the config file on a background thread.
+// Messages keep flowing through the old phrase list until the new one is
+// compiled; a file that fails to load leaves the old settings in place.
+// Async-signal-safe (for SIGHUP handlers).
+void chat_engine_reload(struct chat_engine *e);
+
+struct lws_context *chat_engine_context(struct chat_engine *e);
+
+void chat_engine_get_limits(struct chat_engine *e, struct chat_limits *limits);
+
+// Checks limits and hands them to the service loop, waiting up to a second for
+// it to take them. Returns -1 if they are invalid (nothing changes), 1 if the
+// loop has not applied them yet, 0 once they are in effect. Not for use on a
+// service thread.
+int chat_engine_set_limits(struct chat_engine *e, const struct chat_limits *limits);
+
+// Stores a message from username and broadcasts it as a writer would.
+// Bypasses admission: for host services feeding the room directly. With
+// several service threads it may be called from any thread; otherwise call it
+// on the thread that services the engine, as lws does not allow requesting
+// writeable callbacks from other threads. username and message are cleaned
+// like client input; returns -1 if the message is empty afterwards.
+int chat_engine_post(struct chat_engine *e, const char *username, const char *message);
+
+// Newest-last "user: message" lines, '\n' separated. Caller frees.
+char *chat_engine_history(struct chat_engine *e, int limit);
+
+// The newest limit lines stored from from_ms up to, not including, to_ms
+// (milliseconds since the epoch, 0 for an open end), in the same format.
+// Served by a range scan of the ts index. Caller frees.
+char *chat_engine_history_range(struct chat_engine *e, long long from_ms, long long to_ms, int limit);
+
+void chat_engine_counts(struct chat_engine *e, int *readers, int *writers);
+
+// Offline dump and load of a database no engine is running on, in the format
+// of history_archive.h. Export writes db_path's rows, then those of its
+// partition files if it has any, oldest first; compress deflates the file.
+// Import appends to db_path's messages table in one transaction, building
+// the ts index once at the end. Both return the number of rows, or -1 with
+// the reason printed.
+long long chat_engine_export_history(const char *db_path, const char *path, int compress);
+long long chat_engine_import_history(const char *db_path, const char *path);
+
+#endif
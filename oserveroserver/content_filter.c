@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "content_filter.h"
+
+#define MAX_PHRASE_LEN 256
+#define MAX_TABLE_BYTES (256u << 20)
+#define NO_STATE UINT32_MAX
+#define HAS_OUTPUT 0x80000000u
+
+struct phrase {
+    char *text; // lowercased, NUL-terminated
+    size_t len;
+    enum filter_action action;
+    unsigned long hits;
+};
+
+struct content_filter {
+    int refs;
+    char *path;
+
+    struct phrase *phrases;
+    size_t nphrases;
+
+    // Input bytes are mapped to classes first: class 0 is every byte that
+    // occurs in no phrase, so the table has one column per distinct byte.
+    uint8_t class_of[256];
+    unsigned nclasses;
+
+    uint32_t nstates;
+    // nstates x nclasses, complete (failure links folded in). Entries hold
+    // the target's row offset (state * nclasses), with HAS_OUTPUT set when a
+    // phrase ends at the target or one of its suffixes.
+    uint32_t *next;
+    uint32_t *out;    // phrase ending at the state, or NO_STATE
+    uint32_t *dict;   // nearest proper suffix state with an output, or NO_STATE
+};
+
+static const char *action_names[] = { "none", "flag", "mask", "reject" };
+
+const char *content_filter_action_name(enum filter_action action) {
+    return action_names[action];
+}
+
+static void filter_free(struct content_filter *f) {
+    for (size_t i = 0; i < f->nphrases; i++) free(f->phrases[i].text);
+    free(f->phrases);
+    free(f->next);
+    free(f->out);
+    free(f->dict);
+    free(f->path);
+    free(f);
+}
+
+struct content_filter *content_filter_retain(struct content_filter *f) {
+    if (f) __atomic_add_fetch(&f->refs, 1, __ATOMIC_RELAXED);
+    return f;
+}
+
+void content_filter_release(struct content_filter *f) {
+    if (f && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) filter_free(f);
+}
+
+static int parse_action(const char *word, size_t n, enum filter_action *action) {
+    for (int a = FILTER_FLAG; a <= FILTER_REJECT; a++) {
+        if (strlen(action_names[a]) == n && strncasecmp(word, action_names[a], n) == 0) {
+            *action = (enum filter_action)a;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Adds a phrase; a repeated phrase keeps its most severe action.
+static int add_phrase(struct content_filter *f, size_t *cap, const char *text, size_t len,
+                      enum filter_action action) {
+    char lower[MAX_PHRASE_LEN];
+    for (size_t i = 0; i < len; i++) lower[i] = (char)tolower((unsigned char)text[i]);
+    for (size_t i = 0; i < f->nphrases; i++) {
+        struct phrase *p = &f->phrases[i];
+        if (p->len == len && memcmp(p->text, lower, len) == 0) {
+            if (action > p->action) p->action = action;
+            return 0;
+        }
+    }
+    if (f->nphrases == *cap) {
+        size_t ncap = *cap ? *cap * 2 : 64;
+        struct phrase *tmp = realloc(f->phrases, ncap * sizeof(*tmp));
+        if (!tmp) return -1;
+        f->phrases = tmp;
+        *cap = ncap;
+    }
+    struct phrase *p = &f->phrases[f->nphrases];
+    p->text = malloc(len + 1);
+    if (!p->text) return -1;
+    memcpy(p->text, lower, len);
+    p->text[len] = '\0';
+    p->len = len;
+    p->action = action;
+    p->hits = 0;
+    f->nphrases++;
+    return 0;
+}
+
+static int read_phrases(struct content_filter *f, FILE *fp) {
+    char *line = NULL;
+    size_t line_cap = 0, cap = 0;
+    ssize_t n;
+    int lineno = 0, rc = 0;
+    while ((n = getline(&line, &line_cap, fp)) >= 0) {
+        lineno++;
+        while (n > 0 && isspace((unsigned char)line[n - 1])) line[--n] = '\0';
+        char *p = line;
+        while (isspace((unsigned char)*p)) p++;
+        if (*p == '\0' || *p == '#') continue;
+        char *word = p;
+        while (*p && !isspace((unsigned char)*p)) p++;
+        size_t word_len = (size_t)(p - word);
+        while (isspace((unsigned char)*p)) p++;
+        size_t len = strlen(p);
+        enum filter_action action;
+        if (parse_action(word, word_len, &action) != 0 || len == 0 || len > MAX_PHRASE_LEN) {
+            fprintf(stderr, "%s:%d: expected 'reject|mask|flag <phrase>' (phrase up to %d bytes)\n",
+                    f->path, lineno, MAX_PHRASE_LEN);
+            rc = -1;
+            break;
+        }
+        if (add_phrase(f, &cap, p, len, action) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    free(line);
+    return rc;
+}
+
+static int build_automaton(struct content_filter *f) {
+    size_t total = 1;
+    f->nclasses = 1;
+    memset(f->class_of, 0, sizeof(f->class_of));
+    for (size_t i = 0; i < f->nphrases; i++) {
+        total += f->phrases[i].len;
+        for (size_t k = 0; k < f->phrases[i].len; k++) {
+            unsigned char b = (unsigned char)f->phrases[i].text[k];
+            if (!f->class_of[b]) f->class_of[b] = (uint8_t)f->nclasses++;
+        }
+    }
+    for (int b = 'A'; b <= 'Z'; b++) f->class_of[b] = f->class_of[tolower(b)];
+    if (total * f->nclasses * sizeof(uint32_t) > MAX_TABLE_BYTES) {
+        fprintf(stderr, "%s: phrase list too large (%zu states x %u classes)\n",
+                f->path, total, f->nclasses);
+        return -1;
+    }
+
+    // Trie, then BFS to fill in failure transitions. Row 0 is the root, so a
+    // 0 entry below the root means "no edge yet".
+    const unsigned nc = f->nclasses;
+    f->next = calloc(total * nc, sizeof(uint32_t));
+    f->out = malloc(total * sizeof(uint32_t));
+    f->dict = malloc(total * sizeof(uint32_t));
+    uint32_t *fail = calloc(total, sizeof(uint32_t));
+    uint32_t *queue = malloc(total * sizeof(uint32_t));
+    if (!f->next || !f->out || !f->dict || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return -1;
+    }
+    for (size_t s = 0; s < total; s++) {
+        f->out[s] = NO_STATE;
+        f->dict[s] = NO_STATE;
+    }
+    uint32_t nstates = 1;
+    for (size_t i = 0; i < f->nphrases; i++) {
+        uint32_t s = 0;
+        for (size_t k = 0; k < f->phrases[i].len; k++) {
+            uint32_t *t = &f->next[(size_t)s * nc + f->class_of[(unsigned char)f->phrases[i].text[k]]];
+            if (!*t) *t = nstates++;
+            s = *t;
+        }
+        f->out[s] = (uint32_t)i;
+    }
+
+    size_t head = 0, tail = 0;
+    for (unsigned c = 0; c < nc; c++) {
+        uint32_t t = f->next[c];
+        if (t) queue[tail++] = t; // fail[t] = 0
+    }
+    while (head < tail) {
+        uint32_t s = queue[head++];
+        uint32_t fs = fail[s];
+        f->dict[s] = f->out[fs] != NO_STATE ? fs : f->dict[fs];
+        for (unsigned c = 0; c < nc; c++) {
+            uint32_t *t = &f->next[(size_t)s * nc + c];
+            uint32_t via_fail = f->next[(size_t)fs * nc + c];
+            if (*t) {
+                fail[*t] = via_fail;
+                queue[tail++] = *t;
+            } else {
+                *t = via_fail;
+            }
+        }
+    }
+    free(fail);
+    free(queue);
+    for (size_t k = 0; k < (size_t)nstates * nc; k++) {
+        uint32_t t = f->next[k];
+        f->next[k] = t * nc | (f->out[t] != NO_STATE || f->dict[t] != NO_STATE ? HAS_OUTPUT : 0);
+    }
+    f->nstates = nstates;
+    // Shared prefixes leave rows unused at the end.
+    uint32_t *shrunk = realloc(f->next, (size_t)nstates * nc * sizeof(uint32_t));
+    if (shrunk) f->next = shrunk;
+    return 0;
+}
+
+struct content_filter *content_filter_load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "Cannot open content filter '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct content_filter *f = calloc(1, sizeof(*f));
+    if (!f || !(f->path = strdup(path))) {
+        free(f);
+        fclose(fp);
+        return NULL;
+    }
+    f->refs = 1;
+    int rc = read_phrases(f, fp);
+    fclose(fp);
+    if (rc != 0 || build_automaton(f) != 0) {
+        filter_free(f);
+        return NULL;
+    }
+    return f;
+}
+
+enum filter_action content_filter_apply(struct content_filter *f, char *msg, size_t len,
+                                        const char **phrase) {
+    enum filter_action worst = FILTER_NONE;
+    const unsigned nc = f->nclasses;
+    uint32_t row = 0;
+    if (phrase) *phrase = NULL;
+    for (size_t i = 0; i < len; i++) {
+        uint32_t t = f->next[row + f->class_of[(unsigned char)msg[i]]];
+        row = t & ~HAS_OUTPUT;
+        if (!(t & HAS_OUTPUT)) continue;
+        uint32_t s = row / nc;
+        uint32_t u = f->out[s] != NO_STATE ? s : f->dict[s];
+        for (; u != NO_STATE; u = f->dict[u]) {
+            struct phrase *p = &f->phrases[f->out[u]];
+            __atomic_add_fetch(&p->hits, 1, __ATOMIC_RELAXED);
+            if (p->action > worst) {
+                worst = p->action;
+                if (phrase) *phrase = p->text;
+            }
+            if (p->action == FILTER_REJECT) return FILTER_REJECT;
+            // Only bytes up to i are overwritten, and those were already
+            // consumed, so overlapping phrases still match.
+            if (p->action == FILTER_MASK) memset(msg + i + 1 - p->len, '*', p->len);
+        }
+    }
+    return worst;
+}
+
+// Appends s as a JSON string body, escaping quotes, backslashes and controls.
+static size_t json_escape(char *buf, size_t len, const char *s, size_t n) {
+    size_t off = 0;
+    for (size_t i = 0; i < n && off + 7 < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c == '"' || c == '\\') {
+            buf[off++] = '\\';
+            buf[off++] = (char)c;
+        } else if (c < 0x20) {
+            off += (size_t)snprintf(buf + off, len - off, "\\u%04x", c);
+        } else {
+            buf[off++] = (char)c;
+        }
+    }
+    return off;
+}
+
+size_t content_filter_format_json(struct content_filter *f, char *buf, size_t len, int phrases) {
+    size_t off = 0;
+#define APPEND(...) do { \
+        size_t at_ = off < len ? off : len; \
+        int w_ = snprintf(buf + at_, len - at_, __VA_ARGS__); \
+        if (w_ > 0) off += (size_t)w_; \
+    } while (0)
+    APPEND("{\"phrases\":%zu,\"states\":%u,\"classes\":%u,\"table_bytes\":%zu",
+           f->nphrases, f->nstates, f->nclasses,
+           (size_t)f->nstates * f->nclasses * sizeof(uint32_t));
+    if (phrases) APPEND(",\"hits\":[");
+    int first = 1;
+    for (size_t i = 0; phrases && i < f->nphrases; i++) {
+        const struct phrase *p = &f->phrases[i];
+        unsigned long hits = __atomic_load_n(&p->hits, __ATOMIC_RELAXED);
+        if (!hits) continue;
+        APPEND("%s{\"phrase\":\"", first ? "" : ",");
+        if (off < len) off += json_escape(buf + off, len - off, p->text, p->len);
+        APPEND("\",\"action\":\"%s\",\"hits\":%lu}", action_names[p->action], hits);
+        first = 0;
+    }
+    APPEND("%s}", phrases ? "]" : "");
+#undef APPEND
+    if (len && off >= len) off = len - 1;
+    return off;
+}
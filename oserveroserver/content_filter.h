@@ -0,0 +1,49 @@
+#ifndef CONTENT_FILTER_H
+#define CONTENT_FILTER_H
+
+#include <stddef.h>
+
+// Multi-phrase filter for writer messages. The phrase list is compiled into an
+// Aho-Corasick automaton with a full transition table over the bytes that
+// occur in phrases, so matching costs one table lookup per input byte
+// whatever the number of phrases. ASCII letters match case-insensitively;
+// phrases match anywhere, including inside words.
+//
+// File format, one phrase per line:
+//   # comment
+//   reject buy followers now
+//   mask   darn
+//   flag   meet me offline
+
+// Ordered by severity; apply() reports the most severe action hit.
+enum filter_action {
+    FILTER_NONE,
+    FILTER_FLAG,   // deliver, but count and log
+    FILTER_MASK,   // deliver with the phrase replaced by '*'
+    FILTER_REJECT, // drop the message
+};
+
+struct content_filter;
+
+// Compiles the file at path. Returns NULL and prints the reason on failure.
+struct content_filter *content_filter_load(const char *path);
+
+// Filters are shared by service threads and swapped on reload; the last
+// release frees it.
+struct content_filter *content_filter_retain(struct content_filter *f);
+void content_filter_release(struct content_filter *f);
+
+// Scans msg[0..len), masks FILTER_MASK phrases in place and bumps each hit
+// phrase's counter. Stops at the first FILTER_REJECT phrase. *phrase, if not
+// NULL, is set to the most severe phrase hit (valid while f is held).
+enum filter_action content_filter_apply(struct content_filter *f, char *msg, size_t len,
+                                        const char **phrase);
+
+const char *content_filter_action_name(enum filter_action action);
+
+// Automaton size as a JSON object, plus the phrases with hits when phrases is
+// set. The phrase list reveals the blocked words, so only the admin socket
+// asks for it. Returns bytes written, truncated to len - 1.
+size_t content_filter_format_json(struct content_filter *f, char *buf, size_t len, int phrases);
+
+#endif
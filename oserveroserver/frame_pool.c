@@ -0,0 +1,261 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "frame_pool.h"
+
+#define SLAB_SIZE (2u << 20)
+#define NUM_CLASSES 4
+#define OVERSIZE_CLASS 0xffffffffu
+#define BLOCK_MAGIC 0xf4a3e5b1u
+
+// Sits in front of every block; keeps the payload 16-byte aligned.
+struct block_hdr {
+    uint32_t cls;
+    uint32_t magic;
+    size_t size; // usable bytes
+};
+
+struct free_block {
+    struct free_block *next;
+};
+
+struct size_class {
+    const char *name;
+    size_t block;     // including the header
+    int cache_cap;    // blocks a thread keeps before returning half to the depot
+    int huge;         // slabs honour frame_pool_set_hugepages()
+
+    pthread_mutex_t depot_mutex;
+    struct free_block *depot;
+    int depot_count;
+
+    unsigned long allocs;
+    unsigned long cache_hits;
+    unsigned long depot_refills;
+    unsigned long slabs;
+    unsigned long frees;
+};
+
+static struct size_class classes[NUM_CLASSES] = {
+    { "control", 256, 128, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0 },
+    { "chat", 8192, 64, 0, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0 },
+    { "history", 65536, 16, 1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0 },
+    { "history_large", SLAB_SIZE, 2, 1, PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0 },
+};
+
+static int hugepages = FRAME_POOL_PAGES_DEFAULT;
+static unsigned long oversize_allocs;
+static unsigned long hugetlb_slabs;
+static unsigned long hugetlb_fallbacks;
+
+struct thread_cache {
+    struct free_block *head[NUM_CLASSES];
+    int count[NUM_CLASSES];
+    int registered;
+};
+
+static __thread struct thread_cache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+#define STAT_INC(x) __atomic_add_fetch(&(x), 1, __ATOMIC_RELAXED)
+
+static void depot_put(struct size_class *sc, struct free_block *head, struct free_block *tail, int n) {
+    pthread_mutex_lock(&sc->depot_mutex);
+    tail->next = sc->depot;
+    sc->depot = head;
+    sc->depot_count += n;
+    pthread_mutex_unlock(&sc->depot_mutex);
+}
+
+// Returns a thread's cached blocks to the depots when it exits.
+static void tcache_flush(void *arg) {
+    struct thread_cache *tc = arg;
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        struct free_block *head = tc->head[i];
+        if (!head) continue;
+        struct free_block *tail = head;
+        while (tail->next) tail = tail->next;
+        depot_put(&classes[i], head, tail, tc->count[i]);
+        tc->head[i] = NULL;
+        tc->count[i] = 0;
+    }
+}
+
+static void tcache_key_init(void) {
+    pthread_key_create(&tcache_key, tcache_flush);
+}
+
+static void tcache_register(void) {
+    pthread_once(&tcache_once, tcache_key_init);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = 1;
+}
+
+void frame_pool_set_hugepages(enum frame_pool_hugepages mode) {
+    __atomic_store_n(&hugepages, (int)mode, __ATOMIC_RELAXED);
+}
+
+static void *map_slab(int huge) {
+    int mode = huge ? __atomic_load_n(&hugepages, __ATOMIC_RELAXED) : FRAME_POOL_PAGES_DEFAULT;
+    if (mode == FRAME_POOL_PAGES_HUGETLB) {
+        void *p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            STAT_INC(hugetlb_slabs);
+            return p;
+        }
+        STAT_INC(hugetlb_fallbacks); // no reserved huge pages; try THP
+        mode = FRAME_POOL_PAGES_THP;
+    }
+    if (mode == FRAME_POOL_PAGES_THP) {
+        // Over-map and trim so the slab is 2 MiB aligned and THP-eligible.
+        size_t len = 2 * (size_t)SLAB_SIZE;
+        char *raw = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) return NULL;
+        uintptr_t aligned = ((uintptr_t)raw + SLAB_SIZE - 1) & ~((uintptr_t)SLAB_SIZE - 1);
+        char *p = (char *)aligned;
+        if (p > raw) munmap(raw, (size_t)(p - raw));
+        size_t tail = (size_t)(raw + len - (p + SLAB_SIZE));
+        if (tail) munmap(p + SLAB_SIZE, tail);
+        madvise(p, SLAB_SIZE, MADV_HUGEPAGE);
+        return p;
+    }
+    void *p = mmap(NULL, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Fills the calling thread's cache for class i from the depot or a new slab.
+static int refill(int i) {
+    struct size_class *sc = &classes[i];
+    int want = sc->cache_cap / 2 > 0 ? sc->cache_cap / 2 : 1;
+    pthread_mutex_lock(&sc->depot_mutex);
+    int got = 0;
+    while (sc->depot && got < want) {
+        struct free_block *b = sc->depot;
+        sc->depot = b->next;
+        sc->depot_count--;
+        b->next = tcache.head[i];
+        tcache.head[i] = b;
+        got++;
+    }
+    pthread_mutex_unlock(&sc->depot_mutex);
+    if (got) {
+        tcache.count[i] += got;
+        STAT_INC(sc->depot_refills);
+        return 0;
+    }
+
+    char *slab = map_slab(sc->huge);
+    if (!slab) return -1;
+    STAT_INC(sc->slabs);
+    size_t n = SLAB_SIZE / sc->block;
+    for (size_t k = 0; k < n; k++) {
+        struct block_hdr *h = (struct block_hdr *)(slab + k * sc->block);
+        h->cls = (uint32_t)i;
+        h->magic = BLOCK_MAGIC;
+        h->size = sc->block - sizeof(struct block_hdr);
+        struct free_block *b = (struct free_block *)(h + 1);
+        b->next = tcache.head[i];
+        tcache.head[i] = b;
+    }
+    tcache.count[i] += (int)n;
+    return 0;
+}
+
+static int class_for(size_t size) {
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        if (size <= classes[i].block - sizeof(struct block_hdr)) return i;
+    }
+    return -1;
+}
+
+void *frame_pool_alloc(size_t size) {
+    int i = class_for(size);
+    if (i < 0) {
+        STAT_INC(oversize_allocs);
+        struct block_hdr *h = malloc(sizeof(struct block_hdr) + size);
+        if (!h) return NULL;
+        h->cls = OVERSIZE_CLASS;
+        h->magic = BLOCK_MAGIC;
+        h->size = size;
+        return h + 1;
+    }
+    if (!tcache.registered) tcache_register();
+    struct size_class *sc = &classes[i];
+    STAT_INC(sc->allocs);
+    if (tcache.head[i]) {
+        STAT_INC(sc->cache_hits);
+    } else if (refill(i) != 0) {
+        return NULL;
+    }
+    struct free_block *b = tcache.head[i];
+    tcache.head[i] = b->next;
+    tcache.count[i]--;
+    return b;
+}
+
+void frame_pool_free(void *p) {
+    if (!p) return;
+    struct block_hdr *h = (struct block_hdr *)p - 1;
+    if (h->cls == OVERSIZE_CLASS) {
+        free(h);
+        return;
+    }
+    int i = (int)h->cls;
+    struct size_class *sc = &classes[i];
+    STAT_INC(sc->frees);
+    if (!tcache.registered) tcache_register();
+    struct free_block *b = p;
+    b->next = tcache.head[i];
+    tcache.head[i] = b;
+    if (++tcache.count[i] <= sc->cache_cap) return;
+
+    // Cache over capacity: hand half of it back to the depot.
+    int give = tcache.count[i] / 2;
+    struct free_block *head = tcache.head[i], *tail = head;
+    for (int k = 1; k < give; k++) tail = tail->next;
+    tcache.head[i] = tail->next;
+    tcache.count[i] -= give;
+    depot_put(sc, head, tail, give);
+}
+
+size_t frame_pool_usable(const void *p) {
+    const struct block_hdr *h = (const struct block_hdr *)p - 1;
+    return h->size;
+}
+
+size_t frame_pool_format_json(char *buf, size_t len) {
+    size_t off = 0;
+#define APPEND(...) do { \
+        size_t at_ = off < len ? off : len; \
+        int w_ = snprintf(buf + at_, len - at_, __VA_ARGS__); \
+        if (w_ > 0) off += (size_t)w_; \
+    } while (0)
+    static const char *modes[] = { "default", "thp", "hugetlb" };
+    APPEND("{\"hugepages\":\"%s\",\"classes\":[", modes[__atomic_load_n(&hugepages, __ATOMIC_RELAXED)]);
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        struct size_class *sc = &classes[i];
+        unsigned long allocs = __atomic_load_n(&sc->allocs, __ATOMIC_RELAXED);
+        unsigned long hits = __atomic_load_n(&sc->cache_hits, __ATOMIC_RELAXED);
+        APPEND("%s{\"class\":\"%s\",\"block\":%zu,\"allocs\":%lu,\"cache_hits\":%lu,"
+               "\"hit_rate\":%.4f,\"depot_refills\":%lu,\"slabs\":%lu,\"frees\":%lu}",
+               i ? "," : "", sc->name, sc->block, allocs, hits,
+               allocs ? (double)hits / (double)allocs : 0.0,
+               __atomic_load_n(&sc->depot_refills, __ATOMIC_RELAXED),
+               __atomic_load_n(&sc->slabs, __ATOMIC_RELAXED),
+               __atomic_load_n(&sc->frees, __ATOMIC_RELAXED));
+    }
+    APPEND("],\"oversize_allocs\":%lu,\"hugetlb_slabs\":%lu,\"hugetlb_fallbacks\":%lu}",
+           __atomic_load_n(&oversize_allocs, __ATOMIC_RELAXED),
+           __atomic_load_n(&hugetlb_slabs, __ATOMIC_RELAXED),
+           __atomic_load_n(&hugetlb_fallbacks, __ATOMIC_RELAXED));
+#undef APPEND
+    if (len && off >= len) off = len - 1;
+    return off;
+}
@@ -0,0 +1,35 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stddef.h>
+
+// Size-classed allocator for outbound frames. Blocks come from 2 MiB slabs and
+// are recycled through per-thread caches backed by a shared depot, so fan-out
+// allocation cost does not depend on malloc's state. Slabs are mapped by the
+// thread that needs them and therefore follow its NUMA memory policy.
+//
+// Classes (usable bytes): control frames <= 240, chat frames <= 8176,
+// history chunks <= 65520 and <= 2 MiB - 16. Larger requests fall back to
+// malloc and are counted as oversize.
+
+enum frame_pool_hugepages {
+    FRAME_POOL_PAGES_DEFAULT, // plain anonymous mappings
+    FRAME_POOL_PAGES_THP,     // 2 MiB-aligned slabs with MADV_HUGEPAGE
+    FRAME_POOL_PAGES_HUGETLB, // MAP_HUGETLB from the reserved pool, THP on failure
+};
+
+// Sets the slab backing of the two history classes; control and chat frames
+// stay on regular pages. Only slabs mapped afterwards are affected.
+void frame_pool_set_hugepages(enum frame_pool_hugepages mode);
+
+void *frame_pool_alloc(size_t size);
+void frame_pool_free(void *p);
+
+// Usable size of a block returned by frame_pool_alloc().
+size_t frame_pool_usable(const void *p);
+
+// Per-class counters as a JSON object. Returns bytes written, truncated to
+// len - 1.
+size_t frame_pool_format_json(char *buf, size_t len);
+
+#endif
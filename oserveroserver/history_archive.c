@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <zlib.h>
+
+#include "history_archive.h"
+
+#define ARCHIVE_MAGIC "SCHA"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_BUF (256 * 1024)
+#define ARCHIVE_MODE "wb6" // gzip at deflate level 6; "wbT" writes plain
+#define ARCHIVE_MAX_FIELD (16 << 20) // longer lengths mean a damaged file
+#define TAG_ROW 0x01
+#define TAG_END 0x00
+
+struct archive_writer {
+    gzFile gz;
+    int failed;
+    long long prev_ts;
+    unsigned long long rows;
+    size_t len;
+    unsigned char buf[ARCHIVE_BUF];
+};
+
+struct archive_reader {
+    gzFile gz;
+    int failed;         // the stream ended in error, e.g. a cut gzip trailer
+    long long prev_ts;
+    unsigned long long rows;
+    size_t pos;
+    size_t len;
+    char *row;          // username and message of the current row
+    size_t row_cap;
+    unsigned char buf[ARCHIVE_BUF];
+};
+
+static void flush_buf(struct archive_writer *w) {
+    if (w->len && !w->failed && gzwrite(w->gz, w->buf, (unsigned)w->len) != (int)w->len) w->failed = 1;
+    w->len = 0;
+}
+
+static void put_bytes(struct archive_writer *w, const void *p, size_t n) {
+    if (w->len + n > sizeof(w->buf)) flush_buf(w);
+    if (n > sizeof(w->buf)) {
+        if (!w->failed && gzwrite(w->gz, p, (unsigned)n) != (int)n) w->failed = 1;
+        return;
+    }
+    memcpy(w->buf + w->len, p, n);
+    w->len += n;
+}
+
+static void put_varint(struct archive_writer *w, uint64_t v) {
+    unsigned char b[10];
+    size_t n = 0;
+    do {
+        b[n] = (unsigned char)(v & 0x7f);
+        v >>= 7;
+        if (v) b[n] |= 0x80;
+        n++;
+    } while (v);
+    put_bytes(w, b, n);
+}
+
+struct archive_writer *archive_writer_open(const char *path, int compress) {
+    struct archive_writer *w = calloc(1, sizeof(*w));
+    if (!w) {
+        fprintf(stderr, "Out of memory for the archive writer\n");
+        return NULL;
+    }
+    if (!(w->gz = gzopen(path, compress ? ARCHIVE_MODE : "wbT"))) {
+        fprintf(stderr, "Cannot create archive '%s': %s\n", path, strerror(errno));
+        free(w);
+        return NULL;
+    }
+    gzbuffer(w->gz, ARCHIVE_BUF);
+    put_bytes(w, ARCHIVE_MAGIC, 4);
+    unsigned char version = ARCHIVE_VERSION;
+    put_bytes(w, &version, 1);
+    return w;
+}
+
+int archive_write_row(struct archive_writer *w, const struct archive_row *row) {
+    long long d = row->ts_ms - w->prev_ts;
+    unsigned char tag = TAG_ROW;
+    put_bytes(w, &tag, 1);
+    put_varint(w, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+    put_varint(w, row->username_len);
+    put_bytes(w, row->username, row->username_len);
+    put_varint(w, row->message_len);
+    put_bytes(w, row->message, row->message_len);
+    w->prev_ts = row->ts_ms;
+    w->rows++;
+    return w->failed ? -1 : 0;
+}
+
+int archive_writer_close(struct archive_writer *w) {
+    unsigned char tag = TAG_END;
+    put_bytes(w, &tag, 1);
+    put_varint(w, w->rows);
+    flush_buf(w);
+    int rc = w->failed || gzclose(w->gz) != Z_OK ? -1 : 0;
+    free(w);
+    return rc;
+}
+
+// Returns the number of bytes now buffered from r->pos, at least want unless
+// the file ended.
+static size_t fill(struct archive_reader *r, size_t want) {
+    if (r->len - r->pos >= want) return r->len - r->pos;
+    memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+    r->len -= r->pos;
+    r->pos = 0;
+    while (r->len < want) {
+        int n = gzread(r->gz, r->buf + r->len, (unsigned)(sizeof(r->buf) - r->len));
+        if (n <= 0) {
+            // A cut gzip stream ends with 0 from gzread(), not -1
+            int err;
+            gzerror(r->gz, &err);
+            if (n < 0 || err != Z_OK) r->failed = 1;
+            break;
+        }
+        r->len += (size_t)n;
+    }
+    return r->len;
+}
+
+static int get_varint(struct archive_reader *r, uint64_t *v) {
+    size_t have = fill(r, 10);
+    *v = 0;
+    for (size_t i = 0; i < have && i < 10; i++) {
+        unsigned char b = r->buf[r->pos + i];
+        *v |= (uint64_t)(b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+            r->pos += i + 1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Appends n bytes of the file to r->row at off.
+static int get_bytes(struct archive_reader *r, size_t off, size_t n) {
+    if (off + n > r->row_cap) {
+        size_t cap = (off + n) * 2;
+        char *p = realloc(r->row, cap);
+        if (!p) return -1;
+        r->row = p;
+        r->row_cap = cap;
+    }
+    while (n > 0) {
+        size_t have = fill(r, 1);
+        if (!have) return -1;
+        size_t c = have < n ? have : n;
+        memcpy(r->row + off, r->buf + r->pos, c);
+        r->pos += c;
+        off += c;
+        n -= c;
+    }
+    return 0;
+}
+
+struct archive_reader *archive_reader_open(const char *path) {
+    struct archive_reader *r = calloc(1, sizeof(*r));
+    if (!r) {
+        fprintf(stderr, "Out of memory for the archive reader\n");
+        return NULL;
+    }
+    if (!(r->gz = gzopen(path, "rb"))) {
+        fprintf(stderr, "Cannot open archive '%s': %s\n", path, strerror(errno));
+        free(r);
+        return NULL;
+    }
+    gzbuffer(r->gz, ARCHIVE_BUF);
+    if (fill(r, 5) < 5 || memcmp(r->buf, ARCHIVE_MAGIC, 4) != 0 || r->buf[4] != ARCHIVE_VERSION) {
+        fprintf(stderr, "'%s' is not a history archive this server can read\n", path);
+        archive_reader_close(r);
+        return NULL;
+    }
+    r->pos = 5;
+    return r;
+}
+
+int archive_read_row(struct archive_reader *r, struct archive_row *row) {
+    if (!fill(r, 1)) return -1;
+    unsigned char tag = r->buf[r->pos++];
+    uint64_t v, ulen, mlen;
+    // The end marker must also end the file: reading on checks the gzip
+    // trailer, which a cut compressed file lacks.
+    if (tag == TAG_END)
+        return get_varint(r, &v) == 0 && v == r->rows && fill(r, 1) == 0 && !r->failed ? 0 : -1;
+    if (tag != TAG_ROW || get_varint(r, &v) != 0 || get_varint(r, &ulen) != 0 ||
+        ulen > ARCHIVE_MAX_FIELD || get_bytes(r, 0, ulen) != 0 || get_varint(r, &mlen) != 0 ||
+        mlen > ARCHIVE_MAX_FIELD || get_bytes(r, ulen, mlen) != 0)
+        return -1;
+    r->prev_ts += (long long)(v >> 1) ^ -(long long)(v & 1);
+    r->rows++;
+    row->ts_ms = r->prev_ts;
+    row->username = r->row;
+    row->username_len = ulen;
+    row->message = r->row + ulen;
+    row->message_len = mlen;
+    return 1;
+}
+
+void archive_reader_close(struct archive_reader *r) {
+    if (!r) return;
+    gzclose(r->gz);
+    free(r->row);
+    free(r);
+}
@@ -0,0 +1,47 @@
+#ifndef HISTORY_ARCHIVE_H
+#define HISTORY_ARCHIVE_H
+
+#include <stddef.h>
+
+// Compact binary dump of history rows, for moving a database between hosts
+// or seeding a test server.
+//
+// Layout, all of it deflated (gzip framing) when written with compress:
+//   "SCHA" and a version byte
+//   per row: 0x01, varint zigzag(ts_ms - previous row's ts_ms),
+//            varint username length, username, varint message length, message
+//   0x00 and a varint row count
+// ts_ms is milliseconds since the epoch, 0 when the row had no time. Varints
+// are LEB128. A file without the end marker, or whose count does not match,
+// is reported as damaged.
+
+struct archive_writer;
+struct archive_reader;
+
+struct archive_row {
+    long long ts_ms;
+    const char *username; // valid until the next read, not NUL-terminated
+    size_t username_len;
+    const char *message;
+    size_t message_len;
+};
+
+// Creates or truncates path. Returns NULL and prints the reason on failure.
+struct archive_writer *archive_writer_open(const char *path, int compress);
+
+int archive_write_row(struct archive_writer *w, const struct archive_row *row);
+
+// Writes the end marker and closes the file. Returns -1 if any write failed.
+int archive_writer_close(struct archive_writer *w);
+
+// Reads plain and compressed files alike. Returns NULL and prints the reason
+// on failure.
+struct archive_reader *archive_reader_open(const char *path);
+
+// Returns 1 with the next row in *row, 0 after the last one, -1 when the file
+// is damaged or truncated.
+int archive_read_row(struct archive_reader *r, struct archive_row *row);
+
+void archive_reader_close(struct archive_reader *r);
+
+#endif
@@ -0,0 +1,253 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "history_cache.h"
+#include "log.h"
+
+#define COMPACT_MIN_BYTES (1024 * 1024) // dead prefix worth rewriting the file for
+#define COPY_CHUNK (64 * 1024)
+
+struct history_file {
+    int refs;
+    int fd;
+    uint64_t base; // logical offset of the file's first byte
+};
+
+// Logical offset of a row's fragment and the length of its text
+struct cache_row {
+    uint64_t off;
+    uint32_t text_len;
+};
+
+struct history_cache {
+    pthread_mutex_t mutex;
+    char *path;
+    char *tmp_path;
+    struct history_file *file;
+    int failed;          // write error seen, every span goes to the database
+    uint64_t end;        // logical offset past the last row
+    uint64_t first;      // rows first .. next - 1 are kept
+    uint64_t next;
+    uint64_t mask;
+    uint64_t compact_at; // dead bytes before the next compaction attempt
+    struct cache_row *rows;
+    unsigned long served;
+    unsigned long misses;
+    unsigned long compactions;
+};
+
+// Unmasked continuation fragment, FIN clear. Returns the header length.
+static size_t fragment_header(unsigned char *h, uint64_t len) {
+    h[0] = 0x00;
+    if (len < 126) {
+        h[1] = (unsigned char)len;
+        return 2;
+    }
+    if (len < 65536) {
+        h[1] = 126;
+        h[2] = (unsigned char)(len >> 8);
+        h[3] = (unsigned char)len;
+        return 4;
+    }
+    h[1] = 127;
+    for (int i = 0; i < 8; i++) h[2 + i] = (unsigned char)(len >> (56 - 8 * i));
+    return 10;
+}
+
+static size_t fragment_header_len(uint64_t len) {
+    return len < 126 ? 2 : len < 65536 ? 4 : 10;
+}
+
+int history_file_fd(const struct history_file *f) {
+    return f->fd;
+}
+
+void history_file_release(struct history_file *f) {
+    if (f && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+static struct history_file *file_new(int fd, uint64_t base) {
+    struct history_file *f = calloc(1, sizeof(*f));
+    if (!f) return NULL;
+    f->refs = 1;
+    f->fd = fd;
+    f->base = base;
+    return f;
+}
+
+// Copies len bytes in the kernel where the filesystem allows it.
+static int copy_range(int in, off_t in_off, int out, size_t len) {
+    off_t out_off = 0;
+    while (len > 0) {
+        ssize_t n = copy_file_range(in, &in_off, out, &out_off, len, 0);
+        if (n < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            break;
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        len -= (size_t)n;
+    }
+    char buf[COPY_CHUNK];
+    while (len > 0) {
+        ssize_t n = pread(in, buf, len < sizeof(buf) ? len : sizeof(buf), in_off);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || pwrite(out, buf, (size_t)n, out_off) != n) return -1;
+        in_off += n;
+        out_off += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Moves the kept rows to a new file once the dropped ones outweigh them.
+// Caller holds hc->mutex.
+static void maybe_compact(struct history_cache *hc) {
+    uint64_t live = hc->rows[hc->first & hc->mask].off;
+    uint64_t dead = live - hc->file->base;
+    if (dead < hc->compact_at || dead < hc->end - live) return;
+    struct history_file *f = NULL;
+    int fd = open(hc->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0 || copy_range(hc->file->fd, (off_t)dead, fd, hc->end - live) != 0 ||
+        !(f = file_new(fd, live)) || rename(hc->tmp_path, hc->path) != 0) {
+        log_warn("History cache compaction of '%s' failed: %s", hc->path, strerror(errno));
+        free(f);
+        if (fd >= 0) {
+            close(fd);
+            unlink(hc->tmp_path);
+        }
+        hc->compact_at = dead * 2;
+        return;
+    }
+    history_file_release(hc->file);
+    hc->file = f;
+    hc->compact_at = COMPACT_MIN_BYTES;
+    hc->compactions++;
+}
+
+struct history_cache *history_cache_open(const char *path, int rows) {
+    struct history_cache *hc = calloc(1, sizeof(*hc));
+    if (!hc) return NULL;
+    uint64_t n = 2;
+    while (n < (uint64_t)rows) n <<= 1;
+    hc->mask = n - 1;
+    hc->compact_at = COMPACT_MIN_BYTES;
+    size_t plen = strlen(path);
+    int fd = -1;
+    if (!(hc->rows = calloc(n, sizeof(*hc->rows))) || !(hc->path = strdup(path)) ||
+        !(hc->tmp_path = malloc(plen + 5))) {
+        fprintf(stderr, "Out of memory for the history cache\n");
+        goto fail;
+    }
+    memcpy(hc->tmp_path, path, plen);
+    memcpy(hc->tmp_path + plen, ".tmp", 5);
+    unlink(hc->tmp_path); // left over from an interrupted compaction
+    if ((fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) {
+        fprintf(stderr, "Cannot create history cache '%s': %s\n", path, strerror(errno));
+        goto fail;
+    }
+    if (!(hc->file = file_new(fd, 0))) goto fail;
+    pthread_mutex_init(&hc->mutex, NULL);
+    return hc;
+fail:
+    if (fd >= 0) close(fd);
+    free(hc->tmp_path);
+    free(hc->path);
+    free(hc->rows);
+    free(hc);
+    return NULL;
+}
+
+void history_cache_close(struct history_cache *hc) {
+    if (!hc) return;
+    history_file_release(hc->file);
+    pthread_mutex_destroy(&hc->mutex);
+    free(hc->tmp_path);
+    free(hc->path);
+    free(hc->rows);
+    free(hc);
+}
+
+int history_cache_append(struct history_cache *hc, const char *username, const char *message) {
+    size_t ulen = strlen(username), mlen = strlen(message);
+    uint64_t text_len = ulen + 2 + mlen;
+    unsigned char hdr[10];
+    size_t hlen = fragment_header(hdr, text_len + 1);
+    struct iovec iov[5] = {
+        { hdr, hlen }, { "\n", 1 }, { (void *)username, ulen }, { ": ", 2 }, { (void *)message, mlen },
+    };
+    size_t total = hlen + 1 + text_len;
+    pthread_mutex_lock(&hc->mutex);
+    if (hc->failed) {
+        pthread_mutex_unlock(&hc->mutex);
+        return -1;
+    }
+    ssize_t n = pwritev(hc->file->fd, iov, 5, (off_t)(hc->end - hc->file->base));
+    if (n != (ssize_t)total) {
+        log_error("History cache '%s' stopped, history comes from the database: %s", hc->path,
+                  n < 0 ? strerror(errno) : "short write");
+        hc->failed = 1;
+        pthread_mutex_unlock(&hc->mutex);
+        return -1;
+    }
+    if (hc->next - hc->first > hc->mask) hc->first++;
+    hc->rows[hc->next & hc->mask] = (struct cache_row){ hc->end, (uint32_t)text_len };
+    hc->next++;
+    hc->end += total;
+    maybe_compact(hc);
+    pthread_mutex_unlock(&hc->mutex);
+    return 0;
+}
+
+void history_cache_skip(struct history_cache *hc, uint64_t rows) {
+    pthread_mutex_lock(&hc->mutex);
+    hc->first += rows;
+    hc->next += rows;
+    pthread_mutex_unlock(&hc->mutex);
+}
+
+int history_cache_span(struct history_cache *hc, int rows, struct history_span *span) {
+    pthread_mutex_lock(&hc->mutex);
+    uint64_t have = hc->next - hc->first;
+    if (hc->failed || rows < 0 || ((uint64_t)rows > have && hc->first > 0)) {
+        hc->misses++;
+        pthread_mutex_unlock(&hc->mutex);
+        return -1;
+    }
+    int n = (uint64_t)rows < have ? rows : (int)have;
+    if (n > 0) {
+        uint64_t base = hc->file->base, first = hc->next - (uint64_t)n;
+        const struct cache_row *r = &hc->rows[first & hc->mask];
+        span->file = hc->file;
+        __atomic_add_fetch(&hc->file->refs, 1, __ATOMIC_RELAXED);
+        span->first_off = r->off + fragment_header_len(r->text_len + 1) + 1 - base;
+        span->first_len = r->text_len;
+        span->rest_off = (n > 1 ? hc->rows[(first + 1) & hc->mask].off : hc->end) - base;
+        span->rest_len = hc->end - base - span->rest_off;
+    }
+    hc->served++;
+    pthread_mutex_unlock(&hc->mutex);
+    return n;
+}
+
+size_t history_cache_format_json(struct history_cache *hc, char *buf, size_t len) {
+    pthread_mutex_lock(&hc->mutex);
+    int n = snprintf(buf, len,
+                     "{\"rows\":%llu,\"bytes\":%llu,\"served\":%lu,\"misses\":%lu,"
+                     "\"compactions\":%lu,\"failed\":%s}",
+                     (unsigned long long)(hc->next - hc->first),
+                     (unsigned long long)(hc->end - hc->file->base), hc->served, hc->misses,
+                     hc->compactions, hc->failed ? "true" : "false");
+    pthread_mutex_unlock(&hc->mutex);
+    if (n < 0) return 0;
+    if (len && (size_t)n >= len) return len - 1;
+    return (size_t)n;
+}
@@ -0,0 +1,70 @@
+#ifndef HISTORY_CACHE_H
+#define HISTORY_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// On-disk copy of the newest history rows, stored as ready-to-send WebSocket
+// fragments so a join on a plain socket can go out with sendfile() instead of
+// a SQLite query and several copies.
+//
+// File layout: one unmasked continuation fragment per message (opcode 0, FIN
+// clear), whose payload is '\n' followed by "username: message". A history of
+// n rows is sent as a text fragment (FIN clear) holding the first row, the
+// fragments of the other n - 1 rows straight from the file, and
+// HISTORY_CACHE_END. The client receives the same '\n'-joined message a
+// snapshot from SQLite would give. Control frames may sit between fragments,
+// so lws' own pings and pongs cannot corrupt it between rows.
+//
+// The file only grows at the end. Once the rows that fell out of the window
+// take up more space than the rest, the live part is copied to a new file
+// that replaces the old one. A transfer still reading the old file keeps it
+// open through its history_file reference.
+
+#define HISTORY_CACHE_END "\x80\x00" // empty final continuation fragment
+#define HISTORY_CACHE_END_LEN 2
+
+struct history_cache;
+struct history_file;
+
+// Newest rows of the cache, oldest first. The byte ranges are offsets into
+// file; the caller holds a reference to it.
+struct history_span {
+    struct history_file *file;
+    uint64_t first_off; // text of the first row, without fragment header or '\n'
+    size_t first_len;
+    uint64_t rest_off;  // fragments of the other rows
+    size_t rest_len;
+};
+
+// Creates or truncates path. Keeps at least rows rows. Returns NULL and prints
+// the reason on failure.
+struct history_cache *history_cache_open(const char *path, int rows);
+
+// Open transfers keep their file until they release it.
+void history_cache_close(struct history_cache *hc);
+
+// Thread-safe. A write error stops the cache for good, so every history is
+// read from the database again; it is reported once.
+int history_cache_append(struct history_cache *hc, const char *username, const char *message);
+
+// Thread-safe. Returns how many of the newest rows rows are in *span, which
+// is fewer only when the whole history is shorter, or -1 when the cache no
+// longer holds that many and the caller must ask the database. span->file is
+// set, and must be released, when the result is above 0.
+int history_cache_span(struct history_cache *hc, int rows, struct history_span *span);
+
+// The database already holds rows rows the cache never saw (history kept
+// across a restart). Requests for more rows than were appended since go to
+// the database. Call before the first append.
+void history_cache_skip(struct history_cache *hc, uint64_t rows);
+
+int history_file_fd(const struct history_file *f);
+
+void history_file_release(struct history_file *f);
+
+// Rows, file size and counters as a JSON object. Returns bytes written,
+// truncated to len - 1.
+size_t history_cache_format_json(struct history_cache *hc, char *buf, size_t len);
+
+#endif
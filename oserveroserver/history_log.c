@@ -0,0 +1,543 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <zlib.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
+
+#include "history_log.h"
+#include "log.h"
+
+#define LOG_HEAD 8           // body length and CRC
+#define LOG_BODY_MIN 20      // id, ts_ms, username length
+#define LOG_BODY_MAX (16 << 20)
+#define LOG_READ_BUF (1 << 20)
+#define OP_WRITE 1           // user_data of the ring's operations
+#define OP_SPILL 2
+#define OP_SYNC 3
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_URING 1
+
+// Just enough of the io_uring ABI for write, write and fdatasync chains.
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+};
+#endif
+
+// A commit group: staged into buf, then written and synced while the next
+// one is staged into the other.
+struct log_group {
+    unsigned char *buf;    // registered with the ring as its index in groups[]
+    size_t len;
+    unsigned char *spill;  // the rest of a group larger than buf
+    size_t spill_len;
+    size_t spill_cap;
+    unsigned long rows;
+    uint64_t off;
+    long long submitted_us;
+};
+
+struct history_log {
+    char *path;
+    int fd;
+    uint64_t off;          // where the next group goes
+    struct log_group groups[2];
+    int cur;               // the group being staged
+    int inflight;          // the other one is on the ring
+#ifdef HAVE_URING
+    struct uring ring;
+    int uring;             // 0 when the kernel refused it
+    unsigned ops;          // operations of the group in flight
+#endif
+    pthread_mutex_t stats_mutex;
+    unsigned long long groups_done;
+    unsigned long long rows;
+    unsigned long long bytes;
+    unsigned long long commit_us; // submit to synced, summed over groups
+    unsigned long stalls;  // commits that waited for the group before
+    unsigned long resets;
+    unsigned long failures;
+};
+
+static void put_le(unsigned char *p, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static long long mono_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#ifdef HAVE_URING
+static int uring_setup(struct uring *r, unsigned entries) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) return -1;
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len) r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sq_ring = mmap(NULL, r->sq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) goto fail;
+    r->cq_ring = r->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        r->cq_ring = mmap(NULL, r->cq_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) goto fail;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+                   IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail;
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+fail:
+    if (r->sqes && r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_len);
+    if (r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+    return -1;
+}
+
+static void uring_close(struct uring *r) {
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_len);
+    munmap(r->sq_ring, r->sq_ring_len);
+    close(r->fd);
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r) {
+    unsigned tail = *r->sq_tail;
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    return sqe;
+}
+
+// Submits what uring_sqe() queued, without waiting for it.
+static int uring_submit(struct uring *r, unsigned n) {
+    while (n > 0) {
+        int rc = (int)syscall(__NR_io_uring_enter, r->fd, n, 0, 0, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            return -1;
+        }
+        n -= (unsigned)rc;
+    }
+    return 0;
+}
+
+// Waits for n completions. res[] is indexed by user_data. Sets *stalled when
+// they were not all in already.
+static int uring_reap(struct uring *r, unsigned n, int res[4], int *stalled) {
+    unsigned done = 0;
+    *stalled = 0;
+    for (;;) {
+        unsigned head = *r->cq_head;
+        while (done < n && head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            if (cqe->user_data < 4) res[cqe->user_data] = cqe->res;
+            head++;
+            done++;
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+        if (done == n) return 0;
+        *stalled = 1;
+        if (syscall(__NR_io_uring_enter, r->fd, 0, n - done, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+            errno != EINTR)
+            return -1;
+    }
+}
+
+// Registers both group buffers and the log file, so writes skip the page
+// pinning and file lookup per operation.
+static int uring_start(struct history_log *hl) {
+    if (uring_setup(&hl->ring, 8) != 0) return -1;
+    struct iovec iov[2] = { { hl->groups[0].buf, HISTORY_LOG_BUF }, { hl->groups[1].buf, HISTORY_LOG_BUF } };
+    if (syscall(__NR_io_uring_register, hl->ring.fd, IORING_REGISTER_BUFFERS, iov, 2) != 0 ||
+        syscall(__NR_io_uring_register, hl->ring.fd, IORING_REGISTER_FILES, &hl->fd, 1) != 0) {
+        int err = errno;
+        uring_close(&hl->ring);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+// The group as linked operations: the registered buffer, the spill if any,
+// then fdatasync. A failed or short write cancels what follows it.
+static int uring_start_group(struct history_log *hl, int gi) {
+    struct log_group *g = &hl->groups[gi];
+    struct io_uring_sqe *sqe;
+    unsigned n = 0;
+    if (g->len) {
+        sqe = uring_sqe(&hl->ring);
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->fd = 0;
+        sqe->addr = (uint64_t)(uintptr_t)g->buf;
+        sqe->len = (unsigned)g->len;
+        sqe->off = g->off;
+        sqe->buf_index = (uint16_t)gi;
+        sqe->user_data = OP_WRITE;
+        n++;
+    }
+    if (g->spill_len) {
+        sqe = uring_sqe(&hl->ring);
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+        sqe->fd = 0;
+        sqe->addr = (uint64_t)(uintptr_t)g->spill;
+        sqe->len = (unsigned)g->spill_len;
+        sqe->off = g->off + g->len;
+        sqe->user_data = OP_SPILL;
+        n++;
+    }
+    sqe = uring_sqe(&hl->ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = 0;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = OP_SYNC;
+    n++;
+    hl->ops = n;
+    return uring_submit(&hl->ring, n);
+}
+
+static int uring_finish_group(struct history_log *hl, struct log_group *g, int *stalled) {
+    int res[4] = { 0, 0, 0, 0 };
+    if (uring_reap(&hl->ring, hl->ops, res, stalled) != 0) return -1;
+    if ((g->len && res[OP_WRITE] != (int)g->len) ||
+        (g->spill_len && res[OP_SPILL] != (int)g->spill_len) || res[OP_SYNC] != 0) {
+        errno = res[OP_WRITE] < 0 ? -res[OP_WRITE] : res[OP_SPILL] < 0 ? -res[OP_SPILL]
+              : res[OP_SYNC] < 0 ? -res[OP_SYNC] : EIO;
+        return -1;
+    }
+    return 0;
+}
+#endif
+
+static int plain_write_group(struct history_log *hl, struct log_group *g) {
+    struct iovec iov[2] = { { g->buf, g->len }, { g->spill, g->spill_len } };
+    size_t want = g->len + g->spill_len;
+    ssize_t n;
+    do {
+        n = pwritev(hl->fd, iov, g->spill_len ? 2 : 1, (off_t)g->off);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)want) {
+        if (n >= 0) errno = EIO;
+        return -1;
+    }
+    return fdatasync(hl->fd);
+}
+
+static void clear_group(struct log_group *g) {
+    g->len = 0;
+    g->spill_len = 0;
+    g->rows = 0;
+}
+
+static void count_group(struct history_log *hl, struct log_group *g, int rc, int stalled) {
+    pthread_mutex_lock(&hl->stats_mutex);
+    if (rc == 0) {
+        hl->groups_done++;
+        hl->rows += g->rows;
+        hl->bytes += g->len + g->spill_len;
+        hl->commit_us += (unsigned long long)(mono_us() - g->submitted_us);
+    } else {
+        hl->failures++;
+    }
+    hl->stalls += (unsigned long)stalled;
+    pthread_mutex_unlock(&hl->stats_mutex);
+    if (rc != 0) log_error("Failed to write history log %s: %s", hl->path, strerror(errno));
+}
+
+// Best effort: a preallocated file does not grow with each group, so
+// fdatasync has less metadata to write.
+static void preallocate(struct history_log *hl) {
+    if (fallocate(hl->fd, 0, 0, HISTORY_LOG_SEGMENT) != 0 && errno != EOPNOTSUPP)
+        log_warn("Cannot preallocate history log %s: %s", hl->path, strerror(errno));
+}
+
+// Whatever follows the last intact record is the rest of a torn group, which
+// may still hold whole records behind the damaged one. New groups overwrite it
+// only as far as they reach, so a later replay could run on past a shorter
+// group into those stale records; zeroing the tail restores the empty record
+// that ends the log.
+static void clear_tail(struct history_log *hl) {
+    struct stat sb;
+    if (fstat(hl->fd, &sb) != 0 || (uint64_t)sb.st_size <= hl->off) return;
+    off_t len = sb.st_size - (off_t)hl->off;
+    if (fallocate(hl->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)hl->off, len) != 0) {
+        if (errno != EOPNOTSUPP || ftruncate(hl->fd, (off_t)hl->off) != 0) {
+            log_warn("Cannot clear the tail of history log %s: %s", hl->path, strerror(errno));
+            return;
+        }
+        preallocate(hl);
+    }
+    if (fdatasync(hl->fd) != 0)
+        log_warn("Cannot sync history log %s: %s", hl->path, strerror(errno));
+}
+
+struct history_log *history_log_open(const char *path, int keep) {
+    struct history_log *hl = calloc(1, sizeof(*hl));
+    if (!hl) return NULL;
+    hl->fd = -1;
+    pthread_mutex_init(&hl->stats_mutex, NULL);
+    if (!(hl->path = strdup(path)) ||
+        posix_memalign((void **)&hl->groups[0].buf, 4096, HISTORY_LOG_BUF) != 0 ||
+        posix_memalign((void **)&hl->groups[1].buf, 4096, HISTORY_LOG_BUF) != 0) {
+        history_log_close(hl);
+        return NULL;
+    }
+    if ((hl->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC | (keep ? 0 : O_TRUNC), 0600)) < 0) {
+        fprintf(stderr, "Cannot open history log '%s': %s\n", path, strerror(errno));
+        history_log_close(hl);
+        return NULL;
+    }
+    preallocate(hl);
+#ifdef HAVE_URING
+    hl->uring = uring_start(hl) == 0;
+    if (!hl->uring)
+        fprintf(stderr, "Warning: io_uring unavailable (%s); history log uses pwritev and fdatasync\n",
+                strerror(errno));
+#endif
+    return hl;
+}
+
+void history_log_close(struct history_log *hl) {
+    if (!hl) return;
+    if (hl->fd >= 0) history_log_flush(hl);
+#ifdef HAVE_URING
+    if (hl->uring) uring_close(&hl->ring);
+#endif
+    if (hl->fd >= 0) close(hl->fd);
+    pthread_mutex_destroy(&hl->stats_mutex);
+    for (int i = 0; i < 2; i++) {
+        free(hl->groups[i].spill);
+        free(hl->groups[i].buf);
+    }
+    free(hl->path);
+    free(hl);
+}
+
+long history_log_replay(struct history_log *hl, history_log_replay_fn fn, void *arg) {
+    unsigned char *buf = malloc(LOG_READ_BUF);
+    if (!buf) return -1;
+    size_t cap = LOG_READ_BUF, len = 0, pos = 0;
+    uint64_t off = 0; // file offset of buf[0]
+    long rows = 0;
+    int eof = 0;
+    for (;;) {
+        if (len - pos < LOG_HEAD || len - pos < LOG_HEAD + get_le(buf + pos, 4)) {
+            size_t need = len - pos >= LOG_HEAD ? LOG_HEAD + (size_t)get_le(buf + pos, 4) : LOG_HEAD;
+            if (eof || need > LOG_HEAD + LOG_BODY_MAX) break;
+            memmove(buf, buf + pos, len - pos);
+            off += pos;
+            len -= pos;
+            pos = 0;
+            if (need > cap) {
+                unsigned char *p = realloc(buf, need);
+                if (!p) break;
+                buf = p;
+                cap = need;
+            }
+            ssize_t n = pread(hl->fd, buf + len, cap - len, (off_t)(off + len));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                log_error("Cannot read history log %s: %s", hl->path, strerror(errno));
+                free(buf);
+                return -1;
+            }
+            if (n == 0) eof = 1;
+            len += (size_t)n;
+            continue;
+        }
+        const unsigned char *rec = buf + pos;
+        size_t body_len = (size_t)get_le(rec, 4);
+        const unsigned char *body = rec + LOG_HEAD;
+        if (body_len < LOG_BODY_MIN ||
+            (uint32_t)get_le(rec + 4, 4) != (uint32_t)crc32(0, body, (uInt)body_len))
+            break;
+        size_t ulen = (size_t)get_le(body + 16, 4);
+        if (ulen > body_len - LOG_BODY_MIN) break;
+        struct history_log_row row = {
+            .id = get_le(body, 8),
+            .ts_ms = (long long)get_le(body + 8, 8),
+            .username = (const char *)body + LOG_BODY_MIN,
+            .username_len = ulen,
+            .message = (const char *)body + LOG_BODY_MIN + ulen,
+            .message_len = body_len - LOG_BODY_MIN - ulen,
+        };
+        if (fn(arg, &row) != 0) {
+            free(buf);
+            return -1;
+        }
+        rows++;
+        pos += LOG_HEAD + body_len;
+    }
+    free(buf);
+    hl->off = off + pos;
+    clear_tail(hl);
+    return rows;
+}
+
+int history_log_stage(struct history_log *hl, const struct history_log_row *row) {
+    struct log_group *g = &hl->groups[hl->cur];
+    size_t body_len = LOG_BODY_MIN + row->username_len + row->message_len;
+    size_t need = LOG_HEAD + body_len;
+    if (body_len > LOG_BODY_MAX) return -1;
+    unsigned char *p;
+    if (!g->spill_len && g->len + need <= HISTORY_LOG_BUF) {
+        p = g->buf + g->len;
+        g->len += need;
+    } else {
+        if (g->spill_len + need > g->spill_cap) {
+            size_t cap = (g->spill_len + need) * 2;
+            unsigned char *np = realloc(g->spill, cap);
+            if (!np) return -1;
+            g->spill = np;
+            g->spill_cap = cap;
+        }
+        p = g->spill + g->spill_len;
+        g->spill_len += need;
+    }
+    unsigned char *body = p + LOG_HEAD;
+    put_le(body, row->id, 8);
+    put_le(body + 8, (uint64_t)row->ts_ms, 8);
+    put_le(body + 16, row->username_len, 4);
+    memcpy(body + LOG_BODY_MIN, row->username, row->username_len);
+    memcpy(body + LOG_BODY_MIN + row->username_len, row->message, row->message_len);
+    put_le(p, body_len, 4);
+    put_le(p + 4, crc32(0, body, (uInt)body_len), 4);
+    g->rows++;
+    return 0;
+}
+
+void history_log_discard(struct history_log *hl) {
+    clear_group(&hl->groups[hl->cur]);
+}
+
+int history_log_flush(struct history_log *hl) {
+#ifdef HAVE_URING
+    if (!hl->inflight) return 0;
+    struct log_group *g = &hl->groups[hl->cur ^ 1];
+    int stalled = 0;
+    int rc = uring_finish_group(hl, g, &stalled);
+    count_group(hl, g, rc, stalled);
+    clear_group(g);
+    hl->inflight = 0;
+    return rc;
+#else
+    (void)hl;
+    return 0;
+#endif
+}
+
+int history_log_commit(struct history_log *hl) {
+    struct log_group *g = &hl->groups[hl->cur];
+    if (!g->rows) return 0;
+    int rc = history_log_flush(hl);
+    g->off = hl->off;
+    g->submitted_us = mono_us();
+    hl->off += g->len + g->spill_len;
+#ifdef HAVE_URING
+    if (hl->uring) {
+        if (uring_start_group(hl, hl->cur) != 0) {
+            count_group(hl, g, -1, 0);
+            clear_group(g);
+            return -1;
+        }
+        hl->inflight = 1;
+        hl->cur ^= 1;
+        return rc;
+    }
+#endif
+    int wrc = plain_write_group(hl, g);
+    count_group(hl, g, wrc, 0);
+    clear_group(g);
+    return rc == 0 ? wrc : rc;
+}
+
+uint64_t history_log_size(struct history_log *hl) {
+    return hl->off;
+}
+
+int history_log_reset(struct history_log *hl) {
+    int rc = history_log_flush(hl);
+    if (ftruncate(hl->fd, 0) != 0) {
+        log_error("Cannot truncate history log %s: %s", hl->path, strerror(errno));
+        return -1;
+    }
+    hl->off = 0;
+    preallocate(hl);
+    pthread_mutex_lock(&hl->stats_mutex);
+    hl->resets++;
+    pthread_mutex_unlock(&hl->stats_mutex);
+    return rc;
+}
+
+size_t history_log_format_json(struct history_log *hl, char *buf, size_t len) {
+    pthread_mutex_lock(&hl->stats_mutex);
+    const char *backend = "pwritev";
+#ifdef HAVE_URING
+    if (hl->uring) backend = "io_uring";
+#endif
+    int n = snprintf(buf, len,
+                     "{\"backend\":\"%s\",\"groups\":%llu,\"rows\":%llu,\"bytes\":%llu,"
+                     "\"avg_sync_us\":%.1f,\"stalls\":%lu,\"resets\":%lu,\"failures\":%lu}",
+                     backend, hl->groups_done, hl->rows, hl->bytes,
+                     hl->groups_done ? (double)hl->commit_us / (double)hl->groups_done : 0.0,
+                     hl->stalls, hl->resets, hl->failures);
+    pthread_mutex_unlock(&hl->stats_mutex);
+    return n > 0 && (size_t)n < len ? (size_t)n : 0;
+}
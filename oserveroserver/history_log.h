@@ -0,0 +1,71 @@
+#ifndef HISTORY_LOG_H
+#define HISTORY_LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Append-only log of committed history rows, so SQLite can commit without
+// syncing: a row is durable once its commit group is in the log.
+//
+// Rows are staged into one of two buffers registered with io_uring. A commit
+// submits the group's write and fdatasync as linked operations and returns
+// without waiting; the next commit, or history_log_flush(), reaps them. So a
+// group syncs while the caller runs its next transaction, and a crash can lose
+// at most the last group committed. Kernels or sandboxes without io_uring get
+// pwritev() and fdatasync(), synchronously.
+//
+// Record, little-endian: u32 length of the body, u32 CRC-32 of the body, then
+// the body: u64 id, i64 ts_ms, u32 username length, username, message. The
+// file is preallocated; reading stops at the first record that is empty,
+// short or fails its CRC, which is where a torn write ends the log.
+
+#define HISTORY_LOG_BUF (1 << 20)        // each of the two staging buffers
+#define HISTORY_LOG_SEGMENT (64 << 20)   // preallocated; past it the log wants a reset
+
+struct history_log;
+
+struct history_log_row {
+    uint64_t id;
+    long long ts_ms;
+    const char *username;
+    size_t username_len;
+    const char *message;
+    size_t message_len;
+};
+
+// Returns 0 to go on, -1 to stop the replay.
+typedef int (*history_log_replay_fn)(void *arg, const struct history_log_row *row);
+
+// Opens or creates path. Without keep the file is emptied. Returns NULL and
+// prints the reason on failure.
+struct history_log *history_log_open(const char *path, int keep);
+
+void history_log_close(struct history_log *hl);
+
+// Calls fn for every intact record, oldest first, and positions appends after
+// the last of them; the rest of the file is zeroed. Returns the records read, -1 on a read error or when fn
+// stopped it. Right after history_log_open() only.
+long history_log_replay(struct history_log *hl, history_log_replay_fn fn, void *arg);
+
+// Adds a row to the open commit group.
+int history_log_stage(struct history_log *hl, const struct history_log_row *row);
+
+// Waits for the group before this one, then starts writing this one. Returns
+// -1 if either failed to reach the disk; the group is dropped either way.
+int history_log_commit(struct history_log *hl);
+
+// Waits until every committed group is on the disk. Returns -1 if one was not.
+int history_log_flush(struct history_log *hl);
+
+// Drops the commit group, for a transaction that rolled back.
+void history_log_discard(struct history_log *hl);
+
+// Bytes appended since the last reset.
+uint64_t history_log_size(struct history_log *hl);
+
+// Empties the log, once everything in it is durable elsewhere.
+int history_log_reset(struct history_log *hl);
+
+size_t history_log_format_json(struct history_log *hl, char *buf, size_t len);
+
+#endif
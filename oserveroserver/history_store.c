@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "history_store.h"
+#include "log.h"
+
+#define BLOCK_LEVEL 6    // deflate level used when sealing
+#define DECODED_SLOTS 4  // decompressed blocks kept for the next reads
+
+// Sealed rows, each '\n'-terminated before compression
+struct store_block {
+    uint64_t first; // sequence number of its first row
+    uint32_t rows;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    unsigned char data[];
+};
+
+struct decoded_block {
+    uint64_t first;     // of the block it holds
+    char *raw;          // NULL when the slot is free
+    unsigned long used; // hs->clock at the last hit
+};
+
+struct history_store {
+    pthread_mutex_t mutex;
+    size_t budget;
+    // Blocks oldest first, as a ring of block_cap pointers starting at head
+    struct store_block **blocks;
+    size_t block_cap;
+    size_t head;
+    size_t nblocks;
+    size_t block_bytes;       // memory of the blocks
+    uint64_t block_raw_bytes; // what they hold uncompressed
+    uint64_t first;           // oldest row held
+    uint64_t next;            // sequence number of the next row
+    char *tail;               // rows since the last block, '\n'-terminated
+    size_t tail_len;
+    size_t tail_cap;
+    uint32_t tail_rows;
+    unsigned char *scratch;   // deflate output before it is sized into a block
+    size_t scratch_cap;
+    struct decoded_block decoded[DECODED_SLOTS];
+    unsigned long clock;
+    unsigned long sealed;
+    unsigned long evicted_blocks;
+    unsigned long decompressed;
+    unsigned long decoded_hits;
+    unsigned long misses;
+};
+
+struct history_store *history_store_create(size_t budget) {
+    struct history_store *hs = calloc(1, sizeof(*hs));
+    if (!hs) return NULL;
+    hs->budget = budget;
+    hs->tail_cap = HISTORY_BLOCK_BYTES * 2;
+    hs->block_cap = 16;
+    if (!(hs->tail = malloc(hs->tail_cap)) ||
+        !(hs->blocks = calloc(hs->block_cap, sizeof(*hs->blocks)))) {
+        fprintf(stderr, "Out of memory for the history store\n");
+        free(hs->tail);
+        free(hs);
+        return NULL;
+    }
+    pthread_mutex_init(&hs->mutex, NULL);
+    return hs;
+}
+
+void history_store_destroy(struct history_store *hs) {
+    if (!hs) return;
+    for (size_t i = 0; i < hs->nblocks; i++) free(hs->blocks[(hs->head + i) % hs->block_cap]);
+    for (int i = 0; i < DECODED_SLOTS; i++) free(hs->decoded[i].raw);
+    pthread_mutex_destroy(&hs->mutex);
+    free(hs->blocks);
+    free(hs->tail);
+    free(hs->scratch);
+    free(hs);
+}
+
+// Caller holds hs->mutex.
+static void drop_oldest_block(struct history_store *hs) {
+    struct store_block *b = hs->blocks[hs->head];
+    hs->blocks[hs->head] = NULL;
+    hs->head = (hs->head + 1) % hs->block_cap;
+    hs->nblocks--;
+    hs->first = b->first + b->rows;
+    hs->block_bytes -= sizeof(*b) + b->comp_len;
+    hs->block_raw_bytes -= b->raw_len;
+    hs->evicted_blocks++;
+    free(b);
+}
+
+// Compresses the tail into a new block and drops the oldest blocks that no
+// longer fit the budget. Caller holds hs->mutex.
+static int seal_tail(struct history_store *hs) {
+    uLong bound = compressBound((uLong)hs->tail_len);
+    if (bound > hs->scratch_cap) {
+        unsigned char *s = realloc(hs->scratch, bound);
+        if (!s) return -1;
+        hs->scratch = s;
+        hs->scratch_cap = bound;
+    }
+    if (hs->nblocks == hs->block_cap) {
+        size_t ncap = hs->block_cap * 2;
+        struct store_block **nb = calloc(ncap, sizeof(*nb));
+        if (!nb) return -1;
+        for (size_t i = 0; i < hs->nblocks; i++) nb[i] = hs->blocks[(hs->head + i) % hs->block_cap];
+        free(hs->blocks);
+        hs->blocks = nb;
+        hs->block_cap = ncap;
+        hs->head = 0;
+    }
+    uLongf clen = bound;
+    if (compress2(hs->scratch, &clen, (const Bytef *)hs->tail, (uLong)hs->tail_len, BLOCK_LEVEL) != Z_OK)
+        return -1;
+    struct store_block *b = malloc(sizeof(*b) + clen);
+    if (!b) return -1;
+    b->first = hs->next - hs->tail_rows;
+    b->rows = hs->tail_rows;
+    b->raw_len = (uint32_t)hs->tail_len;
+    b->comp_len = (uint32_t)clen;
+    memcpy(b->data, hs->scratch, clen);
+    hs->blocks[(hs->head + hs->nblocks) % hs->block_cap] = b;
+    hs->nblocks++;
+    hs->block_bytes += sizeof(*b) + clen;
+    hs->block_raw_bytes += hs->tail_len;
+    hs->tail_len = 0;
+    hs->tail_rows = 0;
+    hs->sealed++;
+    while (hs->nblocks > 0 && hs->block_bytes + hs->tail_cap > hs->budget) drop_oldest_block(hs);
+    return 0;
+}
+
+int history_store_append(struct history_store *hs, const char *username, const char *message) {
+    size_t ulen = strlen(username), mlen = strlen(message);
+    size_t len = ulen + 2 + mlen + 1;
+    pthread_mutex_lock(&hs->mutex);
+    if (hs->tail_len + len > hs->tail_cap) {
+        // Only after sealing failed, or for a row longer than a block
+        size_t ncap = (hs->tail_len + len) * 2;
+        char *t = realloc(hs->tail, ncap);
+        if (!t) {
+            pthread_mutex_unlock(&hs->mutex);
+            return -1;
+        }
+        hs->tail = t;
+        hs->tail_cap = ncap;
+    }
+    char *p = hs->tail + hs->tail_len;
+    memcpy(p, username, ulen);
+    memcpy(p + ulen, ": ", 2);
+    memcpy(p + ulen + 2, message, mlen);
+    p[len - 1] = '\n';
+    hs->tail_len += len;
+    hs->tail_rows++;
+    hs->next++;
+    if (hs->tail_len >= HISTORY_BLOCK_BYTES && seal_tail(hs) != 0)
+        log_warn("Sealing a history block failed, keeping %zu bytes uncompressed", hs->tail_len);
+    pthread_mutex_unlock(&hs->mutex);
+    return 0;
+}
+
+void history_store_skip(struct history_store *hs, uint64_t rows) {
+    pthread_mutex_lock(&hs->mutex);
+    hs->first += rows;
+    hs->next += rows;
+    pthread_mutex_unlock(&hs->mutex);
+}
+
+// Offset of the last k rows in '\n'-terminated buf, 0 when it holds no more.
+static size_t last_rows_offset(const char *buf, size_t len, uint64_t k) {
+    size_t start = len - 1; // the last row's '\n'
+    for (; k > 0; k--) {
+        const char *nl = start ? memrchr(buf, '\n', start) : NULL;
+        if (!nl) return 0;
+        start = (size_t)(nl - buf);
+    }
+    return start + 1;
+}
+
+// Rows of b, from a decoded slot or freshly inflated; *fresh is set when the
+// caller owns the buffer. Caller holds hs->mutex.
+static char *block_rows(struct history_store *hs, const struct store_block *b, int *fresh) {
+    for (int i = 0; i < DECODED_SLOTS; i++) {
+        struct decoded_block *d = &hs->decoded[i];
+        if (d->raw && d->first == b->first) {
+            d->used = ++hs->clock;
+            hs->decoded_hits++;
+            *fresh = 0;
+            return d->raw;
+        }
+    }
+    char *raw = malloc(b->raw_len);
+    uLongf rlen = b->raw_len;
+    if (!raw || uncompress((Bytef *)raw, &rlen, b->data, b->comp_len) != Z_OK || rlen != b->raw_len) {
+        free(raw);
+        return NULL;
+    }
+    hs->decompressed++;
+    *fresh = 1;
+    return raw;
+}
+
+// Takes raw into the least recently used slot. Caller holds hs->mutex.
+static void keep_decoded(struct history_store *hs, uint64_t first, char *raw) {
+    struct decoded_block *slot = &hs->decoded[0];
+    for (int i = 0; i < DECODED_SLOTS; i++) {
+        struct decoded_block *d = &hs->decoded[i];
+        if (!d->raw) {
+            slot = d;
+            break;
+        }
+        if (d->used < slot->used) slot = d;
+    }
+    free(slot->raw);
+    slot->first = first;
+    slot->raw = raw;
+    slot->used = ++hs->clock;
+}
+
+struct row_piece {
+    const char *p;
+    size_t len;
+    char *fresh;     // inflated for this read, handed to keep_decoded() after
+    uint64_t first;
+};
+
+int history_store_read(struct history_store *hs, int rows, history_store_alloc alloc, void *arg) {
+    pthread_mutex_lock(&hs->mutex);
+    uint64_t have = hs->next - hs->first;
+    if (rows < 0 || ((uint64_t)rows > have && hs->first > 0)) {
+        hs->misses++;
+        pthread_mutex_unlock(&hs->mutex);
+        return -1;
+    }
+    uint64_t n = (uint64_t)rows < have ? (uint64_t)rows : have, left = n;
+    struct row_piece *pieces = calloc(hs->nblocks + 1, sizeof(*pieces));
+    size_t np = 0, total = 0;
+    int ok = pieces != NULL;
+    // Newest first: the tail, then blocks back from the newest
+    if (ok && left && hs->tail_rows) {
+        uint64_t k = left < hs->tail_rows ? left : hs->tail_rows;
+        size_t off = last_rows_offset(hs->tail, hs->tail_len, k);
+        pieces[np++] = (struct row_piece){ hs->tail + off, hs->tail_len - off, NULL, 0 };
+        left -= k;
+    }
+    for (size_t i = hs->nblocks; ok && left && i-- > 0; ) {
+        const struct store_block *b = hs->blocks[(hs->head + i) % hs->block_cap];
+        int fresh;
+        char *raw = block_rows(hs, b, &fresh);
+        if (!raw) {
+            log_error("History block from row %llu is damaged", (unsigned long long)b->first);
+            ok = 0;
+            break;
+        }
+        uint64_t k = left < b->rows ? left : b->rows;
+        size_t off = k == b->rows ? 0 : last_rows_offset(raw, b->raw_len, k);
+        pieces[np++] = (struct row_piece){ raw + off, b->raw_len - off, fresh ? raw : NULL, b->first };
+        left -= k;
+    }
+    for (size_t i = 0; i < np; i++) total += pieces[i].len;
+    if (total) total--; // no '\n' after the newest row
+    char *out = ok ? alloc(arg, total) : NULL;
+    if (out) {
+        size_t o = 0;
+        for (size_t i = np; i-- > 0; ) {
+            size_t c = pieces[i].len < total - o ? pieces[i].len : total - o;
+            memcpy(out + o, pieces[i].p, c);
+            o += c;
+        }
+    }
+    for (size_t i = 0; i < np; i++) {
+        if (pieces[i].fresh) keep_decoded(hs, pieces[i].first, pieces[i].fresh);
+    }
+    pthread_mutex_unlock(&hs->mutex);
+    free(pieces);
+    return out ? (int)n : -1;
+}
+
+size_t history_store_format_json(struct history_store *hs, char *buf, size_t len) {
+    pthread_mutex_lock(&hs->mutex);
+    uint64_t raw = hs->block_raw_bytes + hs->tail_len;
+    size_t stored = hs->block_bytes + hs->tail_len;
+    int n = snprintf(buf, len,
+                     "{\"rows\":%llu,\"blocks\":%zu,\"tail_rows\":%u,\"raw_bytes\":%llu,"
+                     "\"stored_bytes\":%zu,\"ratio\":%.2f,\"sealed\":%lu,\"evicted_blocks\":%lu,"
+                     "\"decompressed\":%lu,\"decoded_hits\":%lu,\"misses\":%lu}",
+                     (unsigned long long)(hs->next - hs->first), hs->nblocks, hs->tail_rows,
+                     (unsigned long long)raw, stored, stored ? (double)raw / stored : 1.0,
+                     hs->sealed, hs->evicted_blocks, hs->decompressed, hs->decoded_hits,
+                     hs->misses);
+    pthread_mutex_unlock(&hs->mutex);
+    if (n < 0) return 0;
+    if (len && (size_t)n >= len) return len - 1;
+    return (size_t)n;
+}
@@ -0,0 +1,45 @@
+#ifndef HISTORY_STORE_H
+#define HISTORY_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// In-memory history: "username: message" rows, kept as deflate-compressed
+// blocks of about HISTORY_BLOCK_BYTES plus an uncompressed tail of the newest
+// rows. A full tail is sealed into a block by the thread that appends the row
+// that fills it. Reads decompress only the blocks they reach into, and keep
+// the last few decompressed blocks for the next read. Once the blocks exceed
+// the memory budget the oldest are dropped, and their rows have to come from
+// the database again.
+
+#define HISTORY_BLOCK_BYTES (64 * 1024)
+
+struct history_store;
+
+// budget is the memory for compressed blocks and the tail, in bytes.
+struct history_store *history_store_create(size_t budget);
+
+void history_store_destroy(struct history_store *hs);
+
+// Thread-safe. Returns -1 when out of memory, which leaves the store as it was.
+int history_store_append(struct history_store *hs, const char *username, const char *message);
+
+// The database already holds rows rows the store never saw (history kept
+// across a restart). Reads of more rows than were appended since then fail.
+// Call before the first append.
+void history_store_skip(struct history_store *hs, uint64_t rows);
+
+// Returns the buffer for a result of len bytes, NULL to give up.
+typedef char *(*history_store_alloc)(void *arg, size_t len);
+
+// Thread-safe. Writes the newest rows rows, oldest first and '\n'-joined,
+// into a buffer from alloc; fewer when the whole history is shorter. Returns
+// how many rows that is, or -1 when the store no longer holds that many or a
+// block is damaged or alloc failed.
+int history_store_read(struct history_store *hs, int rows, history_store_alloc alloc, void *arg);
+
+// Rows, sizes, compression ratio and counters as a JSON object. Returns bytes
+// written, truncated to len - 1.
+size_t history_store_format_json(struct history_store *hs, char *buf, size_t len);
+
+#endif
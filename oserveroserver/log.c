@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#define LOG_MSG_MAX 384
+#define RING_SLOTS 512          // power of two
+#define SITE_RATE 20            // messages per call site per second
+#define DRAIN_INTERVAL_NS 10000000L
+#define OUT_BUF_SIZE 65536
+
+struct log_record {
+    struct timespec ts;
+    const struct log_site *site;
+    int level;
+    unsigned suppressed;
+    char msg[LOG_MSG_MAX];
+};
+
+// One producer (the owning thread), one consumer (the writer thread).
+struct log_ring {
+    struct log_ring *next;
+    int in_use;              // owned by a live thread
+    char thread[16];
+    unsigned long head;      // next slot to fill, written by the producer
+    unsigned long tail;      // next slot to drain, written by the consumer
+    unsigned long dropped;   // full-ring drops not yet reported
+    struct log_record slots[RING_SLOTS];
+};
+
+int log_min_level = LOG_LVL_INFO;
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+static struct log_ring *rings; // push-only list
+static __thread struct log_ring *my_ring;
+static pthread_key_t ring_key;
+static pthread_once_t key_once = PTHREAD_ONCE_INIT;
+
+static pthread_t writer_tid;
+static int running;
+static int stopping;
+static int json_output;
+static unsigned long total_dropped;
+static unsigned long total_suppressed;
+
+static void release_ring(void *arg) {
+    struct log_ring *r = arg;
+    __atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void) {
+    pthread_key_create(&ring_key, release_ring);
+}
+
+// A drained ring left by an exited thread is reused before a new one is
+// allocated, so thread churn does not grow the list.
+static struct log_ring *claim_ring(void) {
+    pthread_once(&key_once, make_key);
+    struct log_ring *r;
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        int idle = 0;
+        if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) &&
+            __atomic_compare_exchange_n(&r->in_use, &idle, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!r) {
+        r = calloc(1, sizeof(*r));
+        if (!r) return NULL;
+        r->in_use = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    if (pthread_getname_np(pthread_self(), r->thread, sizeof(r->thread)) != 0) r->thread[0] = '\0';
+    pthread_setspecific(ring_key, r);
+    my_ring = r;
+    return r;
+}
+
+static const char *base_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash ? slash + 1 : path;
+}
+
+static size_t json_escape(char *buf, size_t len, const char *s) {
+    size_t off = 0;
+    for (; *s && off + 7 < len; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') {
+            buf[off++] = '\\';
+            buf[off++] = (char)c;
+        } else if (c < 0x20) {
+            off += (size_t)snprintf(buf + off, len - off, "\\u%04x", c);
+        } else {
+            buf[off++] = (char)c;
+        }
+    }
+    return off;
+}
+
+// One output line, newline included. Returns its length, at most len - 1.
+static size_t format_record(char *buf, size_t len, const struct log_record *rec, const char *thread) {
+    struct tm tm;
+    char ts[32];
+    gmtime_r(&rec->ts.tv_sec, &tm);
+    size_t t = strftime(ts, sizeof(ts), "%Y-%m-%dT%H:%M:%S", &tm);
+    snprintf(ts + t, sizeof(ts) - t, ".%03ldZ", rec->ts.tv_nsec / 1000000);
+    const char *file = rec->site ? base_name(rec->site->file) : "log.c";
+    int line = rec->site ? rec->site->line : 0;
+    size_t off = 0;
+#define APPEND(...) do { \
+        size_t at_ = off < len ? off : len; \
+        int w_ = snprintf(buf + at_, len - at_, __VA_ARGS__); \
+        if (w_ > 0) off += (size_t)w_; \
+    } while (0)
+    if (json_output) {
+        APPEND("{\"ts\":\"%s\",\"level\":\"%s\",\"thread\":\"", ts, level_names[rec->level]);
+        if (off < len) off += json_escape(buf + off, len - off, thread);
+        APPEND("\",\"src\":\"%s:%d\",\"msg\":\"", file, line);
+        if (off < len) off += json_escape(buf + off, len - off, rec->msg);
+        if (rec->suppressed) APPEND("\",\"suppressed\":%u}\n", rec->suppressed);
+        else APPEND("\"}\n");
+    } else {
+        APPEND("%s %-5s [%s] %s:%d: %s", ts, level_names[rec->level], thread, file, line, rec->msg);
+        if (rec->suppressed) APPEND(" (%u similar suppressed)", rec->suppressed);
+        APPEND("\n");
+    }
+#undef APPEND
+    if (len && off >= len) {
+        off = len - 1;
+        if (off) buf[off - 1] = '\n';
+    }
+    return off;
+}
+
+static void write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDERR_FILENO, buf, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+// Counts the message against its site's per-second budget. Returns 0 when it
+// is suppressed, otherwise 1 with *suppressed set to the messages dropped
+// since the site last got through.
+static int site_admit(struct log_site *site, long now, unsigned *suppressed) {
+    long w = __atomic_load_n(&site->window, __ATOMIC_RELAXED);
+    if (w != now && __atomic_compare_exchange_n(&site->window, &w, now, 0,
+                                                __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+    if (__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > SITE_RATE) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&total_suppressed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    *suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void log_emit(struct log_site *site, enum log_level level, const char *fmt, ...) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    unsigned suppressed;
+    if (!site_admit(site, ts.tv_sec, &suppressed)) return;
+
+    va_list ap;
+    struct log_ring *r = __atomic_load_n(&running, __ATOMIC_ACQUIRE) ? my_ring : NULL;
+    if (__atomic_load_n(&running, __ATOMIC_ACQUIRE) && !r) r = claim_ring();
+    if (!r) {
+        // Synchronous path: before log_start(), after log_stop() or out of memory.
+        struct log_record rec = { ts, site, level, suppressed, "" };
+        char line[LOG_MSG_MAX + 256], name[16] = "";
+        va_start(ap, fmt);
+        vsnprintf(rec.msg, sizeof(rec.msg), fmt, ap);
+        va_end(ap);
+        pthread_getname_np(pthread_self(), name, sizeof(name));
+        write_all(line, format_record(line, sizeof(line), &rec, name));
+        return;
+    }
+    unsigned long head = r->head;
+    if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+        __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&total_dropped, 1, __ATOMIC_RELAXED);
+        if (suppressed) __atomic_add_fetch(&site->suppressed, suppressed, __ATOMIC_RELAXED);
+        return;
+    }
+    struct log_record *rec = &r->slots[head & (RING_SLOTS - 1)];
+    rec->ts = ts;
+    rec->site = site;
+    rec->level = level;
+    rec->suppressed = suppressed;
+    va_start(ap, fmt);
+    vsnprintf(rec->msg, sizeof(rec->msg), fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out every ring's records in one or more large writes.
+static void drain(char *out) {
+    size_t used = 0;
+    for (struct log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        unsigned long head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        unsigned long tail = r->tail;
+        for (; tail != head; tail++) {
+            if (OUT_BUF_SIZE - used < LOG_MSG_MAX * 2 + 512) {
+                write_all(out, used);
+                used = 0;
+            }
+            used += format_record(out + used, OUT_BUF_SIZE - used, &r->slots[tail & (RING_SLOTS - 1)], r->thread);
+            // Release each slot as soon as it is copied, so a busy producer
+            // gets room back before the write.
+            __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        unsigned long dropped = __atomic_exchange_n(&r->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped) {
+            struct log_record rec = { { 0, 0 }, NULL, LOG_LVL_WARN, 0, "" };
+            clock_gettime(CLOCK_REALTIME, &rec.ts);
+            snprintf(rec.msg, sizeof(rec.msg), "%lu log messages dropped, ring full", dropped);
+            if (OUT_BUF_SIZE - used < LOG_MSG_MAX * 2 + 512) {
+                write_all(out, used);
+                used = 0;
+            }
+            used += format_record(out + used, OUT_BUF_SIZE - used, &rec, r->thread);
+        }
+    }
+    write_all(out, used);
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    char *out = malloc(OUT_BUF_SIZE);
+    if (!out) return NULL;
+    pthread_setname_np(pthread_self(), "log");
+    for (;;) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        drain(out);
+        if (stop) break;
+        struct timespec ts = { 0, DRAIN_INTERVAL_NS };
+        nanosleep(&ts, NULL);
+    }
+    free(out);
+    return NULL;
+}
+
+int log_parse_level(const char *name) {
+    for (int i = LOG_LVL_DEBUG; i <= LOG_LVL_ERROR; i++) {
+        if (strcasecmp(name, level_names[i]) == 0) return i;
+    }
+    return -1;
+}
+
+void log_set_level(enum log_level level) {
+    __atomic_store_n(&log_min_level, (int)level, __ATOMIC_RELAXED);
+}
+
+int log_start(int json) {
+    if (running) return 0;
+    json_output = json;
+    stopping = 0;
+    if (pthread_create(&writer_tid, NULL, writer_main, NULL) != 0) {
+        fprintf(stderr, "Failed to start the log writer thread\n");
+        return -1;
+    }
+    __atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void log_stop(void) {
+    if (!running) return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(writer_tid, NULL);
+}
+
+void log_counters(unsigned long *dropped, unsigned long *suppressed) {
+    if (dropped) *dropped = __atomic_load_n(&total_dropped, __ATOMIC_RELAXED);
+    if (suppressed) *suppressed = __atomic_load_n(&total_suppressed, __ATOMIC_RELAXED);
+}
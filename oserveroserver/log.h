@@ -0,0 +1,62 @@
+#ifndef LOG_H
+#define LOG_H
+
+// Process-wide logger. Each thread formats its messages into its own
+// single-producer ring, and a background thread writes them to stderr, so a
+// service thread never blocks on the terminal or a pipe. A full ring drops
+// the message and counts it. Each call site may log 20 messages per second;
+// the rest are counted and reported with the next message that gets through.
+//
+// Until log_start() (and after log_stop()) messages are written synchronously,
+// so tools that link the engine's modules need no setup.
+
+enum log_level {
+    LOG_LVL_DEBUG,
+    LOG_LVL_INFO,
+    LOG_LVL_WARN,
+    LOG_LVL_ERROR,
+};
+
+// Per call site state, one static instance per log_*() use.
+struct log_site {
+    const char *file;
+    int line;
+    long window;         // second the count applies to
+    unsigned count;
+    unsigned suppressed;
+};
+
+extern int log_min_level;
+
+#define log_at(level, ...) do { \
+        if ((level) >= log_min_level) { \
+            static struct log_site site_ = { __FILE__, __LINE__, 0, 0, 0 }; \
+            log_emit(&site_, (level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#define log_debug(...) log_at(LOG_LVL_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_LVL_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_LVL_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_LVL_ERROR, __VA_ARGS__)
+
+void log_emit(struct log_site *site, enum log_level level, const char *fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+// Parses "debug", "info", "warn" or "error". Returns -1 for anything else.
+int log_parse_level(const char *name);
+
+void log_set_level(enum log_level level);
+
+// Starts the writer thread; json selects one JSON object per line instead of
+// plain text. Returns -1 if the thread cannot be started.
+int log_start(int json);
+
+// Writes out everything queued and stops the writer thread.
+void log_stop(void);
+
+// Messages dropped because a ring was full, and suppressed by the per-site
+// limit, since start.
+void log_counters(unsigned long *dropped, unsigned long *suppressed);
+
+#endif
@@ -0,0 +1,194 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+
+#include "placement.h"
+#include "log.h"
+
+// From <numaif.h>; spelled out so the build does not need libnuma.
+#define PLACEMENT_MPOL_PREFERRED 1
+
+struct placed_thread {
+    int used;
+    pid_t tid;
+    char name[16];
+    char cpus[64];
+    int node; // -1 when unpinned or the CPUs span several nodes
+};
+
+static struct placed_thread threads[PLACEMENT_MAX_THREADS];
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static pid_t current_tid(void) {
+    return (pid_t)syscall(SYS_gettid);
+}
+
+int placement_parse_cpus(const char *list, void *cpu_set) {
+    cpu_set_t *set = cpu_set;
+    CPU_ZERO(set);
+    const char *p = list;
+    while (*p) {
+        char *end;
+        long lo = strtol(p, &end, 10);
+        if (end == p || lo < 0) return -1;
+        long hi = lo;
+        p = end;
+        if (*p == '-') {
+            p++;
+            hi = strtol(p, &end, 10);
+            if (end == p || hi < lo) return -1;
+            p = end;
+        }
+        if (hi >= CPU_SETSIZE) return -1;
+        for (long c = lo; c <= hi; c++) CPU_SET((int)c, set);
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    return CPU_COUNT(set) > 0 ? 0 : -1;
+}
+
+const char *placement_nth_list(const char *spec, int i, char *buf, size_t len) {
+    if (!spec || !*spec) return NULL;
+    const char *p = spec;
+    for (; i > 0; i--) {
+        p = strchr(p, ':');
+        if (!p) return NULL;
+        p++;
+    }
+    size_t n = strcspn(p, ":");
+    if (n == 0 || n >= len) return NULL;
+    memcpy(buf, p, n);
+    buf[n] = '\0';
+    return buf;
+}
+
+static int node_of_cpu(int cpu) {
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR *d = opendir(path);
+    if (!d) return -1;
+    int node = -1;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0) {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(d);
+    return node;
+}
+
+// Node shared by every CPU in set, or -1.
+static int node_of_set(const cpu_set_t *set) {
+    int node = -1;
+    for (int c = 0; c < CPU_SETSIZE; c++) {
+        if (!CPU_ISSET(c, set)) continue;
+        int n = node_of_cpu(c);
+        if (n < 0 || (node >= 0 && n != node)) return -1;
+        node = n;
+    }
+    return node;
+}
+
+static void record(const char *name, const char *cpus, int node) {
+    pid_t tid = current_tid();
+    pthread_mutex_lock(&threads_mutex);
+    struct placed_thread *slot = NULL;
+    for (int i = 0; i < PLACEMENT_MAX_THREADS; i++) {
+        if (threads[i].used && threads[i].tid == tid) { slot = &threads[i]; break; }
+        if (!threads[i].used && !slot) slot = &threads[i];
+    }
+    if (slot) {
+        slot->used = 1;
+        slot->tid = tid;
+        snprintf(slot->name, sizeof(slot->name), "%s", name);
+        snprintf(slot->cpus, sizeof(slot->cpus), "%s", cpus ? cpus : "");
+        slot->node = node;
+    }
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+int placement_apply(const char *name, const char *cpus) {
+    // Renaming the main thread would rename the process in ps/top.
+    if (current_tid() != getpid()) pthread_setname_np(pthread_self(), name);
+    if (!cpus || !*cpus) {
+        record(name, NULL, -1);
+        return 0;
+    }
+    cpu_set_t set;
+    if (placement_parse_cpus(cpus, &set) != 0) {
+        log_error("Invalid CPU list '%s' for %s", cpus, name);
+        return -1;
+    }
+    int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (rc != 0) {
+        log_error("Failed to pin %s to CPUs %s: %s", name, cpus, strerror(rc));
+        return -1;
+    }
+    int node = node_of_set(&set);
+    if (node >= 0 && node < (int)(8 * sizeof(unsigned long))) {
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_set_mempolicy, PLACEMENT_MPOL_PREFERRED, &mask, 8 * sizeof(mask)) != 0)
+            node = -1; // kernel without NUMA support; pinning still applies
+    }
+    record(name, cpus, node);
+    return 0;
+}
+
+void placement_forget(void) {
+    pid_t tid = current_tid();
+    pthread_mutex_lock(&threads_mutex);
+    for (int i = 0; i < PLACEMENT_MAX_THREADS; i++) {
+        if (threads[i].used && threads[i].tid == tid) threads[i].used = 0;
+    }
+    pthread_mutex_unlock(&threads_mutex);
+}
+
+// CPU the thread last ran on, field 39 of /proc/self/task/<tid>/stat.
+static int last_cpu(pid_t tid) {
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int)tid);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    char *p = strrchr(buf, ')'); // comm may contain spaces
+    if (!p) return -1;
+    int field = 2;
+    for (p++; *p && field < 39; p++) {
+        if (*p == ' ') field++;
+    }
+    return field == 39 ? atoi(p) : -1;
+}
+
+size_t placement_format_json(char *buf, size_t len) {
+    size_t off = 0;
+    int first = 1;
+#define APPEND(...) do { \
+        size_t at_ = off < len ? off : len; \
+        int w_ = snprintf(buf + at_, len - at_, __VA_ARGS__); \
+        if (w_ > 0) off += (size_t)w_; \
+    } while (0)
+    APPEND("[");
+    pthread_mutex_lock(&threads_mutex);
+    for (int i = 0; i < PLACEMENT_MAX_THREADS; i++) {
+        const struct placed_thread *t = &threads[i];
+        if (!t->used) continue;
+        APPEND("%s{\"name\":\"%s\",\"tid\":%d,\"cpus\":\"%s\",\"node\":%d,\"last_cpu\":%d}",
+               first ? "" : ",", t->name, (int)t->tid, t->cpus, t->node, last_cpu(t->tid));
+        first = 0;
+    }
+    pthread_mutex_unlock(&threads_mutex);
+    APPEND("]");
+#undef APPEND
+    if (len && off >= len) off = len - 1;
+    return off;
+}
@@ -0,0 +1,31 @@
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <stddef.h>
+
+// CPU pinning and NUMA placement for the engine's threads. Each pinned thread
+// prefers memory from the node of its CPUs, so what it allocates afterwards
+// (clients it accepts, frames it builds, its malloc arena) stays node-local.
+
+#define PLACEMENT_MAX_THREADS 64
+
+// Parses a CPU list such as "0-3,8". Returns -1 on a malformed list.
+int placement_parse_cpus(const char *list, void *cpu_set /* cpu_set_t * */);
+
+// Returns the i-th ':'-separated CPU list of spec ("0-1:2-3" -> "2-3" for i=1)
+// copied into buf, or NULL when spec has fewer entries.
+const char *placement_nth_list(const char *spec, int i, char *buf, size_t len);
+
+// Names the calling thread and, when cpus is non-NULL and non-empty, pins it
+// and sets a preferred-node memory policy for the node those CPUs belong to.
+// The thread is recorded for placement_format_json() either way.
+int placement_apply(const char *name, const char *cpus);
+
+// Forgets the calling thread (on thread exit).
+void placement_forget(void);
+
+// Appends a JSON array describing every recorded thread to buf. Returns the
+// number of bytes written (excluding the terminator), truncated to len - 1.
+size_t placement_format_json(char *buf, size_t len);
+
+#endif
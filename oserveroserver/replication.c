@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "replication.h"
+#include "unix_socket.h"
+#include "placement.h"
+#include "log.h"
+
+#define REPL_MAX_STANDBYS 4
+#define REPL_SOCKET_MODE 0600      // the stream carries the whole history
+#define REPL_IO_TIMEOUT_S 5         // a standby that stops reading is dropped
+#define REPL_FRAME_MIN 22           // id, ts_ms, username length, two NULs
+#define REPL_FRAME_MAX (64 << 20)
+#define REPL_BATCH 256              // rows per apply call on the standby
+#define REPL_RECV_BUF (256 * 1024)
+#define REPL_RECONNECT_PAUSE_MS 100 // most between connections that carry nothing
+
+struct repl_buf {
+    unsigned char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct repl_standby {
+    struct repl_server *rs;
+    int fd;
+    pthread_t tid;
+    pthread_cond_t cond; // queue grew, or stopping
+    // The rest under rs->mutex
+    int live;            // takes rows from repl_publish()/repl_commit()
+    int oom;             // a catch-up row did not fit; the chunk is read again
+    int done;            // sender thread finished
+    struct repl_buf queue;
+    uint64_t queued_id;  // last row queued or taken by the sender
+    uint64_t taken_id;   // last row taken by the sender
+};
+
+struct repl_server {
+    char *path;
+    int listen_fd;
+    int stop_pipe[2];
+    repl_catch_up_fn catch_up;
+    void *arg;
+    pthread_t tid;
+    int running;
+    pthread_mutex_t mutex;
+    int stop;                                     // under mutex
+    struct repl_standby *standbys[REPL_MAX_STANDBYS]; // under mutex
+    unsigned long long rows_live;                 // under mutex, as are the counters below
+    unsigned long long rows_caught_up;
+    unsigned long long bytes_sent;
+    unsigned long connects;
+    unsigned long overflows;
+    // Under the caller's lock
+    struct repl_buf staged;
+    uint64_t staged_id;
+    unsigned long staged_rows;
+    int staged_failed;
+};
+
+struct repl_client {
+    char *path;
+    repl_apply_fn apply;
+    repl_lost_fn lost;
+    void *arg;
+    pthread_t tid;
+    pthread_mutex_t mutex;
+    int fd;              // under mutex, as are stop and the counters
+    int stop;
+    int primary_lost;
+    uint64_t last_id;    // last row applied
+    long long last_ts_ms;
+    unsigned long long rows;
+    unsigned long reconnects;
+    unsigned char *buf;  // client thread only
+    size_t len;
+    size_t cap;
+    struct repl_row batch[REPL_BATCH];
+};
+
+static void put_le(unsigned char *p, uint64_t v, int n) {
+    for (int i = 0; i < n; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static uint64_t get_le(const unsigned char *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) v |= (uint64_t)p[i] << (8 * i);
+    return v;
+}
+
+static int buf_reserve(struct repl_buf *b, size_t more) {
+    if (b->len + more <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + more) cap *= 2;
+    unsigned char *p = realloc(b->data, cap);
+    if (!p) return -1;
+    b->data = p;
+    b->cap = cap;
+    return 0;
+}
+
+static int encode_row(struct repl_buf *b, const struct repl_row *row) {
+    size_t body = REPL_FRAME_MIN + row->username_len + row->message_len;
+    if (body > REPL_FRAME_MAX || buf_reserve(b, 4 + body) != 0) return -1;
+    unsigned char *p = b->data + b->len;
+    put_le(p, body, 4);
+    put_le(p + 4, row->id, 8);
+    put_le(p + 12, (uint64_t)row->ts_ms, 8);
+    put_le(p + 20, row->username_len, 4);
+    memcpy(p + 24, row->username, row->username_len);
+    p[24 + row->username_len] = '\0';
+    memcpy(p + 25 + row->username_len, row->message, row->message_len);
+    p[25 + row->username_len + row->message_len] = '\0';
+    b->len += 4 + body;
+    return 0;
+}
+
+static int read_all(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Sender thread of one standby: reads the hello, then alternates between
+// catching up from the database and sending what the live stream queued.
+static void *sender_main(void *arg) {
+    struct repl_standby *st = arg;
+    struct repl_server *rs = st->rs;
+    struct repl_buf out = { 0 };
+    unsigned char hello[8];
+    placement_apply("replication", NULL);
+    if (read_all(st->fd, hello, sizeof(hello)) == 0) {
+        pthread_mutex_lock(&rs->mutex);
+        st->queued_id = st->taken_id = get_le(hello, 8);
+        pthread_mutex_unlock(&rs->mutex);
+        log_info("Standby connected to %s, from row %llu", rs->path,
+                 (unsigned long long)st->queued_id);
+        for (;;) {
+            pthread_mutex_lock(&rs->mutex);
+            while (!st->queue.len && st->live && !rs->stop) pthread_cond_wait(&st->cond, &rs->mutex);
+            if (!st->queue.len && rs->stop) {
+                pthread_mutex_unlock(&rs->mutex);
+                break;
+            }
+            if (!st->queue.len) {
+                uint64_t after = st->queued_id;
+                st->oom = 0;
+                pthread_mutex_unlock(&rs->mutex);
+                if (rs->catch_up(rs->arg, st, after, REPL_CATCH_UP_ROWS) < 0) break;
+                continue;
+            }
+            struct repl_buf b = st->queue;
+            st->queue = out;
+            st->taken_id = st->queued_id;
+            pthread_mutex_unlock(&rs->mutex);
+            out = b;
+            if (unix_socket_write_all(st->fd, out.data, out.len) != 0) break;
+            pthread_mutex_lock(&rs->mutex);
+            rs->bytes_sent += out.len;
+            pthread_mutex_unlock(&rs->mutex);
+            out.len = 0;
+        }
+    }
+    pthread_mutex_lock(&rs->mutex);
+    if (!rs->stop) log_warn("Standby on %s disconnected after row %llu", rs->path,
+                            (unsigned long long)st->taken_id);
+    st->live = 0;
+    st->done = 1;
+    pthread_mutex_unlock(&rs->mutex);
+    free(out.data);
+    placement_forget();
+    return NULL;
+}
+
+static void free_standby(struct repl_standby *st) {
+    pthread_join(st->tid, NULL);
+    close(st->fd);
+    pthread_cond_destroy(&st->cond);
+    free(st->queue.data);
+    free(st);
+}
+
+static void accept_standby(struct repl_server *rs) {
+    int fd = accept4(rs->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0) return;
+    // The socket file is owner only; an abstract socket has no file mode, so
+    // the same rule is checked on the peer.
+    unsigned uid = 0;
+    if (!unix_socket_peer_allowed(fd, &uid)) {
+        log_warn("Refused standby connection from uid %u", uid);
+        close(fd);
+        return;
+    }
+    struct timeval tv = { REPL_IO_TIMEOUT_S, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    struct repl_standby *st = calloc(1, sizeof(*st));
+    if (!st) {
+        close(fd);
+        return;
+    }
+    st->rs = rs;
+    st->fd = fd;
+    pthread_cond_init(&st->cond, NULL);
+    struct repl_standby *reaped[REPL_MAX_STANDBYS];
+    int nreaped = 0, slot = -1;
+    pthread_mutex_lock(&rs->mutex);
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        if (rs->standbys[i] && rs->standbys[i]->done) {
+            reaped[nreaped++] = rs->standbys[i];
+            rs->standbys[i] = NULL;
+        }
+        if (!rs->standbys[i] && slot < 0) slot = i;
+    }
+    if (slot >= 0 && pthread_create(&st->tid, NULL, sender_main, st) == 0) {
+        rs->standbys[slot] = st;
+        rs->connects++;
+        st = NULL;
+    }
+    pthread_mutex_unlock(&rs->mutex);
+    for (int i = 0; i < nreaped; i++) free_standby(reaped[i]);
+    if (st) {
+        log_warn("Refused a standby on %s: %s", rs->path,
+                 slot < 0 ? "too many standbys" : "no thread");
+        close(fd);
+        pthread_cond_destroy(&st->cond);
+        free(st);
+    }
+}
+
+static void *accept_main(void *arg) {
+    struct repl_server *rs = arg;
+    placement_apply("repl-accept", NULL);
+    for (;;) {
+        struct pollfd pfds[2] = { { rs->stop_pipe[0], POLLIN, 0 }, { rs->listen_fd, POLLIN, 0 } };
+        if (poll(pfds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            log_error("Replication socket poll failed: %s", strerror(errno));
+            break;
+        }
+        if (pfds[0].revents) break;
+        if (pfds[1].revents & POLLIN) accept_standby(rs);
+    }
+    placement_forget();
+    return NULL;
+}
+
+struct repl_server *repl_server_start(const char *path, repl_catch_up_fn catch_up, void *arg) {
+    struct repl_server *rs = calloc(1, sizeof(*rs));
+    if (!rs) return NULL;
+    rs->catch_up = catch_up;
+    rs->arg = arg;
+    rs->listen_fd = -1;
+    rs->stop_pipe[0] = rs->stop_pipe[1] = -1;
+    pthread_mutex_init(&rs->mutex, NULL);
+    if (!(rs->path = strdup(path)) || pipe2(rs->stop_pipe, O_CLOEXEC) != 0 ||
+        (rs->listen_fd = unix_socket_listen(path, REPL_SOCKET_MODE, REPL_MAX_STANDBYS,
+                                            "replication")) < 0 ||
+        pthread_create(&rs->tid, NULL, accept_main, rs) != 0) {
+        if (rs->listen_fd >= 0) fprintf(stderr, "Failed to start the replication thread\n");
+        repl_server_stop(rs);
+        return NULL;
+    }
+    rs->running = 1;
+    return rs;
+}
+
+void repl_server_stop(struct repl_server *rs) {
+    if (!rs) return;
+    if (rs->running) {
+        if (write(rs->stop_pipe[1], "x", 1) < 0) {}
+        pthread_join(rs->tid, NULL);
+    }
+    // Refuse new connections first: a standby whose stream then ends finds
+    // nobody listening and takes over.
+    if (rs->listen_fd >= 0) {
+        close(rs->listen_fd);
+        if (rs->path[0] != '@') unlink(rs->path);
+    }
+    pthread_mutex_lock(&rs->mutex);
+    rs->stop = 1;
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++)
+        if (rs->standbys[i]) pthread_cond_signal(&rs->standbys[i]->cond);
+    pthread_mutex_unlock(&rs->mutex);
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++)
+        if (rs->standbys[i]) free_standby(rs->standbys[i]);
+    if (rs->stop_pipe[0] >= 0) {
+        close(rs->stop_pipe[0]);
+        close(rs->stop_pipe[1]);
+    }
+    pthread_mutex_destroy(&rs->mutex);
+    free(rs->staged.data);
+    free(rs->path);
+    free(rs);
+}
+
+void repl_queue_row(struct repl_standby *st, const struct repl_row *row) {
+    struct repl_server *rs = st->rs;
+    pthread_mutex_lock(&rs->mutex);
+    if (!st->oom && encode_row(&st->queue, row) == 0) {
+        st->queued_id = row->id;
+        rs->rows_caught_up++;
+    } else {
+        st->oom = 1;
+    }
+    pthread_mutex_unlock(&rs->mutex);
+}
+
+void repl_go_live(struct repl_standby *st) {
+    pthread_mutex_lock(&st->rs->mutex);
+    if (!st->oom) st->live = 1;
+    pthread_mutex_unlock(&st->rs->mutex);
+}
+
+void repl_stage(struct repl_server *rs, const struct repl_row *row) {
+    if (encode_row(&rs->staged, row) != 0) rs->staged_failed = 1;
+    rs->staged_id = row->id;
+    rs->staged_rows++;
+}
+
+void repl_discard(struct repl_server *rs) {
+    rs->staged.len = 0;
+    rs->staged_rows = 0;
+    rs->staged_failed = 0;
+}
+
+void repl_commit(struct repl_server *rs) {
+    if (!rs->staged_rows) return;
+    pthread_mutex_lock(&rs->mutex);
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        struct repl_standby *st = rs->standbys[i];
+        if (!st || !st->live) continue;
+        if (rs->staged_failed || st->queue.len + rs->staged.len > REPL_QUEUE_MAX ||
+            buf_reserve(&st->queue, rs->staged.len) != 0) {
+            // Too far behind to queue for: back to the database after the
+            // last row the sender took.
+            st->live = 0;
+            st->queue.len = 0;
+            st->queued_id = st->taken_id;
+            rs->overflows++;
+            log_warn("Standby on %s fell behind at row %llu; catching up from the database",
+                     rs->path, (unsigned long long)st->taken_id);
+        } else {
+            memcpy(st->queue.data + st->queue.len, rs->staged.data, rs->staged.len);
+            st->queue.len += rs->staged.len;
+            st->queued_id = rs->staged_id;
+        }
+        pthread_cond_signal(&st->cond);
+    }
+    rs->rows_live += rs->staged_rows;
+    pthread_mutex_unlock(&rs->mutex);
+    repl_discard(rs);
+}
+
+void repl_publish(struct repl_server *rs, const struct repl_row *row) {
+    repl_stage(rs, row);
+    repl_commit(rs);
+}
+
+size_t repl_server_format_json(struct repl_server *rs, char *buf, size_t len) {
+    pthread_mutex_lock(&rs->mutex);
+    int standbys = 0, live = 0;
+    for (int i = 0; i < REPL_MAX_STANDBYS; i++) {
+        struct repl_standby *st = rs->standbys[i];
+        if (!st || st->done) continue;
+        standbys++;
+        live += st->live;
+    }
+    int n = snprintf(buf, len,
+                     "{\"standbys\":%d,\"live\":%d,\"connects\":%lu,\"rows_live\":%llu,"
+                     "\"rows_caught_up\":%llu,\"bytes_sent\":%llu,\"overflows\":%lu}",
+                     standbys, live, rs->connects, rs->rows_live, rs->rows_caught_up,
+                     rs->bytes_sent, rs->overflows);
+    pthread_mutex_unlock(&rs->mutex);
+    return n > 0 && (size_t)n < len ? (size_t)n : 0;
+}
+
+// Returns a connected socket that has asked for the rows after after, or -1
+// with errno set.
+static int connect_primary(const char *path, uint64_t after) {
+    struct sockaddr_un addr;
+    socklen_t alen = unix_socket_addr(path, &addr);
+    if (!alen) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unsigned char hello[8];
+    put_le(hello, after, 8);
+    if (connect(fd, (struct sockaddr *)&addr, alen) != 0 ||
+        unix_socket_write_all(fd, hello, sizeof(hello)) != 0) {
+        int err = errno;
+        close(fd);
+        errno = err;
+        return -1;
+    }
+    return fd;
+}
+
+static void deliver(struct repl_client *rc, int n) {
+    rc->apply(rc->arg, rc->batch, n);
+    pthread_mutex_lock(&rc->mutex);
+    rc->last_id = rc->batch[n - 1].id;
+    rc->last_ts_ms = rc->batch[n - 1].ts_ms;
+    rc->rows += (unsigned long long)n;
+    pthread_mutex_unlock(&rc->mutex);
+}
+
+// Applies every complete frame in the buffer and keeps the partial one.
+// Returns -1 on a malformed frame.
+static int consume(struct repl_client *rc) {
+    size_t pos = 0;
+    int nb = 0, bad = 0;
+    while (rc->len - pos >= 4) {
+        size_t body = (size_t)get_le(rc->buf + pos, 4);
+        if (body < REPL_FRAME_MIN || body > REPL_FRAME_MAX) {
+            bad = 1;
+            break;
+        }
+        if (rc->len - pos - 4 < body) break;
+        const unsigned char *p = rc->buf + pos + 4;
+        size_t ulen = (size_t)get_le(p + 16, 4);
+        if (ulen > body - REPL_FRAME_MIN || p[20 + ulen] || p[body - 1]) {
+            bad = 1;
+            break;
+        }
+        rc->batch[nb++] = (struct repl_row){
+            .id = get_le(p, 8),
+            .ts_ms = (long long)get_le(p + 8, 8),
+            .username = (const char *)p + 20,
+            .username_len = ulen,
+            .message = (const char *)p + 21 + ulen,
+            .message_len = body - REPL_FRAME_MIN - ulen,
+        };
+        pos += 4 + body;
+        if (nb == REPL_BATCH) {
+            deliver(rc, nb);
+            nb = 0;
+        }
+    }
+    if (nb) deliver(rc, nb);
+    if (bad) return -1;
+    memmove(rc->buf, rc->buf + pos, rc->len - pos);
+    rc->len -= pos;
+    // A frame larger than the buffer
+    size_t need = rc->len >= 4 ? 4 + (size_t)get_le(rc->buf, 4) : 0;
+    if (need > rc->cap) {
+        unsigned char *p = realloc(rc->buf, need);
+        if (!p) return -1;
+        rc->buf = p;
+        rc->cap = need;
+    }
+    return 0;
+}
+
+static void *client_main(void *arg) {
+    struct repl_client *rc = arg;
+    // A primary that is exiting can still accept a connection and then
+    // close it, so the first retries come quickly.
+    int got_any = 0, pause_ms = 0;
+    placement_apply("standby", NULL);
+    for (;;) {
+        ssize_t n = read(rc->fd, rc->buf + rc->len, rc->cap - rc->len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n > 0) {
+            got_any = 1;
+            pause_ms = 0;
+            rc->len += (size_t)n;
+            if (consume(rc) == 0) continue;
+            log_error("Malformed replication frame from %s", rc->path);
+        }
+        // The stream ended. While the primary still listens this was only
+        // the connection; otherwise the primary is gone.
+        pthread_mutex_lock(&rc->mutex);
+        int stop = rc->stop;
+        uint64_t after = rc->last_id;
+        if (!stop) {
+            close(rc->fd);
+            rc->fd = -1;
+        }
+        pthread_mutex_unlock(&rc->mutex);
+        if (stop) break;
+        if (!got_any) {
+            pause_ms = pause_ms ? pause_ms * 2 : 1;
+            if (pause_ms > REPL_RECONNECT_PAUSE_MS) pause_ms = REPL_RECONNECT_PAUSE_MS;
+            usleep((useconds_t)pause_ms * 1000);
+        }
+        int fd = connect_primary(rc->path, after);
+        int err = errno;
+        pthread_mutex_lock(&rc->mutex);
+        stop = rc->stop;
+        if (stop && fd >= 0) close(fd);
+        else if (fd >= 0) rc->reconnects++;
+        else if (!stop) rc->primary_lost = 1;
+        if (!stop) rc->fd = fd;
+        pthread_mutex_unlock(&rc->mutex);
+        if (stop) break;
+        if (fd >= 0) {
+            log_warn("Replication stream from %s broke; resumed after row %llu", rc->path,
+                     (unsigned long long)after);
+            rc->len = 0;
+            got_any = 0;
+            continue;
+        }
+        log_warn("Primary at %s is gone (%s) after row %llu", rc->path, strerror(err),
+                 (unsigned long long)after);
+        rc->lost(rc->arg);
+        break;
+    }
+    placement_forget();
+    return NULL;
+}
+
+struct repl_client *repl_client_start(const char *path, uint64_t after, repl_apply_fn apply,
+                                      repl_lost_fn lost, void *arg) {
+    struct repl_client *rc = calloc(1, sizeof(*rc));
+    if (!rc) return NULL;
+    rc->apply = apply;
+    rc->lost = lost;
+    rc->arg = arg;
+    rc->last_id = after;
+    rc->cap = REPL_RECV_BUF;
+    if (!(rc->path = strdup(path)) || !(rc->buf = malloc(rc->cap))) {
+        free(rc->path);
+        free(rc);
+        return NULL;
+    }
+    if ((rc->fd = connect_primary(path, after)) < 0) {
+        fprintf(stderr, "Cannot reach the primary at '%s': %s\n", path, strerror(errno));
+        free(rc->buf);
+        free(rc->path);
+        free(rc);
+        return NULL;
+    }
+    pthread_mutex_init(&rc->mutex, NULL);
+    if (pthread_create(&rc->tid, NULL, client_main, rc) != 0) {
+        fprintf(stderr, "Failed to start the standby thread\n");
+        close(rc->fd);
+        pthread_mutex_destroy(&rc->mutex);
+        free(rc->buf);
+        free(rc->path);
+        free(rc);
+        return NULL;
+    }
+    return rc;
+}
+
+void repl_client_stop(struct repl_client *rc) {
+    if (!rc) return;
+    pthread_mutex_lock(&rc->mutex);
+    rc->stop = 1;
+    if (rc->fd >= 0) shutdown(rc->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&rc->mutex);
+    pthread_join(rc->tid, NULL);
+    if (rc->fd >= 0) close(rc->fd);
+    pthread_mutex_destroy(&rc->mutex);
+    free(rc->buf);
+    free(rc->path);
+    free(rc);
+}
+
+size_t repl_client_format_json(struct repl_client *rc, char *buf, size_t len) {
+    pthread_mutex_lock(&rc->mutex);
+    int n = snprintf(buf, len,
+                     "{\"connected\":%s,\"primary_lost\":%s,\"rows\":%llu,\"last_id\":%llu,"
+                     "\"last_ts_ms\":%lld,\"reconnects\":%lu}",
+                     rc->fd >= 0 ? "true" : "false", rc->primary_lost ? "true" : "false",
+                     rc->rows, (unsigned long long)rc->last_id, rc->last_ts_ms, rc->reconnects);
+    pthread_mutex_unlock(&rc->mutex);
+    return n > 0 && (size_t)n < len ? (size_t)n : 0;
+}
@@ -0,0 +1,91 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Streams stored history rows to hot standby processes over a local UNIX
+// socket, and follows such a stream on the standby side.
+//
+// A standby connects and sends the highest row id it already holds, as 8
+// bytes little-endian. The primary answers with every later row from its
+// database, read REPL_CATCH_UP_ROWS at a time, then with each row as it
+// commits, in id order. One frame per row, little-endian:
+//   u32 length of the rest, u64 id, i64 ts_ms (0 when the row has no time),
+//   u32 username length, username, NUL, message, NUL
+// There are no acknowledgements; a standby trails the primary by its queue
+// and the socket buffers.
+//
+// Live rows are queued per standby without waiting on it. A standby whose
+// queue passes REPL_QUEUE_MAX goes back to reading from the database after
+// the last row it was handed, and rejoins the live stream once caught up.
+// The socket is created mode 0600, and only peers running as the server's
+// user or root are served, which also covers a leading '@' in the path: the
+// Linux abstract namespace, where the mode does not apply.
+
+#define REPL_QUEUE_MAX (16 << 20)
+#define REPL_CATCH_UP_ROWS 1024
+
+struct repl_row {
+    uint64_t id;
+    long long ts_ms;
+    const char *username; // NUL-terminated
+    size_t username_len;
+    const char *message;  // NUL-terminated
+    size_t message_len;
+};
+
+struct repl_server;
+struct repl_standby;
+struct repl_client;
+
+// Queues up to max rows with ids above after for st with repl_queue_row(),
+// under the lock the publishing side holds, and calls repl_go_live() before
+// releasing it when there were fewer than max. Returns the rows queued, -1 to
+// drop the standby. Runs on the standby's sender thread.
+typedef int (*repl_catch_up_fn)(void *arg, struct repl_standby *st, uint64_t after, int max);
+
+// Replaces a stale socket file at path. Returns NULL and prints the reason on
+// failure.
+struct repl_server *repl_server_start(const char *path, repl_catch_up_fn catch_up, void *arg);
+
+// Sends what is already queued, then closes every standby connection and
+// removes the socket file.
+void repl_server_stop(struct repl_server *rs);
+
+void repl_queue_row(struct repl_standby *st, const struct repl_row *row);
+void repl_go_live(struct repl_standby *st);
+
+// Hands a committed row to every live standby. Callers hold the lock
+// catch_up takes, so each row reaches a standby exactly once, by one path
+// or the other.
+void repl_publish(struct repl_server *rs, const struct repl_row *row);
+
+// Rows inserted inside a transaction wait in repl_stage() until repl_commit()
+// publishes them, or repl_discard() forgets them on rollback. Same lock.
+void repl_stage(struct repl_server *rs, const struct repl_row *row);
+void repl_commit(struct repl_server *rs);
+void repl_discard(struct repl_server *rs);
+
+size_t repl_server_format_json(struct repl_server *rs, char *buf, size_t len);
+
+// Standby side. Rows arrive in id order, up to a few hundred per call; they
+// point into the receive buffer and are valid for the call only.
+typedef void (*repl_apply_fn)(void *arg, const struct repl_row *rows, int n);
+
+// Called once, on the client thread, when the stream ended and the primary's
+// socket no longer takes connections. Not called after repl_client_stop().
+typedef void (*repl_lost_fn)(void *arg);
+
+// Connects to the primary at path and asks for the rows after after. A stream
+// that breaks while the primary still listens is resumed after the last row
+// applied. Returns NULL and prints the reason when the primary cannot be
+// reached.
+struct repl_client *repl_client_start(const char *path, uint64_t after, repl_apply_fn apply,
+                                      repl_lost_fn lost, void *arg);
+
+void repl_client_stop(struct repl_client *rc);
+
+size_t repl_client_format_json(struct repl_client *rc, char *buf, size_t len);
+
+#endif
@@ -0,0 +1,317 @@
+#include <string.h>
+
+#include "sanitize.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SANITIZE_X86 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SANITIZE_NEON 1
+#endif
+
+// Length of the leading run of printable ASCII (0x20..0x7e) in p[0..n).
+static size_t ascii_run_scalar(const unsigned char *p, size_t n) {
+    size_t i = 0;
+    while (i < n && p[i] >= 0x20 && p[i] < 0x7f) i++;
+    return i;
+}
+
+// A "clean run" is a prefix of p[0..n) that is valid UTF-8, contains no
+// controls, ends on a sequence boundary and holds at most max_chars code
+// points. Returns its length in bytes and its code points in *chars.
+typedef size_t (*clean_run_fn)(const unsigned char *p, size_t n, size_t max_chars, size_t *chars);
+
+static size_t clean_run_scalar(const unsigned char *p, size_t n, size_t max_chars, size_t *chars) {
+    size_t run = ascii_run_scalar(p, n < max_chars ? n : max_chars);
+    *chars = run;
+    return run;
+}
+
+#ifdef SANITIZE_X86
+// Signed compares: bytes >= 0x80 are negative, so one "> 0x1f" test rejects
+// both C0 controls and non-ASCII.
+__attribute__((target("sse2")))
+static size_t clean_run_sse2(const unsigned char *p, size_t n, size_t max_chars, size_t *chars) {
+    const __m128i lo = _mm_set1_epi8(0x1f), hi = _mm_set1_epi8(0x7f);
+    if (n > max_chars) n = max_chars;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+        unsigned mask = (unsigned)_mm_movemask_epi8(ok);
+        if (mask != 0xffff) {
+            i += (size_t)__builtin_ctz(~mask);
+            *chars = i;
+            return i;
+        }
+    }
+    i += ascii_run_scalar(p + i, n - i);
+    *chars = i;
+    return i;
+}
+
+// UTF-8 error classes for the lookup validator (Keiser & Lemire, "Validating
+// UTF-8 In Less Than One Instruction Per Byte"). Each byte pair is
+// classified by three 16-entry tables; a non-zero AND means an error.
+#define U8_TOO_SHORT  (1 << 0) // lead not followed by a continuation
+#define U8_TOO_LONG   (1 << 1) // ASCII followed by a continuation
+#define U8_OVERLONG_3 (1 << 2)
+#define U8_TOO_LARGE  (1 << 3)
+#define U8_SURROGATE  (1 << 4)
+#define U8_OVERLONG_2 (1 << 5)
+#define U8_TOO_LARGE_1000 (1 << 6)
+#define U8_OVERLONG_4 (1 << 6)
+#define U8_TWO_CONTS  (1 << 7) // fine only as the 3rd/4th byte of a sequence
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+__attribute__((target("avx2")))
+static inline __m256i table16(char a0, char a1, char a2, char a3, char a4, char a5, char a6, char a7,
+                              char a8, char a9, char a10, char a11, char a12, char a13, char a14, char a15) {
+    return _mm256_broadcastsi128_si256(_mm_setr_epi8(a0, a1, a2, a3, a4, a5, a6, a7,
+                                                     a8, a9, a10, a11, a12, a13, a14, a15));
+}
+
+// The 32 bytes ending n bytes before the end of v, continuing from prev.
+#define PREV(v, prev, n) _mm256_alignr_epi8((v), _mm256_permute2x128_si256((prev), (v), 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static size_t clean_run_avx2(const unsigned char *p, size_t n, size_t max_chars, size_t *chars) {
+    const __m256i b1_high = table16(
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        (char)(U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4));
+    const __m256i b1_low = table16(
+        (char)(U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4),
+        (char)(U8_CARRY | U8_OVERLONG_2),
+        (char)U8_CARRY, (char)U8_CARRY,
+        (char)(U8_CARRY | U8_TOO_LARGE),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000),
+        (char)(U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000));
+    const __m256i b2_high = table16(
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4),
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE),
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+        (char)(U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE),
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i ctrl_max = _mm256_set1_epi8(0x1f), del = _mm256_set1_epi8(0x7f);
+    const __m256i c2 = _mm256_set1_epi8((char)0xc2), c1_end = _mm256_set1_epi8((char)0xa0);
+    const __m256i cont_max = _mm256_set1_epi8((char)0xbf);
+    const __m256i third = _mm256_set1_epi8((char)(0xe0 - 0x80)), fourth = _mm256_set1_epi8((char)(0xf0 - 0x80));
+    const __m256i high = _mm256_set1_epi8((char)0x80);
+    __m256i prev = _mm256_setzero_si256();
+    size_t i = 0, count = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i bad = _mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl_max), v),
+                                      _mm256_cmpeq_epi8(v, del));
+        size_t block_chars;
+        if (_mm256_movemask_epi8(v) == 0 && _mm256_testz_si256(prev, high)) {
+            block_chars = 32; // ASCII, and no sequence left open by prev
+        } else {
+            __m256i prev1 = PREV(v, prev, 1);
+            __m256i sc = _mm256_and_si256(
+                _mm256_and_si256(
+                    _mm256_shuffle_epi8(b1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+                    _mm256_shuffle_epi8(b1_low, _mm256_and_si256(prev1, nibble))),
+                _mm256_shuffle_epi8(b2_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble)));
+            __m256i must23 = _mm256_or_si256(_mm256_subs_epu8(PREV(v, prev, 2), third),
+                                             _mm256_subs_epu8(PREV(v, prev, 3), fourth));
+            bad = _mm256_or_si256(bad, _mm256_xor_si256(_mm256_and_si256(must23, high), sc));
+            // C1 controls: 0xc2 followed by 0x80..0x9f
+            bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_cmpeq_epi8(prev1, c2),
+                                                         _mm256_cmpgt_epi8(c1_end, v)));
+            block_chars = (size_t)__builtin_popcount(
+                (unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(v, cont_max)));
+        }
+        if (!_mm256_testz_si256(bad, bad) || count + block_chars > max_chars) break;
+        count += block_chars;
+        prev = v;
+    }
+    // The last accepted block may end inside a sequence whose continuation
+    // bytes were never checked; hand that sequence back.
+    for (size_t k = 1; k <= 3 && k <= i; k++) {
+        unsigned char b = p[i - k];
+        if ((b & 0xc0) == 0x80) continue;
+        size_t need = b >= 0xf0 ? 4 : b >= 0xe0 ? 3 : b >= 0xc0 ? 2 : 1;
+        if (need > k) {
+            i -= k;
+            count--;
+        }
+        break;
+    }
+    *chars = count;
+    return i;
+}
+#undef PREV
+#endif
+
+#ifdef SANITIZE_NEON
+static size_t clean_run_neon(const unsigned char *p, size_t n, size_t max_chars, size_t *chars) {
+    const uint8x16_t lo = vdupq_n_u8(0x20), hi = vdupq_n_u8(0x7f);
+    if (n > max_chars) n = max_chars;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        uint8x16_t ok = vandq_u8(vcgeq_u8(v, lo), vcltq_u8(v, hi));
+        if (vminvq_u8(ok) != 0xff) break;
+    }
+    i += ascii_run_scalar(p + i, n - i);
+    *chars = i;
+    return i;
+}
+#endif
+
+struct sanitize_impl {
+    const char *name;
+    clean_run_fn clean_run;
+    // Block size of a validating clean_run. After it stops, the next
+    // 2 * block bytes go through the scalar path instead of retrying the
+    // same failing block at every byte. 0 for ASCII-only runs.
+    size_t block;
+};
+
+static const struct sanitize_impl impl_scalar = { "scalar", clean_run_scalar, 0 };
+#ifdef SANITIZE_X86
+static const struct sanitize_impl impl_sse2 = { "sse2", clean_run_sse2, 0 };
+static const struct sanitize_impl impl_avx2 = { "avx2", clean_run_avx2, 32 };
+#endif
+#ifdef SANITIZE_NEON
+static const struct sanitize_impl impl_neon = { "neon", clean_run_neon, 0 };
+#endif
+
+// Validates the sequence at p against Unicode Table 3-7. On failure,
+// *consumed is the length of the maximal invalid subpart (at least 1).
+static int decode_utf8(const unsigned char *p, size_t n, size_t *consumed, unsigned *cp) {
+    unsigned char c = p[0], lo = 0x80, hi = 0xbf;
+    size_t need;
+    unsigned v;
+    if (c >= 0xc2 && c <= 0xdf) {
+        need = 1;
+        v = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        need = 2;
+        v = c & 0x0f;
+        if (c == 0xe0) lo = 0xa0;      // overlong
+        else if (c == 0xed) hi = 0x9f; // surrogates
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        need = 3;
+        v = c & 0x07;
+        if (c == 0xf0) lo = 0x90;      // overlong
+        else if (c == 0xf4) hi = 0x8f; // > U+10FFFF
+    } else {
+        *consumed = 1;
+        return -1;
+    }
+    size_t i = 1;
+    for (; i <= need; i++) {
+        if (i >= n || p[i] < lo || p[i] > hi) {
+            *consumed = i;
+            return -1;
+        }
+        v = (v << 6) | (p[i] & 0x3f);
+        lo = 0x80;
+        hi = 0xbf;
+    }
+    *consumed = i;
+    *cp = v;
+    return 0;
+}
+
+static size_t sanitize_with(const struct sanitize_impl *impl, char *buf, size_t len,
+                            size_t max_chars, size_t max_bytes) {
+    unsigned char *s = (unsigned char *)buf;
+    size_t r = 0, w = 0, chars = 0, scalar_until = 0;
+    while (r < len && chars < max_chars && w < max_bytes) {
+        size_t room = len - r;
+        if (room > max_bytes - w) room = max_bytes - w;
+        size_t run = 0, run_chars = 0;
+        if (r >= scalar_until) {
+            run = impl->clean_run(s + r, room, max_chars - chars, &run_chars);
+            if (impl->block && run < room) scalar_until = r + run + 2 * impl->block;
+        }
+        if (!run) run = clean_run_scalar(s + r, room, max_chars - chars, &run_chars);
+        if (run) {
+            if (w != r) memmove(s + w, s + r, run);
+            r += run;
+            w += run;
+            chars += run_chars;
+            continue;
+        }
+
+        unsigned char c = s[r];
+        if (c < 0x80) {
+            r++;
+            if (c == '\t') {
+                s[w++] = ' ';
+                chars++;
+            }
+            continue; // other C0 controls and DEL are dropped
+        }
+        size_t n;
+        unsigned cp;
+        if (decode_utf8(s + r, len - r, &n, &cp) != 0) {
+            r += n;
+            s[w++] = '?';
+            chars++;
+            continue;
+        }
+        if (cp < 0xa0) { // C1 controls
+            r += n;
+            continue;
+        }
+        if (w + n > max_bytes) break;
+        if (w != r) memmove(s + w, s + r, n);
+        r += n;
+        w += n;
+        chars++;
+    }
+    if (w < len) s[w] = '\0';
+    return w;
+}
+
+size_t sanitize_text_scalar(char *buf, size_t len, size_t max_chars, size_t max_bytes) {
+    return sanitize_with(&impl_scalar, buf, len, max_chars, max_bytes);
+}
+
+static const struct sanitize_impl *selected;
+
+static const struct sanitize_impl *select_impl(void) {
+    const struct sanitize_impl *impl = __atomic_load_n(&selected, __ATOMIC_ACQUIRE);
+    if (impl) return impl;
+    impl = &impl_scalar;
+#if defined(SANITIZE_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) impl = &impl_avx2;
+    else if (__builtin_cpu_supports("sse2")) impl = &impl_sse2;
+#elif defined(SANITIZE_NEON)
+    impl = &impl_neon;
+#endif
+    // Every thread picks the same implementation, so racing here is harmless.
+    __atomic_store_n(&selected, impl, __ATOMIC_RELEASE);
+    return impl;
+}
+
+size_t sanitize_text(char *buf, size_t len, size_t max_chars, size_t max_bytes) {
+    return sanitize_with(select_impl(), buf, len, max_chars, max_bytes);
+}
+
+const char *sanitize_impl(void) {
+    return select_impl()->name;
+}
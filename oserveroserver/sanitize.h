@@ -0,0 +1,27 @@
+#ifndef SANITIZE_H
+#define SANITIZE_H
+
+#include <stddef.h>
+
+// In-place cleanup of inbound text before it reaches the history or other
+// clients:
+//   - invalid UTF-8 (overlongs, surrogates, > U+10FFFF, truncated sequences)
+//     becomes '?', one per maximal invalid subpart
+//   - C0 controls, DEL and C1 controls are removed; tab becomes a space, so
+//     stored lines never contain '\n'
+//   - output is clamped to max_chars code points and max_bytes bytes without
+//     splitting a sequence
+// Runs of printable ASCII are checked 16 or 32 bytes at a time (SSE2/AVX2,
+// NEON on arm64); everything else takes the scalar path.
+//
+// Returns the new length. buf is NUL-terminated when the result is shorter
+// than len, so callers that reserve len + 1 bytes always get a C string.
+size_t sanitize_text(char *buf, size_t len, size_t max_chars, size_t max_bytes);
+
+// Same result, one byte at a time. Reference for tests and benchmarks.
+size_t sanitize_text_scalar(char *buf, size_t len, size_t max_chars, size_t max_bytes);
+
+// Implementation sanitize_text() dispatches to: "avx2", "sse2", "neon" or "scalar".
+const char *sanitize_impl(void);
+
+#endif
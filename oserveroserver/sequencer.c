@@ -0,0 +1,85 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "sequencer.h"
+
+struct seq_slot {
+    uint64_t ready; // seq + 1 once item is published
+    void *item;
+};
+
+struct sequencer {
+    uint64_t next;             // next sequence number to hand out
+    char pad[64 - sizeof(uint64_t)];
+    uint64_t applied;          // everything below has been applied
+    pthread_mutex_t apply_mutex;
+    sequencer_apply apply;
+    void *arg;
+    uint64_t mask;
+    unsigned long handed_off;
+    unsigned long full_waits;
+    struct seq_slot slots[];
+};
+
+struct sequencer *sequencer_create(unsigned slots, sequencer_apply apply, void *arg) {
+    uint64_t n = 1;
+    while (n < slots) n <<= 1;
+    struct sequencer *s = calloc(1, sizeof(*s) + n * sizeof(struct seq_slot));
+    if (!s) return NULL;
+    s->mask = n - 1;
+    s->apply = apply;
+    s->arg = arg;
+    pthread_mutex_init(&s->apply_mutex, NULL);
+    return s;
+}
+
+void sequencer_destroy(struct sequencer *s) {
+    if (!s) return;
+    pthread_mutex_destroy(&s->apply_mutex);
+    free(s);
+}
+
+// Applies ready items in order while this thread can take the apply mutex.
+// A producer that finds the mutex taken leaves its item to the holder, which
+// looks once more after unlocking, so no published item is stranded.
+static void drain(struct sequencer *s, uint64_t own) {
+    while (pthread_mutex_trylock(&s->apply_mutex) == 0) {
+        uint64_t next = s->applied;
+        for (;;) {
+            struct seq_slot *slot = &s->slots[next & s->mask];
+            if (__atomic_load_n(&slot->ready, __ATOMIC_ACQUIRE) != next + 1) break;
+            s->apply(s->arg, next, slot->item);
+            if (next != own) __atomic_add_fetch(&s->handed_off, 1, __ATOMIC_RELAXED);
+            next++;
+            __atomic_store_n(&s->applied, next, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&s->apply_mutex);
+        if (__atomic_load_n(&s->slots[next & s->mask].ready, __ATOMIC_SEQ_CST) != next + 1) break;
+    }
+}
+
+uint64_t sequencer_submit(struct sequencer *s, void *item) {
+    uint64_t seq = __atomic_fetch_add(&s->next, 1, __ATOMIC_RELAXED);
+    // The slot is free once the item one lap behind has been applied.
+    if (seq - __atomic_load_n(&s->applied, __ATOMIC_ACQUIRE) > s->mask) {
+        __atomic_add_fetch(&s->full_waits, 1, __ATOMIC_RELAXED);
+        while (seq - __atomic_load_n(&s->applied, __ATOMIC_ACQUIRE) > s->mask) {
+            drain(s, seq);
+            sched_yield();
+        }
+    }
+    struct seq_slot *slot = &s->slots[seq & s->mask];
+    slot->item = item;
+    __atomic_store_n(&slot->ready, seq + 1, __ATOMIC_SEQ_CST);
+    drain(s, seq);
+    return seq;
+}
+
+void sequencer_get_stats(struct sequencer *s, struct sequencer_stats *st) {
+    st->submitted = __atomic_load_n(&s->next, __ATOMIC_RELAXED);
+    st->applied = __atomic_load_n(&s->applied, __ATOMIC_RELAXED);
+    st->handed_off = __atomic_load_n(&s->handed_off, __ATOMIC_RELAXED);
+    st->full_waits = __atomic_load_n(&s->full_waits, __ATOMIC_RELAXED);
+}
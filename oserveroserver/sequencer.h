@@ -0,0 +1,38 @@
+#ifndef SEQUENCER_H
+#define SEQUENCER_H
+
+#include <stdint.h>
+
+// Total-order sequencer for items produced on several threads. Submitting
+// takes the next sequence number with one atomic add and publishes the item in
+// a ring slot. Items are handed to the apply callback strictly in sequence
+// order, one at a time, by whichever submitting thread holds the apply mutex,
+// so an item may be applied on a thread other than its producer's and the
+// callback's own cost (e.g. a SQLite insert) is serialised behind that mutex.
+// Producers only trylock it and never block on it, but one that finds the
+// ring full spins with sched_yield() until the applier makes room. Once every
+// sequencer_submit() call has returned, every submitted item has been applied.
+
+typedef void (*sequencer_apply)(void *arg, uint64_t seq, void *item);
+
+struct sequencer;
+
+// slots is rounded up to a power of two. A producer more than slots items
+// ahead of the oldest unapplied one yields until there is room.
+struct sequencer *sequencer_create(unsigned slots, sequencer_apply apply, void *arg);
+
+void sequencer_destroy(struct sequencer *s);
+
+// Returns the item's sequence number, starting at 0.
+uint64_t sequencer_submit(struct sequencer *s, void *item);
+
+struct sequencer_stats {
+    uint64_t submitted;
+    uint64_t applied;
+    unsigned long handed_off; // applied by a thread other than the producer
+    unsigned long full_waits; // submits that found the ring full
+};
+
+void sequencer_get_stats(struct sequencer *s, struct sequencer_stats *st);
+
+#endif
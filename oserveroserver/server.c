@@ -2,456 +2,253 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
-#include <sqlite3.h>
-#include <libwebsockets.h>
-#include <time.h>
-#include <ctype.h>
-
-#define PORT 8080
-#define MAX_NAME_LEN 64
-#define MAX_ROLE_LEN 16
-#define MAX_MSG_LEN 4096
-#define HISTORY_LIMIT 500
-
-struct client {
-    struct lws *wsi;
-    char username[MAX_NAME_LEN];
-    char role[MAX_ROLE_LEN]; // "READER", "WRITER" or "NONE"
-    struct client *next;
-};
-
-static struct client *clients_head = NULL;
-static pthread_mutex_t clients_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-static pthread_rwlock_t history_lock = PTHREAD_RWLOCK_INITIALIZER;
-
-static sqlite3 *db = NULL;
-static sqlite3_stmt *insert_stmt = NULL;
-static sqlite3_stmt *select_stmt = NULL;
-
-static void broadcast_text(const char *message);
-
-static void add_client(struct lws *wsi) {
-    struct client *c = calloc(1, sizeof(struct client));
-    if (!c) return;
-    c->wsi = wsi;
-    snprintf(c->username, MAX_NAME_LEN, "Anonymous");
-    snprintf(c->role, MAX_ROLE_LEN, "NONE"); // No role until set
-    pthread_mutex_lock(&clients_mutex);
-    c->next = clients_head;
-    clients_head = c;
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-static void remove_client(struct lws *wsi) {
-    pthread_mutex_lock(&clients_mutex);
-    struct client **p = &clients_head;
-    while (*p) {
-        if ((*p)->wsi == wsi) {
-            struct client *tofree = *p;
-            *p = tofree->next;
-            free(tofree);
-            break;
-        }
-        p = &(*p)->next;
-    }
-    pthread_mutex_unlock(&clients_mutex);
-}
-
-static struct client* find_client(struct lws *wsi) {
-    struct client *found = NULL;
-    pthread_mutex_lock(&clients_mutex);
-    struct client *p = clients_head;
-    while (p) {
-        if (p->wsi == wsi) {
-            found = p;
-            break;
-        }
-        p = p->next;
-    }
-    pthread_mutex_unlock(&clients_mutex);
-    return found;
-}
-
-static void count_roles(int *readers, int *writers) {
-    int r=0, w=0;
-    pthread_mutex_lock(&clients_mutex);
-    struct client *p = clients_head;
-    while (p) {
-        if (strcasecmp(p->role, "WRITER") == 0) w++;
-        else if (strcasecmp(p->role, "READER") == 0) r++;
-        p = p->next;
-    }
-    pthread_mutex_unlock(&clients_mutex);
-    if (readers) *readers = r;
-    if (writers) *writers = w;
-}
-
-static struct lws **collect_wsis(int *out_count) {
-    *out_count = 0;
-    pthread_mutex_lock(&clients_mutex);
-    int count = 0;
-    struct client *p = clients_head;
-    while (p) { count++; p = p->next; }
-    if (count == 0) { pthread_mutex_unlock(&clients_mutex); return NULL; }
-    struct lws **arr = malloc(sizeof(struct lws *) * count);
-    if (!arr) { pthread_mutex_unlock(&clients_mutex); return NULL; }
-    int i = 0;
-    p = clients_head;
-    while (p) {
-        arr[i++] = p->wsi;
-        p = p->next;
-    }
-    pthread_mutex_unlock(&clients_mutex);
-    *out_count = count;
-    return arr;
-}
-
-static int init_db(const char *filename) {
-    int rc = sqlite3_open(filename, &db);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Cannot open sqlite db '%s': %s\n", filename, sqlite3_errmsg(db));
-        return -1;
-    }
-    char *errmsg = NULL;
-    rc = sqlite3_exec(db, "PRAGMA journal_mode=WAL;", NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Warning: failed to set WAL mode: %s\n", errmsg ? errmsg : "unknown");
-        sqlite3_free(errmsg);
-    }
-    const char *create_sql =
-        "CREATE TABLE IF NOT EXISTS messages ("
-        "id INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "username TEXT NOT NULL, "
-        "message TEXT NOT NULL, "
-        "ts DATETIME DEFAULT (strftime('%Y-%m-%d %H:%M:%f','now'))"
-        ");";
-    rc = sqlite3_exec(db, create_sql, NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to create table: %s\n", errmsg ? errmsg : "unknown");
-        sqlite3_free(errmsg);
-        sqlite3_close(db);
-        db = NULL;
-        return -1;
-    }
-
-    
-    rc = sqlite3_exec(db, "DELETE FROM messages;", NULL, NULL, &errmsg);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to clear table: %s\n", errmsg ? errmsg : "unknown");
-        sqlite3_free(errmsg);
-        
-    }
-
-    const char *insert_sql = "INSERT INTO messages (username, message) VALUES (?, ?);";
-    rc = sqlite3_prepare_v2(db, insert_sql, -1, &insert_stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare insert stmt: %s\n", sqlite3_errmsg(db));
-        sqlite3_close(db);
-        db = NULL;
-        return -1;
-    }
-    const char *select_sql =
-        "SELECT username, message, ts FROM messages "
-        "ORDER BY id DESC LIMIT ?;";
-    rc = sqlite3_prepare_v2(db, select_sql, -1, &select_stmt, NULL);
-    if (rc != SQLITE_OK) {
-        fprintf(stderr, "Failed to prepare select stmt: %s\n", sqlite3_errmsg(db));
-        sqlite3_finalize(insert_stmt);
-        insert_stmt = NULL;
-        sqlite3_close(db);
-        db = NULL;
-        return -1;
-    }
-    return 0;
-}
-
-
-static void close_db() {
-    if (insert_stmt) { sqlite3_finalize(insert_stmt); insert_stmt = NULL; }
-    if (select_stmt) { sqlite3_finalize(select_stmt); select_stmt = NULL; }
-    if (db) { sqlite3_close(db); db = NULL; }
-}
-
-static int db_insert_message(const char *username, const char *message) {
-    if (!db || !insert_stmt) return -1;
-    int rc;
-    sqlite3_reset(insert_stmt);
-    sqlite3_clear_bindings(insert_stmt);
-    rc = sqlite3_bind_text(insert_stmt, 1, username ? username : "Anonymous", -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) return -1;
-    rc = sqlite3_bind_text(insert_stmt, 2, message ? message : "", -1, SQLITE_TRANSIENT);
-    if (rc != SQLITE_OK) return -1;
-    rc = sqlite3_step(insert_stmt);
-    if (rc != SQLITE_DONE) {
-        fprintf(stderr, "Failed to insert message: %s\n", sqlite3_errmsg(db));
-        return -1;
-    }
-    return 0;
-}
-
-static char *db_get_history_snapshot(int limit) {
-    if (!db || !select_stmt) return NULL;
-    int rc;
-    sqlite3_reset(select_stmt);
-    sqlite3_clear_bindings(select_stmt);
-    rc = sqlite3_bind_int(select_stmt, 1, limit);
-    if (rc != SQLITE_OK) return NULL;
-    size_t arr_cap = 64;
-    size_t arr_len = 0;
-    char **rows = malloc(sizeof(char*) * arr_cap);
-    if (!rows) return NULL;
-    while ((rc = sqlite3_step(select_stmt)) == SQLITE_ROW) {
-        const unsigned char *uname = sqlite3_column_text(select_stmt, 0);
-        const unsigned char *msg = sqlite3_column_text(select_stmt, 1);
-        
-        const char *u = uname ? (const char*)uname : "Anonymous";
-        const char *m = msg ? (const char*)msg : "";
-        size_t needed = strlen(u) + 2 + strlen(m) + 1;
-        char *line = malloc(needed);
-        if (!line) continue;
-        snprintf(line, needed, "%s: %s", u, m);
-        if (arr_len + 1 > arr_cap) {
-            arr_cap *= 2;
-            char **tmp = realloc(rows, sizeof(char*) * arr_cap);
-            if (!tmp) break;
-            rows = tmp;
-        }
-        rows[arr_len++] = line;
-    }
-    if (rc != SQLITE_DONE && rc != SQLITE_ROW) {}
-    size_t total = 0;
-    for (size_t i = 0; i < arr_len; ++i) total += strlen(rows[i]) + 1;
-    char *out = malloc(total + 1);
-    if (!out) {
-        for (size_t i=0;i<arr_len;i++) free(rows[i]);
-        free(rows);
-        return NULL;
-    }
-    out[0] = '\0';
-    for (ssize_t i = arr_len - 1; i >= 0; --i) {
-        strcat(out, rows[i]);
-        if (i > 0) strcat(out, "\n");
-    }
-    for (size_t i=0;i<arr_len;i++) free(rows[i]);
-    free(rows);
-    return out;
-}
-
-static void broadcast_counts() {
-    int readers=0, writers=0;
-    count_roles(&readers, &writers);
-    char buf[128];
-    snprintf(buf, sizeof(buf), "SYSTEM_COUNTS:%d:%d", readers, writers);
-    broadcast_text(buf);
-}
-
-static void send_to_client(struct client *c, const char *msg) {
-    if (!c || !c->wsi || !msg) return;
-    size_t msg_len = strlen(msg);
-    unsigned char *buf = malloc(LWS_PRE + msg_len);
-    if (!buf) return;
-    memcpy(buf + LWS_PRE, msg, msg_len);
-    lws_write(c->wsi, buf + LWS_PRE, msg_len, LWS_WRITE_TEXT);
-    free(buf);
-}
-
-static void broadcast_text(const char *message) {
-    if (!message) return;
-    size_t msg_len = strlen(message);
-    unsigned char *buf = malloc(LWS_PRE + msg_len);
-    if (!buf) return;
-    memcpy(buf + LWS_PRE, message, msg_len);
-    int count = 0;
-    struct lws **wsis = collect_wsis(&count);
-    for (int i = 0; i < count; i++) {
-        struct lws *wsi = wsis[i];
-        if (wsi) {
-            lws_write(wsi, buf + LWS_PRE, msg_len, LWS_WRITE_TEXT);
-        }
-    }
-    free(wsis);
-    free(buf);
-}
-
-static int active_readers() {
-    int r=0,w=0;
-    count_roles(&r, &w);
-    return r;
-}
-
-static int active_writers() {
-    int r=0,w=0;
-    count_roles(&r, &w);
-    return w;
-}
-
-static int can_admit_as_reader() {
-    return active_writers() == 0;
-}
-
-static int can_admit_as_writer() {
-    return active_writers() == 0 && active_readers() == 0;
-}
-
-static int ws_callback(struct lws *wsi, enum lws_callback_reasons reason,
-                       void *user, void *in, size_t len) {
-    (void)user;
-    switch (reason) {
-        case LWS_CALLBACK_ESTABLISHED: {
-            add_client(wsi);
-            break;
-        }
-        case LWS_CALLBACK_RECEIVE: {
-            char *msg = malloc(len + 1);
-            if (!msg) break;
-            memcpy(msg, in, len);
-            msg[len] = '\0';
-            struct client *c = find_client(wsi);
-            if (!c) { free(msg); break; }
-
-            if (strncmp(msg, "username:", 9) == 0) {
-                char *uname = msg + 9;
-                while (*uname == ' ' || *uname == '\t') uname++;
-                snprintf(c->username, MAX_NAME_LEN, "%s", uname);
-            } else if (strncmp(msg, "role:", 5) == 0) {
-                char *r = msg + 5;
-                while (*r == ' ' || *r == '\t') r++;
-                if (strcasecmp(r, "WRITER") == 0) {
-                    if (can_admit_as_writer()) {
-                        snprintf(c->role, MAX_ROLE_LEN, "WRITER");
-                        // Send history BEFORE confirming role
-                        pthread_rwlock_rdlock(&history_lock);
-                        char *snap = db_get_history_snapshot(HISTORY_LIMIT);
-                        pthread_rwlock_unlock(&history_lock);
-                        if (snap) {
-                            send_to_client(c, snap);
-                            free(snap);
-                        }
-                        // Confirm role
-                        send_to_client(c, "ROLE_CONFIRMED:writer");
-                        char sysmsg[200];
-                        snprintf(sysmsg, sizeof(sysmsg), "System: %s joined as Writer", c->username);
-                        broadcast_text(sysmsg);
-                    } else {
-                        send_to_client(c, "ROLE_DENIED:A writer or readers are already inside.");
-                    }
-                } else {
-                    if (can_admit_as_reader()) {
-                        snprintf(c->role, MAX_ROLE_LEN, "READER");
-                        pthread_rwlock_rdlock(&history_lock);
-                        char *snap = db_get_history_snapshot(HISTORY_LIMIT);
-                        pthread_rwlock_unlock(&history_lock);
-                        if (snap) {
-                            send_to_client(c, snap);
-                            free(snap);
-                        }
-                        send_to_client(c, "ROLE_CONFIRMED:reader");
-                        char sysmsg[200];
-                        snprintf(sysmsg, sizeof(sysmsg), "System: %s joined as Reader", c->username);
-                        broadcast_text(sysmsg);
-                    } else {
-                        send_to_client(c, "ROLE_DENIED:A writer is already inside.");
-                    }
-                }
-                broadcast_counts();
-            } else if (strncmp(msg, "get_history", 11) == 0) {
-                pthread_rwlock_rdlock(&history_lock);
-                char *snap = db_get_history_snapshot(HISTORY_LIMIT);
-                pthread_rwlock_unlock(&history_lock);
-                if (snap) {
-                    send_to_client(c, snap);
-                    free(snap);
-                } else {
-                    send_to_client(c, "");
-                }
-            } else {
-                if (strcasecmp(c->role, "WRITER") != 0) {
-                    char err[200];
-                    snprintf(err, sizeof(err), "System: You are a READER — you cannot send messages.");
-                    send_to_client(c, err);
-                } else {
-                    char out[MAX_MSG_LEN];
-
-                   
-                    snprintf(out, sizeof(out), "%s: %s",
-                             c->username[0] ? c->username : "Anon", msg);
-
-                    pthread_rwlock_wrlock(&history_lock);
-                    if (db_insert_message(c->username, msg) != 0) {
-                        fprintf(stderr, "Warning: failed to insert message into DB\n");
-                    }
-                    pthread_rwlock_unlock(&history_lock);
-
-                    broadcast_text(out);
-                }
-            }
-            free(msg);
-            break;
-        }
-        case LWS_CALLBACK_CLOSED: {
-            struct client *c = find_client(wsi);
-            if (c && strcasecmp(c->role, "WRITER") == 0) {
-                char sysmsg[200];
-                snprintf(sysmsg, sizeof(sysmsg), "System: %s disconnected.", c->username);
-                remove_client(wsi);
-                broadcast_text(sysmsg);
-                broadcast_counts();
-            } else {
-                remove_client(wsi);
-                broadcast_counts();
-            }
-            break;
-        }
-        default:
-            break;
+#include <signal.h>
+#include <getopt.h>
+
+#include "chat_engine.h"
+#include "log.h"
+
+static struct chat_engine *engine = NULL;
+
+static void on_signal(int sig) {
+    if (!engine) return;
+    if (sig == SIGHUP) chat_engine_reload(engine);
+    else chat_engine_stop(engine);
+}
+
+static void usage(const char *prog, const struct chat_engine_config *cfg) {
+    fprintf(stderr,
+        "Usage: %s [options] [database_file.sqlite]\n"
+        "       %s export [--compress] database_file.sqlite ARCHIVE\n"
+        "       %s import database_file.sqlite ARCHIVE\n"
+        "  --port N                 TCP port (default %d; 0 = none, needs --unix-socket)\n"
+        "  --tls-cert PATH          PEM certificate chain (enables TLS)\n"
+        "  --tls-key PATH           PEM private key\n"
+        "  --tls-ciphers LIST       OpenSSL cipher list for TLS <= 1.2\n"
+        "  --tls13-ciphers LIST     TLS 1.3 ciphersuites\n"
+        "  --tls-session-cache N    server session cache entries (0 disables, default %d)\n"
+        "  --tls-session-timeout S  resumable session lifetime in seconds (default %d)\n"
+        "  --tls-ticket-key PATH    raw session ticket key shared across restarts\n"
+        "  --no-tls-tickets         disable stateless session tickets\n"
+        "  --ktls                   enable kernel TLS offload (Linux, OpenSSL 3)\n"
+        "  --no-h2                  only offer HTTP/1.1 over TLS (no RFC 8441 WebSockets)\n"
+        "  --index PATH             web client served at / (default index.html)\n"
+        "  --unix-socket PATH       also listen on a UNIX socket ('@name' = abstract)\n"
+        "  --unix-socket-owner U:G  owner and group of the socket file\n"
+        "  --unix-socket-mode MODE  octal permissions of the socket file, e.g. 0660\n"
+        "  --event-loop LOOP        poll (default), libuv or libev\n"
+        "  --service-threads N      lws service threads (poll loop only, default 1)\n"
+        "  --service-cpus LISTS     CPUs per service thread, ':'-separated, e.g. 0:1 or 0-1:2-3\n"
+        "  --persist-thread         commit history on a dedicated thread in batches\n"
+        "  --persist-cpus LIST      CPUs for the persistence thread, e.g. 4\n"
+        "  --hugepages MODE         history frame backing: off (default), thp or hugetlb\n"
+        "  --filter PATH            reject/mask/flag phrase list for writer messages (SIGHUP reloads)\n"
+        "  --writer-rate R          sustained messages per second per writer (0 = unlimited, default %g)\n"
+        "  --writer-burst N         messages a writer may send at once (default %d)\n"
+        "  --dedup-window N         recent messages checked for repeats (0 disables, default %d)\n"
+        "  --dedup-seconds S        how long a repeat stays suppressed (default %d)\n"
+        "  --no-load-shedding       never defer history, refuse upgrades or drop readers\n"
+        "  --record PATH            record inbound traffic for bench/replay (truncates PATH)\n"
+        "  --admin-socket PATH      control socket for stats and live limits ('@name' = abstract)\n"
+        "  --admin-socket-mode MODE octal permissions of the control socket (default 0600)\n"
+        "  --writers N              writers allowed at once; above 1 readers may join too (default 1)\n"
+        "  --writev                 write frames to plain sockets directly, bypassing lws_write()\n"
+        "  --history-cache PATH     send join history to plain sockets from this file (truncates PATH)\n"
+        "  --history-memory MB      keep this much compressed history in memory for joins\n"
+        "  --partition-daily        start a new history file each UTC day\n"
+        "  --partition-rows N       start a new history file every N rows\n"
+        "  --partition-keep N       history files kept; older ones are deleted (0 keeps all)\n"
+        "  --config PATH            limits file, applied at start and on SIGHUP\n"
+        "  --log-level LEVEL        debug, info (default), warn or error\n"
+        "  --log-json               log one JSON object per line\n"
+        "  --keep-history           keep the rows already in the database (e.g. after import)\n"
+        "  --replication-socket PATH stream stored history to hot standbys on this UNIX socket\n"
+        "  --standby PATH           follow the primary's replication socket; take over when it dies\n"
+        "  --history-log PATH       sync stored rows through this append-only log (io_uring)\n",
+        prog, prog, prog, cfg->port, cfg->tls.session_cache_size, cfg->tls.session_timeout, cfg->writer_rate,
+        cfg->writer_burst, cfg->dedup_window, cfg->dedup_seconds);
+}
+
+// "export" and "import" subcommands: history to and from a binary archive.
+static int archive_command(int argc, char **argv) {
+    int compress = argc > 2 && strcmp(argv[2], "--compress") == 0;
+    if (argc != 4 + compress || (compress && strcmp(argv[1], "import") == 0)) {
+        struct chat_engine_config cfg;
+        chat_engine_config_init(&cfg);
+        usage(argv[0], &cfg);
+        return 1;
     }
+    const char *db = argv[2 + compress], *file = argv[3 + compress];
+    long long rows = strcmp(argv[1], "export") == 0
+                         ? chat_engine_export_history(db, file, compress)
+                         : chat_engine_import_history(db, file);
+    if (rows < 0) return 1;
+    printf("%s %lld rows\n", strcmp(argv[1], "export") == 0 ? "Exported" : "Imported", rows);
     return 0;
 }
 
-
-
-
-static const struct lws_protocols protocols[] = {
-    {
-        "chat-protocol",
-        ws_callback,
-        0,
-        4096,
-    },
-    { NULL, NULL, 0, 0 }
-};
-
 int main(int argc, char **argv) {
-    const char *dbfile = "chat_history.sqlite";
-    if (argc > 1) dbfile = argv[1];
-    if (init_db(dbfile) != 0) {
-        fprintf(stderr, "Failed to initialize database. Exiting.\n");
-        return 1;
+    if (argc > 1 && (strcmp(argv[1], "export") == 0 || strcmp(argv[1], "import") == 0))
+        return archive_command(argc, argv);
+    struct chat_engine_config cfg;
+    chat_engine_config_init(&cfg);
+    enum {
+        OPT_TLS_CERT = 256, OPT_TLS_KEY, OPT_TLS_CIPHERS, OPT_TLS13_CIPHERS,
+        OPT_TLS_SESSION_CACHE, OPT_TLS_SESSION_TIMEOUT, OPT_TLS_TICKET_KEY,
+        OPT_NO_TLS_TICKETS, OPT_KTLS, OPT_NO_H2, OPT_PORT, OPT_INDEX,
+        OPT_UNIX_SOCKET, OPT_UNIX_SOCKET_OWNER, OPT_UNIX_SOCKET_MODE,
+        OPT_EVENT_LOOP, OPT_SERVICE_THREADS, OPT_SERVICE_CPUS, OPT_PERSIST_THREAD,
+        OPT_PERSIST_CPUS, OPT_HUGEPAGES, OPT_FILTER, OPT_WRITER_RATE, OPT_WRITER_BURST,
+        OPT_DEDUP_WINDOW, OPT_DEDUP_SECONDS,
+        OPT_NO_LOAD_SHEDDING, OPT_RECORD, OPT_LOG_LEVEL, OPT_LOG_JSON,
+        OPT_ADMIN_SOCKET, OPT_ADMIN_SOCKET_MODE, OPT_CONFIG, OPT_WRITERS, OPT_WRITEV,
+        OPT_HISTORY_CACHE, OPT_HISTORY_MEMORY, OPT_PARTITION_DAILY, OPT_PARTITION_ROWS,
+        OPT_PARTITION_KEEP, OPT_KEEP_HISTORY, OPT_REPLICATION_SOCKET, OPT_STANDBY,
+        OPT_HISTORY_LOG,
+    };
+    static const struct option long_opts[] = {
+        { "tls-cert", required_argument, NULL, OPT_TLS_CERT },
+        { "tls-key", required_argument, NULL, OPT_TLS_KEY },
+        { "tls-ciphers", required_argument, NULL, OPT_TLS_CIPHERS },
+        { "tls13-ciphers", required_argument, NULL, OPT_TLS13_CIPHERS },
+        { "tls-session-cache", required_argument, NULL, OPT_TLS_SESSION_CACHE },
+        { "tls-session-timeout", required_argument, NULL, OPT_TLS_SESSION_TIMEOUT },
+        { "tls-ticket-key", required_argument, NULL, OPT_TLS_TICKET_KEY },
+        { "no-tls-tickets", no_argument, NULL, OPT_NO_TLS_TICKETS },
+        { "ktls", no_argument, NULL, OPT_KTLS },
+        { "no-h2", no_argument, NULL, OPT_NO_H2 },
+        { "port", required_argument, NULL, OPT_PORT },
+        { "index", required_argument, NULL, OPT_INDEX },
+        { "unix-socket", required_argument, NULL, OPT_UNIX_SOCKET },
+        { "unix-socket-owner", required_argument, NULL, OPT_UNIX_SOCKET_OWNER },
+        { "unix-socket-mode", required_argument, NULL, OPT_UNIX_SOCKET_MODE },
+        { "event-loop", required_argument, NULL, OPT_EVENT_LOOP },
+        { "service-threads", required_argument, NULL, OPT_SERVICE_THREADS },
+        { "service-cpus", required_argument, NULL, OPT_SERVICE_CPUS },
+        { "persist-thread", no_argument, NULL, OPT_PERSIST_THREAD },
+        { "persist-cpus", required_argument, NULL, OPT_PERSIST_CPUS },
+        { "hugepages", required_argument, NULL, OPT_HUGEPAGES },
+        { "filter", required_argument, NULL, OPT_FILTER },
+        { "writer-rate", required_argument, NULL, OPT_WRITER_RATE },
+        { "writer-burst", required_argument, NULL, OPT_WRITER_BURST },
+        { "dedup-window", required_argument, NULL, OPT_DEDUP_WINDOW },
+        { "dedup-seconds", required_argument, NULL, OPT_DEDUP_SECONDS },
+        { "no-load-shedding", no_argument, NULL, OPT_NO_LOAD_SHEDDING },
+        { "record", required_argument, NULL, OPT_RECORD },
+        { "log-level", required_argument, NULL, OPT_LOG_LEVEL },
+        { "log-json", no_argument, NULL, OPT_LOG_JSON },
+        { "admin-socket", required_argument, NULL, OPT_ADMIN_SOCKET },
+        { "admin-socket-mode", required_argument, NULL, OPT_ADMIN_SOCKET_MODE },
+        { "config", required_argument, NULL, OPT_CONFIG },
+        { "writers", required_argument, NULL, OPT_WRITERS },
+        { "writev", no_argument, NULL, OPT_WRITEV },
+        { "history-cache", required_argument, NULL, OPT_HISTORY_CACHE },
+        { "history-memory", required_argument, NULL, OPT_HISTORY_MEMORY },
+        { "partition-daily", no_argument, NULL, OPT_PARTITION_DAILY },
+        { "partition-rows", required_argument, NULL, OPT_PARTITION_ROWS },
+        { "partition-keep", required_argument, NULL, OPT_PARTITION_KEEP },
+        { "keep-history", no_argument, NULL, OPT_KEEP_HISTORY },
+        { "replication-socket", required_argument, NULL, OPT_REPLICATION_SOCKET },
+        { "standby", required_argument, NULL, OPT_STANDBY },
+        { "history-log", required_argument, NULL, OPT_HISTORY_LOG },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt, log_level, log_json = 0;
+    while ((opt = getopt_long(argc, argv, "h", long_opts, NULL)) != -1) {
+        switch (opt) {
+            case OPT_TLS_CERT: cfg.tls.cert_path = optarg; break;
+            case OPT_TLS_KEY: cfg.tls.key_path = optarg; break;
+            case OPT_TLS_CIPHERS: cfg.tls.cipher_list = optarg; break;
+            case OPT_TLS13_CIPHERS: cfg.tls.tls13_ciphers = optarg; break;
+            case OPT_TLS_SESSION_CACHE: cfg.tls.session_cache_size = atoi(optarg); break;
+            case OPT_TLS_SESSION_TIMEOUT: cfg.tls.session_timeout = atoi(optarg); break;
+            case OPT_TLS_TICKET_KEY: cfg.tls.ticket_key_path = optarg; break;
+            case OPT_NO_TLS_TICKETS: cfg.tls.tickets = 0; break;
+            case OPT_KTLS: cfg.tls.ktls = 1; break;
+            case OPT_NO_H2: cfg.tls.h2 = 0; break;
+            case OPT_PORT:
+                cfg.port = atoi(optarg);
+                if (cfg.port < 0 || cfg.port > 65535) { usage(argv[0], &cfg); return 1; }
+                break;
+            case OPT_INDEX: cfg.index_path = optarg; break;
+            case OPT_UNIX_SOCKET: cfg.unix_path = optarg; break;
+            case OPT_UNIX_SOCKET_OWNER: cfg.unix_owner = optarg; break;
+            case OPT_UNIX_SOCKET_MODE: cfg.unix_mode = (int)strtol(optarg, NULL, 8); break;
+            case OPT_EVENT_LOOP:
+                if (strcmp(optarg, "poll") == 0) cfg.event_loop = CHAT_LOOP_POLL;
+                else if (strcmp(optarg, "libuv") == 0) cfg.event_loop = CHAT_LOOP_LIBUV;
+                else if (strcmp(optarg, "libev") == 0) cfg.event_loop = CHAT_LOOP_LIBEV;
+                else { usage(argv[0], &cfg); return 1; }
+                break;
+            case OPT_SERVICE_THREADS: cfg.service_threads = atoi(optarg); break;
+            case OPT_SERVICE_CPUS: cfg.service_cpus = optarg; break;
+            case OPT_PERSIST_THREAD: cfg.persist_thread = 1; break;
+            case OPT_PERSIST_CPUS: cfg.persist_cpus = optarg; cfg.persist_thread = 1; break;
+            case OPT_HUGEPAGES:
+                if (strcmp(optarg, "off") == 0) cfg.hugepages = CHAT_PAGES_DEFAULT;
+                else if (strcmp(optarg, "thp") == 0) cfg.hugepages = CHAT_PAGES_THP;
+                else if (strcmp(optarg, "hugetlb") == 0) cfg.hugepages = CHAT_PAGES_HUGETLB;
+                else { usage(argv[0], &cfg); return 1; }
+                break;
+            case OPT_FILTER: cfg.filter_path = optarg; break;
+            case OPT_WRITER_RATE: cfg.writer_rate = atof(optarg); break;
+            case OPT_WRITER_BURST: cfg.writer_burst = atoi(optarg); break;
+            case OPT_DEDUP_WINDOW: cfg.dedup_window = atoi(optarg); break;
+            case OPT_DEDUP_SECONDS: cfg.dedup_seconds = atoi(optarg); break;
+            case OPT_NO_LOAD_SHEDDING: cfg.load_shedding = 0; break;
+            case OPT_RECORD: cfg.record_path = optarg; break;
+            case OPT_LOG_LEVEL:
+                if ((log_level = log_parse_level(optarg)) < 0) { usage(argv[0], &cfg); return 1; }
+                log_set_level(log_level);
+                break;
+            case OPT_LOG_JSON: log_json = 1; break;
+            case OPT_ADMIN_SOCKET: cfg.admin_path = optarg; break;
+            case OPT_ADMIN_SOCKET_MODE: cfg.admin_mode = (int)strtol(optarg, NULL, 8); break;
+            case OPT_CONFIG: cfg.config_path = optarg; break;
+            case OPT_WRITERS: cfg.max_writers = atoi(optarg); break;
+            case OPT_WRITEV: cfg.writev_fast_path = 1; break;
+            case OPT_HISTORY_CACHE: cfg.history_cache_path = optarg; break;
+            case OPT_HISTORY_MEMORY: cfg.history_memory_mb = atoi(optarg); break;
+            case OPT_PARTITION_DAILY: cfg.partition_daily = 1; break;
+            case OPT_PARTITION_ROWS: cfg.partition_rows = atoi(optarg); break;
+            case OPT_PARTITION_KEEP: cfg.partition_keep = atoi(optarg); break;
+            case OPT_KEEP_HISTORY: cfg.keep_history = 1; break;
+            case OPT_REPLICATION_SOCKET: cfg.replication_path = optarg; break;
+            case OPT_STANDBY: cfg.standby_of = optarg; break;
+            case OPT_HISTORY_LOG: cfg.history_log_path = optarg; break;
+            case 'h': usage(argv[0], &cfg); return 0;
+            default: usage(argv[0], &cfg); return 1;
+        }
     }
-    struct lws_context_creation_info info;
-    struct lws_context *context;
-    memset(&info, 0, sizeof(info));
-    info.port = PORT;
-    info.protocols = protocols;
-    info.gid = -1;
-    info.uid = -1;
+    if (optind < argc) cfg.db_path = argv[optind];
 
-    context = lws_create_context(&info);
-    if (!context) {
-        fprintf(stderr, "lws init failed\n");
-        close_db();
+    log_start(log_json);
+    engine = chat_engine_create(&cfg);
+    if (!engine) {
+        log_stop();
+        fprintf(stderr, "Failed to start the chat engine. Exiting.\n");
         return 1;
     }
-    printf("Broadcast server (SQLite-backed) started on :%d\n", PORT);
-    printf("DB file: %s\n", dbfile);
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGHUP, on_signal);
+
+    if (cfg.port)
+        printf("Broadcast server (SQLite-backed) started on :%d%s\n", cfg.port,
+               !cfg.tls.cert_path ? "" : cfg.tls.h2 ? " (TLS, h2)" : " (TLS)");
+    else
+        printf("Broadcast server (SQLite-backed) started without a TCP port\n");
+    if (cfg.unix_path) printf("UNIX socket: %s\n", cfg.unix_path);
+    if (cfg.admin_path) printf("Admin socket: %s\n", cfg.admin_path);
+    if (cfg.standby_of) printf("Standby of: %s\n", cfg.standby_of);
+    else if (cfg.replication_path) printf("Replication socket: %s\n", cfg.replication_path);
+    printf("DB file: %s\n", cfg.db_path);
+    if (cfg.history_log_path) printf("History log: %s\n", cfg.history_log_path);
     printf("Waiting for connections...\n");
-    int n = 0;
-    while (n >= 0) {
-        n = lws_service(context, 1000);
-    }
-    lws_context_destroy(context);
-    close_db();
-    return 0;
+    int rc = chat_engine_run(engine);
+    chat_engine_destroy(engine);
+    engine = NULL;
+    log_stop();
+    return rc == 0 ? 0 : 1;
 }
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+
+#include "traffic_record.h"
+#include "log.h"
+
+#define RECORD_BUF_SIZE (64 * 1024)
+#define HEADER_SIZE 24
+#define MAX_VARINT 10
+
+struct traffic_recorder {
+    pthread_mutex_t mutex;
+    int fd;
+    char *path;
+    int failed;             // write error seen, recording stopped
+    uint64_t last_us;       // CLOCK_MONOTONIC of the previous record
+    uint32_t next_conn;
+    unsigned long events;
+    unsigned long long bytes;
+    size_t used;
+    unsigned char buf[RECORD_BUF_SIZE];
+};
+
+struct traffic_reader {
+    FILE *fp;
+    uint64_t start_us;
+    uint64_t at_us;
+    char *data;
+    size_t cap;
+};
+
+static uint64_t monotonic_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+}
+
+static size_t put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static void put_le(unsigned char *p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++) p[i] = (unsigned char)(v >> (8 * i));
+}
+
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Caller holds r->mutex.
+static void flush_locked(struct traffic_recorder *r) {
+    if (r->used && !r->failed && write_all(r->fd, r->buf, r->used) != 0) {
+        log_error("Traffic recording to '%s' stopped: %s", r->path, strerror(errno));
+        r->failed = 1;
+    }
+    r->used = 0;
+}
+
+struct traffic_recorder *traffic_recorder_open(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot open traffic recording '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    struct traffic_recorder *r = calloc(1, sizeof(*r));
+    if (!r || !(r->path = strdup(path))) {
+        free(r);
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_init(&r->mutex, NULL);
+    r->fd = fd;
+    r->next_conn = 1;
+    r->last_us = monotonic_us();
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    memcpy(r->buf, TRAFFIC_MAGIC, sizeof(TRAFFIC_MAGIC));
+    put_le(r->buf + 8, TRAFFIC_VERSION, 4);
+    put_le(r->buf + 12, 0, 4);
+    put_le(r->buf + 16, (uint64_t)tv.tv_sec * 1000000u + (uint64_t)tv.tv_usec, 8);
+    r->used = HEADER_SIZE;
+    r->bytes = HEADER_SIZE;
+    return r;
+}
+
+uint32_t traffic_recorder_next_conn(struct traffic_recorder *r) {
+    return __atomic_fetch_add(&r->next_conn, 1, __ATOMIC_RELAXED);
+}
+
+void traffic_record(struct traffic_recorder *r, enum traffic_type type, uint32_t conn,
+                    const void *data, size_t len) {
+    unsigned char head[1 + 3 * MAX_VARINT];
+    if (type != TRAFFIC_FRAME) len = 0;
+    pthread_mutex_lock(&r->mutex);
+    if (r->failed) {
+        pthread_mutex_unlock(&r->mutex);
+        return;
+    }
+    // The clock is read under the mutex so deltas never go negative.
+    uint64_t now = monotonic_us();
+    size_t n = 0;
+    head[n++] = (unsigned char)type;
+    n += put_varint(head + n, now - r->last_us);
+    n += put_varint(head + n, conn);
+    if (type == TRAFFIC_FRAME) n += put_varint(head + n, len);
+    r->last_us = now;
+
+    if (r->used + n + len > RECORD_BUF_SIZE) flush_locked(r);
+    memcpy(r->buf + r->used, head, n);
+    r->used += n;
+    if (len > RECORD_BUF_SIZE - r->used) {
+        // Larger than the buffer: write it straight through.
+        flush_locked(r);
+        if (!r->failed && write_all(r->fd, data, len) != 0) {
+            log_error("Traffic recording to '%s' stopped: %s", r->path, strerror(errno));
+            r->failed = 1;
+        }
+    } else if (len) {
+        memcpy(r->buf + r->used, data, len);
+        r->used += len;
+    }
+    r->events++;
+    r->bytes += n + len;
+    pthread_mutex_unlock(&r->mutex);
+}
+
+void traffic_recorder_close(struct traffic_recorder *r) {
+    if (!r) return;
+    pthread_mutex_lock(&r->mutex);
+    flush_locked(r);
+    pthread_mutex_unlock(&r->mutex);
+    if (fsync(r->fd) != 0 && errno != EINVAL)
+        fprintf(stderr, "fsync '%s': %s\n", r->path, strerror(errno));
+    close(r->fd);
+    pthread_mutex_destroy(&r->mutex);
+    free(r->path);
+    free(r);
+}
+
+size_t traffic_recorder_format_json(struct traffic_recorder *r, char *buf, size_t len) {
+    pthread_mutex_lock(&r->mutex);
+    int n = snprintf(buf, len, "{\"events\":%lu,\"bytes\":%llu,\"failed\":%s}",
+                     r->events, r->bytes, r->failed ? "true" : "false");
+    pthread_mutex_unlock(&r->mutex);
+    if (n < 0) return 0;
+    if (len && (size_t)n >= len) return len - 1;
+    return (size_t)n;
+}
+
+struct traffic_reader *traffic_reader_open(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        fprintf(stderr, "Cannot open traffic recording '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    unsigned char h[HEADER_SIZE];
+    if (fread(h, 1, sizeof(h), fp) != sizeof(h) ||
+        memcmp(h, TRAFFIC_MAGIC, sizeof(TRAFFIC_MAGIC)) != 0) {
+        fprintf(stderr, "'%s' is not a traffic recording\n", path);
+        fclose(fp);
+        return NULL;
+    }
+    uint32_t version = 0;
+    for (int i = 0; i < 4; i++) version |= (uint32_t)h[8 + i] << (8 * i);
+    if (version != TRAFFIC_VERSION) {
+        fprintf(stderr, "'%s': unsupported recording version %u\n", path, version);
+        fclose(fp);
+        return NULL;
+    }
+    struct traffic_reader *r = calloc(1, sizeof(*r));
+    if (!r) {
+        fclose(fp);
+        return NULL;
+    }
+    r->fp = fp;
+    for (int i = 0; i < 8; i++) r->start_us |= (uint64_t)h[16 + i] << (8 * i);
+    return r;
+}
+
+// Returns 0 on success, -1 at EOF or on an overlong encoding.
+static int get_varint(FILE *fp, uint64_t *v) {
+    *v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int c = getc(fp);
+        if (c == EOF) return -1;
+        *v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) return 0;
+    }
+    return -1;
+}
+
+int traffic_reader_next(struct traffic_reader *r, struct traffic_event *ev) {
+    int type = getc(r->fp);
+    if (type == EOF) return 0;
+    if (type < TRAFFIC_OPEN || type > TRAFFIC_CLOSE) return -1;
+    uint64_t delta, conn, len = 0;
+    if (get_varint(r->fp, &delta) != 0 || get_varint(r->fp, &conn) != 0) return 0;
+    if (conn > UINT32_MAX) return -1;
+    if (type == TRAFFIC_FRAME) {
+        if (get_varint(r->fp, &len) != 0) return 0;
+        if (len > (64u << 20)) return -1;
+        if (len + 1 > r->cap) {
+            char *tmp = realloc(r->data, len + 1);
+            if (!tmp) return -1;
+            r->data = tmp;
+            r->cap = len + 1;
+        }
+        if (fread(r->data, 1, len, r->fp) != len) return 0;
+        r->data[len] = '\0';
+    }
+    r->at_us += delta;
+    ev->type = (enum traffic_type)type;
+    ev->at_us = r->at_us;
+    ev->conn = (uint32_t)conn;
+    ev->data = type == TRAFFIC_FRAME ? r->data : NULL;
+    ev->len = (size_t)len;
+    return 1;
+}
+
+uint64_t traffic_reader_start(const struct traffic_reader *r) {
+    return r->start_us;
+}
+
+void traffic_reader_close(struct traffic_reader *r) {
+    if (!r) return;
+    fclose(r->fp);
+    free(r->data);
+    free(r);
+}
@@ -0,0 +1,66 @@
+#ifndef TRAFFIC_RECORD_H
+#define TRAFFIC_RECORD_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Capture of inbound chat-protocol traffic for replay against another build.
+//
+// File layout (integers little-endian):
+//   header  "CHATREC\0", u32 version, u32 reserved, u64 start (Unix time, us)
+//   record  u8 type, varint us since the previous record, varint connection,
+//           and for TRAFFIC_FRAME varint length + payload bytes
+// Connections are numbered from 1 in the order they opened. Payloads are
+// stored as received, before sanitizing.
+
+#define TRAFFIC_MAGIC "CHATREC"
+#define TRAFFIC_VERSION 1
+
+enum traffic_type {
+    TRAFFIC_OPEN = 1,  // WebSocket established
+    TRAFFIC_FRAME = 2, // one complete inbound message
+    TRAFFIC_CLOSE = 3, // connection gone, from either side
+};
+
+struct traffic_recorder;
+
+// Creates or truncates path. Returns NULL and prints the reason on failure.
+struct traffic_recorder *traffic_recorder_open(const char *path);
+
+// Thread-safe. Records are buffered and written in 64 KiB chunks; a write
+// error stops the recording and is reported once.
+void traffic_record(struct traffic_recorder *r, enum traffic_type type, uint32_t conn,
+                    const void *data, size_t len);
+
+// Next connection number; thread-safe.
+uint32_t traffic_recorder_next_conn(struct traffic_recorder *r);
+
+// Flushes and closes the file.
+void traffic_recorder_close(struct traffic_recorder *r);
+
+// Events and bytes written so far, as a JSON object. Returns bytes written,
+// truncated to len - 1.
+size_t traffic_recorder_format_json(struct traffic_recorder *r, char *buf, size_t len);
+
+struct traffic_event {
+    enum traffic_type type;
+    uint64_t at_us; // since the start of the recording
+    uint32_t conn;
+    const char *data; // TRAFFIC_FRAME payload, valid until the next read
+    size_t len;
+};
+
+struct traffic_reader;
+
+struct traffic_reader *traffic_reader_open(const char *path);
+
+// Returns 1 with *ev filled in, 0 at the end of the file, -1 on a damaged
+// record (a file cut short by a crash ends cleanly at its last full record).
+int traffic_reader_next(struct traffic_reader *r, struct traffic_event *ev);
+
+// Unix time of the first record, in microseconds.
+uint64_t traffic_reader_start(const struct traffic_reader *r);
+
+void traffic_reader_close(struct traffic_reader *r);
+
+#endif
@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "unix_socket.h"
+
+socklen_t unix_socket_addr(const char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    size_t plen = strlen(path);
+    if (plen >= sizeof(addr->sun_path)) return 0;
+    memcpy(addr->sun_path, path, plen);
+    if (path[0] == '@') addr->sun_path[0] = '\0';
+    else plen++;
+    return (socklen_t)(offsetof(struct sockaddr_un, sun_path) + plen);
+}
+
+int unix_socket_listen(const char *path, int mode, int backlog, const char *what) {
+    struct sockaddr_un addr;
+    socklen_t alen = unix_socket_addr(path, &addr);
+    if (!alen) {
+        fprintf(stderr, "The %s socket path '%s' is too long\n", what, path);
+        return -1;
+    }
+    struct stat sb;
+    if (path[0] != '@' && lstat(path, &sb) == 0) {
+        if (!S_ISSOCK(sb.st_mode)) {
+            fprintf(stderr, "Refusing to replace non-socket '%s'\n", path);
+            return -1;
+        }
+        unlink(path); // stale socket from a previous run
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create the %s socket: %s\n", what, strerror(errno));
+        return -1;
+    }
+    // bind() creates the file with the socket's own mode less the umask, so
+    // there is no window with wider access. The umask is process-wide and
+    // other threads may be creating files, so it is left alone; the chmod
+    // afterwards only restores bits the umask took away.
+    int rc = fchmod(fd, (mode_t)mode);
+    if (rc == 0) rc = bind(fd, (struct sockaddr *)&addr, alen);
+    if (rc == 0 && path[0] != '@') rc = chmod(path, (mode_t)mode);
+    if (rc != 0 || listen(fd, backlog) != 0) {
+        fprintf(stderr, "Failed to listen on %s socket '%s': %s\n", what, path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int unix_socket_peer_allowed(int fd, unsigned *uid) {
+    struct ucred cr;
+    socklen_t len = sizeof(cr);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cr, &len) != 0) return 0;
+    *uid = (unsigned)cr.uid;
+    return cr.uid == geteuid() || cr.uid == 0;
+}
+
+int unix_socket_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef UNIX_SOCKET_H
+#define UNIX_SOCKET_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Local UNIX stream sockets shared by the admin and replication listeners. A
+// leading '@' in a path selects the Linux abstract namespace, which has no
+// file and so no file mode; unix_socket_peer_allowed() applies the same
+// owner-only rule to the peer instead.
+
+// Fills addr for path. Returns the address length, or 0 when path is too long.
+socklen_t unix_socket_addr(const char *path, struct sockaddr_un *addr);
+
+// Listens on path. A socket file gets permission bits mode from the moment it
+// exists: they are set on the socket before bind, without touching the
+// process umask. A stale socket file is replaced, any other file is not.
+// Returns the fd, or -1 after printing the reason, with what ("admin") naming
+// the socket.
+int unix_socket_listen(const char *path, int mode, int backlog, const char *what);
+
+// Returns 1 when the peer runs as the server's user or as root. *uid is set to
+// the peer's uid either way.
+int unix_socket_peer_allowed(int fd, unsigned *uid);
+
+// Sends all of buf, retrying short writes, without raising SIGPIPE. Returns -1
+// on error.
+int unix_socket_write_all(int fd, const void *buf, size_t len);
+
+#endif